@@ -0,0 +1,114 @@
+#include "sql-arena.h"
+
+#include <string.h>
+
+#define ARENA_ALIGN(n) (((n) + 7) & ~(gsize)7)
+
+typedef struct sql_arena_chunk_t {
+    struct sql_arena_chunk_t *next;
+    gsize size;                 /* usable bytes after the header */
+} sql_arena_chunk_t;
+
+#define CHUNK_HEADER_SIZE ARENA_ALIGN(sizeof(sql_arena_chunk_t))
+
+struct sql_arena_t {
+    sql_arena_chunk_t *chunks;  /* in use, current one at the head */
+    sql_arena_chunk_t *spare;   /* kept from previous statements */
+    char *pos;
+    char *end;
+    gsize chunk_size;
+    GPtrArray *arrays;          /* taken from the arena, freed on reset */
+};
+
+sql_arena_t *
+sql_arena_new(gsize chunk_size)
+{
+    sql_arena_t *arena = g_new0(sql_arena_t, 1);
+    arena->chunk_size = ARENA_ALIGN(chunk_size);
+    arena->arrays = g_ptr_array_new();
+    return arena;
+}
+
+static void
+chunk_list_free(sql_arena_chunk_t *c)
+{
+    while (c) {
+        sql_arena_chunk_t *next = c->next;
+        g_free(c);
+        c = next;
+    }
+}
+
+void
+sql_arena_free(sql_arena_t *arena)
+{
+    if (arena == NULL) {
+        return;
+    }
+    sql_arena_reset(arena);
+    chunk_list_free(arena->spare);
+    g_ptr_array_free(arena->arrays, TRUE);
+    g_free(arena);
+}
+
+void
+sql_arena_reset(sql_arena_t *arena)
+{
+    guint i;
+    for (i = 0; i < arena->arrays->len; i++) {
+        g_ptr_array_free(g_ptr_array_index(arena->arrays, i), TRUE);
+    }
+    g_ptr_array_set_size(arena->arrays, 0);
+
+    while (arena->chunks) {
+        sql_arena_chunk_t *c = arena->chunks;
+        arena->chunks = c->next;
+        if (c->size == arena->chunk_size) {
+            c->next = arena->spare;
+            arena->spare = c;
+        } else {
+            g_free(c);
+        }
+    }
+    arena->pos = arena->end = NULL;
+}
+
+static void
+arena_grow(sql_arena_t *arena, gsize size)
+{
+    sql_arena_chunk_t *c;
+
+    if (size <= arena->chunk_size && arena->spare) {
+        c = arena->spare;
+        arena->spare = c->next;
+    } else {
+        gsize n = MAX(size, arena->chunk_size);
+        c = g_malloc(CHUNK_HEADER_SIZE + n);
+        c->size = n;
+    }
+    c->next = arena->chunks;
+    arena->chunks = c;
+    arena->pos = (char *)c + CHUNK_HEADER_SIZE;
+    arena->end = arena->pos + c->size;
+}
+
+void *
+sql_arena_alloc0(sql_arena_t *arena, gsize size)
+{
+    size = ARENA_ALIGN(size);
+    if ((gsize)(arena->end - arena->pos) < size) {
+        arena_grow(arena, size);
+    }
+    void *p = arena->pos;
+    arena->pos += size;
+    memset(p, 0, size);
+    return p;
+}
+
+GPtrArray *
+sql_arena_ptr_array_new(sql_arena_t *arena)
+{
+    GPtrArray *array = g_ptr_array_new();
+    g_ptr_array_add(arena->arrays, array);
+    return array;
+}
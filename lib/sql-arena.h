@@ -0,0 +1,29 @@
+#ifndef SQL_ARENA_H
+#define SQL_ARENA_H
+
+#include <glib.h>
+
+#define SQL_ARENA_CHUNK_SIZE 8192
+
+/**
+ * bump pointer allocator for the nodes of a parsed statement
+ *
+ * nothing is freed on its own, everything goes at once on reset. the
+ * chunks are kept for the next statement, only those larger than the
+ * chunk size are given back
+ */
+typedef struct sql_arena_t sql_arena_t;
+
+sql_arena_t *sql_arena_new(gsize chunk_size);
+
+void sql_arena_free(sql_arena_t *);
+
+void sql_arena_reset(sql_arena_t *);
+
+/* zero filled */
+void *sql_arena_alloc0(sql_arena_t *, gsize size);
+
+/* array without free func, freed with its elements on reset */
+GPtrArray *sql_arena_ptr_array_new(sql_arena_t *);
+
+#endif /* SQL_ARENA_H */
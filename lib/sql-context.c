@@ -2,32 +2,56 @@
 
 #include "mylexer.l.h"
 #include "sql-property.h"
+#include "sql-arena.h"
 
 void sqlParser(void *yyp,int yymajor, sql_token_t yyminor, sql_context_t *);
 void sqlParserFree(void *p,void(*freeProc)(void *));
 void *sqlParserAlloc(void *(*mallocProc)(size_t));
+void sqlParserReset(void *p);
 void sqlParserTrace(FILE *TraceFILE, char *zTracePrompt);
 void yylex_restore_buffer(void *);
+void yylex_reset_state(void *);
 
 void sql_context_init(sql_context_t *p)
 {
     memset(p, 0, sizeof(sql_context_t));
 }
 
-void sql_context_destroy(sql_context_t *p)
+/* drop the statement, the arena, parser and scanner are kept */
+static void sql_context_clear(sql_context_t *p)
 {
-    if (p->sql_statement)
+    if (p->sql_statement && !p->stmt_in_arena)
         sql_statement_free(p->sql_statement, p->stmt_type);
+    if (p->arena)
+        sql_arena_reset(p->arena);
     if (p->message)
         g_free(p->message);
     if (p->property)
         sql_property_free(p->property);
 }
 
+void sql_context_destroy(sql_context_t *p)
+{
+    sql_context_clear(p);
+    if (p->arena)
+        sql_arena_free(p->arena);
+    if (p->parser)
+        sqlParserFree(p->parser, free);
+    if (p->scanner)
+        yylex_destroy(p->scanner);
+}
+
 void sql_context_reset(sql_context_t *p)
 {
-    sql_context_destroy(p);
+    struct sql_arena_t *arena = p->arena;
+    void *parser = p->parser;
+    void *scanner = p->scanner;
+
+    sql_context_clear(p);
     sql_context_init(p);
+    p->arena = arena;
+    p->parser = parser;
+    p->scanner = scanner;
 }
 
 void sql_context_append_msg(sql_context_t *p, char *msg)
@@ -70,6 +94,22 @@ gboolean sql_context_has_sharding_property(sql_context_t *p)
     return p && p->property && (p->property->table || p->property->group);
 }
 
+void sql_context_end_property(sql_context_t *context)
+{
+    sql_property_t *prop = context->property;
+    if (prop->mode == MODE_READWRITE) {
+        context->rw_flag |= CF_FORCE_MASTER;
+    } else if (prop->mode == MODE_READONLY) {
+        context->rw_flag |= CF_FORCE_SLAVE;
+    }
+    if (!sql_property_is_valid(context->property)) {
+        sql_property_free(context->property);
+        context->property = NULL;
+        g_message(G_STRLOC ":invalid comment");
+        sql_context_set_error(context, PARSE_SYNTAX_ERR, "comment error");
+    }
+}
+
 static void parse_token(sql_context_t *context, int code, sql_token_t token,
                         void *parser, sql_property_parser_t *prop_parser)
 {
@@ -81,18 +121,7 @@ static void parse_token(sql_context_t *context, int code, sql_token_t token,
         return;
     } else if (code == TK_PROPERTY_END) {
         prop_parser->is_parsing = FALSE;
-        sql_property_t *prop = context->property;
-        if (prop->mode == MODE_READWRITE) {
-            context->rw_flag |= CF_FORCE_MASTER;
-        } else if (prop->mode == MODE_READONLY) {
-            context->rw_flag |= CF_FORCE_SLAVE;
-        }
-        if (!sql_property_is_valid(context->property)) {
-            sql_property_free(context->property);
-            context->property = NULL;
-            g_message(G_STRLOC ":invalid comment");
-            sql_context_set_error(context, PARSE_SYNTAX_ERR, "comment error");
-        }
+        sql_context_end_property(context);
         return;
     } else if (code == TK_MYSQL_HINT) {
         context->rw_flag |= CF_WRITE;
@@ -119,15 +148,28 @@ static void parse_token(sql_context_t *context, int code, sql_token_t token,
   sql->len is length including the 2 NUL */
 void sql_context_parse_len(sql_context_t *context, GString *sql)
 {
-    yyscan_t scanner;
-    yylex_init(&scanner);
+    sql_context_reset(context);
+    if (context->scanner == NULL) {
+        yylex_init(&context->scanner);
+    }
+    if (context->parser == NULL) {
+        context->parser = sqlParserAlloc(malloc);
+    }
+    if (context->arena == NULL) {
+        context->arena = sql_arena_new(SQL_ARENA_CHUNK_SIZE);
+    }
+    yyscan_t scanner = context->scanner;
+    void *parser = context->parser;
+
+    yylex_reset_state(scanner);
     YY_BUFFER_STATE buf_state = yy_scan_buffer(sql->str, sql->len, scanner);
 #if PARSER_TRACE
     sqlParserTrace(stdout, "---ParserTrace: ");
 #endif
-    
-    void *parser = sqlParserAlloc(malloc);
-    sql_context_reset(context);
+
+    /* every node of the statement is taken from the arena */
+    context->stmt_in_arena = 1;
+    sql_expr_set_arena(context->arena);
 
     static sql_property_parser_t comment_parser;
     sql_property_parser_reset(&comment_parser);
@@ -158,9 +200,9 @@ void sql_context_parse_len(sql_context_t *context, GString *sql)
         }
         sqlParser(parser, 0, token, context);
     }
-    sqlParserFree(parser, free);
+    sqlParserReset(parser);
+    sql_expr_set_arena(NULL);
     yy_delete_buffer(buf_state, scanner);
-    yylex_destroy(scanner);
 }
 
 gboolean sql_context_is_autocommit_on(sql_context_t *context)
@@ -203,6 +245,12 @@ gboolean sql_context_is_single_node_trx(sql_context_t *context)
         && context->property->transaction == TRX_SINGLE_NODE;
 }
 
+/* replication delay in msec the statement accepts, 0 for any */
+int sql_context_max_lag(sql_context_t *context)
+{
+    return context && context->property ? context->property->max_lag : 0;
+}
+
 gboolean sql_context_is_cacheable(sql_context_t *context)
 {
     if (context->stmt_type != STMT_SELECT)
@@ -210,7 +258,7 @@ gboolean sql_context_is_cacheable(sql_context_t *context)
     if (context->clause_flags & CF_SUBQUERY)
         return FALSE;
     sql_select_t *select = context->sql_statement;
-    if (!select->from_src)
+    if (!select || !select->from_src)
         return FALSE;
     if (select->lock_read)
         return FALSE;
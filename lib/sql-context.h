@@ -21,6 +21,7 @@ enum sql_parsing_place_t {
 };
 
 struct sql_property_t;
+struct sql_arena_t;
 
 typedef struct sql_context_t {
     enum sql_parse_state_code_t rc;
@@ -37,6 +38,12 @@ typedef struct sql_context_t {
     enum sql_parsing_place_t parsing_place;
 
     struct sql_property_t *property;
+    unsigned int stmt_in_arena:1;
+
+    /* kept across statements, created on the first parse */
+    struct sql_arena_t *arena;  /* owns the parsed statement */
+    void *parser;
+    void *scanner;
 } sql_context_t;
 
 
@@ -55,6 +62,9 @@ void sql_context_add_stmt(sql_context_t *,
 
 gboolean sql_context_using_property(sql_context_t *);
 
+/* flags and validity of the property comment just read */
+void sql_context_end_property(sql_context_t *);
+
 gboolean sql_context_has_sharding_property(sql_context_t *p);
 
 void sql_context_parse_len(sql_context_t *, GString *sql);
@@ -65,6 +75,8 @@ gboolean sql_context_is_autocommit_off(sql_context_t *);
 
 gboolean sql_context_is_single_node_trx(sql_context_t *);
 
+int sql_context_max_lag(sql_context_t *);
+
 gboolean sql_context_is_cacheable(sql_context_t *);
 
 
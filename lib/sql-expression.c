@@ -9,12 +9,38 @@
 #include <glib.h>
 
 #include "myparser.y.h"
+#include "sql-arena.h"
+
+static sql_arena_t *node_arena;
+
+void sql_expr_set_arena(sql_arena_t *arena)
+{
+    node_arena = arena;
+}
+
+void *sql_node_alloc0(gsize size)
+{
+    return node_arena ? sql_arena_alloc0(node_arena, size) : g_malloc0(size);
+}
+
+void sql_node_free(void *p)
+{
+    if (!node_arena)
+        g_free(p);
+}
+
+static GPtrArray *node_array_new(GDestroyNotify free_func)
+{
+    if (node_arena)
+        return sql_arena_ptr_array_new(node_arena);
+    return g_ptr_array_new_with_free_func(free_func);
+}
 
 char *sql_token_dup(sql_token_t token)
 {
     if (token.n == 0)
         return NULL;
-    char *s = g_malloc0(token.n + 1);
+    char *s = sql_node_alloc0(token.n + 1);
     memcpy(s, token.z, token.n);
     sql_string_dequote(s);
     return s;
@@ -77,7 +103,7 @@ sql_expr_t *sql_expr_new(int op, const sql_token_t *token)
     if (token && op != TK_INTEGER) {
         extra = token->n + 1;
     }
-    sql_expr_t *expr = g_malloc0(sizeof(sql_expr_t) + extra);
+    sql_expr_t *expr = sql_node_alloc0(sizeof(sql_expr_t) + extra);
     if (expr) {
         expr->op = op;
         if (token) {
@@ -112,7 +138,7 @@ sql_expr_t *sql_expr_dup(const sql_expr_t *p)
         extra = strlen(p->token_text) + 1;
     }
     int size = sizeof(sql_expr_t) + extra;
-    sql_expr_t *expr = g_malloc0(size);
+    sql_expr_t *expr = sql_node_alloc0(size);
     if (expr) {
         memcpy(expr, p, size);
         if (p->op == TK_DOT) {
@@ -166,7 +192,7 @@ void sql_expr_attach_subtrees(sql_expr_t *root, sql_expr_t *left, sql_expr_t *ri
 
 void sql_expr_free(void *p)
 {
-    if (p) {
+    if (p && !node_arena) {
         sql_expr_t *exp = (sql_expr_t *)p;
         if (exp->left)
             sql_expr_free(exp->left);
@@ -302,7 +328,7 @@ sql_expr_list_t *sql_expr_list_append(sql_expr_list_t *list, sql_expr_t *expr)
     if (expr == NULL)
         return list;
     if (list == NULL) {
-        list = g_ptr_array_new_with_free_func(sql_expr_free);
+        list = node_array_new(sql_expr_free);
     }
     g_ptr_array_add(list, expr);
     return list;
@@ -375,7 +401,7 @@ int sql_expr_list_find_aggregates(sql_expr_list_t *list, GROUP_AGGR *aggr_array)
 
 void sql_expr_list_free(sql_expr_list_t *list)
 {
-    if (list)
+    if (list && !node_arena)
         g_ptr_array_free(list, TRUE);
 }
 
@@ -391,12 +417,12 @@ enum sql_func_type_t sql_func_type(const char *s)
 
 sql_column_t *sql_column_new()
 {
-    return g_new0(struct sql_column_t, 1);
+    return sql_node_alloc0(sizeof(sql_column_t));
 }
 
 void sql_column_free(void *p)
 {
-    if (!p)
+    if (!p || node_arena)
         return;
     sql_column_t *col = (sql_column_t *)p;
     if (col->expr)
@@ -413,7 +439,7 @@ sql_column_list_t *sql_column_list_append(sql_column_list_t *list, sql_column_t
     if (col == NULL)
         return list;
     if (list == NULL) {
-        list = g_ptr_array_new_with_free_func(sql_column_free);
+        list = node_array_new(sql_column_free);
     }
     g_ptr_array_add(list, col);
     return list;
@@ -421,19 +447,19 @@ sql_column_list_t *sql_column_list_append(sql_column_list_t *list, sql_column_t
 
 void sql_column_list_free(sql_column_list_t *list)
 {
-    if (list)
+    if (list && !node_arena)
         g_ptr_array_free(list, TRUE);
 }
 
 sql_select_t *sql_select_new()
 {
-    sql_select_t *p = g_new0(sql_select_t, 1);
+    sql_select_t *p = sql_node_alloc0(sizeof(sql_select_t));
     return p;
 }
 
 void sql_select_free(sql_select_t *p)
 {
-    if (!p)
+    if (!p || node_arena)
         return;
     if (p->columns)     /* The fields of the result */
         sql_expr_list_free(p->columns);
@@ -459,13 +485,13 @@ void sql_select_free(sql_select_t *p)
 
 sql_delete_t *sql_delete_new()
 {
-    sql_delete_t *p = g_new0(sql_delete_t, 1);
+    sql_delete_t *p = sql_node_alloc0(sizeof(sql_delete_t));
     return p;
 }
 
 void sql_delete_free(sql_delete_t *p)
 {
-    if (!p)
+    if (!p || node_arena)
         return;
     if (p->from_src)         /* The FROM clause */
         sql_src_list_free(p->from_src);
@@ -482,13 +508,13 @@ void sql_delete_free(sql_delete_t *p)
 
 sql_update_t *sql_update_new()
 {
-    sql_update_t *p = g_new0(sql_update_t, 1);
+    sql_update_t *p = sql_node_alloc0(sizeof(sql_update_t));
     return p;
 }
 
 void sql_update_free(sql_update_t *p)
 {
-    if (!p)
+    if (!p || node_arena)
         return;
     if (p->table)
         sql_src_list_free(p->table);
@@ -507,14 +533,14 @@ void sql_update_free(sql_update_t *p)
 
 sql_insert_t *sql_insert_new()
 {
-    sql_insert_t *p = g_new0(sql_insert_t, 1);
+    sql_insert_t *p = sql_node_alloc0(sizeof(sql_insert_t));
     return p;
 }
 
 
 void sql_insert_free(sql_insert_t *p)
 {
-    if (!p)
+    if (!p || node_arena)
         return;
     if (p->table)
         sql_src_list_free(p->table);
@@ -527,7 +553,7 @@ void sql_insert_free(sql_insert_t *p)
 
 void sql_src_item_free(void *p)
 {
-    if (!p)
+    if (!p || node_arena)
         return;
     struct sql_src_item_t *item = (struct sql_src_item_t *)p;
     if (item->table_name)
@@ -551,7 +577,7 @@ sql_src_list_t *sql_src_list_append(sql_src_list_t *p, sql_token_t *tname,
                 sql_token_t *dbname, sql_token_t *alias, sql_select_t *subquery,
                 sql_expr_t *on_clause, sql_id_list_t *using_clause)
 {
-    struct sql_src_item_t *item = g_new0(sql_src_item_t, 1);
+    struct sql_src_item_t *item = sql_node_alloc0(sizeof(sql_src_item_t));
     if (item) {
         item->table_name = tname ? sql_token_dup(*tname) : NULL;
         item->table_alias = alias ? sql_token_dup(*alias) : NULL;
@@ -561,7 +587,7 @@ sql_src_list_t *sql_src_list_append(sql_src_list_t *p, sql_token_t *tname,
         item->pUsing = using_clause;
     }
     if (!p) {
-        p = g_ptr_array_new_with_free_func(sql_src_item_free);
+        p = node_array_new(sql_src_item_free);
     }
     g_ptr_array_add(p, item);
     return p;
@@ -569,14 +595,14 @@ sql_src_list_t *sql_src_list_append(sql_src_list_t *p, sql_token_t *tname,
 
 void sql_src_list_free(sql_src_list_t *p)
 {
-    if (p)
+    if (p && !node_arena)
         g_ptr_array_free(p, TRUE);
 }
 
 sql_id_list_t *sql_id_list_append(sql_id_list_t *p, sql_token_t *id_name)
 {
     if (!p) {
-        p = g_ptr_array_new_with_free_func(g_free);
+        p = node_array_new(g_free);
     }
     if (id_name)
         g_ptr_array_add(p, sql_token_dup(*id_name));
@@ -585,7 +611,7 @@ sql_id_list_t *sql_id_list_append(sql_id_list_t *p, sql_token_t *id_name)
 
 void sql_id_list_free(sql_id_list_t *p)
 {
-    if (p)
+    if (p && !node_arena)
         g_ptr_array_free(p, TRUE);
 }
 
@@ -764,7 +790,7 @@ void sql_expr_print(sql_expr_t *p, int depth)
 
 void sql_statement_free(void *clause, sql_stmt_type_t stmt_type)
 {
-    if (!clause)
+    if (!clause || node_arena)
         return;
     switch(stmt_type) {
     case STMT_SELECT:
@@ -843,7 +869,7 @@ int sql_join_type(sql_token_t kw)
         }
         ++i;
     }
-    g_free(kw_str);
+    sql_node_free(kw_str);
     return ret;
 }
 
@@ -227,6 +227,18 @@ typedef struct sql_set_transaction_t {
 } sql_set_transaction_t;
     
 
+struct sql_arena_t;
+
+/**
+ * while an arena is set, nodes are taken from it and the free functions
+ * leave them alone, they go with the arena. NULL is back to the heap
+ */
+void sql_expr_set_arena(struct sql_arena_t *);
+
+void *sql_node_alloc0(gsize size);
+
+void sql_node_free(void *);
+
 char *sql_token_dup(sql_token_t);
 
 void sql_string_dequote(char *str);
@@ -272,6 +284,8 @@ sql_src_list_t *sql_src_list_append(sql_src_list_t *, sql_token_t *tname,
  sql_token_t *dbname, sql_token_t *alias, sql_select_t *subquery,
  sql_expr_t *on_clause, sql_id_list_t *using_clause);
 
+void sql_src_item_free(void *p);
+
 void sql_src_list_free(sql_src_list_t *p);
 
 sql_id_list_t *sql_id_list_append(sql_id_list_t *p, sql_token_t *id_name);
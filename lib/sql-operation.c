@@ -136,7 +136,7 @@ void sql_set_names(sql_context_t *ps, char *val)
     if (ps->property) {
         sql_context_set_error(ps, PARSE_NOT_SUPPORT,
                               "Commanding comment is not allowed in SET clause");
-        g_free(val);
+        sql_node_free(val);
         return;
     }
     const char *charsets[] = {"latin1", "ascii", "gb2312", "gbk", "utf8", "utf8mb4", "big5"};
@@ -145,7 +145,7 @@ void sql_set_names(sql_context_t *ps, char *val)
         char msg[64] = {0};
         snprintf(msg, 64, "Unknown character set: %s", val);
         sql_context_set_error(ps, PARSE_NOT_SUPPORT, msg);
-        g_free(val);
+        sql_node_free(val);
         return;
     }
     sql_context_add_stmt(ps, STMT_SET_NAMES, val);
@@ -163,7 +163,7 @@ void sql_set_transaction(sql_context_t *ps, int scope, int rw_feature, int level
                                     "GLOBAL scope SET TRANSACTION is not supported now");
         return;
     }
-    sql_set_transaction_t *set_tran = g_new0(sql_set_transaction_t, 1);
+    sql_set_transaction_t *set_tran = sql_node_alloc0(sizeof(sql_set_transaction_t));
     set_tran->scope = scope;
     set_tran->rw_feature = rw_feature;
     set_tran->level = level;
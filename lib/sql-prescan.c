@@ -0,0 +1,410 @@
+#include "sql-prescan.h"
+
+#include <string.h>
+
+#include "sql-arena.h"
+#include "sql-operation.h"
+#include "sql-property.h"
+
+#define PROPERTY_TOKEN_MAX 256
+
+typedef struct {
+    const char *p;
+    const char *end;
+} prescan_t;
+
+enum {
+    BLANK_UNSURE = -1,
+    BLANK_DONE,
+    BLANK_PROPERTY,         /* stopped at a property comment */
+};
+
+/* words of a SELECT that need the parse tree, or make it a write */
+static const char *select_unsure_words[] = {
+    "UPDATE",               /* FOR UPDATE */
+    "LOCK",                 /* LOCK IN SHARE MODE */
+    "SHARE",                /* FOR SHARE */
+    "NOWAIT",
+    "SKIP",                 /* SKIP LOCKED */
+    "INTO",
+    "SQL_CALC_FOUND_ROWS",
+    "LAST_INSERT_ID",
+    "CURRENT_DATE",
+    "CETUS_SEQUENCE",
+    "CETUS_VERSION",
+    NULL
+};
+
+static gboolean
+is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static gboolean
+is_word_char(char c)
+{
+    return g_ascii_isalnum(c) || c == '_';
+}
+
+static gboolean
+word_is(const char *z, int n, const char *keyword)
+{
+    return n == strlen(keyword) && g_ascii_strncasecmp(z, keyword, n) == 0;
+}
+
+static int
+scan_word(prescan_t *s, const char **z)
+{
+    *z = s->p;
+    while (s->p < s->end && is_word_char(*s->p)) {
+        s->p++;
+    }
+    return s->p - *z;
+}
+
+/* past the closing quote of the string or quoted name at s->p */
+static gboolean
+skip_quoted(prescan_t *s)
+{
+    char quote = *s->p;
+    const char *p = s->p + 1;
+
+    while (p < s->end) {
+        /* memchr is vectorized in libc, literals are skipped in blocks */
+        const char *q = memchr(p, quote, s->end - p);
+        if (q == NULL) {
+            return FALSE;
+        }
+        if (quote != '`') {
+            const char *b = q;
+            while (b > p && b[-1] == '\\') {
+                b--;
+            }
+            if ((q - b) % 2) {  /* escaped by a backslash */
+                p = q + 1;
+                continue;
+            }
+        }
+        if (q + 1 < s->end && q[1] == quote) { /* doubled */
+            p = q + 2;
+            continue;
+        }
+        s->p = q + 1;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* past the end of the comment whose body starts at p, NULL if none */
+static const char *
+comment_end(const char *p, const char *end)
+{
+    while (p < end) {
+        const char *q = memchr(p, '*', end - p);
+        if (q == NULL || q + 1 >= end) {
+            return NULL;
+        }
+        if (q[1] == '/') {
+            return q + 2;
+        }
+        p = q + 1;
+    }
+    return NULL;
+}
+
+/* whitespace and comments, the same ones as the lexer */
+static int
+skip_blank(prescan_t *s)
+{
+    while (s->p < s->end) {
+        const char *p = s->p;
+        if (is_space(*p)) {
+            s->p++;
+        } else if (*p == '#' || (*p == '-' && p + 2 < s->end && p[1] == '-'
+                                 && (p[2] == ' ' || p[2] == '\t' || p[2] == '\n'))) {
+            const char *q = memchr(p, '\n', s->end - p);
+            s->p = q ? q + 1 : s->end;
+        } else if (*p == '/' && p + 1 < s->end && p[1] == '*') {
+            if (p + 2 < s->end && p[2] == '#') {
+                return BLANK_PROPERTY;
+            }
+            if (p + 2 < s->end && p[2] == '!') {
+                return BLANK_UNSURE;    /* mysql hint, the parser takes it as a write */
+            }
+            const char *q = comment_end(p + 2, s->end);
+            if (q == NULL) {
+                return BLANK_UNSURE;
+            }
+            s->p = q;
+        } else {
+            break;
+        }
+    }
+    return BLANK_DONE;
+}
+
+/* nothing but blanks and a semicolon left */
+static gboolean
+at_end(prescan_t *s)
+{
+    if (skip_blank(s) != BLANK_DONE) {
+        return FALSE;
+    }
+    if (s->p < s->end && *s->p == ';') {
+        s->p++;
+        if (skip_blank(s) != BLANK_DONE) {
+            return FALSE;
+        }
+    }
+    return s->p == s->end;
+}
+
+/* next word, 0 if something else comes first, -1 if unsure */
+static int
+next_word(prescan_t *s, const char **z)
+{
+    if (skip_blank(s) != BLANK_DONE) {
+        return -1;
+    }
+    if (s->p == s->end || !g_ascii_isalnum(*s->p)) {
+        return 0;
+    }
+    return scan_word(s, z);
+}
+
+/* the K = V pairs of a property comment, as the lexer hands them */
+static gboolean
+scan_property(prescan_t *s, sql_context_t *context)
+{
+    sql_property_parser_t parser;
+    char token[PROPERTY_TOKEN_MAX];
+
+    sql_property_parser_reset(&parser);
+    if (context->property == NULL) {
+        context->property = g_new0(sql_property_t, 1);
+    }
+
+    s->p += 3;
+    while (s->p < s->end) {
+        const char *z = s->p;
+        char c = *z;
+        if (is_space(c) || c == ',' || c == ';') {
+            s->p++;
+            continue;
+        }
+        if (c == '*') {
+            while (s->p < s->end && *s->p == '*') {
+                s->p++;
+            }
+            if (s->p < s->end && *s->p == '/') {
+                s->p++;
+                sql_context_end_property(context);
+                return context->rc == PARSE_OK;
+            }
+            return FALSE;
+        }
+
+        if (c == '=') {
+            s->p++;
+        } else if (c == '"' || c == '\'') {
+            if (!skip_quoted(s)) {
+                return FALSE;
+            }
+        } else if (is_word_char(c) || c == '.' || c == '-') {
+            while (s->p < s->end && (is_word_char(*s->p) || *s->p == '.' || *s->p == '-')) {
+                s->p++;
+            }
+        } else {
+            return FALSE;
+        }
+
+        int n = s->p - z;
+        if (n >= sizeof(token)) {
+            return FALSE;
+        }
+        memcpy(token, z, n);
+        token[n] = '\0';
+        if (!sql_property_parser_parse(&parser, token, n, context->property)) {
+            return FALSE;
+        }
+    }
+    return FALSE;
+}
+
+/* rest of a statement, FALSE if one of words shows up */
+static gboolean
+scan_body(prescan_t *s, const char **words)
+{
+    gboolean empty = TRUE;
+
+    for (;;) {
+        if (skip_blank(s) != BLANK_DONE) {
+            return FALSE;
+        }
+        if (s->p == s->end) {
+            return !empty;
+        }
+
+        char c = *s->p;
+        if (c == ';') {     /* anything after it is another statement */
+            return !empty && at_end(s);
+        }
+        empty = FALSE;
+
+        if (c == '\'' || c == '"' || c == '`') {
+            if (!skip_quoted(s)) {
+                return FALSE;
+            }
+        } else if (g_ascii_isalnum(c)) {
+            const char *z;
+            int n = scan_word(s, &z);
+            int i;
+            for (i = 0; words && words[i]; i++) {
+                if (word_is(z, n, words[i])) {
+                    return FALSE;
+                }
+            }
+        } else if (c != '\0' && strchr("(),<>!=&|~+-*/%.?@", c)) {
+            s->p++;
+        } else {
+            return FALSE;   /* not ascii or unknown to the lexer */
+        }
+    }
+}
+
+/* SET AUTOCOMMIT = 0|1, made into the same tree as the parser's */
+static gboolean
+prescan_set(prescan_t *s, sql_context_t *context)
+{
+    sql_token_t name, value;
+    const char *z;
+    int n;
+
+    n = next_word(s, &z);
+    if (n <= 0 || !word_is(z, n, "AUTOCOMMIT")) {
+        return FALSE;
+    }
+    name.z = z;
+    name.n = n;
+
+    if (skip_blank(s) != BLANK_DONE || s->p == s->end || *s->p != '=') {
+        return FALSE;
+    }
+    s->p++;
+
+    n = next_word(s, &z);
+    if (n != 1 || (*z != '0' && *z != '1')) {
+        return FALSE;
+    }
+    value.z = z;
+    value.n = n;
+
+    if (!at_end(s) || context->property) {
+        return FALSE;
+    }
+
+    if (context->arena == NULL) {
+        context->arena = sql_arena_new(SQL_ARENA_CHUNK_SIZE);
+    }
+    context->stmt_in_arena = 1;
+    sql_expr_set_arena(context->arena);
+
+    sql_expr_t *left = sql_expr_new(TK_ID, &name);
+    left->var_scope = SCOPE_SESSION;
+    sql_expr_t *eq = sql_expr_new(TK_EQ, NULL);
+    sql_expr_attach_subtrees(eq, left, sql_expr_new(TK_INTEGER, &value));
+    sql_set_variable(context, sql_expr_list_append(NULL, eq));
+
+    sql_expr_set_arena(NULL);
+    return context->rc == PARSE_OK;
+}
+
+gboolean
+sql_context_prescan(sql_context_t *context, GString *sql)
+{
+    prescan_t s;
+    const char *z;
+    int n;
+
+    sql_context_reset(context);
+    if (sql->len < 2) {
+        return FALSE;
+    }
+    s.p = sql->str;
+    s.end = sql->str + sql->len - 2;
+
+    for (;;) {
+        int rc = skip_blank(&s);
+        if (rc == BLANK_UNSURE) {
+            return FALSE;
+        } else if (rc == BLANK_DONE) {
+            break;
+        }
+        if (!scan_property(&s, context)) {
+            return FALSE;
+        }
+    }
+
+    if (s.p == s.end || !g_ascii_isalpha(*s.p)) {
+        return FALSE;
+    }
+    n = scan_word(&s, &z);
+
+    if (word_is(z, n, "SELECT")) {
+        if (!scan_body(&s, select_unsure_words)) {
+            return FALSE;
+        }
+        context->rw_flag |= CF_READ;
+        context->stmt_type = STMT_SELECT;
+    } else if (word_is(z, n, "INSERT") || word_is(z, n, "REPLACE")) {
+        if (!scan_body(&s, NULL)) {
+            return FALSE;
+        }
+        context->rw_flag |= CF_WRITE;
+        context->stmt_type = STMT_INSERT;
+    } else if (word_is(z, n, "UPDATE")) {
+        if (!scan_body(&s, NULL)) {
+            return FALSE;
+        }
+        context->rw_flag |= CF_WRITE;
+        context->stmt_type = STMT_UPDATE;
+    } else if (word_is(z, n, "DELETE")) {
+        if (!scan_body(&s, NULL)) {
+            return FALSE;
+        }
+        context->rw_flag |= CF_WRITE;
+        context->stmt_type = STMT_DELETE;
+    } else if (word_is(z, n, "BEGIN")) {
+        if (!at_end(&s)) {
+            return FALSE;
+        }
+        context->rw_flag |= CF_WRITE;
+        context->stmt_type = STMT_START;
+    } else if (word_is(z, n, "START")) {
+        n = next_word(&s, &z);
+        if (n <= 0 || !word_is(z, n, "TRANSACTION") || !at_end(&s)) {
+            return FALSE;
+        }
+        context->rw_flag |= CF_WRITE;
+        context->stmt_type = STMT_START;
+    } else if (word_is(z, n, "COMMIT") || word_is(z, n, "ROLLBACK")) {
+        int type = word_is(z, n, "COMMIT") ? STMT_COMMIT : STMT_ROLLBACK;
+        n = next_word(&s, &z);
+        /* COMMIT WORK, MySQL has no COMMIT TRANSACTION */
+        if (n < 0 || (n > 0 && !word_is(z, n, "WORK")) || !at_end(&s)) {
+            return FALSE;
+        }
+        context->rw_flag |= CF_WRITE;
+        context->stmt_type = type;
+    } else if (word_is(z, n, "SET")) {
+        if (!prescan_set(&s, context)) {
+            return FALSE;
+        }
+    } else {
+        return FALSE;
+    }
+
+    context->stmt_count = 1;
+    return TRUE;
+}
@@ -0,0 +1,22 @@
+#ifndef SQL_PRESCAN_H
+#define SQL_PRESCAN_H
+
+#include <glib.h>
+
+#include "sql-context.h"
+
+/**
+ * classify sql in a single pass, without the grammar, for statements
+ * whose rw_flag, stmt_type and property comment are enough:
+ *   SELECT without locking reads or columns answered by the proxy
+ *   INSERT, REPLACE, UPDATE, DELETE
+ *   SET AUTOCOMMIT = 0|1
+ *   BEGIN, START TRANSACTION, COMMIT, ROLLBACK
+ * sql_statement is left NULL except for SET. sql must be terminated with
+ * 2 NUL like for sql_context_parse_len()
+ *
+ * @return FALSE if unsure, sql has to go through the parser then
+ */
+gboolean sql_context_prescan(sql_context_t *context, GString *sql);
+
+#endif /* SQL_PRESCAN_H */
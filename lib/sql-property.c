@@ -1,5 +1,6 @@
 #include "sql-property.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 enum property_parse_state_t{
@@ -21,6 +22,8 @@ gboolean sql_property_is_valid(sql_property_t *p)
 {
     if (p->table && p->group)/* mutual exclusive */
         return FALSE;
+    if (p->max_lag == ERROR_VALUE)
+        return FALSE;
     return TRUE;
 }
 
@@ -60,6 +63,15 @@ static int string_to_code(const char *str)
     return ERROR_VALUE;
 }
 
+static int string_to_msec(const char *str)
+{
+    char *end = NULL;
+    long msec = strtol(str, &end, 10);
+    if (end == str || *end != '\0' || msec < 0 || msec > G_MAXINT)
+        return ERROR_VALUE;
+    return msec;
+}
+
 static gboolean parser_find_key(sql_property_parser_t *parser,
                                 const char *token, int len)
 {
@@ -72,6 +84,7 @@ static gboolean parser_find_key(sql_property_parser_t *parser,
         {"mode", offsetof(struct sql_property_t, mode), TYPE_INT, string_to_code },
         {"scope", offsetof(struct sql_property_t, scope), TYPE_INT, string_to_code },
         {"transaction", offsetof(struct sql_property_t, transaction), TYPE_INT, string_to_code },
+        {"max_lag", offsetof(struct sql_property_t, max_lag), TYPE_INT, string_to_msec },
         {"group", offsetof(struct sql_property_t, group), TYPE_STRING, NULL },
         {"table", offsetof(struct sql_property_t, table), TYPE_STRING, NULL },
         {"key", offsetof(struct sql_property_t, key), TYPE_STRING, NULL },
@@ -18,6 +18,7 @@ typedef struct sql_property_t {
     int mode;
     int scope;
     int transaction;
+    int max_lag; /* msec, replicas lagging more are not read */
     char *group;
     char *table;
     char *key;
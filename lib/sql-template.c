@@ -0,0 +1,411 @@
+#include "sql-template.h"
+
+#include <string.h>
+
+#include "mylexer.l.h"
+
+void yylex_restore_buffer(void *);
+void yylex_reset_state(void *);
+
+struct sql_template_t {
+    GString *sql;           /* statement the template was parsed from */
+    GArray *tokens;         /* sql_token_pos_t of sql */
+    sql_context_t context;  /* spans point into sql */
+};
+
+/*
+ * copy of a statement whose spans point into another string with the
+ * same tokens, the literal terms are taken from the tokens of that string
+ */
+typedef struct {
+    const char *from;
+    const sql_token_pos_t *from_tokens;
+    const char *to;
+    const sql_token_pos_t *to_tokens;
+    guint n_tokens;
+    guint8 *bound;      /* literal tokens seen, only when checking a template */
+    gboolean failed;    /* span not on a token boundary or literal bound twice */
+} sql_binder_t;
+
+static gboolean
+is_literal(int code)
+{
+    return code == TK_INTEGER || code == TK_FLOAT || code == TK_STRING;
+}
+
+gboolean
+sql_fingerprint(sql_context_t *context, GString *sql, GString *fp, GArray *tokens)
+{
+    gboolean ok = TRUE;
+    int code;
+
+    if (context->scanner == NULL) {
+        yylex_init(&context->scanner);
+    }
+    yyscan_t scanner = context->scanner;
+
+    yylex_reset_state(scanner);
+    YY_BUFFER_STATE buf_state = yy_scan_buffer(sql->str, sql->len, scanner);
+
+    while ((code = yylex(scanner)) > 0) {
+        const char *z = yyget_text(scanner);
+        int n = yyget_leng(scanner);
+
+        if (code == TK_PROPERTY_START || code == TK_MYSQL_HINT) {
+            yylex_restore_buffer(scanner);
+            ok = FALSE;
+            break;
+        }
+
+        sql_token_pos_t pos = {z - sql->str, z - sql->str + n, code};
+        g_array_append_val(tokens, pos);
+
+        if (fp->len > 0) {
+            g_string_append_c(fp, ' ');
+        }
+        if (is_literal(code)) {
+            g_string_append_c(fp, '?');
+            g_string_append_c(fp, code == TK_STRING ? 's' : (code == TK_INTEGER ? 'i' : 'f'));
+        } else {
+            g_string_append_len(fp, z, n);
+        }
+    }
+
+    yy_delete_buffer(buf_state, scanner);
+    return ok;
+}
+
+/* index of the token starting (or ending) at p, -1 if none */
+static int
+binder_find(sql_binder_t *b, const char *p, gboolean at_end)
+{
+    if (p < b->from) {
+        return -1;
+    }
+
+    uint32_t off = p - b->from;
+    int low = 0, high = (int) b->n_tokens - 1;
+
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        uint32_t v = at_end ? b->from_tokens[mid].end : b->from_tokens[mid].start;
+        if (v == off) {
+            return mid;
+        } else if (v < off) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return -1;
+}
+
+static const char *
+binder_map(sql_binder_t *b, const char *p, gboolean at_end)
+{
+    if (p == NULL) {
+        return NULL;
+    }
+
+    int i = binder_find(b, p, at_end);
+    if (i < 0) {
+        b->failed = TRUE;
+        return NULL;
+    }
+    return b->to + (at_end ? b->to_tokens[i].end : b->to_tokens[i].start);
+}
+
+static sql_select_t *bind_select(sql_binder_t *, const sql_select_t *);
+
+static sql_expr_list_t *bind_expr_list(sql_binder_t *, const sql_expr_list_t *);
+
+static sql_expr_t *
+bind_expr(sql_binder_t *b, const sql_expr_t *p)
+{
+    if (p == NULL) {
+        return NULL;
+    }
+
+    sql_expr_t *e;
+    int i = -1;
+
+    if (is_literal(p->op) && !p->left && !p->right && !p->list && !p->select) {
+        i = binder_find(b, p->start, FALSE);
+        if (i >= 0 && (b->from_tokens[i].code != p->op
+                    || p->end != b->from + b->from_tokens[i].end)) {
+            i = -1;
+        }
+    }
+
+    if (i >= 0) {
+        /* a literal term, re-made from the other string */
+        if (b->bound) {
+            if (b->bound[i]) {
+                b->failed = TRUE;
+            }
+            b->bound[i] = 1;
+        }
+        sql_token_t token;
+        token.z = b->to + b->to_tokens[i].start;
+        token.n = b->to_tokens[i].end - b->to_tokens[i].start;
+        e = sql_expr_new(p->op, &token);
+        e->height = p->height;
+        e->flags = p->flags;
+        e->var_scope = p->var_scope;
+        e->alias = g_strdup(p->alias);
+        return e;
+    }
+
+    int extra = p->token_text ? strlen(p->token_text) + 1 : 0;
+    e = g_malloc0(sizeof(sql_expr_t) + extra);
+    *e = *p;
+    if (p->token_text) {
+        e->token_text = (char *) &e[1];
+        memcpy(e->token_text, p->token_text, extra);
+    }
+    e->left = bind_expr(b, p->left);
+    e->right = bind_expr(b, p->right);
+    e->list = bind_expr_list(b, p->list);
+    e->select = bind_select(b, p->select);
+    e->alias = g_strdup(p->alias);
+    e->start = binder_map(b, p->start, FALSE);
+    e->end = binder_map(b, p->end, TRUE);
+    return e;
+}
+
+static sql_expr_list_t *
+bind_expr_list(sql_binder_t *b, const sql_expr_list_t *list)
+{
+    if (list == NULL) {
+        return NULL;
+    }
+
+    sql_expr_list_t *l = g_ptr_array_new_with_free_func(sql_expr_free);
+    guint i;
+    for (i = 0; i < list->len; i++) {
+        g_ptr_array_add(l, bind_expr(b, g_ptr_array_index(list, i)));
+    }
+    return l;
+}
+
+static sql_column_list_t *
+bind_column_list(sql_binder_t *b, const sql_column_list_t *list)
+{
+    if (list == NULL) {
+        return NULL;
+    }
+
+    sql_column_list_t *l = g_ptr_array_new_with_free_func(sql_column_free);
+    guint i;
+    for (i = 0; i < list->len; i++) {
+        const sql_column_t *col = g_ptr_array_index(list, i);
+        sql_column_t *c = sql_column_new();
+        c->expr = bind_expr(b, col->expr);
+        c->type = g_strdup(col->type);
+        c->sort_order = col->sort_order;
+        c->alias = g_strdup(col->alias);
+        g_ptr_array_add(l, c);
+    }
+    return l;
+}
+
+static sql_id_list_t *
+bind_id_list(const sql_id_list_t *list)
+{
+    if (list == NULL) {
+        return NULL;
+    }
+
+    sql_id_list_t *l = g_ptr_array_new_with_free_func(g_free);
+    guint i;
+    for (i = 0; i < list->len; i++) {
+        g_ptr_array_add(l, g_strdup(g_ptr_array_index(list, i)));
+    }
+    return l;
+}
+
+static sql_src_list_t *
+bind_src_list(sql_binder_t *b, const sql_src_list_t *list)
+{
+    if (list == NULL) {
+        return NULL;
+    }
+
+    sql_src_list_t *l = g_ptr_array_new_with_free_func(sql_src_item_free);
+    guint i;
+    for (i = 0; i < list->len; i++) {
+        const sql_src_item_t *src = g_ptr_array_index(list, i);
+        sql_src_item_t *item = g_new0(sql_src_item_t, 1);
+        item->dbname = g_strdup(src->dbname);
+        item->table_name = g_strdup(src->table_name);
+        item->table_alias = g_strdup(src->table_alias);
+        item->select = bind_select(b, src->select);
+        item->jointype = src->jointype;
+        item->on_clause = bind_expr(b, src->on_clause);
+        item->pUsing = bind_id_list(src->pUsing);
+        item->func_arg = bind_expr_list(b, src->func_arg);
+        g_ptr_array_add(l, item);
+    }
+    return l;
+}
+
+static sql_select_t *
+bind_select(sql_binder_t *b, const sql_select_t *p)
+{
+    if (p == NULL) {
+        return NULL;
+    }
+
+    sql_select_t *s = sql_select_new();
+    s->op = p->op;
+    s->flags = p->flags;
+    s->columns = bind_expr_list(b, p->columns);
+    s->from_src = bind_src_list(b, p->from_src);
+    s->where_clause = bind_expr(b, p->where_clause);
+    s->groupby_clause = bind_expr_list(b, p->groupby_clause);
+    s->having_clause = bind_expr(b, p->having_clause);
+    s->orderby_clause = bind_column_list(b, p->orderby_clause);
+    s->prior = bind_select(b, p->prior);
+    s->limit = bind_expr(b, p->limit);
+    s->offset = bind_expr(b, p->offset);
+    s->lock_read = p->lock_read;
+    return s;
+}
+
+static void *
+bind_statement(sql_binder_t *b, const void *stmt, sql_stmt_type_t type)
+{
+    switch (type) {
+    case STMT_SELECT:
+        return bind_select(b, stmt);
+    case STMT_UPDATE: {
+        const sql_update_t *p = stmt;
+        sql_update_t *u = sql_update_new();
+        u->table = bind_src_list(b, p->table);
+        u->set_list = bind_expr_list(b, p->set_list);
+        u->where_clause = bind_expr(b, p->where_clause);
+        u->orderby_clause = bind_column_list(b, p->orderby_clause);
+        u->limit = bind_expr(b, p->limit);
+        u->offset = bind_expr(b, p->offset);
+        return u;
+    }
+    case STMT_DELETE: {
+        const sql_delete_t *p = stmt;
+        sql_delete_t *d = sql_delete_new();
+        d->from_src = bind_src_list(b, p->from_src);
+        d->where_clause = bind_expr(b, p->where_clause);
+        d->orderby_clause = bind_column_list(b, p->orderby_clause);
+        d->limit = bind_expr(b, p->limit);
+        d->offset = bind_expr(b, p->offset);
+        return d;
+    }
+    case STMT_INSERT: {
+        const sql_insert_t *p = stmt;
+        sql_insert_t *ins = sql_insert_new();
+        ins->is_replace = p->is_replace;
+        ins->table = bind_src_list(b, p->table);
+        ins->sel_val = bind_select(b, p->sel_val);
+        ins->columns = bind_id_list(p->columns);
+        return ins;
+    }
+    default:
+        g_assert_not_reached();
+        return NULL;
+    }
+}
+
+static void
+bind_context(sql_binder_t *b, const sql_context_t *from, sql_context_t *to)
+{
+    sql_context_reset(to);
+    to->rc = from->rc;
+    to->explain = from->explain;
+    to->stmt_type = from->stmt_type;
+    to->stmt_count = from->stmt_count;
+    to->rw_flag = from->rw_flag;
+    to->clause_flags = from->clause_flags;
+    to->where_flags = from->where_flags;
+    to->parsing_place = from->parsing_place;
+    to->sql_statement = bind_statement(b, from->sql_statement, from->stmt_type);
+}
+
+sql_template_t *
+sql_template_new(sql_context_t *context, GString *sql, GArray *tokens)
+{
+    if (context->rc != PARSE_OK || context->property || context->explain
+            || context->message || context->sql_statement == NULL) {
+        return NULL;
+    }
+
+    switch (context->stmt_type) {
+    case STMT_SELECT:
+    case STMT_UPDATE:
+    case STMT_DELETE:
+    case STMT_INSERT:
+        break;
+    default:
+        return NULL;
+    }
+
+    sql_template_t *t = g_new0(sql_template_t, 1);
+    t->sql = g_string_new_len(sql->str, sql->len);
+    t->tokens = g_array_sized_new(FALSE, FALSE, sizeof(sql_token_pos_t), tokens->len);
+    g_array_append_vals(t->tokens, tokens->data, tokens->len);
+    sql_context_init(&t->context);
+
+    sql_binder_t b;
+    b.from = sql->str;
+    b.from_tokens = (sql_token_pos_t *) tokens->data;
+    b.to = t->sql->str;
+    b.to_tokens = (sql_token_pos_t *) t->tokens->data;
+    b.n_tokens = tokens->len;
+    b.bound = g_new0(guint8, tokens->len);
+    b.failed = FALSE;
+
+    bind_context(&b, context, &t->context);
+
+    /* every literal has to be a term, else it went somewhere else */
+    guint i;
+    for (i = 0; i < tokens->len && !b.failed; i++) {
+        if (is_literal(b.from_tokens[i].code) && !b.bound[i]) {
+            b.failed = TRUE;
+        }
+    }
+    g_free(b.bound);
+
+    if (b.failed) {
+        sql_template_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+void
+sql_template_free(sql_template_t *t)
+{
+    if (t == NULL) {
+        return;
+    }
+    sql_context_destroy(&t->context);
+    g_string_free(t->sql, TRUE);
+    g_array_free(t->tokens, TRUE);
+    g_free(t);
+}
+
+void
+sql_template_bind(sql_template_t *t, GString *sql, GArray *tokens, sql_context_t *context)
+{
+    sql_binder_t b;
+
+    g_assert(tokens->len == t->tokens->len);
+
+    b.from = t->sql->str;
+    b.from_tokens = (sql_token_pos_t *) t->tokens->data;
+    b.to = sql->str;
+    b.to_tokens = (sql_token_pos_t *) tokens->data;
+    b.n_tokens = tokens->len;
+    b.bound = NULL;
+    b.failed = FALSE;
+
+    bind_context(&b, &t->context, context);
+}
@@ -0,0 +1,43 @@
+#ifndef SQL_TEMPLATE_H
+#define SQL_TEMPLATE_H
+
+#include <glib.h>
+
+#include "sql-context.h"
+
+/* a token of a sql string, as offsets into the string */
+typedef struct sql_token_pos_t {
+    uint32_t start;
+    uint32_t end;
+    int code;
+} sql_token_pos_t;
+
+/* parsed statement whose literals can be replaced by those of another
+   statement with the same fingerprint */
+typedef struct sql_template_t sql_template_t;
+
+/**
+ * tokenize sql, which must be terminated with 2 NUL like for
+ * sql_context_parse_len(), literals are written as placeholders to fp.
+ * the scanner of context is used, it is created if not yet
+ *
+ * @return FALSE if the statement has comments that change its meaning
+ */
+gboolean sql_fingerprint(sql_context_t *context, GString *sql, GString *fp, GArray *tokens);
+
+/**
+ * keep the statement just parsed into context from sql
+ *
+ * @return NULL if not every literal of sql is a term of the statement
+ */
+sql_template_t *sql_template_new(sql_context_t *context, GString *sql, GArray *tokens);
+
+void sql_template_free(sql_template_t *);
+
+/**
+ * the statement of the template with the literals of sql, as if sql
+ * was parsed into context
+ */
+void sql_template_bind(sql_template_t *, GString *sql, GArray *tokens, sql_context_t *context);
+
+#endif /* SQL_TEMPLATE_H */
@@ -11,6 +11,7 @@
 #include "character-set.h"
 #include "chassis-event.h"
 #include "chassis-options.h"
+#include "chassis-workers.h"
 #include "cetus-monitor.h"
 #include "glib-ext.h"
 #include "network-mysqld-packet.h"
@@ -282,6 +283,11 @@ static int admin_send_backends_info(network_mysqld_con *admin_con, const char *s
     field->type = MYSQL_TYPE_STRING;
     g_ptr_array_add(fields, field);
 
+    field = network_mysqld_proto_fielddef_new();
+    field->name = g_strdup("weight");
+    field->type = MYSQL_TYPE_STRING;
+    g_ptr_array_add(fields, field);
+
     field = network_mysqld_proto_fielddef_new();
     field->name = g_strdup("uuid");
     field->type = MYSQL_TYPE_STRING;
@@ -331,6 +337,9 @@ static int admin_send_backends_info(network_mysqld_con *admin_con, const char *s
         snprintf(buffer, sizeof(buffer), "%d", backend->slave_delay_msec);
         g_ptr_array_add(row, backend->type == BACKEND_TYPE_RO ? g_strdup(buffer) : NULL);
 
+        snprintf(buffer, sizeof(buffer), "%d", backend->weight);
+        g_ptr_array_add(row, backend->type == BACKEND_TYPE_RO ? g_strdup(buffer) : NULL);
+
         g_ptr_array_add(row, backend->uuid->len ? g_strdup(backend->uuid->str) : NULL);
 
         snprintf(buffer, sizeof(buffer), "%d", backend->pool->cur_idle_connections); 
@@ -1273,6 +1282,8 @@ static int admin_reduce_memory(network_mysqld_con *con, const char *sql)
     g_message("%s:Total free space (bytes): %d", G_STRLOC, m.fordblks);
     g_message("%s:Top-most, releasable space (bytes): %d", G_STRLOC, m.keepcost);
 
+    network_packet_pool_shrink();
+
     if (m.fordblks > m.uordblks) {
         malloc_trim(0);
         m = mallinfo();
@@ -1483,7 +1494,8 @@ static int admin_update_user_password(network_mysqld_con *con, const char *sql)
         pwd_type = CETUS_CLIENT_PWD;
     }
     gboolean affected = cetus_users_update_record(g->users, user, new_pwd, pwd_type);
-    if (affected)
+    /* the master writes the file, the workers only update their copy */
+    if (affected && !chassis_is_worker(con->srv))
         cetus_users_write_json(g->users);
     network_mysqld_con_send_ok_full(con->client, affected?1:0, 0,
                                     SERVER_STATUS_AUTOCOMMIT, 0);
@@ -1500,7 +1512,7 @@ static int admin_delete_user_password(network_mysqld_con *con, const char *sql)
 
     chassis_private *g = con->srv->priv;
     gboolean affected = cetus_users_delete_record(g->users, user);
-    if (affected)
+    if (affected && !chassis_is_worker(con->srv))
         cetus_users_write_json(g->users);
     network_mysqld_con_send_ok_full(con->client, affected?1:0, 0,
                                     SERVER_STATUS_AUTOCOMMIT, 0);
@@ -1586,6 +1598,7 @@ static int admin_update_backend(network_mysqld_con *con, const char *sql)
     int i = 0;
     char type_str[64] = {0};
     char state_str[64] = {0};
+    int weight = -1;
     char *col;
     for (; (col = set_cols_array[i]) != NULL; ++i) {
         g_strstrip(col);
@@ -1593,12 +1606,21 @@ static int admin_update_backend(network_mysqld_con *con, const char *sql)
             sscanf(col, "type=%*['\"]%32[a-zA-Z]%*['\"]", type_str);
         } else if (strncasecmp(col, "state", 5) == 0) {
             sscanf(col, "state=%*['\"]%32[a-zA-Z]%*['\"]", state_str);
+        } else if (strncasecmp(col, "weight", 6) == 0) {
+            if (sscanf(col, "weight=%d", &weight) != 1 || weight < 0
+                || weight > BACKEND_WEIGHT_MAX)
+            {
+                g_free(set_cols_str);
+                g_strfreev(set_cols_array);
+                network_mysqld_con_send_error(con->client, C("weight must be in 0..100"));
+                return PROXY_SEND_RESULT;
+            }
         }
     }
     g_free(set_cols_str);
     g_strfreev(set_cols_array);
 
-    if (type_str[0] == '\0' && state_str[0] == '\0')
+    if (type_str[0] == '\0' && state_str[0] == '\0' && weight == -1)
         return PROXY_NO_DECISION;
 
     chassis_private *g = con->srv->priv;
@@ -1619,7 +1641,12 @@ static int admin_update_backend(network_mysqld_con *con, const char *sql)
         }
         int type = type_str[0] != '\0' ? backend_type(type_str) : bk->type;
         int state = state_str[0] != '\0' ? backend_state(state_str) : bk->state;
-        network_backends_modify(g->backends, backend_ndx, type, state);
+        if (type_str[0] != '\0' || state_str[0] != '\0') {
+            network_backends_modify(g->backends, backend_ndx, type, state);
+        }
+        if (weight != -1) {
+            network_backends_set_weight(g->backends, backend_ndx, weight);
+        }
         affected_rows = 1;
     } else {
         for (i = 0; i < network_backends_count(g->backends); ++i) {
@@ -1627,7 +1654,12 @@ static int admin_update_backend(network_mysqld_con *con, const char *sql)
             if (bk) {
                 int type = type_str[0] != '\0' ? backend_type(type_str) : bk->type;
                 int state = state_str[0] != '\0' ? backend_state(state_str) : bk->state;
-                network_backends_modify(g->backends, i, type, state);
+                if (type_str[0] != '\0' || state_str[0] != '\0') {
+                    network_backends_modify(g->backends, i, type, state);
+                }
+                if (weight != -1) {
+                    network_backends_set_weight(g->backends, i, weight);
+                }
                 affected_rows += 1;
             }
         }
@@ -1679,12 +1711,152 @@ static int admin_supported_stats(network_mysqld_con *con)
     APPEND_ROW_1_COL(rows, "query_time_table");
     APPEND_ROW_1_COL(rows, "server_query_details");
     APPEND_ROW_1_COL(rows, "query_wait_table");
+    APPEND_ROW_1_COL(rows, "packet_pool");
+    APPEND_ROW_1_COL(rows, "latency");
+    APPEND_ROW_1_COL(rows, "latency_sql");
+    APPEND_ROW_1_COL(rows, "prometheus");
     network_mysqld_con_send_resultset(con->client, fields, rows);
     network_mysqld_proto_fielddefs_free(fields);
     g_ptr_array_free(rows, TRUE);
     return PROXY_SEND_RESULT;
 }
 
+static void append_latency_rows(GPtrArray *rows, const char *name, const latency_hist_t *h)
+{
+    if (h->count == 0) {
+        return;
+    }
+
+    GPtrArray *row = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_add(row, g_strdup_printf("%s.count", name));
+    g_ptr_array_add(row, g_strdup_printf("%" G_GUINT64_FORMAT, h->count));
+    g_ptr_array_add(rows, row);
+    row = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_add(row, g_strdup_printf("%s.avg_us", name));
+    g_ptr_array_add(row, g_strdup_printf("%" G_GUINT64_FORMAT, h->sum_us / h->count));
+    g_ptr_array_add(rows, row);
+
+    static const char *suffixes[] = {"p50_us", "p99_us", "p999_us"};
+    static const double q[] = {0.5, 0.99, 0.999};
+    int i;
+    for (i = 0; i < G_N_ELEMENTS(q); i++) {
+        row = g_ptr_array_new_with_free_func(g_free);
+        g_ptr_array_add(row, g_strdup_printf("%s.%s", name, suffixes[i]));
+        g_ptr_array_add(row, g_strdup_printf("%" G_GUINT64_FORMAT, latency_hist_percentile(h, q[i])));
+        g_ptr_array_add(rows, row);
+    }
+}
+
+/* the top statements, most time spent first */
+static gint latency_sql_cmp(gconstpointer a, gconstpointer b)
+{
+    const latency_sql_t *x = *(const latency_sql_t **)a;
+    const latency_sql_t *y = *(const latency_sql_t **)b;
+    return x->weight < y->weight ? 1 : (x->weight > y->weight ? -1 : 0);
+}
+
+static GPtrArray *latency_sql_sorted(query_stats_t *stats)
+{
+    GPtrArray *top = g_ptr_array_new();
+    int i;
+    for (i = 0; i < LATENCY_TOP_SQL; i++) {
+        if (stats->latency_sql[i].hash) {
+            g_ptr_array_add(top, &(stats->latency_sql[i]));
+        }
+    }
+    g_ptr_array_sort(top, latency_sql_cmp);
+    return top;
+}
+
+static void append_prometheus_label(GString *out, const char *name, const char *value)
+{
+    const char *p;
+    g_string_append_printf(out, "%s=\"", name);
+    for (p = value; *p; p++) {
+        if (*p == '\\' || *p == '"') {
+            g_string_append_c(out, '\\');
+        }
+        g_string_append_c(out, *p);
+    }
+    g_string_append_c(out, '"');
+}
+
+/* prometheus text format, a row per line */
+static int admin_send_prometheus_stats(network_mysqld_con *con, query_stats_t *stats)
+{
+    GString *out = g_string_sized_new(16384);
+    GString *labels = g_string_new(NULL);
+    int i;
+
+    g_string_append(out, "# HELP cetus_query_latency_seconds Time from a request read to its response sent.\n");
+    g_string_append(out, "# TYPE cetus_query_latency_seconds summary\n");
+    latency_hist_append_prometheus(out, "cetus_query_latency_seconds", NULL, &(stats->latency_total));
+
+    g_string_append(out, "# HELP cetus_proxy_latency_seconds Part of the query latency no backend is working.\n");
+    g_string_append(out, "# TYPE cetus_proxy_latency_seconds summary\n");
+    latency_hist_append_prometheus(out, "cetus_proxy_latency_seconds", NULL, &(stats->latency_proxy));
+
+    g_string_append(out, "# HELP cetus_command_latency_seconds Query latency by command.\n");
+    g_string_append(out, "# TYPE cetus_command_latency_seconds summary\n");
+    for (i = 0; i < LATENCY_CMD_MAX; i++) {
+        g_string_assign(labels, "");
+        append_prometheus_label(labels, "command", latency_cmd_name(i));
+        latency_hist_append_prometheus(out, "cetus_command_latency_seconds", labels->str,
+                                       &(stats->latency_cmd[i]));
+    }
+
+    g_string_append(out, "# HELP cetus_backend_latency_seconds Time a backend takes to answer.\n");
+    g_string_append(out, "# TYPE cetus_backend_latency_seconds summary\n");
+    network_backends_t *bs = con->srv->priv->backends;
+    for (i = 0; i < network_backends_count(bs); i++) {
+        network_backend_t *backend = network_backends_get(bs, i);
+        if (backend == NULL || backend->id < 0) {
+            continue;
+        }
+        g_string_assign(labels, "");
+        append_prometheus_label(labels, "backend", backend->addr->name->str);
+        latency_hist_append_prometheus(out, "cetus_backend_latency_seconds", labels->str,
+                                       &(stats->latency_backend[backend->id]));
+    }
+
+    g_string_append(out, "# HELP cetus_sql_latency_seconds Query latency of the statements taking the most time.\n");
+    g_string_append(out, "# TYPE cetus_sql_latency_seconds summary\n");
+    GPtrArray *top = latency_sql_sorted(stats);
+    for (i = 0; i < top->len; i++) {
+        latency_sql_t *s = g_ptr_array_index(top, i);
+        char fingerprint[32];
+        snprintf(fingerprint, sizeof(fingerprint), "%016lx", s->hash);
+        g_string_assign(labels, "");
+        append_prometheus_label(labels, "fingerprint", fingerprint);
+        g_string_append_c(labels, ',');
+        append_prometheus_label(labels, "sql", s->text);
+        latency_hist_append_prometheus(out, "cetus_sql_latency_seconds", labels->str, &(s->hist));
+    }
+    g_ptr_array_free(top, TRUE);
+
+    GPtrArray *fields = network_mysqld_proto_fielddefs_new();
+    MAKE_FIELD_DEF_1_COL(fields, "metrics");
+    GPtrArray *rows = g_ptr_array_new_with_free_func(
+        (void *)network_mysqld_mysql_field_row_free);
+    char **lines = g_strsplit(out->str, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        if (lines[i][0] == '\0') {
+            continue;
+        }
+        GPtrArray *row = g_ptr_array_new_with_free_func(g_free);
+        g_ptr_array_add(row, g_strdup(lines[i]));
+        g_ptr_array_add(rows, row);
+    }
+    g_strfreev(lines);
+
+    network_mysqld_con_send_resultset(con->client, fields, rows);
+    network_mysqld_proto_fielddefs_free(fields);
+    g_ptr_array_free(rows, TRUE);
+    g_string_free(labels, TRUE);
+    g_string_free(out, TRUE);
+    return PROXY_SEND_RESULT;
+}
+
 static int admin_get_stats(network_mysqld_con *con, const char *sql)
 {
     const char *p = sql + 9;
@@ -1694,50 +1866,110 @@ static int admin_get_stats(network_mysqld_con *con, const char *sql)
         ++p; /* stats get [xxx], point to xxx */
     }
 
+    chassis *chas = con->srv;
+    /* too large for the stack with the latency histograms */
+    query_stats_t *stats = g_new(query_stats_t, 1);
+    chassis_query_stats_get(chas, stats);
+    if (strcasecmp(p, "prometheus") == 0) {
+        int rc = admin_send_prometheus_stats(con, stats);
+        g_free(stats);
+        return rc;
+    }
+
     GPtrArray *fields = network_mysqld_proto_fielddefs_new();
     MAKE_FIELD_DEF_2_COL(fields, "name", "value");
     GPtrArray *rows = g_ptr_array_new_with_free_func(
         (void *)network_mysqld_mysql_field_row_free);
-    chassis *chas = con->srv;
-    query_stats_t *stats = &(chas->query_stats);
     char buf1[32] = {0};
     char buf2[32] = {0};
     int i;
     if (strcasecmp(p, "client_query") == 0) {
-        snprintf(buf1, 32, "%lu", stats->client_query.ro);
-        snprintf(buf2, 32, "%lu", stats->client_query.rw);
+        snprintf(buf1, 32, "%" G_GUINT64_FORMAT, stats->client_query.ro);
+        snprintf(buf2, 32, "%" G_GUINT64_FORMAT, stats->client_query.rw);
         APPEND_ROW_2_COL(rows, "client_query.ro", buf1);
         APPEND_ROW_2_COL(rows, "client_query.rw", buf2);
     } else if (strcasecmp(p, "proxyed_query") == 0) {
-        snprintf(buf1, 32, "%lu", stats->proxyed_query.ro);
-        snprintf(buf2, 32, "%lu", stats->proxyed_query.rw);
+        snprintf(buf1, 32, "%" G_GUINT64_FORMAT, stats->proxyed_query.ro);
+        snprintf(buf2, 32, "%" G_GUINT64_FORMAT, stats->proxyed_query.rw);
         APPEND_ROW_2_COL(rows, "proxyed_query.ro", buf1);
         APPEND_ROW_2_COL(rows, "proxyed_query.rw", buf2);
     } else if (strcasecmp(p, "query_time_table") == 0) {
         for (i = 0; i < MAX_QUERY_TIME && stats->query_time_table[i]; ++i) {
             GPtrArray *row = g_ptr_array_new_with_free_func(g_free);
             g_ptr_array_add(row, g_strdup_printf("query_time_table.%d", i+1));
-            g_ptr_array_add(row, g_strdup_printf("%lu", stats->query_time_table[i]));
+            g_ptr_array_add(row, g_strdup_printf("%" G_GUINT64_FORMAT, stats->query_time_table[i]));
             g_ptr_array_add(rows, row);
         }
     } else if (strcasecmp(p, "query_wait_table") == 0) {
         for (i = 0; i < MAX_QUERY_TIME && stats->query_wait_table[i]; ++i) {
             GPtrArray *row = g_ptr_array_new_with_free_func(g_free);
             g_ptr_array_add(row, g_strdup_printf("query_wait_table.%d", i+1));
-            g_ptr_array_add(row, g_strdup_printf("%lu", stats->query_wait_table[i]));
+            g_ptr_array_add(row, g_strdup_printf("%" G_GUINT64_FORMAT, stats->query_wait_table[i]));
             g_ptr_array_add(rows, row);
         }
     } else if (strcasecmp(p, "server_query_details") == 0) {
-        for (i = 0; i < MAX_SERVER_NUM && i < network_backends_count(chas->priv->backends); ++i) {
+        for (i = 0; i < network_backends_count(chas->priv->backends); ++i) {
+            network_backend_t *backend = network_backends_get(chas->priv->backends, i);
+            if (backend->id < 0) {
+                continue;
+            }
             GPtrArray *row = g_ptr_array_new_with_free_func(g_free);
             g_ptr_array_add(row, g_strdup_printf("server_query_details.%d.ro", i+1));
-            g_ptr_array_add(row, g_strdup_printf("%lu", stats->server_query_details[i].ro));
+            g_ptr_array_add(row, g_strdup_printf("%" G_GUINT64_FORMAT, stats->server_query_details[backend->id].ro));
             g_ptr_array_add(rows, row);
             row = g_ptr_array_new_with_free_func(g_free);
             g_ptr_array_add(row, g_strdup_printf("server_query_details.%d.rw", i+1));
-            g_ptr_array_add(row, g_strdup_printf("%lu", stats->server_query_details[i].rw));
+            g_ptr_array_add(row, g_strdup_printf("%" G_GUINT64_FORMAT, stats->server_query_details[backend->id].rw));
+            g_ptr_array_add(rows, row);
+        }
+    } else if (strcasecmp(p, "packet_pool") == 0) {
+        network_packet_pool_stats_t pool_stats;
+        network_packet_pool_get_stats(&pool_stats);
+        snprintf(buf1, 32, "%" G_GUINT64_FORMAT, pool_stats.hits);
+        snprintf(buf2, 32, "%" G_GUINT64_FORMAT, pool_stats.misses);
+        APPEND_ROW_2_COL(rows, "packet_pool.hits", buf1);
+        APPEND_ROW_2_COL(rows, "packet_pool.misses", buf2);
+        snprintf(buf1, 32, "%" G_GUINT64_FORMAT, pool_stats.puts);
+        snprintf(buf2, 32, "%" G_GUINT64_FORMAT, pool_stats.drops);
+        APPEND_ROW_2_COL(rows, "packet_pool.puts", buf1);
+        APPEND_ROW_2_COL(rows, "packet_pool.drops", buf2);
+        for (i = 0; i < NETWORK_PACKET_POOL_CLASSES; ++i) {
+            GPtrArray *row = g_ptr_array_new_with_free_func(g_free);
+            g_ptr_array_add(row, g_strdup_printf("packet_pool.free.%u",
+                                                 network_packet_pool_class_size(i)));
+            g_ptr_array_add(row, g_strdup_printf("%u", pool_stats.free_count[i]));
+            g_ptr_array_add(rows, row);
+        }
+    } else if (strcasecmp(p, "latency") == 0) {
+        append_latency_rows(rows, "latency.total", &(stats->latency_total));
+        append_latency_rows(rows, "latency.proxy", &(stats->latency_proxy));
+        for (i = 0; i < LATENCY_CMD_MAX; ++i) {
+            char name[64];
+            snprintf(name, sizeof(name), "latency.%s", latency_cmd_name(i));
+            append_latency_rows(rows, name, &(stats->latency_cmd[i]));
+        }
+        for (i = 0; i < network_backends_count(chas->priv->backends); ++i) {
+            network_backend_t *backend = network_backends_get(chas->priv->backends, i);
+            if (backend->id < 0) {
+                continue;
+            }
+            char name[64];
+            snprintf(name, sizeof(name), "latency.backend.%d", i+1);
+            append_latency_rows(rows, name, &(stats->latency_backend[backend->id]));
+        }
+    } else if (strcasecmp(p, "latency_sql") == 0) {
+        GPtrArray *top = latency_sql_sorted(stats);
+        for (i = 0; i < top->len; ++i) {
+            latency_sql_t *s = g_ptr_array_index(top, i);
+            GPtrArray *row = g_ptr_array_new_with_free_func(g_free);
+            g_ptr_array_add(row, g_strdup_printf("latency_sql.%d.sql", i+1));
+            g_ptr_array_add(row, g_strdup(s->text));
             g_ptr_array_add(rows, row);
+            char name[64];
+            snprintf(name, sizeof(name), "latency_sql.%d", i+1);
+            append_latency_rows(rows, name, &(s->hist));
         }
+        g_ptr_array_free(top, TRUE);
     } else if (strcasecmp(p, "reset") == 0) {
         APPEND_ROW_2_COL(rows, "reset", "0");
     } else {
@@ -1747,6 +1979,7 @@ static int admin_get_stats(network_mysqld_con *con, const char *sql)
 
     network_mysqld_proto_fielddefs_free(fields);
     g_ptr_array_free(rows, TRUE);
+    g_free(stats);
     return PROXY_SEND_RESULT;
 }
 
@@ -1846,8 +2079,7 @@ static int admin_set_config(network_mysqld_con *con, const char *sql)
 
 static int admin_reset_stats(network_mysqld_con *con, const char *sql)
 {
-    query_stats_t *stats = &con->srv->query_stats;
-    memset(stats, 0, sizeof(*stats));
+    chassis_query_stats_reset(con->srv);
     network_mysqld_con_send_ok_full(con->client, 1, 0,
                                     SERVER_STATUS_AUTOCOMMIT, 0);
     return PROXY_SEND_RESULT;
@@ -1891,26 +2123,58 @@ static int admin_send_status(network_mysqld_con *con, const char *sql)
     GString *plugin_names = g_string_new(0);
     get_module_names(con->srv, plugin_names);
     APPEND_ROW_2_COL(rows, "Loaded modules", plugin_names->str);
+    int idle_conns = network_backends_idle_conns(g->backends);
+    int used_conns = network_backends_used_conns(g->backends);
+    int clients = g->cons->len;
+    if (chassis_is_master(con->srv)) {
+        /* the clients are with the workers */
+        chassis_worker_stats_t *ws = con->srv->worker_stats;
+        int i;
+        idle_conns = used_conns = clients = 0;
+        for (i = 0; i < con->srv->worker_processes; i++) {
+            idle_conns += ws->conns[i].idle_backend_conns;
+            used_conns += ws->conns[i].used_backend_conns;
+            clients += ws->conns[i].clients;
+        }
+    }
     const int bsize = 32;
     static char buf1[32], buf2[32], buf3[32];
-    snprintf(buf1, bsize, "%d", network_backends_idle_conns(g->backends));
+    snprintf(buf1, bsize, "%d", idle_conns);
     APPEND_ROW_2_COL(rows, "Idle backend connections", buf1);
-    snprintf(buf2, bsize, "%d", network_backends_used_conns(g->backends));
+    snprintf(buf2, bsize, "%d", used_conns);
     APPEND_ROW_2_COL(rows, "Used backend connections", buf2);
-    snprintf(buf3, bsize, "%d", g->cons->len);
+    snprintf(buf3, bsize, "%d", clients);
     APPEND_ROW_2_COL(rows, "Client connections", buf3);
 
-    query_stats_t *stats = &(con->srv->query_stats);
+    if (con->srv->worker_processes > 1) {
+        static char workers[32];
+        snprintf(workers, sizeof(workers), "%d", con->srv->worker_processes);
+        APPEND_ROW_2_COL(rows, "Worker processes", workers);
+    }
+
+    query_stats_t *stats = g_new(query_stats_t, 1);
+    chassis_query_stats_get(con->srv, stats);
     char qcount[32];
-    snprintf(qcount, 32, "%ld", stats->client_query.ro+stats->client_query.rw);
+    snprintf(qcount, 32, "%" G_GUINT64_FORMAT, stats->client_query.ro + stats->client_query.rw);
     APPEND_ROW_2_COL(rows, "Query count", qcount);
    
+    char xacount[32];
     if (config->has_shard_plugin) { 
-        char xacount[32];
-        snprintf(xacount, 32, "%ld", stats->xa_count);
+        snprintf(xacount, 32, "%" G_GUINT64_FORMAT, stats->xa_count);
         APPEND_ROW_2_COL(rows, "XA count", xacount);
     }
 
+    char latency[64];
+    if (stats->latency_total.count > 0) {
+        snprintf(latency, sizeof(latency),
+                "%" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT,
+                latency_hist_percentile(&(stats->latency_total), 0.5),
+                latency_hist_percentile(&(stats->latency_total), 0.99),
+                latency_hist_percentile(&(stats->latency_total), 0.999));
+        APPEND_ROW_2_COL(rows, "Latency us (p50, p99, p999)", latency);
+    }
+    g_free(stats);
+
     char qps[64];
     calc_qps_average(C(qps));
     APPEND_ROW_2_COL(rows, "QPS (1min, 5min, 15min)", qps);
@@ -2036,7 +2300,7 @@ static struct sql_handler_entry_t sql_handler_shard_map[] = {
      "insert into backends values ('<ip:port@group>', '(ro|rw)', '<state>')",
      "add mysql instance to backends list"},
     {"update backends set", admin_update_backend,
-     "update backends set (type|state)=x where (backend_ndx=<index>|address=<'ip:port'>)",
+     "update backends set (type|state|weight)=x where (backend_ndx=<index>|address=<'ip:port'>)",
      "update mysql instance type or state"},
     {"delete from backends", admin_delete_backend,
      "delete from backends where (backend_ndx=<index>|address=<'ip:port'>)"},
@@ -2104,7 +2368,7 @@ static struct sql_handler_entry_t sql_handler_rw_map[] = {
      "insert into backends values ('<ip:port>', '(ro|rw)', '<state>')",
      "add mysql instance to backends list"},
     {"update backends set", admin_update_backend,
-     "update backends set (type|state)=x where (backend_ndx=<index>|address=<'ip:port'>)",
+     "update backends set (type|state|weight)=x where (backend_ndx=<index>|address=<'ip:port'>)",
      "update mysql instance type or state"},
     {"delete from backends", admin_delete_backend,
      "delete from backends where (backend_ndx=<index>|address=<'ip:port'>)"},
@@ -2147,6 +2411,311 @@ static int admin_help(network_mysqld_con *con, const char *sql)
     return PROXY_SEND_RESULT;
 }
 
+static sql_handler_func
+admin_find_handler(chassis_plugin_config *config, const char *sql)
+{
+    struct sql_handler_entry_t *sql_handler_map =
+        config->has_shard_plugin ? sql_handler_shard_map : sql_handler_rw_map;
+    int i;
+    for (i = 0; sql_handler_map[i].prefix; ++i) {
+        if (strcasestr(sql, sql_handler_map[i].prefix)) {
+            return sql_handler_map[i].func;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * multi-process mode: the admin runs in the master, a statement not
+ * listed here only needs the state of the master or what the workers
+ * publish in the shared memory
+ */
+typedef enum {
+    ADMIN_SCOPE_ALL = 1,    /* a change, made in the master and then in every worker */
+    ADMIN_SCOPE_WORKERS,    /* about the connections, the results of the workers are merged */
+} admin_scope_t;
+
+struct admin_scope_entry_t {
+    sql_handler_func func;
+    admin_scope_t scope;
+    int key_cols;       /* rows with the same first key_cols columns are merged into one,
+                           0 to merge all of them, -1 to keep every row */
+    guint sum_cols;     /* bitmap of the columns added up when rows are merged */
+};
+
+static struct admin_scope_entry_t admin_scope_map[] = {
+    {admin_send_backends_info, ADMIN_SCOPE_WORKERS, 1, 0x380},  /* idle, used, total */
+    {admin_send_backend_detail_info, ADMIN_SCOPE_WORKERS, 2, 0x1c},
+    {admin_show_connectionlist, ADMIN_SCOPE_WORKERS, -1, 0},
+    {admin_send_connection_stat, ADMIN_SCOPE_WORKERS, 0, 0x1},
+    {admin_show_status, ADMIN_SCOPE_WORKERS, 1, 0x2},
+    {admin_add_allow_ip, ADMIN_SCOPE_ALL},
+    {admin_add_deny_ip, ADMIN_SCOPE_ALL},
+    {admin_delete_allow_ip, ADMIN_SCOPE_ALL},
+    {admin_delete_deny_ip, ADMIN_SCOPE_ALL},
+    {admin_set_reduce_conns, ADMIN_SCOPE_ALL},
+    {admin_reduce_memory, ADMIN_SCOPE_ALL},
+    {admin_set_maintain, ADMIN_SCOPE_ALL},
+    {admin_reload_shard, ADMIN_SCOPE_ALL},
+    {admin_update_user_password, ADMIN_SCOPE_ALL},
+    {admin_delete_user_password, ADMIN_SCOPE_ALL},
+    {admin_insert_backend, ADMIN_SCOPE_ALL},
+    {admin_update_backend, ADMIN_SCOPE_ALL},
+    {admin_delete_backend, ADMIN_SCOPE_ALL},
+    {admin_add_backend, ADMIN_SCOPE_ALL},
+    {admin_set_config, ADMIN_SCOPE_ALL},
+    {NULL}
+};
+
+static struct admin_scope_entry_t *admin_get_scope(sql_handler_func func)
+{
+    int i;
+    for (i = 0; admin_scope_map[i].func; ++i) {
+        if (admin_scope_map[i].func == func) {
+            return &admin_scope_map[i];
+        }
+    }
+    return NULL;
+}
+
+static gboolean admin_packet_is_err(const GString *packet)
+{
+    return packet->len > NET_HEADER_SIZE && (guchar)packet->str[NET_HEADER_SIZE] == MYSQLD_PACKET_ERR;
+}
+
+/* next packet of the result a worker replied, packet->offset past its header */
+static gboolean admin_reply_next(GString *reply, gsize *pos, network_packet *packet)
+{
+    if (*pos + NET_HEADER_SIZE > reply->len) {
+        return FALSE;
+    }
+    const guchar *p = (const guchar *)reply->str + *pos;
+    gsize len = p[0] | (p[1] << 8) | (p[2] << 16);
+    if (*pos + NET_HEADER_SIZE + len > reply->len) {
+        return FALSE;
+    }
+    packet->data = reply;
+    packet->offset = *pos + NET_HEADER_SIZE;
+    *pos += NET_HEADER_SIZE + len;
+    return TRUE;
+}
+
+/**
+ * decode the resultset a worker replied, the rows are added to rows
+ *
+ * @return the field defs, NULL if it is not a resultset
+ */
+static GPtrArray *admin_reply_parse(GString *reply, GPtrArray *rows)
+{
+    network_packet packet;
+    gsize pos = 0;
+    guint64 field_count, i;
+    guint8 first;
+
+    if (!admin_reply_next(reply, &pos, &packet)
+        || network_mysqld_proto_peek_int8(&packet, &first)
+        || first == MYSQLD_PACKET_OK || first == MYSQLD_PACKET_ERR
+        || network_mysqld_proto_get_lenenc_int(&packet, &field_count)
+        || field_count == 0)
+    {
+        return NULL;
+    }
+
+    GPtrArray *fields = network_mysqld_proto_fielddefs_new();
+    for (i = 0; i < field_count; i++) {
+        MYSQL_FIELD *field = network_mysqld_proto_fielddef_new();
+        g_ptr_array_add(fields, field);
+        if (!admin_reply_next(reply, &pos, &packet)
+            || network_mysqld_proto_get_fielddef(&packet, field, CLIENT_PROTOCOL_41))
+        {
+            network_mysqld_proto_fielddefs_free(fields);
+            return NULL;
+        }
+    }
+    admin_reply_next(reply, &pos, &packet); /* EOF */
+
+    while (admin_reply_next(reply, &pos, &packet)) {
+        if (network_mysqld_proto_peek_int8(&packet, &first) || first == MYSQLD_PACKET_EOF) {
+            break;
+        }
+        GPtrArray *row = g_ptr_array_new_with_free_func(g_free);
+        for (i = 0; i < field_count; i++) {
+            gchar *value = NULL;
+            network_mysqld_proto_peek_int8(&packet, &first);
+            if (first == MYSQLD_PACKET_NULL) {
+                packet.offset++;
+            } else if (network_mysqld_proto_get_lenenc_str(&packet, &value, NULL)) {
+                break;
+            }
+            g_ptr_array_add(row, value);
+        }
+        g_ptr_array_add(rows, row);
+    }
+    return fields;
+}
+
+static gboolean admin_row_key_equal(GPtrArray *a, GPtrArray *b, int key_cols)
+{
+    int i;
+    for (i = 0; i < key_cols && i < a->len && i < b->len; i++) {
+        if (g_strcmp0(a->pdata[i], b->pdata[i]) != 0) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* fold the rows of one worker into the rows of the others */
+static void admin_merge_rows(GPtrArray *rows, GPtrArray *more, struct admin_scope_entry_t *scope)
+{
+    int i, j, k;
+    for (i = 0; i < more->len; i++) {
+        GPtrArray *row = more->pdata[i];
+        GPtrArray *same = NULL;
+        if (scope->key_cols >= 0) {
+            for (j = 0; j < rows->len && !same; j++) {
+                if (admin_row_key_equal(rows->pdata[j], row, scope->key_cols)) {
+                    same = rows->pdata[j];
+                }
+            }
+        }
+        if (same == NULL) {
+            g_ptr_array_add(rows, row);
+            more->pdata[i] = NULL;
+            continue;
+        }
+        for (k = 0; k < same->len && k < row->len; k++) {
+            if (scope->sum_cols & (1 << k)) {
+                gint64 sum = g_ascii_strtoll(same->pdata[k] ? same->pdata[k] : "0", NULL, 10)
+                    + g_ascii_strtoll(row->pdata[k] ? row->pdata[k] : "0", NULL, 10);
+                g_free(same->pdata[k]);
+                same->pdata[k] = g_strdup_printf("%" G_GINT64_FORMAT, sum);
+            }
+        }
+    }
+}
+
+/**
+ * run a statement in the master of multi-process mode
+ *
+ * a change is made here first, if it fails the workers aren't asked.
+ * if a worker doesn't take it, the error is reported though the master
+ * and the others have it
+ */
+static int admin_run_in_workers(network_mysqld_con *con, sql_handler_func func, const char *sql)
+{
+    struct admin_scope_entry_t *scope = admin_get_scope(func);
+    GString *replies[MAX_WORKER_PROCESSES];
+    int i;
+
+    if (scope == NULL) {
+        return func(con, sql);
+    }
+
+    if (scope->scope == ADMIN_SCOPE_ALL) {
+        guint8 last_packet_id = con->client->last_packet_id;
+        gboolean packet_id_is_reset = con->client->packet_id_is_reset;
+
+        int ret = func(con, sql);
+        GString *first = g_queue_peek_head(con->client->send_queue->chunks);
+        if (ret != PROXY_SEND_RESULT || (first && admin_packet_is_err(first))) {
+            return ret;
+        }
+
+        int failed = chassis_workers_request(con->srv, WORKER_MSG_ADMIN_QUERY,
+                sql, strlen(sql), replies);
+        GString *errmsg = NULL;
+        for (i = 0; i < con->srv->worker_processes; i++) {
+            if (replies[i] == NULL) {
+                continue;
+            }
+            if (admin_packet_is_err(replies[i])) {
+                failed++;
+                if (errmsg == NULL) {
+                    network_packet packet = {replies[i], NET_HEADER_SIZE};
+                    network_mysqld_err_packet_t *err = network_mysqld_err_packet_new();
+                    if (network_mysqld_proto_get_err_packet(&packet, err) == 0) {
+                        errmsg = g_string_new(err->errmsg->str);
+                    }
+                    network_mysqld_err_packet_free(err);
+                }
+            }
+            g_string_free(replies[i], TRUE);
+        }
+
+        if (failed > 0) {
+            network_socket_clear_send_queue(con->client);
+            con->client->last_packet_id = last_packet_id;
+            con->client->packet_id_is_reset = packet_id_is_reset;
+
+            char *msg = g_strdup_printf("done in the master, but not in %d worker(s)%s%s",
+                    failed, errmsg ? ": " : "", errmsg ? errmsg->str : "");
+            network_mysqld_con_send_error(con->client, msg, strlen(msg));
+            g_free(msg);
+        }
+        if (errmsg) g_string_free(errmsg, TRUE);
+        return PROXY_SEND_RESULT;
+    }
+
+    chassis_workers_request(con->srv, WORKER_MSG_ADMIN_QUERY, sql, strlen(sql), replies);
+    GPtrArray *fields = NULL;
+    GPtrArray *rows = g_ptr_array_new_with_free_func(
+        (void *)network_mysqld_mysql_field_row_free);
+    for (i = 0; i < con->srv->worker_processes; i++) {
+        if (replies[i] == NULL) {
+            continue;
+        }
+        GPtrArray *more = g_ptr_array_new_with_free_func(
+            (void *)network_mysqld_mysql_field_row_free);
+        GPtrArray *more_fields = admin_reply_parse(replies[i], more);
+        if (more_fields) {
+            admin_merge_rows(rows, more, scope);
+            if (fields == NULL) {
+                fields = more_fields;
+            } else {
+                network_mysqld_proto_fielddefs_free(more_fields);
+            }
+        }
+        g_ptr_array_free(more, TRUE);
+        g_string_free(replies[i], TRUE);
+    }
+
+    if (fields == NULL) {
+        /* a syntax error or no worker running, the master answers */
+        g_ptr_array_free(rows, TRUE);
+        return func(con, sql);
+    }
+    network_mysqld_con_send_resultset(con->client, fields, rows);
+    network_mysqld_proto_fielddefs_free(fields);
+    g_ptr_array_free(rows, TRUE);
+    return PROXY_SEND_RESULT;
+}
+
+/* in a worker, run a statement passed on by the master, the reply is the packets of its result */
+static void admin_worker_query(chassis *chas, const char *data, gsize len,
+                               GString *reply, void *arg)
+{
+    network_mysqld_con con = {0};
+    con.srv = chas;
+    con.config = arg;
+    con.client = network_socket_new();
+
+    char *sql = g_strndup(data, len);
+    sql_handler_func func = admin_find_handler(con.config, sql);
+    if (func == NULL || func(&con, sql) != PROXY_SEND_RESULT) {
+        network_mysqld_con_send_error(con.client,
+            C("request error, \"select * from help\" for usage"));
+    }
+    g_free(sql);
+
+    GList *l;
+    for (l = con.client->send_queue->chunks->head; l; l = l->next) {
+        GString *packet = l->data;
+        g_string_append_len(reply, S(packet));
+    }
+    network_socket_free(con.client);
+}
+
 static network_mysqld_stmt_ret
 admin_process_query(network_mysqld_con *con)
 {
@@ -2185,18 +2754,15 @@ admin_process_query(network_mysqld_con *con)
 
     const char *sql = con->orig_sql->str;
 
-    chassis_plugin_config *config = con->config;
-    struct sql_handler_entry_t *sql_handler_map =
-        config->has_shard_plugin ? sql_handler_shard_map : sql_handler_rw_map;
-    int i;
-    for (i = 0; sql_handler_map[i].prefix; ++i) {
-        if (strcasestr(sql, sql_handler_map[i].prefix)) {
-            return sql_handler_map[i].func(con, sql);
-        }
+    sql_handler_func func = admin_find_handler(con->config, sql);
+    if (func == NULL) {
+        network_mysqld_con_send_error(con->client, C("request error, \"select * from help\" for usage"));
+        return PROXY_SEND_RESULT;
     }
-
-    network_mysqld_con_send_error(con->client, C("request error, \"select * from help\" for usage"));
-    return PROXY_SEND_RESULT;
+    if (chassis_is_master(con->srv)) {
+        return admin_run_in_workers(con, func, sql);
+    }
+    return func(con, sql);
 }
 
 /**
@@ -2385,9 +2951,11 @@ static void sql_stats_sampling_func(int fd, short what, void *arg)
 {
     chassis *chas = arg;
 
-    query_stats_t *stats = &(chas->query_stats);
-    ring_buffer_add(&g_sql_count, stats->client_query.ro + stats->client_query.rw);
-    ring_buffer_add(&g_trx_count, stats->xa_count);
+    ring_buffer_add(&g_sql_count,
+            chassis_query_stats_counter(chas, offsetof(query_stats_t, client_query.ro))
+            + chassis_query_stats_counter(chas, offsetof(query_stats_t, client_query.rw)));
+    ring_buffer_add(&g_trx_count,
+            chassis_query_stats_counter(chas, offsetof(query_stats_t, xa_count)));
 
     static struct timeval ten_sec = {10, 0};
     /* EV_PERSIST not work for libevent1.4, re-activate timer each time */
@@ -2498,6 +3066,11 @@ network_mysqld_admin_plugin_apply_config(chassis *chas,
 
     chassis_config_register_service(chas->config_manager, config->address, "admin");
 
+    /* only the master listens, the statements are passed on to the workers */
+    if (chas->worker_processes > 1) {
+        chassis_workers_set_handler(WORKER_MSG_ADMIN_QUERY, admin_worker_query, config);
+    }
+
     /* EV_PERSIST not work for libevent 1.4 */
     g_sampling_timer = g_new0(struct event, 1);
     evtimer_set(g_sampling_timer, sql_stats_sampling_func, chas);
@@ -2506,6 +3079,39 @@ network_mysqld_admin_plugin_apply_config(chassis *chas,
     return 0;
 }
 
+/**
+ * in a forked worker, drop what was inherited from the master
+ */
+static int
+network_mysqld_admin_plugin_start_worker(chassis *chas,
+        chassis_plugin_config *config)
+{
+    chassis_private *priv = chas->priv;
+    int i;
+
+    /* admin clients accepted by the master before the fork */
+    for (i = priv->cons->len - 1; i >= 0; i--) {
+        network_mysqld_con *con = priv->cons->pdata[i];
+        if (con->config == config && con != config->listen_con) {
+            network_mysqld_con_free(con);
+        }
+    }
+
+    if (config->listen_con) {
+        /* the socket file belongs to the master */
+        config->listen_con->server->dst->can_unlink_socket = FALSE;
+        network_mysqld_con_free(config->listen_con);
+        config->listen_con = NULL;
+    }
+
+    if (g_sampling_timer) {
+        evtimer_del(g_sampling_timer);
+        g_free(g_sampling_timer);
+        g_sampling_timer = NULL;
+    }
+    return 0;
+}
+
 G_MODULE_EXPORT int plugin_init(chassis_plugin *p) {
     p->magic        = CHASSIS_PLUGIN_MAGIC;
     p->name         = g_strdup("admin");
@@ -2514,6 +3120,7 @@ G_MODULE_EXPORT int plugin_init(chassis_plugin *p) {
     p->init         = network_mysqld_admin_plugin_new;
     p->get_options  = network_mysqld_admin_plugin_get_options;
     p->apply_config = network_mysqld_admin_plugin_apply_config;
+    p->start_worker = network_mysqld_admin_plugin_start_worker;
     p->destroy      = network_mysqld_admin_plugin_free;
 
     /* For allow_ip configs */
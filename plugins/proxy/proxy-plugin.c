@@ -37,6 +37,7 @@ typedef int socklen_t;
 #include "network-injection.h"
 #include "network-backend.h"
 #include "sql-context.h"
+#include "sql-prescan.h"
 #include "sql-filter-variables.h"
 #include "glib-ext.h"
 #include "chassis-timings.h"
@@ -44,6 +45,7 @@ typedef int socklen_t;
 #include "character-set.h"
 #include "cetus-util.h"
 #include "cetus-users.h"
+#include "cetus-prepared-stmt.h"
 #include "plugin-common.h"
 #include "chassis-options.h"
 
@@ -73,6 +75,7 @@ typedef enum {
     INJ_ID_CHANGE_SQL_MODE,
     INJ_ID_CHANGE_USER,
     INJ_ID_RESET_CONNECTION,
+    INJ_ID_PS_PREPARE_AGAIN,
 } proxy_inj_id_t;
 
 struct chassis_plugin_config {
@@ -182,6 +185,73 @@ static int store_server_ndx_in_prepared_resp(proxy_resultset_t *res, int index)
     return 0;
 }
 
+/**
+ * keep the statement a client prepared, it gets an id of the proxy
+ * instead of the one of the server connection
+ */
+static void register_prepared_stmt(network_mysqld_con *con, injection *inj)
+{
+    proxy_plugin_con_t *st = con->plugin_con_state;
+    sql_context_t *context = st->sql_context;
+    guint16 num_params = 0;
+
+    guint32 server_stmt_id = network_mysqld_prepare_ok_stmt_id(con->server, &num_params);
+    if (server_stmt_id == 0) {
+        return;
+    }
+
+    if (st->stmt_registry == NULL) {
+        st->stmt_registry = stmt_registry_new();
+    }
+    prepared_stmt_t *stmt = stmt_registry_add(st->stmt_registry, con->server->default_db,
+            inj->query->str + 1, inj->query->len - 1, num_params);
+    stmt->is_read = context->stmt_type == STMT_SELECT
+        && !(context->rw_flag & (CF_WRITE | CF_FORCE_MASTER));
+
+    server_stmt_cache_insert(network_mysqld_server_stmt_cache(con, con->server),
+            stmt->db, stmt->sql, server_stmt_id);
+
+    GString *packet = g_queue_peek_head(con->server->recv_queue->chunks);
+    GString payload = { packet->str + NET_HEADER_SIZE, packet->len - NET_HEADER_SIZE, 0 };
+    stmt_payload_set_id(&payload, stmt->id);
+}
+
+/**
+ * a statement was prepared again for the command queued behind it,
+ * which still carries the id of the client
+ */
+static network_mysqld_stmt_ret prepared_again(network_mysqld_con *con)
+{
+    proxy_plugin_con_t *st = con->plugin_con_state;
+    injection *next = g_queue_peek_head(st->injected.queries);
+    if (next == NULL) {
+        return PROXY_IGNORE_RESULT;
+    }
+
+    prepared_stmt_t *stmt = NULL;
+    if (st->stmt_registry) {
+        stmt = stmt_registry_get(st->stmt_registry, stmt_payload_get_id(next->query));
+    }
+
+    guint32 server_stmt_id = network_mysqld_prepare_ok_stmt_id(con->server, NULL);
+    if (server_stmt_id == 0 || stmt == NULL) {
+        gboolean is_long_data = next->query->str[0] == COM_STMT_SEND_LONG_DATA;
+        g_message("%s: prepare again failed for con:%p", G_STRLOC, con);
+        network_injection_queue_reset(st->injected.queries);
+        /* the client is told by the error of the prepare, unless it waits for nothing */
+        if (is_long_data) {
+            network_mysqld_queue_reset(con->client);
+            return PROXY_IGNORE_RESULT;
+        }
+        return PROXY_NO_DECISION;
+    }
+
+    server_stmt_cache_insert(network_mysqld_server_stmt_cache(con, con->server),
+            stmt->db, stmt->sql, server_stmt_id);
+    stmt_payload_set_id(next->query, server_stmt_id);
+    return PROXY_IGNORE_RESULT;
+}
+
 static network_mysqld_stmt_ret
 proxy_c_read_query_result(network_mysqld_con *con)
 {
@@ -223,6 +293,9 @@ proxy_c_read_query_result(network_mysqld_con *con)
         case INJ_ID_RESET_CONNECTION:
             ret = PROXY_IGNORE_RESULT;
             break;
+        case INJ_ID_PS_PREPARE_AGAIN:
+            ret = prepared_again(con);
+            break;
         case INJ_ID_CHANGE_USER:
             if (con->is_changed_user_failed) {
                 g_warning("%s: change user failed for user '%s'@'%s'", G_STRLOC,
@@ -306,6 +379,10 @@ proxy_c_read_query_result(network_mysqld_con *con)
                 }
             }
         }
+
+        if (inj->id == INJ_ID_COM_STMT_PREPARE && con->srv->ps_multiplexing_enabled) {
+            register_prepared_stmt(con, inj);
+        }
     }
 
     switch (ret) {
@@ -338,7 +415,7 @@ proxy_c_read_query_result(network_mysqld_con *con)
             network_queue_clear(recv_sock->recv_queue);
             break;
         default:
-            network_queue_clear(send_sock->send_queue);
+            network_socket_clear_send_queue(send_sock);
             break;
     }
 
@@ -385,15 +462,20 @@ static int network_mysqld_con_handle_insert_id_response(network_mysqld_con *con,
 static int
 process_non_trans_prepare_stmt(network_mysqld_con *con)
 {
-    con->is_prepared = 1;
+    if (!con->srv->ps_multiplexing_enabled) {
+        con->is_prepared = 1;
+    }
     gboolean visit_slave = FALSE;
     proxy_plugin_con_t *st = con->plugin_con_state;
     sql_context_t *context = st->sql_context;
 
     gboolean is_orig_ro_server = FALSE;
+    gboolean is_orig_within_lag = TRUE;
     if (con->server != NULL) {
         if (st->backend && st->backend->type == BACKEND_TYPE_RO) {
             is_orig_ro_server = TRUE;
+            is_orig_within_lag = network_backends_within_lag(con->srv->priv->backends,
+                    st->backend_ndx, sql_context_max_lag(context));
         }
     }
 
@@ -402,7 +484,7 @@ process_non_trans_prepare_stmt(network_mysqld_con *con)
     if (!con->srv->master_preferred && context->stmt_type == STMT_SELECT) {
         visit_slave = TRUE;
         g_debug("%s: set read only true for ps", G_STRLOC);
-        if (con->prepare_stmt_count == 0 && !is_orig_ro_server) {
+        if (con->prepare_stmt_count == 0 && (!is_orig_ro_server || !is_orig_within_lag)) {
             g_debug("%s: try to get from slave", G_STRLOC);
             /* use ro server */
             int type = BACKEND_TYPE_RO;
@@ -524,6 +606,10 @@ static int process_non_trans_query(network_mysqld_con *con,
     switch (context->stmt_type) {
     case STMT_SELECT: {
         sql_select_t *select = (sql_select_t *)context->sql_statement;
+        if (select == NULL) { /* prescanned, nothing to answer here */
+            con->is_calc_found_rows = 0;
+            break;
+        }
 
         con->is_calc_found_rows = (select->flags & SF_CALC_FOUND_ROWS) ? 1 : 0;
         g_debug(G_STRLOC ": is_calc_found_rows: %d", con->is_calc_found_rows);
@@ -626,14 +712,17 @@ static int process_non_trans_query(network_mysqld_con *con,
         con->is_read_ro_server_allowed = 1;
         if (con->srv->query_cache_enabled) {
             if (sql_context_is_cacheable(st->sql_context)) {
-                if (try_to_get_resp_from_query_cache(con)) {
+                if (try_to_get_resp_from_query_cache(con, st->sql_context)) {
                     return PROXY_SEND_RESULT;
                 }
             }
         }
 
         if (con->config->read_master_percentage != 100) {
-            if (!is_orig_ro_server) {
+            if (!is_orig_ro_server
+                || !network_backends_within_lag(con->srv->priv->backends, st->backend_ndx,
+                                                sql_context_max_lag(context)))
+            {
                 gboolean success = proxy_get_backend_ndx(con, BACKEND_TYPE_RO, FALSE);
                 if (!success && con->server == NULL) {
                     con->slave_conn_shortaged = 1;
@@ -925,6 +1014,9 @@ reset_connection(network_mysqld_con *con)
             INJ_ID_RESET_CONNECTION, packet, TRUE);
 
     con->server->is_in_sess_context = 0;
+    if (con->server->stmt_cache) {
+        server_stmt_cache_clear(con->server->stmt_cache);
+    }
 
     return 0;
 }
@@ -959,6 +1051,9 @@ adjust_user(network_mysqld_con *con)
                     INJ_ID_CHANGE_USER, payload, TRUE);
 
         con->server->is_in_sess_context = 0;
+        if (con->server->stmt_cache) {
+            server_stmt_cache_clear(con->server->stmt_cache);
+        }
         g_string_free(hashed_password, TRUE);
         return 0;
     }
@@ -1077,7 +1172,11 @@ static int forced_visit(network_mysqld_con *con, proxy_plugin_con_t *st,
         con->use_slave_forced = 1;
     }
 
-    if (st->backend == NULL || (st->backend && st->backend->type != type)) {
+    gboolean is_stale = type == BACKEND_TYPE_RO && st->backend
+        && !network_backends_within_lag(con->srv->priv->backends, st->backend_ndx,
+                                        sql_context_max_lag(context));
+
+    if (st->backend == NULL || (st->backend && st->backend->type != type) || is_stale) {
         gboolean success = proxy_get_backend_ndx(con, type,
                                   context->rw_flag & CF_FORCE_SLAVE);
         if (!success) {
@@ -1125,13 +1224,15 @@ static int process_rw_split(network_mysqld_con *con, proxy_plugin_con_t *st,
             query_attr->conn_reserved = 1;
             if (command == COM_QUERY) {
                 process_trans_query(con);
-            } else if (command == COM_STMT_PREPARE) {
+            } else if (command == COM_STMT_PREPARE && !con->srv->ps_multiplexing_enabled) {
                 con->is_prepared = 1;
             }
         } else {
             if (command == COM_STMT_PREPARE) {
-                query_attr->conn_reserved = 1;
-                con->is_prepared = 1;
+                if (!con->srv->ps_multiplexing_enabled) {
+                    query_attr->conn_reserved = 1;
+                    con->is_prepared = 1;
+                }
                 if (process_non_trans_prepare_stmt(con) == PROXY_NO_CONNECTION) {
                     *disp_flag = PROXY_NO_CONNECTION;
                     return 0;
@@ -1162,7 +1263,11 @@ process_query_or_stmt_prepare(network_mysqld_con *con, proxy_plugin_con_t *st,
     g_string_append_c(con->orig_sql, '\0');
 
     sql_context_t *context = st->sql_context;
-    sql_context_parse_len(context, con->orig_sql);
+    /* the query cache needs the tables, only the parser has them */
+    if (con->srv->sql_prescan_disabled || con->srv->query_cache_enabled
+            || !sql_context_prescan(context, con->orig_sql)) {
+        sql_context_parse_len(context, con->orig_sql);
+    }
     if (context->rc == PARSE_SYNTAX_ERR) {
         char *msg = context->message;
         g_message("%s SQL syntax error: %s. while parsing: %s",
@@ -1191,6 +1296,10 @@ process_query_or_stmt_prepare(network_mysqld_con *con, proxy_plugin_con_t *st,
         return 0;
     }
 
+    if (con->srv->query_cache_enabled) {
+        invalidate_query_cache(con, context);
+    }
+
     if (context->clause_flags & CF_LOCAL_QUERY) {
         *disp_flag = proxy_handle_local_query(con, context);
         return 0;
@@ -1257,6 +1366,201 @@ process_query_or_stmt_prepare(network_mysqld_con *con, proxy_plugin_con_t *st,
     return 1;
 }
 
+/* the cursor of stmt is gone on the server, the last one unpins the client */
+static void
+stmt_cursor_closed(network_mysqld_con *con, proxy_plugin_con_t *st, prepared_stmt_t *stmt)
+{
+    if (!stmt->cursor_open) {
+        return;
+    }
+    stmt->cursor_open = 0;
+    if (--st->open_cursors == 0) {
+        con->is_prepared = 0;
+    }
+}
+
+/**
+ * pick the backend of a statement command when prepared statements are
+ * multiplexed, the statement is looked up in the registry of the client
+ *
+ * @return 0 if disp_flag is set and the command is finished
+ */
+static int
+process_stmt_command(network_mysqld_con *con, proxy_plugin_con_t *st,
+        network_packet *packet, mysqld_query_attr_t *query_attr,
+        int command, int *disp_flag, prepared_stmt_t **stmt_out)
+{
+    prepared_stmt_t *stmt = NULL;
+    guint32 stmt_id = 0;
+
+    if (network_mysqld_proto_get_int32(packet, &stmt_id) == 0 && st->stmt_registry) {
+        stmt = stmt_registry_get(st->stmt_registry, stmt_id);
+    }
+
+    if (stmt == NULL) {
+        /* these two are never answered */
+        if (command != COM_STMT_CLOSE && command != COM_STMT_SEND_LONG_DATA) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Unknown prepared statement handler (%u) given to proxy",
+                    stmt_id);
+            network_mysqld_con_send_error_full(con->client, msg, strlen(msg),
+                    ER_UNKNOWN_STMT_HANDLER, "HY000");
+        } else {
+            network_mysqld_queue_reset(con->client);
+        }
+        *disp_flag = PROXY_SEND_RESULT;
+        return 0;
+    }
+
+    gboolean may_switch = FALSE;
+    /* a command closing the last cursor still goes to its server */
+    gboolean is_pinned = con->is_prepared;
+
+    switch (command) {
+    case COM_STMT_CLOSE:
+        if (stmt->cursor_open && con->server) {
+            /* a cursor is only closed with its handle, it is prepared again when needed */
+            guint32 server_stmt_id = server_stmt_cache_remove(
+                    network_mysqld_server_stmt_cache(con, con->server), stmt->db, stmt->sql);
+            stmt_cursor_closed(con, st, stmt);
+            stmt_registry_remove(st->stmt_registry, stmt_id);
+            if (server_stmt_id != 0) {
+                GString payload = { packet->data->str + NET_HEADER_SIZE,
+                                    packet->data->len - NET_HEADER_SIZE, 0 };
+                stmt_payload_set_id(&payload, server_stmt_id);
+                return 1;
+            }
+        } else {
+            /* the handles stay on the servers for the other clients */
+            stmt_cursor_closed(con, st, stmt);
+            stmt_registry_remove(st->stmt_registry, stmt_id);
+        }
+        network_mysqld_queue_reset(con->client);
+        *disp_flag = PROXY_SEND_RESULT;
+        return 0;
+    case COM_STMT_RESET:
+        if (stmt->cursor_open) {
+            /* the server closes the cursor */
+            stmt_cursor_closed(con, st, stmt);
+        } else if (!stmt->long_data_sent) {
+            /* no long data nor cursor of it left on a server */
+            network_mysqld_con_send_ok(con->client);
+            *disp_flag = PROXY_SEND_RESULT;
+            return 0;
+        }
+        stmt->long_data_sent = 0;
+        break;
+    case COM_STMT_SEND_LONG_DATA:
+        may_switch = !stmt->long_data_sent;
+        stmt->long_data_sent = 1;
+        /* the execute has to follow on the same connection */
+        query_attr->conn_reserved = 1;
+        break;
+    case COM_STMT_EXECUTE: {
+        guint8 flags = 0;
+        may_switch = !stmt->long_data_sent;
+        stmt->long_data_sent = 0;
+        if (network_mysqld_proto_get_int8(packet, &flags) == 0 && flags != 0) {
+            /* cursors stay on their server, pinned until they are closed */
+            if (!stmt->cursor_open) {
+                stmt->cursor_open = 1;
+                st->open_cursors++;
+            }
+            con->is_prepared = 1;
+            query_attr->conn_reserved = 1;
+        } else {
+            /* executing it again closes its cursor */
+            stmt_cursor_closed(con, st, stmt);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+
+    *stmt_out = stmt;
+
+    if (!may_switch || con->is_in_transaction || !con->is_auto_commit
+            || con->is_in_sess_context || ((is_pinned || con->is_prepared) && con->server))
+    {
+        con->srv->query_stats.client_query.rw++;
+        return 1;
+    }
+
+    gboolean is_orig_ro_server = con->server && st->backend
+        && st->backend->type == BACKEND_TYPE_RO;
+
+    if (stmt->is_read && !con->srv->master_preferred
+            && con->config->read_master_percentage != 100)
+    {
+        con->srv->query_stats.client_query.ro++;
+        con->is_read_ro_server_allowed = 1;
+        if (!is_orig_ro_server
+            || !network_backends_within_lag(con->srv->priv->backends, st->backend_ndx,
+                                            sql_context_max_lag(st->sql_context)))
+        {
+            if (!proxy_get_backend_ndx(con, BACKEND_TYPE_RO, FALSE) && con->server == NULL) {
+                con->slave_conn_shortaged = 1;
+                g_debug("%s:slave_conn_shortaged is true", G_STRLOC);
+            }
+        }
+    } else {
+        con->srv->query_stats.client_query.rw++;
+        if (is_orig_ro_server && !proxy_get_backend_ndx(con, BACKEND_TYPE_RW, FALSE)) {
+            con->master_conn_shortaged = 1;
+            g_debug("%s:PROXY_NO_CONNECTION", G_STRLOC);
+            *disp_flag = PROXY_NO_CONNECTION;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * point the statement command queued last to the handle of the server
+ * connection, preparing the statement there first if it isn't yet
+ *
+ * @return -1 if it can't be prepared again
+ */
+static int
+bind_server_stmt(network_mysqld_con *con, prepared_stmt_t *stmt)
+{
+    proxy_plugin_con_t *st = con->plugin_con_state;
+    network_socket *server = con->server;
+    injection *inj = g_queue_peek_tail(st->injected.queries);
+    server_stmt_cache_t *cache = network_mysqld_server_stmt_cache(con, server);
+
+    if (con->rob_other_conn) {
+        /* the change of user queued later drops them */
+        server_stmt_cache_clear(cache);
+    }
+
+    if (inj->query->str[0] == COM_STMT_EXECUTE) {
+        prepared_stmt_bind_types(stmt, inj->query);
+    }
+
+    guint32 server_stmt_id = server_stmt_cache_lookup(cache, stmt->db, stmt->sql);
+    if (server_stmt_id != 0) {
+        stmt_payload_set_id(inj->query, server_stmt_id);
+        return 0;
+    }
+
+    /* unqualified tables have to resolve as they did when it was prepared */
+    GString *db = con->client->default_db->len > 0 ? con->client->default_db : server->default_db;
+    if (!g_string_equal(db, stmt->db)) {
+        g_message("%s: stmt of db:%s can't be prepared again in db:%s for con:%p",
+                G_STRLOC, stmt->db->str, db->str, con);
+        return -1;
+    }
+
+    GString *payload = g_string_sized_new(stmt->sql->len + 1);
+    g_string_append_c(payload, (char) COM_STMT_PREPARE);
+    g_string_append_len(payload, S(stmt->sql));
+    proxy_inject_packet(con, PROXY_QUEUE_ADD_PREPEND,
+            INJ_ID_PS_PREPARE_AGAIN, payload, TRUE);
+    return 0;
+}
+
 static network_mysqld_stmt_ret network_read_query(network_mysqld_con *con,
         proxy_plugin_con_t *st)
 {
@@ -1266,6 +1570,7 @@ static network_mysqld_stmt_ret network_read_query(network_mysqld_con *con,
     packet.offset = 0;
 
     mysqld_query_attr_t query_attr = {0};
+    prepared_stmt_t *stmt = NULL;
 
     con->master_conn_shortaged = 0;
     con->slave_conn_shortaged = 0;
@@ -1316,6 +1621,31 @@ static network_mysqld_stmt_ret network_read_query(network_mysqld_con *con,
     case COM_CHANGE_USER:
         network_mysqld_con_send_error(con->client, C("(proxy) unable to process change user"));
         return PROXY_SEND_RESULT;
+    case COM_STMT_EXECUTE:
+    case COM_STMT_SEND_LONG_DATA:
+    case COM_STMT_RESET:
+    case COM_STMT_FETCH:
+    case COM_STMT_CLOSE:
+        if (con->srv->ps_multiplexing_enabled) {
+            if (!process_stmt_command(con, st, &packet, &query_attr,
+                        command, &disp_flag, &stmt))
+            {
+                return disp_flag;
+            }
+        }
+        break;
+    case COM_RESET_CONNECTION:
+        /* the server forgets the statements of everyone on the connection */
+        if (st->stmt_registry) {
+            stmt_registry_free(st->stmt_registry);
+            st->stmt_registry = NULL;
+        }
+        if (con->srv->ps_multiplexing_enabled && st->open_cursors > 0) {
+            /* and closes their cursors */
+            st->open_cursors = 0;
+            con->is_prepared = 0;
+        }
+        break;
     default:
         break;
     } /* end switch */
@@ -1378,10 +1708,12 @@ static network_mysqld_stmt_ret network_read_query(network_mysqld_con *con,
     } else {
         if (backend->type == BACKEND_TYPE_RW) {
             con->srv->query_stats.proxyed_query.rw++;
-            con->srv->query_stats.server_query_details[st->backend_ndx].ro++;
+            if (backend->id >= 0)
+                con->srv->query_stats.server_query_details[backend->id].ro++;
         } else {
             con->srv->query_stats.proxyed_query.ro++;
-            con->srv->query_stats.server_query_details[st->backend_ndx].rw++;
+            if (backend->id >= 0)
+                con->srv->query_stats.server_query_details[backend->id].rw++;
         }
     }
 
@@ -1403,6 +1735,20 @@ static network_mysqld_stmt_ret network_read_query(network_mysqld_con *con,
                             INJ_ID_COM_DEFAULT, payload, TRUE);
     }
 
+    if (stmt != NULL && bind_server_stmt(con, stmt) != 0) {
+        network_injection_queue_reset(st->injected.queries);
+        if (command != COM_STMT_SEND_LONG_DATA) {
+            network_mysqld_con_send_error_full(con->client,
+                    C("(proxy) statement was prepared in another default database"),
+                    ER_UNKNOWN_STMT_HANDLER, "HY000");
+        } else {
+            network_mysqld_queue_reset(con->client);
+        }
+        return PROXY_SEND_RESULT;
+    } else if (command == COM_RESET_CONNECTION && con->server->stmt_cache) {
+        server_stmt_cache_clear(con->server->stmt_cache);
+    }
+
     if (con->multiple_server_mode) {
         query_attr.conn_reserved = 1;
         if (command == COM_STMT_EXECUTE || command == COM_STMT_CLOSE)
@@ -1580,6 +1926,8 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_read_query) {
         network_mysqld_queue_reset(send_sock);
         network_mysqld_queue_append(send_sock,
                                     send_sock->send_queue, S(inj->query));
+        network_mysqld_close_evicted_stmts(send_sock);
+        network_mysqld_con_time_backend(con, st->backend);
 
         network_queue_clear(recv_sock->recv_queue);
         break;
@@ -1634,18 +1982,24 @@ static gboolean proxy_get_backend_ndx(network_mysqld_con *con,
 
     int idx;
     if (type == BACKEND_TYPE_RO) {
+        int max_lag = sql_context_max_lag(st->sql_context);
         if (force_slave) {
-            idx = network_backends_get_ro_ndx(g->backends, BACKEND_ALGO_ROUND_ROBIN);
+            idx = network_backends_get_ro_ndx(g->backends, con->srv->read_balance_algo, max_lag);
         } else {
             int x = g_random_int_range(0, 100);
             if (x < con->config->read_master_percentage) {
                 idx = network_backends_get_rw_ndx(g->backends);
             } else {
-                idx = network_backends_get_ro_ndx(g->backends, BACKEND_ALGO_ROUND_ROBIN);
+                idx = network_backends_get_ro_ndx(g->backends, con->srv->read_balance_algo,
+                                                  max_lag);
             }
             g_debug(G_STRLOC "x: %d, read_master_percentage: %d, read: %d\n",
                     x, con->config->read_master_percentage, idx);
         }
+        if (idx == -1 && max_lag > 0) {
+            /* no slave within the lag budget */
+            idx = network_backends_get_rw_ndx(g->backends);
+        }
     } else { /* type == BACKEND_TYPE_RW */
         idx = network_backends_get_rw_ndx(g->backends);
     }
@@ -1770,6 +2124,7 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_send_query_result) {
     network_mysqld_queue_reset(send_sock);
     network_mysqld_queue_append(send_sock, send_sock->send_queue,
             S(inj->query));
+    network_mysqld_close_evicted_stmts(send_sock);
 
     g_debug("%s: call reset_command_response_state for con:%p", G_STRLOC, con);
     network_mysqld_con_reset_command_response_state(con);
@@ -1853,7 +2208,7 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_read_query_result) {
         }
         case COM_STMT_PREPARE: {
             network_mysqld_com_stmt_prep_result_t *r = con->parse.data;
-            if (r->status == MYSQLD_PACKET_OK) {
+            if (r->status == MYSQLD_PACKET_OK && !con->srv->ps_multiplexing_enabled) {
                 con->prepare_stmt_count++;
             }
             break;
@@ -2122,6 +2477,7 @@ proxy_plugin_con_free(network_mysqld_con *con, proxy_plugin_con_t *st)
         g_warning("%s: st backend_ndx_array is not nill for con:%p", G_STRLOC, con);
     }
 
+    stmt_registry_free(st->stmt_registry);
     g_free(st);
 }
 
@@ -2371,7 +2727,8 @@ int network_mysqld_proxy_plugin_apply_config(chassis *chas,
         return -1;
     }
 
-    if (network_socket_bind(listen_sock)) {
+    /* every worker process listens on the same port */
+    if (plugin_bind_listen(chas, listen_sock)) {
         return -1;
     }
     g_message("proxy listening on port %s, con:%p", config->address, con);
@@ -2381,16 +2738,14 @@ int network_mysqld_proxy_plugin_apply_config(chassis *chas,
 
 
     /**
-     * call network_mysqld_con_accept() with this connection when we are done
+     * call network_mysqld_con_accept() with this connection when we are done,
+     * the master of multi-process mode leaves the clients to the workers
      */
+    if (!chassis_is_master(chas)) {
+        plugin_start_accept(chas, con);
+    }
 
-    event_set(&(listen_sock->event), listen_sock->fd,
-            EV_READ|EV_PERSIST, network_mysqld_con_accept, con);
-    event_base_set(chas->event_base, &(listen_sock->event));
-    event_add(&(listen_sock->event), NULL);
-    g_debug("%s:listen sock, ev:%p",G_STRLOC, (&listen_sock->event));
-
-    if (network_backends_load_config(g->backends, chas) != -1) {
+    if (network_backends_load_config(g->backends, chas) != -1 && !chassis_is_master(chas)) {
         network_connection_pool_create_conns(chas);
     }
     chassis_config_register_service(chas->config_manager, config->address, "proxy");
@@ -2407,6 +2762,17 @@ int network_mysqld_proxy_plugin_apply_config(chassis *chas,
     return 0;
 }
 
+/**
+ * a forked worker takes its listen socket and opens its pools
+ */
+int network_mysqld_proxy_plugin_start_worker(chassis *chas,
+        chassis_plugin_config *config)
+{
+    plugin_start_accept(chas, config->listen_con);
+    network_connection_pool_create_conns(chas);
+    return 0;
+}
+
 GList *network_mysqld_proxy_plugin_allow_ip_get(chassis_plugin_config *config) {
     if (config && config->allow_ip_table) {
         return g_hash_table_get_keys(config->allow_ip_table);
@@ -2465,6 +2831,7 @@ G_MODULE_EXPORT int plugin_init(chassis_plugin *p) {
     p->init         = network_mysqld_proxy_plugin_new;
     p->get_options  = network_mysqld_proxy_plugin_get_options;
     p->apply_config = network_mysqld_proxy_plugin_apply_config;
+    p->start_worker = network_mysqld_proxy_plugin_start_worker;
     p->destroy      = network_mysqld_proxy_plugin_free;
 
     /* For allow_ip configs */
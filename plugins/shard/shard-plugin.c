@@ -27,7 +27,9 @@
 #include "sharding-parser.h"
 #include "sharding-query-plan.h"
 #include "sql-filter-variables.h"
+#include "sql-template.h"
 #include "cetus-log.h"
+#include "cetus-prepared-stmt.h"
 
 #ifdef NETWORK_DEBUG_TRACE_STATE_CHANGES
 #include "cetus-query-queue.h"
@@ -43,6 +45,9 @@
 
 #define XA_LOG_BUF_LEN 2048
 
+#define PLAN_CACHE_SIZE_DEFAULT 1024
+#define PLAN_CACHE_MAX_SQL_LEN 8192
+
 struct chassis_plugin_config {
     /**< listening address of the proxy */
     gchar *address;
@@ -67,6 +72,11 @@ struct chassis_plugin_config {
 
     gchar *deny_ip;
     GHashTable *deny_ip_table;
+
+    /* fingerprint -> cached_sql_info_t, 0 size to disable */
+    gint sql_plan_cache_size;
+    GHashTable *sql_plan_cache;
+    GQueue sql_plan_lru;    /* cached_sql_info_t.lru, most recently used first */
 };
 
 /**
@@ -235,7 +245,7 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_read_query) {
         break;
     }
 
-    if (con->srv->query_cache_enabled) {
+    if (con->srv->query_cache_enabled && con->parse.command == COM_QUERY) {
         shard_plugin_con_t *st = con->plugin_con_state;
         if (sql_context_is_cacheable(st->sql_context)) {
             shard_plugin_con_t *st = con->plugin_con_state;
@@ -243,7 +253,7 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_read_query) {
                     !(st->sql_context->rw_flag & CF_FORCE_MASTER) &&
                     !(st->sql_context->rw_flag & CF_FORCE_SLAVE)) 
             {
-                if (try_to_get_resp_from_query_cache(con)) {
+                if (try_to_get_resp_from_query_cache(con, st->sql_context)) {
                     return NETWORK_SOCKET_SUCCESS;
                 }
             }
@@ -538,6 +548,326 @@ static int shard_handle_local_query(network_mysqld_con *con, sql_context_t *cont
     return PROXY_SEND_RESULT;
 }
 
+static void cached_sql_info_free(gpointer p)
+{
+    cached_sql_info_t *info = p;
+    sql_template_free(info->tmpl);
+    g_free(info);
+}
+
+
+/**
+ * parse con->orig_sql into context, statements only differing in literals
+ * are parsed once and then re-bound to the literals of each query
+ */
+static void proxy_parse_sql(network_mysqld_con *con, sql_context_t *context)
+{
+    chassis_plugin_config *config = con->config;
+    GHashTable *cache = config->sql_plan_cache;
+    GString *sql = con->orig_sql;
+    cached_sql_info_t *info;
+
+    if (cache == NULL || sql->len > PLAN_CACHE_MAX_SQL_LEN) {
+        sql_context_parse_len(context, sql);
+        return;
+    }
+
+    GString *fp = g_string_sized_new(sql->len);
+    GArray *tokens = g_array_new(FALSE, FALSE, sizeof(sql_token_pos_t));
+
+    if (!sql_fingerprint(context, sql, fp, tokens)) {
+        sql_context_parse_len(context, sql);
+        goto out;
+    }
+
+    info = g_hash_table_lookup(cache, fp->str);
+    if (info) {
+        info->last_visit_time = time(0);
+        info->visited_cnt++;
+        g_queue_unlink(&config->sql_plan_lru, &info->lru);
+        g_queue_push_head_link(&config->sql_plan_lru, &info->lru);
+        if (info->tmpl) {
+            sql_template_bind(info->tmpl, sql, tokens, context);
+        } else {
+            sql_context_parse_len(context, sql);
+        }
+        goto out;
+    }
+
+    sql_context_parse_len(context, sql);
+
+    if (g_hash_table_size(cache) >= config->sql_plan_cache_size) {
+        /* drop the least recently used */
+        GList *oldest = g_queue_pop_tail_link(&config->sql_plan_lru);
+        g_hash_table_remove(cache, oldest->data);
+    }
+    info = g_new0(cached_sql_info_t, 1);
+    info->last_visit_time = time(0);
+    info->visited_cnt = 1;
+    info->tmpl = sql_template_new(context, sql, tokens);
+    info->lru.data = g_string_free(fp, FALSE);
+    g_hash_table_insert(cache, info->lru.data, info);
+    g_queue_push_head_link(&config->sql_plan_lru, &info->lru);
+    fp = NULL;
+
+out:
+    if (fp) {
+        g_string_free(fp, TRUE);
+    }
+    g_array_free(tokens, TRUE);
+}
+
+/**
+ * how a prepared statement is routed, either by the value bound to the
+ * placeholder of the sharding key or to the one group it was prepared on
+ */
+typedef struct {
+    int key_param;      /* -1 if not routed by the sharding key */
+    char *db;
+    char *table;
+    char *group;
+    int stmt_type;
+    int rw_flag;
+} shard_stmt_route_t;
+
+static void shard_stmt_route_free(shard_stmt_route_t *route)
+{
+    g_free(route->db);
+    g_free(route->table);
+    g_free(route->group);
+    g_free(route);
+}
+
+static int shard_stmt_error(network_mysqld_con *con, const char *msg, guint errcode)
+{
+    g_message("%s: %s, sql:%s", G_STRLOC, msg, con->orig_sql->str);
+    network_mysqld_con_send_error_full(con->client, msg, strlen(msg), errcode, "HY000");
+    return PROXY_SEND_RESULT;
+}
+
+/**
+ * parse the statement once, it has to run on a single group, which is
+ * picked at execute from the sharding key value if it is a placeholder
+ */
+static int shard_prepare_stmt(network_mysqld_con *con, network_packet *packet)
+{
+    shard_plugin_con_t *st = con->plugin_con_state;
+    sql_context_t *context = st->sql_context;
+
+    network_mysqld_con_reset_query_state(con);
+    if (con->client->default_db->len == 0) {
+        g_string_assign(con->client->default_db, con->srv->default_db);
+    }
+
+    gsize sql_len = packet->data->len - packet->offset;
+    network_mysqld_proto_get_gstr_len(packet, sql_len, con->orig_sql);
+    g_string_append_c(con->orig_sql, '\0');/* 2 more NULL for lexer EOB */
+    g_string_append_c(con->orig_sql, '\0');
+    sql_context_parse_len(context, con->orig_sql);
+    g_string_truncate(con->orig_sql, con->orig_sql->len - 2);
+
+    if (context->rc == PARSE_SYNTAX_ERR) {
+        char *msg = context->message;
+        g_message("%s SQL syntax error: %s. while parsing: %s",
+                  G_STRLOC, msg, con->orig_sql->str);
+        network_mysqld_con_send_error_full(con->client, msg, strlen(msg),
+                                           ER_SYNTAX_ERROR, "42000");
+        return PROXY_SEND_RESULT;
+    } else if (context->rc != PARSE_OK) {
+        return shard_stmt_error(con, context->message ?: "(cetus) statement can't be prepared",
+                                ER_CETUS_NOT_SUPPORTED);
+    }
+    if (context->stmt_type != STMT_SELECT && context->stmt_type != STMT_INSERT
+        && context->stmt_type != STMT_UPDATE && context->stmt_type != STMT_DELETE) {
+        return shard_stmt_error(con,
+                "(cetus) only SELECT, INSERT, UPDATE and DELETE can be prepared",
+                ER_CETUS_NOT_SUPPORTED);
+    }
+    if ((context->rw_flag & CF_FORCE_SLAVE) && (context->rw_flag & CF_WRITE)) {
+        return shard_stmt_error(con, "Force write on read-only slave", ER_UNKNOWN_ERROR);
+    }
+
+    shard_stmt_route_t *route = g_new0(shard_stmt_route_t, 1);
+    const char *db = NULL, *table = NULL;
+    GString *group = NULL;
+    route->stmt_type = context->stmt_type;
+    route->rw_flag = context->rw_flag;
+    route->key_param = sharding_stmt_key_param(con->client->default_db, context,
+                                               con->orig_sql->str, &db, &table);
+    if (route->key_param >= 0) {
+        route->db = g_strdup(db);
+        route->table = g_strdup(table);
+        GPtrArray *groups = g_ptr_array_new();
+        shard_conf_get_any_group(groups, route->db, route->table);
+        group = groups->len > 0 ? g_ptr_array_index(groups, 0) : NULL;
+        g_ptr_array_free(groups, TRUE);
+    } else {
+        sharding_plan_t *plan = sharding_plan_new(con->orig_sql);
+        int rv = sharding_parse_groups(con->client->default_db, context,
+                                       &(con->srv->query_stats), con->key, plan);
+        if (rv != ERROR_UNPARSABLE && plan->groups->len == 1) {
+            group = g_ptr_array_index(plan->groups, 0);
+            route->group = g_strdup(group->str);
+        }
+        sharding_plan_free(plan);
+        if (rv == ERROR_UNPARSABLE) {
+            shard_stmt_route_free(route);
+            return shard_stmt_error(con, context->message ?: "sql parse error",
+                                    ER_CETUS_PARSE_SHARDING);
+        }
+    }
+    if (group == NULL) {
+        shard_stmt_route_free(route);
+        return shard_stmt_error(con,
+                "(cetus) prepared statement has to run on one group",
+                ER_CETUS_NOT_SUPPORTED);
+    }
+
+    if (st->stmt_registry == NULL) {
+        st->stmt_registry = stmt_registry_new();
+    }
+    prepared_stmt_t *stmt = stmt_registry_add(st->stmt_registry, con->client->default_db,
+            S(con->orig_sql), 0);
+    stmt->is_read = context->stmt_type == STMT_SELECT
+        && !(context->rw_flag & (CF_WRITE | CF_FORCE_MASTER));
+    stmt->plugin_data = route;
+    stmt->plugin_data_free = (GDestroyNotify)shard_stmt_route_free;
+
+    con->client_stmt_id = stmt->id;
+    st->stmt_group = group;
+    return PROXY_NO_DECISION;
+}
+
+/**
+ * route an execute by its statement, the bound sharding key is decoded
+ * from the packet, the sql is never parsed again
+ */
+static int shard_execute_stmt(network_mysqld_con *con, network_packet *packet)
+{
+    shard_plugin_con_t *st = con->plugin_con_state;
+    GString *data = packet->data;
+    prepared_stmt_t *stmt = NULL;
+    guint32 stmt_id = 0;
+    guint8 flags = 0;
+
+    network_mysqld_con_reset_query_state(con);
+    if (network_mysqld_proto_get_int32(packet, &stmt_id) == 0
+        && network_mysqld_proto_get_int8(packet, &flags) == 0 && st->stmt_registry) {
+        stmt = stmt_registry_get(st->stmt_registry, stmt_id);
+    }
+    if (stmt == NULL) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Unknown prepared statement handler (%u) given to proxy",
+                stmt_id);
+        return shard_stmt_error(con, msg, ER_UNKNOWN_STMT_HANDLER);
+    }
+    g_string_assign_len(con->orig_sql, S(stmt->sql));
+
+    if (!g_string_equal(con->client->default_db, stmt->db)) {
+        return shard_stmt_error(con, "(cetus) statement was prepared in another db",
+                                ER_CETUS_NOT_SUPPORTED);
+    }
+    if (flags != 0) {
+        return shard_stmt_error(con, "(cetus) cursor is not supported",
+                                ER_CETUS_NOT_SUPPORTED);
+    }
+    if (stmt->long_data_sent) {
+        stmt->long_data_sent = 0;
+        return shard_stmt_error(con, "(cetus) COM_STMT_SEND_LONG_DATA is not supported",
+                                ER_CETUS_NOT_SUPPORTED);
+    }
+
+    GString *payload = g_string_new_len(data->str + NET_HEADER_SIZE, data->len - NET_HEADER_SIZE);
+    prepared_stmt_bind_types(stmt, payload);
+    if (payload->len != data->len - NET_HEADER_SIZE) {
+        g_string_truncate(data, NET_HEADER_SIZE);
+        g_string_append_len(data, S(payload));
+        network_mysqld_proto_set_packet_len(data, payload->len);
+    }
+
+    shard_stmt_route_t *route = stmt->plugin_data;
+    GString *group = NULL;
+    if (route->key_param >= 0) {
+        gboolean is_int = FALSE;
+        gint64 num = 0;
+        GString *str = g_string_new(NULL);
+        if (!prepared_stmt_get_param(stmt, payload, route->key_param, &is_int, &num, str)) {
+            g_string_free(str, TRUE);
+            g_string_free(payload, TRUE);
+            return shard_stmt_error(con,
+                    "(cetus) sharding key has to be bound to an integer, string or date",
+                    ER_CETUS_PARSE_SHARDING);
+        }
+        group = sharding_stmt_key_group(route->db, route->table, is_int, num, str->str);
+        g_string_free(str, TRUE);
+        if (group == NULL) {
+            g_string_free(payload, TRUE);
+            return shard_stmt_error(con, "(proxy)sharding key parse error",
+                                    ER_CETUS_PARSE_SHARDING);
+        }
+    } else {
+        group = shard_conf_get_group(route->group);
+        if (group == NULL) {
+            g_string_free(payload, TRUE);
+            return shard_stmt_error(con, "(cetus) group of the statement is not configured",
+                                    ER_CETUS_NO_GROUP);
+        }
+    }
+    g_string_free(payload, TRUE);
+
+    /* the plan and the backend are chosen as for the statement parsed */
+    sql_context_reset(st->sql_context);
+    st->sql_context->stmt_type = route->stmt_type;
+    st->sql_context->rw_flag = route->rw_flag;
+    st->stmt_group = group;
+    return PROXY_NO_DECISION;
+}
+
+/* statement commands the proxy answers by itself */
+static int shard_stmt_command(network_mysqld_con *con, network_packet *packet, guint8 command)
+{
+    shard_plugin_con_t *st = con->plugin_con_state;
+    prepared_stmt_t *stmt = NULL;
+    guint32 stmt_id = 0;
+
+    if (network_mysqld_proto_get_int32(packet, &stmt_id) == 0 && st->stmt_registry) {
+        stmt = stmt_registry_get(st->stmt_registry, stmt_id);
+    }
+
+    switch (command) {
+    case COM_STMT_CLOSE:
+        /* the handles stay on the servers for the other clients */
+        if (stmt) {
+            stmt_registry_remove(st->stmt_registry, stmt_id);
+        }
+        network_mysqld_queue_reset(con->client);
+        break;
+    case COM_STMT_SEND_LONG_DATA:
+        /* never answered, the next execute tells */
+        if (stmt) {
+            stmt->long_data_sent = 1;
+        }
+        network_mysqld_queue_reset(con->client);
+        break;
+    case COM_STMT_RESET:
+        if (stmt == NULL) {
+            char msg[128];
+            snprintf(msg, sizeof(msg), "Unknown prepared statement handler (%u) given to proxy",
+                    stmt_id);
+            network_mysqld_con_send_error_full(con->client, msg, strlen(msg),
+                    ER_UNKNOWN_STMT_HANDLER, "HY000");
+            break;
+        }
+        /* no long data nor cursor of it left on a server */
+        stmt->long_data_sent = 0;
+        network_mysqld_con_send_ok(con->client);
+        break;
+    default:
+        break;
+    }
+    return PROXY_SEND_RESULT;
+}
+
 static int proxy_parse_query(network_mysqld_con *con)
 {
     shard_plugin_con_t *st = con->plugin_con_state;
@@ -598,7 +928,7 @@ static int proxy_parse_query(network_mysqld_con *con)
 
             g_debug("%s: sql:%s", G_STRLOC, con->orig_sql->str);
             sql_context_t *context = st->sql_context;
-            sql_context_parse_len(context, con->orig_sql);
+            proxy_parse_sql(con, context);
 
             if (context->rc == PARSE_SYNTAX_ERR) {
                 char *msg = context->message;
@@ -622,6 +952,10 @@ static int proxy_parse_query(network_mysqld_con *con)
                 return PROXY_SEND_RESULT;
             }
 
+            if (con->srv->query_cache_enabled) {
+                invalidate_query_cache(con, context);
+            }
+
             if (context->clause_flags & CF_LOCAL_QUERY) {
                 return shard_handle_local_query(con, context);
             }
@@ -634,12 +968,14 @@ static int proxy_parse_query(network_mysqld_con *con)
             g_debug("%s: quit command:%d", G_STRLOC, command);
             con->state = ST_CLOSE_CLIENT;
             return PROXY_SEND_NONE;
-        case COM_STMT_PREPARE: {
-            network_mysqld_con_send_error_full(con->client,
-                C("sharding proxy does not support prepare stmt"),
-                ER_CETUS_NOT_SUPPORTED, "HY000");
-            return PROXY_SEND_RESULT;
-        }
+        case COM_STMT_PREPARE:
+            return shard_prepare_stmt(con, &packet);
+        case COM_STMT_EXECUTE:
+            return shard_execute_stmt(con, &packet);
+        case COM_STMT_CLOSE:
+        case COM_STMT_SEND_LONG_DATA:
+        case COM_STMT_RESET:
+            return shard_stmt_command(con, &packet, command);
         case COM_PING:
             network_mysqld_con_send_ok(con->client);
             return PROXY_SEND_RESULT;
@@ -1149,6 +1485,11 @@ static int proxy_get_server_list(network_mysqld_con *con)
             return disp_flag;
         }
         break;
+    case COM_STMT_PREPARE:
+    case COM_STMT_EXECUTE:
+        sharding_plan_add_group(plan, st->stmt_group);
+        rv = USE_SHARDING;
+        break;
     default:
         rv = sharding_parse_groups(con->client->default_db, st->sql_context, stats,
                                    con->key, plan);
@@ -1241,16 +1582,17 @@ static gboolean proxy_get_pooled_connection(
     }
 
     if (type == BACKEND_TYPE_RO) {
-        backend = network_group_pick_slave_backend(backend_group);
+        backend = network_group_pick_slave_backend(g->backends, backend_group,
+                                                   con->srv->read_balance_algo,
+                                                   sql_context_max_lag(st->sql_context));
         if (backend == NULL) { /* fallback to readwrite backend */
             type = BACKEND_TYPE_RW;
         }
     }
 
     if (type == BACKEND_TYPE_RW) {
-        backend = backend_group->master; /* may be NULL if master down */
-        if (!backend || (backend->state != BACKEND_STATE_UP &&
-                         backend->state != BACKEND_STATE_UNKNOWN)) {
+        backend = network_group_pick_master_backend(g->backends, backend_group);
+        if (!backend) {
             *server_unavailable = 1;
             return FALSE;
         }
@@ -1467,6 +1809,55 @@ proxy_add_server_connection_array(network_mysqld_con *con, int *server_unavailab
     return TRUE;
 }
 
+/**
+ * an execute runs on whatever connection the group hands out, the
+ * statement is prepared again there if the server lacks it
+ */
+static gboolean check_stmt_prepared(network_mysqld_con *con)
+{
+    GString *packet = g_queue_peek_head(con->client->recv_queue->chunks);
+    gboolean result = TRUE;
+    size_t i;
+
+    for (i = 0; i < con->servers->len; i++) {
+        server_session_t *pmd = g_ptr_array_index(con->servers, i);
+        if (!pmd->participated) {
+            continue;
+        }
+
+        network_socket *server = pmd->server;
+        if (server->is_robbed && server->stmt_cache) {
+            server_stmt_cache_clear(server->stmt_cache);
+        }
+        /* before anything else is queued, they are not answered */
+        network_mysqld_close_evicted_stmts(server);
+
+        if (con->parse.command != COM_STMT_EXECUTE) {
+            continue;
+        }
+
+        guint32 server_stmt_id = server_stmt_cache_lookup(
+                network_mysqld_server_stmt_cache(con, server),
+                con->client->default_db, con->orig_sql);
+        if (server_stmt_id == 0) {
+            if (pmd->attr_consistent) {
+                pmd->attr_consistent = 0;
+                pmd->attr_diff = ATTR_DIF_PREPARE_STMT;
+            } else {
+                pmd->attr_diff |= ATTR_DIF_PREPARE_STMT;
+            }
+            con->unmatched_attribute |= ATTR_DIF_PREPARE_STMT;
+            result = FALSE;
+            g_debug("%s: stmt not prepared on server:%p", G_STRLOC, server);
+        } else {
+            GString payload = { packet->str + NET_HEADER_SIZE, packet->len - NET_HEADER_SIZE, 0 };
+            stmt_payload_set_id(&payload, server_stmt_id);
+        }
+    }
+
+    return result;
+}
+
 static gboolean check_and_set_attr_bitmap(network_mysqld_con *con)
 {
     size_t i;
@@ -1566,6 +1957,12 @@ static gboolean check_and_set_attr_bitmap(network_mysqld_con *con)
         pmd->attr_consistent_checked = 1;
     }
 
+    if (con->parse.command == COM_STMT_PREPARE || con->parse.command == COM_STMT_EXECUTE) {
+        if (!check_stmt_prepared(con)) {
+            result = FALSE;
+        }
+    }
+
     return result;
 }
 
@@ -1619,6 +2016,9 @@ static gboolean check_user_consistant(network_mysqld_con *con)
             g_string_free(payload, TRUE);
 
             pmd->server->is_robbed = 0;
+            if (pmd->server->stmt_cache) {
+                server_stmt_cache_clear(pmd->server->stmt_cache);
+            }
             pmd->attr_adjusted_now = 1;
             pmd->server->parse.qs_state = PARSE_COM_QUERY_INIT;
             g_debug("%s: change user for server", G_STRLOC);
@@ -1724,6 +2124,9 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_get_server_conn_list) {
                 g_debug("%s: autocommit adjust", G_STRLOC);
                 shard_set_autocommit(con);
                 con->attr_adj_state = ATTR_DIF_SET_AUTOCOMMIT;
+            } else if (con->unmatched_attribute & ATTR_DIF_PREPARE_STMT) {
+                shard_set_stmt_prepared(con);
+                con->attr_adj_state = ATTR_DIF_PREPARE_STMT;
             }
 
             return NETWORK_SOCKET_SUCCESS;
@@ -1871,6 +2274,11 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_get_server_conn_list) {
             }
         }
 
+        if (!con->dist_tran && con->servers->len == 1) {
+            server_session_t *pmd = g_ptr_array_index(con->servers, 0);
+            network_mysqld_con_time_backend(con, pmd->backend);
+        }
+
         if (is_xa_query) {
             if (con->srv->xa_log_detailed) {
                 tc_log_info(LOG_INFO, 0, "XA QUERY %s %s %s",
@@ -1898,6 +2306,21 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_get_server_conn_list) {
  * @note we should only send one result back to the client
  */
 NETWORK_MYSQLD_PLUGIN_PROTO(proxy_send_query_result) {
+    if (con->parse.command == COM_STMT_PREPARE && con->client_stmt_id) {
+        network_mysqld_com_stmt_prep_result_t *prep = con->parse.data;
+        shard_plugin_con_t *st = con->plugin_con_state;
+        if (prep == NULL || prep->first_packet || prep->status != MYSQLD_PACKET_OK) {
+            stmt_registry_remove(st->stmt_registry, con->client_stmt_id);
+        } else {
+            prepared_stmt_t *stmt = stmt_registry_get(st->stmt_registry, con->client_stmt_id);
+            if (stmt) {
+                stmt->num_params = con->client_stmt_num_params;
+            }
+        }
+        con->client_stmt_id = 0;
+        con->client_stmt_num_params = 0;
+    }
+
     if (con->server_to_be_closed) {
         if (con->servers != NULL) {
             g_debug("%s:call proxy_put_shard_conn_to_pool for con:%p", G_STRLOC, con);
@@ -2027,6 +2450,11 @@ NETWORK_MYSQLD_PLUGIN_PROTO(proxy_disconnect_client) {
 
     network_mysqld_con_reset_query_state(con);
 
+    if (st->stmt_registry) {
+        stmt_registry_free(st->stmt_registry);
+        st->stmt_registry = NULL;
+    }
+
     /* TODO: this should inside "st"_free, but now "st" shared by many plugins */
 	if (st->sql_context) {
 		sql_context_destroy(st->sql_context);
@@ -2075,6 +2503,8 @@ static chassis_plugin_config *network_mysqld_shard_plugin_new(void) {
     config->read_timeout_dbl = -1.0;
     config->write_timeout_dbl = -1.0;
 
+    config->sql_plan_cache_size = PLAN_CACHE_SIZE_DEFAULT;
+
     return config;
 }
 
@@ -2092,6 +2522,9 @@ void network_mysqld_shard_plugin_free(chassis *chas, chassis_plugin_config *conf
         chassis_config_unregister_service(chas->config_manager, config->address);
         g_free(config->address);
     }
+    if (config->sql_plan_cache) {
+        g_hash_table_destroy(config->sql_plan_cache);
+    }
     sql_filter_vars_destroy();
     g_debug("%s: call shard_conf_destroy", G_STRLOC);
     shard_conf_destroy();
@@ -2143,6 +2576,10 @@ network_mysqld_shard_plugin_get_options(chassis_plugin_config *config)
         0, 0, OPTION_ARG_STRING, &(config->deny_ip),
         "deny user@IP for proxy permission", NULL);
 
+    chassis_options_add(&opts, "proxy-sql-plan-cache-size",
+        0, 0, OPTION_ARG_INT, &(config->sql_plan_cache_size),
+        "max number of parsed statement shapes to cache, 0 to disable (default: 1024)", NULL);
+
     return opts.options;
 }
 
@@ -2206,6 +2643,12 @@ static int network_mysqld_shard_plugin_apply_config(chassis *chas,
     }
     config->deny_ip_table = deny_ip_table;
 
+    if (config->sql_plan_cache_size > 0) {
+        config->sql_plan_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+                g_free, cached_sql_info_free);
+        g_queue_init(&config->sql_plan_lru);
+    }
+
     /**
      * create a connection handle for the listen socket
      */
@@ -2228,7 +2671,8 @@ static int network_mysqld_shard_plugin_apply_config(chassis *chas,
         return -1;
     }
 
-    if (network_socket_bind(listen_sock)) {
+    /* every worker process listens on the same port */
+    if (plugin_bind_listen(chas, listen_sock)) {
         return -1;
     }
     g_message("shard module listening on port %s, con:%p", config->address, con);
@@ -2250,16 +2694,14 @@ static int network_mysqld_shard_plugin_apply_config(chassis *chas,
             sharding_conf_reload_callback, chas);
 
     /**
-     * call network_mysqld_con_accept() with this connection when we are done
+     * call network_mysqld_con_accept() with this connection when we are done,
+     * the master of multi-process mode leaves the clients to the workers
      */
+    if (!chassis_is_master(chas)) {
+        plugin_start_accept(chas, con);
+    }
 
-    event_set(&(listen_sock->event), listen_sock->fd,
-            EV_READ|EV_PERSIST, network_mysqld_con_accept, con);
-    event_base_set(chas->event_base, &(listen_sock->event));
-    event_add(&(listen_sock->event), NULL);
-    g_debug("%s:listen sock, ev:%p",G_STRLOC, (&listen_sock->event));
-
-    if (network_backends_load_config(g->backends, chas) != -1) {
+    if (network_backends_load_config(g->backends, chas) != -1 && !chassis_is_master(chas)) {
         network_connection_pool_create_conns(chas);
     }
     chassis_config_register_service(chas->config_manager, config->address, "shard");
@@ -2277,6 +2719,17 @@ static int network_mysqld_shard_plugin_apply_config(chassis *chas,
     return 0;
 }
 
+/**
+ * a forked worker takes its listen socket and opens its pools
+ */
+int network_mysqld_shard_plugin_start_worker(chassis *chas,
+        chassis_plugin_config *config)
+{
+    plugin_start_accept(chas, config->listen_con);
+    network_connection_pool_create_conns(chas);
+    return 0;
+}
+
 GList *network_mysqld_shard_plugin_allow_ip_get(chassis_plugin_config *config) {
     if (config && config->allow_ip_table) {
         return g_hash_table_get_keys(config->allow_ip_table);
@@ -2343,6 +2796,7 @@ G_MODULE_EXPORT int plugin_init(chassis_plugin *p) {
     p->init         = network_mysqld_shard_plugin_new;
     p->get_options  = network_mysqld_shard_plugin_get_options;
     p->apply_config = network_mysqld_shard_plugin_apply_config;
+    p->start_worker = network_mysqld_shard_plugin_start_worker;
     p->destroy      = network_mysqld_shard_plugin_free;
 
     /* For allow_ip configs */
@@ -61,49 +61,6 @@ static gboolean expr_is_compound_value(sql_expr_t *p)
         is_arithmetic_op(p->op); /* 1+1, 3%2, 4 * 5, etc */
 }
 
-static unsigned int
-supplemental_hash(unsigned int value)
-{
-    unsigned int tmp1 = value >> 20;
-    unsigned int tmp2 = value >> 12;
-    unsigned int tmp3 = tmp1 ^ tmp2;
-    unsigned int h = value ^ tmp3;
-    tmp1 = h >> 7;
-    tmp2 = h >> 4;
-    tmp3 = tmp1 ^ tmp2;
-    h = h ^ tmp3;
-    return h;
-}
-
-static unsigned int
-cetus_str_hash(const unsigned char *key)
-{
-    int len = strlen((const char *) key);
-    unsigned int hashcode_head = 0;
-    int i = 0;
-    int max = 8;
-
-    if (max > len) {
-        max = len;
-    }
-    for (; i < max; i++) {
-        hashcode_head <<= 4;
-        hashcode_head += key[i];
-    }
-    if (len > max) {
-        i = len - 8;
-        unsigned int hashcode_tail = 0;
-        for (; i < len; i++) {
-            hashcode_tail <<= 4;
-            hashcode_tail += key[i];
-        }
-        return supplemental_hash(hashcode_head ^ hashcode_tail);
-    } else {
-        return supplemental_hash(hashcode_head);
-    }
-}
-
-
 static GString *sql_modify_limit(sql_select_t *select)
 {
     GString *new_sql = NULL;
@@ -222,7 +179,10 @@ sharding_modify_sql(sql_context_t *context, having_condition_t *hav_condi)
 
         /* select DISTINCT x,y,z ==> select DISTINCT x,y,z ORDER BY x,y,z */
         if (modified_sql == NULL) {
+            /* the added columns are owned like the statement, a bound template is on the heap */
+            sql_expr_set_arena(context->stmt_in_arena ? context->arena : NULL);
             modified_sql = sql_modify_orderby(select);
+            sql_expr_set_arena(NULL);
         }
 
         if (modified_sql == NULL && having) {
@@ -279,13 +239,8 @@ static gboolean partition_satisfies(sharding_partition_t *partition, condition_t
     /* partition value -> (low, high] */
     const sharding_vdb_t *conf = partition->vdb;
     if (conf->method == SHARD_METHOD_HASH) {
-        int64_t hash_value =  (conf->key_type == SHARD_DATA_TYPE_STR)
-            ? cetus_str_hash((const unsigned char *) cond.v.str) : cond.v.num;
-
-        int32_t hash_mod = hash_value % conf->logic_shard_num;
-
         if (cond.op == TK_EQ) {
-            return sharding_partition_contain_hash(partition, hash_mod);
+            return sharding_vdb_get_partition(conf, cond.v.num, cond.v.str) == partition;
         } else {
             return TRUE;
         }
@@ -342,27 +297,64 @@ static gboolean partition_satisfies(sharding_partition_t *partition, condition_t
     return false;
 }
 
+/* equation on sharding key, looked up in the vdb routing index */
+static sharding_partition_t *partition_lookup(GPtrArray *partitions, condition_t cond)
+{
+    sharding_partition_t *gp = g_ptr_array_index(partitions, 0);
+    return sharding_vdb_get_partition(gp->vdb, cond.v.num, cond.v.str);
+}
+
+static gboolean partitions_contain(GPtrArray *partitions, sharding_partition_t *part)
+{
+    int i = 0;
+    for (i = 0; i < partitions->len; ++i) {
+        if (g_ptr_array_index(partitions, i) == part) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
 /* filter out those which not satisfy cond */
 static void partitions_filter(GPtrArray *partitions, condition_t cond)
 {
+    if (partitions->len == 0) {
+        return;
+    }
+    sharding_partition_t *match = NULL;
+    if (cond.op == TK_EQ) {
+        match = partition_lookup(partitions, cond);
+    }
     int i = 0;
     for (i = 0; i < partitions->len; ++i) {
         sharding_partition_t *gp = g_ptr_array_index(partitions, i);
-        if (!partition_satisfies(gp, cond)) {
+        gboolean ok = (cond.op == TK_EQ) ? gp == match : partition_satisfies(gp, cond);
+        if (!ok) {
             g_ptr_array_remove_index(partitions, i);
             --i;
         }
     }
 }
 
-/* collect those which satisfy cond */
+/* collect those which satisfy cond, without duplication */
 static void partitions_collect(GPtrArray *from_partitions, condition_t cond,
                                  GPtrArray *to_partitions)
 {
+    if (from_partitions->len == 0) {
+        return;
+    }
+    if (cond.op == TK_EQ) {
+        sharding_partition_t *match = partition_lookup(from_partitions, cond);
+        if (match && partitions_contain(from_partitions, match)
+                && !partitions_contain(to_partitions, match)) {
+            g_ptr_array_add(to_partitions, match);
+        }
+        return;
+    }
     int i = 0;
     for (i = 0; i < from_partitions->len; ++i) {
         sharding_partition_t *gp = g_ptr_array_index(from_partitions, i);
-        if (partition_satisfies(gp, cond)) {
+        if (partition_satisfies(gp, cond) && !partitions_contain(to_partitions, gp)) {
             g_ptr_array_add(to_partitions, gp);
         }
     }
@@ -371,6 +363,13 @@ static void partitions_collect(GPtrArray *from_partitions, condition_t cond,
 /* get first group that satisfies cond */
 sharding_partition_t *partitions_get(GPtrArray *from_partitions, condition_t cond)
 {
+    if (from_partitions->len == 0) {
+        return NULL;
+    }
+    if (cond.op == TK_EQ) {
+        sharding_partition_t *match = partition_lookup(from_partitions, cond);
+        return (match && partitions_contain(from_partitions, match)) ? match : NULL;
+    }
     int i = 0;
     for (i = 0; i < from_partitions->len; ++i) {
         sharding_partition_t *gp = g_ptr_array_index(from_partitions, i);
@@ -518,7 +517,7 @@ static int partitions_collect_IN_expr(GPtrArray *partitions, sql_expr_t *expr)
 
     condition_t cond = {0};
     if (expr->list && expr->list->len > 0) {
-        GPtrArray *partitions = g_ptr_array_new();
+        GPtrArray *collected = g_ptr_array_new();
 
         sql_expr_list_t *args = expr->list;
         int i;
@@ -527,21 +526,19 @@ static int partitions_collect_IN_expr(GPtrArray *partitions, sql_expr_t *expr)
             cond.op = TK_EQ;
             int rc = expr_parse_sharding_value(arg, conf->key_type, &cond);
             if (rc != PARSE_OK) {
-                g_ptr_array_free(partitions, TRUE);
+                g_ptr_array_free(collected, TRUE);
                 return rc;
             }
-            partitions_collect(partitions, cond, partitions);
+            partitions_collect(partitions, cond, collected);
         }
 
-        /* transfer partitions to partitions as output */
-        for (i = partitions->len - 1; i >= 0; --i) {
-            g_ptr_array_remove_index(partitions, i);
-        }
-        for (i = 0; i < partitions->len; ++i) {
-            gpointer *gp = g_ptr_array_index(partitions, i);
+        /* transfer collected to partitions as output */
+        g_ptr_array_set_size(partitions, 0);
+        for (i = 0; i < collected->len; ++i) {
+            gpointer *gp = g_ptr_array_index(collected, i);
             g_ptr_array_add(partitions, gp);
         }
-        g_ptr_array_free(partitions, TRUE);
+        g_ptr_array_free(collected, TRUE);
         return PARSE_OK;
 
     } else {
@@ -1381,6 +1378,184 @@ int routing_by_property(sql_context_t *context, sql_property_t *property,
     return ERROR_UNPARSABLE;
 }
 
+/* number of ? before end, those in quotes and comments are not placeholders */
+static int count_placeholders(const char *p, const char *end)
+{
+    int n = 0;
+    while (p < end) {
+        char c = *p++;
+        if (c == '?') {
+            n++;
+        } else if (c == '\'' || c == '"' || c == '`') {
+            while (p < end && *p != c) {
+                if (*p == '\\' && c != '`') {
+                    p++;
+                }
+                p++;
+            }
+            p++;
+        } else if (c == '/' && p < end && *p == '*') {
+            const char *q = strstr(p + 1, "*/");
+            p = q ? q + 2 : end;
+        } else if (c == '#' || (c == '-' && p + 1 < end && *p == '-'
+                                && (p[1] == ' ' || p[1] == '\t' || p[1] == '\n'))) {
+            const char *q = strchr(p, '\n');
+            p = q ? q + 1 : end;
+        }
+    }
+    return n;
+}
+
+/* the ? that the sharding key equals to on the AND chain of where */
+static sql_expr_t *key_equals_placeholder(sql_expr_t *where)
+{
+    if (!where) {
+        return NULL;
+    }
+    sql_expr_t *found = NULL;
+    GQueue *stack = g_queue_new();
+    g_queue_push_head(stack, where);
+    while (!found && !g_queue_is_empty(stack)) {
+        sql_expr_t *p = g_queue_pop_head(stack);
+        if (p->op == TK_AND) {
+            if (p->right)
+                g_queue_push_head(stack, p->right);
+            if (p->left)
+                g_queue_push_head(stack, p->left);
+        } else if ((p->flags & EP_SHARD_COND) && p->op == TK_EQ
+                   && p->right && p->right->op == TK_VARIABLE) {
+            found = p->right;
+        }
+    }
+    g_queue_free(stack);
+    return found;
+}
+
+int sharding_stmt_key_param(GString *default_db, sql_context_t *context, const char *sql,
+                            const char **db_out, const char **table_out)
+{
+    if (context->rc != PARSE_OK || context->stmt_count != 1
+        || (context->clause_flags & CF_SUBQUERY)
+        || sql_context_has_sharding_property(context)) {
+        return -1;
+    }
+
+    sql_src_list_t *tables = NULL;
+    sql_expr_t *where = NULL;
+    switch (context->stmt_type) {
+    case STMT_SELECT: {
+        sql_select_t *select = context->sql_statement;
+        if (select->prior) {
+            return -1;
+        }
+        tables = select->from_src;
+        where = select->where_clause;
+        break;
+    }
+    case STMT_UPDATE: {
+        sql_update_t *update = context->sql_statement;
+        tables = update->table;
+        where = update->where_clause;
+        break;
+    }
+    case STMT_DELETE: {
+        sql_delete_t *delete = context->sql_statement;
+        tables = delete->from_src;
+        where = delete->where_clause;
+        break;
+    }
+    case STMT_INSERT: {
+        sql_insert_t *insert = context->sql_statement;
+        tables = insert->table;
+        break;
+    }
+    default:
+        return -1;
+    }
+    if (!tables || tables->len != 1) {
+        return -1;
+    }
+    sql_src_item_t *src = g_ptr_array_index(tables, 0);
+    char *db = src->dbname ? src->dbname : default_db->str;
+    if (src->select || !src->table_name) {
+        return -1;
+    }
+    sharding_table_t *shard_info = shard_conf_get_info(db, src->table_name);
+    if (!shard_info) {
+        return -1;
+    }
+    const char *key = shard_info->pkey->str;
+
+    sql_expr_t *param = NULL;
+    if (context->stmt_type == STMT_INSERT) {
+        sql_insert_t *insert = context->sql_statement;
+        sql_select_t *sel_val = insert->sel_val;
+        if (!insert->columns || !sel_val || !sel_val->columns
+            || sel_val->from_src || (sel_val->flags & SF_MULTI_VALUE)) {
+            return -1;
+        }
+        int i;
+        for (i = 0; i < insert->columns->len && i < sel_val->columns->len; ++i) {
+            if (strcasecmp(g_ptr_array_index(insert->columns, i), key) == 0) {
+                sql_expr_t *val = g_ptr_array_index(sel_val->columns, i);
+                param = val->op == TK_VARIABLE ? val : NULL;
+                break;
+            }
+        }
+    } else {
+        if (context->stmt_type == STMT_UPDATE) {
+            sql_update_t *update = context->sql_statement;
+            int i;
+            for (i = 0; update->set_list && i < update->set_list->len; ++i) {
+                sql_expr_t *equation = g_ptr_array_index(update->set_list, i);
+                if (!equation || !equation->left
+                    || expr_is_sharding_key(equation->left, src, key)) {
+                    return -1;
+                }
+            }
+        }
+        if (optimize_sharding_condition(where, src, key)) {
+            param = key_equals_placeholder(where);
+        }
+    }
+    if (!param || !param->start) {
+        return -1;
+    }
+
+    *db_out = db;
+    *table_out = src->table_name;
+    return count_placeholders(sql, param->start);
+}
+
+GString *sharding_stmt_key_group(const char *db, const char *table,
+                                 gboolean is_int, gint64 num, const char *str)
+{
+    sharding_table_t *info = shard_conf_get_info(db, table);
+    if (!info) {
+        return NULL;
+    }
+
+    condition_t cond = {TK_EQ, {0}};
+    char buf[32];
+    if (is_int && info->shard_key_type == SHARD_DATA_TYPE_INT) {
+        cond.v.num = num;
+    } else {
+        if (is_int) {
+            snprintf(buf, sizeof(buf), "%" G_GINT64_FORMAT, num);
+            str = buf;
+        }
+        if (string_to_sharding_value(str, info->shard_key_type, &cond) != PARSE_OK) {
+            return NULL;
+        }
+    }
+
+    GPtrArray *partitions = g_ptr_array_new();
+    shard_conf_table_partitions(partitions, db, table);
+    sharding_partition_t *part = partitions_get(partitions, cond);
+    g_ptr_array_free(partitions, TRUE);
+    return part ? part->group_name : NULL;
+}
+
 int sharding_parse_groups(GString *default_db, sql_context_t *context, query_stats_t *stats,
                           guint32 fixture, sharding_plan_t *plan)
 {
@@ -23,6 +23,22 @@ NETWORK_API int sharding_parse_groups(GString *, sql_context_t *, query_stats_t
 
 NETWORK_API GString *sharding_modify_sql(sql_context_t *, having_condition_t *);
 
+/**
+ * for a prepared statement running on one group picked by the sharding key:
+ * a single sharded table whose key is compared with = to a placeholder
+ * on the top AND level of WHERE, or given one in a single row INSERT
+ *
+ * @param sql the statement the context was parsed from
+ * @return position of that placeholder starting from 0, -1 if none,
+ *         db and table point into the parse tree
+ */
+NETWORK_API int sharding_stmt_key_param(GString *default_db, sql_context_t *, const char *sql,
+                                        const char **db, const char **table);
+
+/* group of the table the sharding key value falls into, NULL if none */
+NETWORK_API GString *sharding_stmt_key_group(const char *db, const char *table,
+                                             gboolean is_int, gint64 num, const char *str);
+
 NETWORK_API void sharding_filter_sql(sql_context_t *);
 
 #endif //__SHARDING_PARSER_H__
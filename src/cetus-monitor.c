@@ -4,29 +4,41 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
-#include <mysql.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "cetus-users.h"
 #include "cetus-util.h"
 #include "chassis-timings.h"
 #include "chassis-event.h"
+#include "chassis-workers.h"
 #include "glib-ext.h"
+#include "network-mysqld-packet.h"
+#include "network-mysqld-proto.h"
 #include "sharding-config.h"
 
 #define CHECK_ALIVE_INTERVAL 3
 #define CHECK_ALIVE_TIMES 2
 #define CHECK_DELAY_INTERVAL 300 * 1000 /* 300ms */
+#define PROBE_TIMEOUT 2 /* seconds, for each try of a probe */
 
 /* Each backend should have db <proxy_heart_beat> and table <tb_heartbeat> */
 #define HEARTBEAT_DB "proxy_heart_beat"
 
+/* probes of one check, the check is re-armed after the last one is done */
+typedef struct probe_round_t {
+    int pending;
+    void (*done)(struct cetus_monitor_t *);
+} probe_round_t;
+
 struct cetus_monitor_t {
     struct chassis *chas;
     GThread *thread;
@@ -38,70 +50,588 @@ struct cetus_monitor_t {
     struct event check_config_timer;
 
     GString *db_passwd;
-    GHashTable *backend_conns;
+    GString *hashed_passwd;
+    GHashTable *backend_conns; /* addr -> backend_probe_t */
+
+    probe_round_t alive_round;
+    probe_round_t write_round;
+    probe_round_t read_round;
 
     GList *registered_objects;
     char *config_id;
 };
 
-static void mysql_conn_free(gpointer e)
+typedef enum {
+    PROBE_IDLE,             /* logged in, nothing in flight */
+    PROBE_CLOSED,
+    PROBE_CONNECTING,
+    PROBE_READ_HANDSHAKE,
+    PROBE_WRITE_AUTH,
+    PROBE_READ_AUTH,
+    PROBE_WRITE_COMMAND,
+    PROBE_READ_RESULT,
+} probe_state_t;
+
+/**
+ * a monitor connection to one backend, driven by the monitor event loop
+ *
+ * every backend is probed at the same time, each probe has its own
+ * deadline so that a hung backend does not delay the others
+ */
+typedef struct backend_probe_t {
+    cetus_monitor_t *monitor;
+    char *addr;
+    network_address *dst;
+    int fd;
+    probe_state_t state;
+    gboolean in_flight;
+    gboolean reused;        /* the connection was open before this try */
+
+    struct event io_event;
+    struct event deadline_event;
+
+    GString *send_buf;
+    gsize send_offset;
+    GString *recv_buf;
+
+    GString *command;       /* COM_QUERY body, empty to only check login */
+    int tries;
+    int max_tries;
+    int backend_ndx;
+    probe_round_t *round;
+    void (*done)(struct backend_probe_t *);
+
+    /* result of the last try */
+    gboolean conn_ok;
+    guint16 query_errno;
+    GString *query_error;
+    GString *value;         /* 1st column of the 1st row, if any */
+    gboolean has_value;
+    int eof_count;
+    int prev_query_errno;   /* to log only on changes */
+} backend_probe_t;
+
+static void probe_io(int fd, short what, void *arg);
+static void probe_finish(backend_probe_t *probe, gboolean conn_ok);
+
+static backend_probe_t *backend_probe_new(cetus_monitor_t *monitor, network_backend_t *backend)
 {
-    MYSQL *conn = e;
-    if (conn) {
-        mysql_close(conn);
+    backend_probe_t *probe = g_new0(backend_probe_t, 1);
+    probe->monitor = monitor;
+    probe->addr = g_strdup(backend->addr->name->str);
+    probe->dst = network_address_copy(NULL, backend->addr);
+    probe->fd = -1;
+    probe->state = PROBE_CLOSED;
+    probe->send_buf = g_string_new(NULL);
+    probe->recv_buf = g_string_new(NULL);
+    probe->command = g_string_new(NULL);
+    probe->query_error = g_string_new(NULL);
+    probe->value = g_string_new(NULL);
+
+    event_set(&probe->io_event, -1, 0, probe_io, probe);
+    event_base_set(monitor->evloop, &probe->io_event);
+    return probe;
+}
+
+static void probe_close(backend_probe_t *probe)
+{
+    event_del(&probe->io_event);
+    if (probe->fd >= 0) {
+        close(probe->fd);
+        probe->fd = -1;
     }
+    probe->state = PROBE_CLOSED;
 }
 
-static char *get_current_sys_timestr(void)
+static void backend_probe_free(gpointer e)
 {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-#define BUFSIZE 32
-    char *time_sec = g_malloc(BUFSIZE);
-    strftime(time_sec, BUFSIZE, "%Y-%m-%d %H:%M:%S", localtime(&tv.tv_sec));
-    char *time_micro = g_strdup_printf("%s.%06ld", time_sec, tv.tv_usec);
-    g_free(time_sec);
-    return time_micro;
+    backend_probe_t *probe = e;
+    if (probe->in_flight) {
+        event_del(&probe->deadline_event);
+    }
+    probe_close(probe);
+    network_address_free(probe->dst);
+    g_string_free(probe->send_buf, TRUE);
+    g_string_free(probe->recv_buf, TRUE);
+    g_string_free(probe->command, TRUE);
+    g_string_free(probe->query_error, TRUE);
+    g_string_free(probe->value, TRUE);
+    g_free(probe->addr);
+    g_free(probe);
 }
 
-static MYSQL *get_mysql_connection(cetus_monitor_t *monitor, char *addr)
+static void probe_wait(backend_probe_t *probe, short what)
 {
-    MYSQL *conn = g_hash_table_lookup(monitor->backend_conns, addr);
-    if (conn) {
-        if (mysql_ping(conn) == 0) {
-            return conn;
-        } else {
-            g_hash_table_remove(monitor->backend_conns, addr);
-            g_message("monitor: remove dead mysql conn of backend: %s", addr);
+    event_del(&probe->io_event);
+    event_set(&probe->io_event, probe->fd, what, probe_io, probe);
+    event_base_set(probe->monitor->evloop, &probe->io_event);
+    event_add(&probe->io_event, NULL);
+}
+
+static void probe_queue_packet(backend_probe_t *probe, GString *body, guint8 packet_id)
+{
+    g_string_truncate(probe->send_buf, 0);
+    probe->send_offset = 0;
+    network_mysqld_proto_append_packet_len(probe->send_buf, body->len);
+    network_mysqld_proto_append_packet_id(probe->send_buf, packet_id);
+    g_string_append_len(probe->send_buf, S(body));
+}
+
+static void probe_send_command(backend_probe_t *probe)
+{
+    GString *body = g_string_sized_new(probe->command->len + 1);
+    if (probe->command->len > 0) {
+        network_mysqld_proto_append_int8(body, COM_QUERY);
+        g_string_append_len(body, S(probe->command));
+    } else {
+        network_mysqld_proto_append_int8(body, COM_PING);
+    }
+    probe_queue_packet(probe, body, 0);
+    g_string_free(body, TRUE);
+
+    probe->eof_count = 0;
+    probe->state = PROBE_WRITE_COMMAND;
+    probe_wait(probe, EV_WRITE);
+}
+
+static void probe_connect(backend_probe_t *probe)
+{
+    probe->reused = FALSE;
+    g_string_truncate(probe->recv_buf, 0);
+
+    probe->fd = socket(probe->dst->addr.common.sa_family, SOCK_STREAM, 0);
+    if (probe->fd < 0) {
+        g_critical("%s: socket() failed: %s (%d)", G_STRLOC, g_strerror(errno), errno);
+        probe_finish(probe, FALSE);
+        return;
+    }
+    fcntl(probe->fd, F_SETFL, O_NONBLOCK | O_RDWR);
+
+    if (connect(probe->fd, &probe->dst->addr.common, probe->dst->len) == 0) {
+        probe->state = PROBE_READ_HANDSHAKE;
+        probe_wait(probe, EV_READ);
+    } else if (errno == EINPROGRESS) {
+        probe->state = PROBE_CONNECTING;
+        probe_wait(probe, EV_WRITE);
+    } else {
+        g_debug("%s: connect(%s) failed: %s", G_STRLOC, probe->addr, g_strerror(errno));
+        probe_finish(probe, FALSE);
+    }
+}
+
+static void probe_deadline(int fd, short what, void *arg)
+{
+    backend_probe_t *probe = arg;
+    g_critical("monitor: probe of backend %s timed out", probe->addr);
+    probe->reused = FALSE; /* a hung backend is not worth a reconnect */
+    probe_finish(probe, FALSE);
+}
+
+static void probe_try(backend_probe_t *probe)
+{
+    probe->conn_ok = FALSE;
+    probe->query_errno = 0;
+    probe->has_value = FALSE;
+    g_string_truncate(probe->query_error, 0);
+
+    struct timeval timeout = {PROBE_TIMEOUT, 0};
+    evtimer_set(&probe->deadline_event, probe_deadline, probe);
+    event_base_set(probe->monitor->evloop, &probe->deadline_event);
+    evtimer_add(&probe->deadline_event, &timeout);
+
+    if (probe->state == PROBE_IDLE) {
+        probe->reused = TRUE;
+        g_string_truncate(probe->recv_buf, 0);
+        probe_send_command(probe);
+    } else {
+        probe_close(probe);
+        probe_connect(probe);
+    }
+}
+
+/**
+ * probe one backend, done() is called when it is finished
+ *
+ * @param sql  query to run after login, NULL to check that it is alive
+ */
+static void probe_start(backend_probe_t *probe, probe_round_t *round, const char *sql,
+                        int max_tries, void (*done)(backend_probe_t *))
+{
+    g_string_assign(probe->command, sql ? sql : "");
+    probe->round = round;
+    probe->done = done;
+    probe->tries = 0;
+    probe->max_tries = max_tries;
+    probe->in_flight = TRUE;
+    round->pending++;
+    probe_try(probe);
+}
+
+static void probe_finish(backend_probe_t *probe, gboolean conn_ok)
+{
+    event_del(&probe->deadline_event);
+    probe->conn_ok = conn_ok;
+    if (conn_ok) {
+        event_del(&probe->io_event);
+        probe->state = PROBE_IDLE;
+    } else {
+        gboolean reused = probe->reused;
+        probe_close(probe);
+        /* the cached connection might just be closed by the server */
+        if (reused) {
+            g_message("monitor: remove dead mysql conn of backend: %s", probe->addr);
+            probe_try(probe);
+            return;
+        }
+        if (++probe->tries < probe->max_tries) {
+            probe_try(probe);
+            return;
         }
     }
 
-    conn = mysql_init(NULL);
-    if (!conn)
-        return NULL;
+    probe->in_flight = FALSE;
+    probe->done(probe);
+
+    probe_round_t *round = probe->round;
+    if (--round->pending == 0) {
+        round->done(probe->monitor);
+    }
+}
+
+static int probe_send_auth(backend_probe_t *probe, network_packet *packet)
+{
+    cetus_monitor_t *monitor = probe->monitor;
+    network_mysqld_auth_challenge *challenge = network_mysqld_auth_challenge_new();
+    if (network_mysqld_proto_get_auth_challenge(packet, challenge)) {
+        network_mysqld_auth_challenge_free(challenge);
+        return -1;
+    }
+
+    network_mysqld_auth_response *auth = network_mysqld_auth_response_new(challenge->capabilities);
+    auth->client_capabilities = CETUS_DEFAULT_FLAGS;
+    auth->client_capabilities &= ~(CLIENT_CONNECT_WITH_DB | CLIENT_COMPRESS);
+    auth->max_packet_size = 0x01000000;
+    auth->charset = challenge->charset;
+    g_string_assign(auth->username, monitor->chas->default_username);
+    g_string_truncate(auth->auth_plugin_data, 0);
+    network_mysqld_proto_password_scramble(auth->auth_plugin_data,
+                                           S(challenge->auth_plugin_data),
+                                           S(monitor->hashed_passwd));
+
+    GString *body = g_string_new(NULL);
+    network_mysqld_proto_append_auth_response(body, auth);
+    probe_queue_packet(probe, body, network_mysqld_proto_get_packet_id(packet->data) + 1);
+    g_string_free(body, TRUE);
+    network_mysqld_auth_response_free(auth);
+    network_mysqld_auth_challenge_free(challenge);
 
-    unsigned int timeout = 2 * SECONDS;
-    mysql_options(conn, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
-    mysql_options(conn, MYSQL_OPT_READ_TIMEOUT, &timeout);
-    mysql_options(conn, MYSQL_OPT_WRITE_TIMEOUT, &timeout);
+    probe->state = PROBE_WRITE_AUTH;
+    probe_wait(probe, EV_WRITE);
+    return 0;
+}
+
+static void probe_save_error(backend_probe_t *probe, network_packet *packet)
+{
+    network_mysqld_err_packet_t *err_packet = network_mysqld_err_packet_new();
+    if (network_mysqld_proto_get_err_packet(packet, err_packet) == 0) {
+        probe->query_errno = err_packet->errcode;
+        g_string_assign_len(probe->query_error, S(err_packet->errmsg));
+    } else {
+        probe->query_errno = G_MAXUINT16;
+        g_string_assign(probe->query_error, "malformed error packet");
+    }
+    network_mysqld_err_packet_free(err_packet);
+}
 
-    char **ip_port = g_strsplit(addr, ":", -1);
-    int port = atoi(ip_port[1]);
-    char *user = monitor->chas->default_username;
-    if (mysql_real_connect(conn, ip_port[0], user, monitor->db_passwd->str,
-                           NULL, port, NULL, 0) == NULL)
+/**
+ * @return -1 if the connection is broken, 1 if the probe is finished,
+ *         0 to read on
+ */
+static int probe_handle_packet(backend_probe_t *probe, network_packet *packet)
+{
+    guint8 status = 0;
+    if (network_mysqld_proto_skip_network_header(packet) ||
+        network_mysqld_proto_peek_int8(packet, &status))
     {
-        g_critical("monitor thread cannot connect to backend: %s@%s",
-                   monitor->chas->default_username, addr);
-        mysql_conn_free(conn);
-        g_strfreev(ip_port);
+        return -1;
+    }
+
+    switch (probe->state) {
+    case PROBE_READ_HANDSHAKE:
+        if (status == MYSQLD_PACKET_ERR) {
+            probe_save_error(probe, packet);
+            g_critical("monitor thread cannot connect to backend: %s@%s, %s",
+                       probe->monitor->chas->default_username, probe->addr,
+                       probe->query_error->str);
+            return -1;
+        }
+        return probe_send_auth(probe, packet);
+    case PROBE_READ_AUTH:
+        if (status != MYSQLD_PACKET_OK) {
+            if (status == MYSQLD_PACKET_ERR) {
+                probe_save_error(probe, packet);
+            } else {
+                g_string_assign(probe->query_error, "auth method not supported");
+            }
+            g_critical("monitor thread cannot connect to backend: %s@%s, %s",
+                       probe->monitor->chas->default_username, probe->addr,
+                       probe->query_error->str);
+            return -1;
+        }
+        g_message("monitor thread connected to backend: %s", probe->addr);
+        if (probe->command->len == 0) {
+            return 1;
+        }
+        probe_send_command(probe);
+        return 0;
+    case PROBE_READ_RESULT:
+        if (probe->eof_count == 0 && !probe->has_value) {
+            if (status == MYSQLD_PACKET_OK) {
+                return 1;
+            } else if (status == MYSQLD_PACKET_ERR) {
+                probe_save_error(probe, packet);
+                return 1;
+            }
+        }
+        if (status == MYSQLD_PACKET_EOF && packet->data->len < NET_HEADER_SIZE + 9) {
+            return ++probe->eof_count == 2 ? 1 : 0;
+        }
+        if (status == MYSQLD_PACKET_ERR) {
+            probe_save_error(probe, packet);
+            return 1;
+        }
+        if (probe->eof_count == 1 && !probe->has_value) {
+            probe->has_value = TRUE;
+            g_string_truncate(probe->value, 0);
+            if (status != MYSQLD_PACKET_NULL) {
+                gchar *s = NULL;
+                guint64 len = 0;
+                if (network_mysqld_proto_get_lenenc_str(packet, &s, &len)) {
+                    return -1;
+                }
+                g_string_assign_len(probe->value, s, len);
+                g_free(s);
+            }
+        }
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static void probe_read(backend_probe_t *probe)
+{
+    char buf[4096];
+    ssize_t len = recv(probe->fd, buf, sizeof(buf), 0);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        probe_wait(probe, EV_READ);
+        return;
+    }
+    if (len <= 0) {
+        g_debug("%s: backend %s closed the monitor conn", G_STRLOC, probe->addr);
+        probe_finish(probe, FALSE);
+        return;
+    }
+    g_string_append_len(probe->recv_buf, buf, len);
+
+    /* handle the complete packets, a packet might switch to writing */
+    while (probe->recv_buf->len >= NET_HEADER_SIZE) {
+        guint32 packet_len = network_mysqld_proto_get_packet_len(probe->recv_buf);
+        if (probe->recv_buf->len < NET_HEADER_SIZE + packet_len) {
+            break;
+        }
+        network_packet packet;
+        packet.data = g_string_new_len(probe->recv_buf->str, NET_HEADER_SIZE + packet_len);
+        packet.offset = 0;
+        g_string_erase(probe->recv_buf, 0, NET_HEADER_SIZE + packet_len);
+
+        probe_state_t state = probe->state;
+        int ret = probe_handle_packet(probe, &packet);
+        g_string_free(packet.data, TRUE);
+        if (ret != 0) {
+            probe_finish(probe, ret > 0);
+            return;
+        }
+        if (probe->state != state) {
+            return;
+        }
+    }
+    probe_wait(probe, EV_READ);
+}
+
+static void probe_write(backend_probe_t *probe)
+{
+    ssize_t len = send(probe->fd, probe->send_buf->str + probe->send_offset,
+                       probe->send_buf->len - probe->send_offset, 0);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        probe_wait(probe, EV_WRITE);
+        return;
+    }
+    if (len < 0) {
+        g_debug("%s: send to backend %s failed: %s", G_STRLOC, probe->addr, g_strerror(errno));
+        probe_finish(probe, FALSE);
+        return;
+    }
+    probe->send_offset += len;
+    if (probe->send_offset < probe->send_buf->len) {
+        probe_wait(probe, EV_WRITE);
+        return;
+    }
+    probe->state = probe->state == PROBE_WRITE_AUTH ? PROBE_READ_AUTH : PROBE_READ_RESULT;
+    probe_wait(probe, EV_READ);
+}
+
+static void probe_io(int fd, short what, void *arg)
+{
+    backend_probe_t *probe = arg;
+
+    switch (probe->state) {
+    case PROBE_CONNECTING: {
+        int so_error = 0;
+        socklen_t so_len = sizeof(so_error);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &so_error, &so_len) || so_error) {
+            g_debug("%s: connect(%s) failed: %s", G_STRLOC, probe->addr, g_strerror(so_error));
+            probe_finish(probe, FALSE);
+            return;
+        }
+        probe->state = PROBE_READ_HANDSHAKE;
+        probe_wait(probe, EV_READ);
+        break;
+    }
+    case PROBE_READ_HANDSHAKE:
+    case PROBE_READ_AUTH:
+    case PROBE_READ_RESULT:
+        probe_read(probe);
+        break;
+    case PROBE_WRITE_AUTH:
+    case PROBE_WRITE_COMMAND:
+        probe_write(probe);
+        break;
+    default:
+        break;
+    }
+}
+
+static backend_probe_t *get_backend_probe(cetus_monitor_t *monitor, network_backend_t *backend)
+{
+    char *addr = backend->addr->name->str;
+    backend_probe_t *probe = g_hash_table_lookup(monitor->backend_conns, addr);
+    if (probe == NULL) {
+        probe = backend_probe_new(monitor, backend);
+        g_hash_table_insert(monitor->backend_conns, probe->addr, probe);
+    }
+    return probe;
+}
+
+/* the backend list might change while probing, find it again */
+static network_backend_t *probe_get_backend(backend_probe_t *probe)
+{
+    network_backends_t *bs = probe->monitor->chas->priv->backends;
+    if (probe->backend_ndx >= network_backends_count(bs)) {
         return NULL;
     }
-    g_hash_table_insert(monitor->backend_conns, g_strdup(addr), conn);
-    g_message("monitor thread connected to backend: %s, cached %d conns",
-              addr, g_hash_table_size(monitor->backend_conns));
-    g_strfreev(ip_port);
-    return conn;
+    network_backend_t *backend = network_backends_get(bs, probe->backend_ndx);
+    if (strcmp(backend->addr->name->str, probe->addr) != 0) {
+        return NULL;
+    }
+    return backend;
+}
+
+/* what the monitor found out about a backend, followed by its address */
+typedef struct backend_state_msg_t {
+    gint32 state;
+    gint32 slave_delay_msec;
+} backend_state_msg_t;
+
+/* in multi-process mode, the monitor runs in the master and tells the workers */
+static void monitor_publish(cetus_monitor_t *monitor, network_backend_t *backend)
+{
+    chassis *chas = monitor->chas;
+    if (!chassis_is_master(chas)) {
+        return;
+    }
+
+    backend_state_msg_t st = {backend->state, backend->slave_delay_msec};
+    GString *msg = g_string_sized_new(sizeof(st) + backend->addr->name->len);
+    g_string_append_len(msg, (const char *)&st, sizeof(st));
+    g_string_append_len(msg, S(backend->addr->name));
+    chassis_workers_broadcast(chas, WORKER_MSG_BACKEND_STATE, S(msg));
+    g_string_free(msg, TRUE);
+}
+
+/* in a worker, take over the state the monitor of the master found */
+static void monitor_apply_backend_state(chassis *chas, const char *data, gsize len,
+                                        GString G_GNUC_UNUSED *reply, void G_GNUC_UNUSED *arg)
+{
+    network_backends_t *bs = chas->priv->backends;
+    backend_state_msg_t st;
+
+    if (len <= sizeof(st)) {
+        return;
+    }
+    memcpy(&st, data, sizeof(st));
+    char *addr = g_strndup(data + sizeof(st), len - sizeof(st));
+    int ndx = network_backends_find_address(bs, addr);
+    g_free(addr);
+    if (ndx < 0) {
+        return;
+    }
+
+    network_backend_t *backend = network_backends_get(bs, ndx);
+    if (backend->state == BACKEND_STATE_DELETED || backend->state == BACKEND_STATE_MAINTAINING) {
+        return;
+    }
+    network_backends_set_slave_delay(bs, ndx, st.slave_delay_msec);
+    if (backend->state != st.state) {
+        network_backends_modify(bs, ndx, backend->type, st.state);
+    }
+}
+
+static void probe_set_state(backend_probe_t *probe, network_backend_t *backend)
+{
+    network_backends_t *bs = probe->monitor->chas->priv->backends;
+    if (backend->state == BACKEND_STATE_DELETED || backend->state == BACKEND_STATE_MAINTAINING) {
+        return;
+    }
+    if (!probe->conn_ok) {
+        if (backend->state != BACKEND_STATE_DOWN) {
+            network_backends_modify(bs, probe->backend_ndx, backend->type, BACKEND_STATE_DOWN);
+            g_critical("Backend %s is set to DOWN.", probe->addr);
+        }
+        g_debug("Backend %s is not ALIVE!", probe->addr);
+    } else {
+        if (backend->state != BACKEND_STATE_UP) {
+            network_backends_modify(bs, probe->backend_ndx, backend->type, BACKEND_STATE_UP);
+            g_message("Backend %s is set to UP.", probe->addr);
+        }
+        g_debug("Backend %s is ALIVE!", probe->addr);
+    }
+    monitor_publish(probe->monitor, backend);
+}
+
+static void probe_round_begin(probe_round_t *round, void (*done)(cetus_monitor_t *))
+{
+    round->done = done;
+    round->pending = 1; /* not done before every probe is started */
+}
+
+static void probe_round_end(cetus_monitor_t *monitor, probe_round_t *round)
+{
+    if (--round->pending == 0) {
+        round->done(monitor);
+    }
+}
+
+static char *get_current_sys_timestr(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+#define BUFSIZE 32
+    char *time_sec = g_malloc(BUFSIZE);
+    strftime(time_sec, BUFSIZE, "%Y-%m-%d %H:%M:%S", localtime(&tv.tv_sec));
+    char *time_micro = g_strdup_printf("%s.%06ld", time_sec, tv.tv_usec);
+    g_free(time_sec);
+    return time_micro;
 }
 
 #define ADD_MONITOR_TIMER(ev_struct, ev_cb, timeout) \
@@ -109,6 +639,23 @@ static MYSQL *get_mysql_connection(cetus_monitor_t *monitor, char *addr)
     event_base_set(monitor->evloop, &(monitor->ev_struct));\
     evtimer_add(&(monitor->ev_struct), &timeout);
 
+static void check_backend_alive(int fd, short what, void *arg);
+
+static void alive_probe_done(backend_probe_t *probe)
+{
+    network_backend_t *backend = probe_get_backend(probe);
+    if (backend) {
+        probe_set_state(probe, backend);
+    }
+}
+
+static void alive_round_done(cetus_monitor_t *monitor)
+{
+    struct timeval timeout = {0};
+    timeout.tv_sec = CHECK_ALIVE_INTERVAL;
+    ADD_MONITOR_TIMER(check_alive_timer, check_backend_alive, timeout);
+}
+
 static void check_backend_alive(int fd, short what, void *arg)
 {
     cetus_monitor_t *monitor = arg;
@@ -116,42 +663,53 @@ static void check_backend_alive(int fd, short what, void *arg)
 
     int i;
     network_backends_t *bs = chas->priv->backends;
+    probe_round_begin(&monitor->alive_round, alive_round_done);
     for (i = 0; i < network_backends_count(bs); i++) {
         network_backend_t *backend = network_backends_get(bs, i);
         if (backend->state == BACKEND_STATE_DELETED ||
            backend->state == BACKEND_STATE_MAINTAINING) 
             continue;
 
-        char *backend_addr = backend->addr->name->str;
-        int check_count = 0;
-        MYSQL *conn = NULL;
-        while (++check_count <= CHECK_ALIVE_TIMES) {
-            conn = get_mysql_connection(monitor, backend_addr);
-            if (conn) break;
-        }
+        backend_probe_t *probe = get_backend_probe(monitor, backend);
+        if (probe->in_flight)
+            continue;
+        probe->backend_ndx = i;
+        probe_start(probe, &monitor->alive_round, NULL, CHECK_ALIVE_TIMES, alive_probe_done);
+    }
+    probe_round_end(monitor, &monitor->alive_round);
+}
 
-        if (conn == NULL) {
-            if (backend->state != BACKEND_STATE_DOWN) {
-                network_backends_modify(bs, i, backend->type, BACKEND_STATE_DOWN);
-                g_critical("Backend %s is set to DOWN.", backend_addr);
-            }
-            g_debug("Backend %s is not ALIVE!", backend_addr);
-        } else {
-            if (backend->state != BACKEND_STATE_UP) {
-                network_backends_modify(bs, i, backend->type, BACKEND_STATE_UP);
-                g_message("Backend %s is set to UP.", backend_addr);
-            }
-            g_debug("Backend %s is ALIVE!", backend_addr);
-        }
+static void check_slave_timestamp(int fd, short what, void *arg);
+static void update_master_timestamp(int fd, short what, void *arg);
+
+static void write_probe_done(backend_probe_t *probe)
+{
+    network_backend_t *backend = probe_get_backend(probe);
+    if (backend == NULL) {
+        return;
+    }
+    probe_set_state(probe, backend);
+    if (!probe->conn_ok) {
+        return;
     }
+    int result = probe->query_errno;
+    if (result != probe->prev_query_errno && result != 0) {
+        g_critical("Update heartbeat error: %d, text: %s, backend: %s",
+                   result, probe->query_error->str, probe->addr);
+    } else if (result != probe->prev_query_errno && result == 0) {
+        g_message("Update heartbeat success. backend: %s", probe->addr);
+    }
+    probe->prev_query_errno = result;
+}
 
+static void write_round_done(cetus_monitor_t *monitor)
+{
+    /* Wait 50ms for RO write data */
     struct timeval timeout = {0};
-    timeout.tv_sec = CHECK_ALIVE_INTERVAL;
-    ADD_MONITOR_TIMER(check_alive_timer, check_backend_alive, timeout);
+    timeout.tv_usec = 50 * 1000;
+    ADD_MONITOR_TIMER(read_slave_timer, check_slave_timestamp, timeout);
 }
 
-static void check_slave_timestamp(int fd, short what, void *arg);
-
 static void update_master_timestamp(int fd, short what, void *arg)
 {
     cetus_monitor_t *monitor = arg;
@@ -166,6 +724,14 @@ static void update_master_timestamp(int fd, short what, void *arg)
      *   PRIMARY KEY (`p_id`)
      * ) ENGINE = InnoDB DEFAULT CHARSET = utf8;
      */
+    static char sql[1024];
+    char *cur_time_str = get_current_sys_timestr();
+    snprintf(sql, sizeof(sql), "INSERT INTO %s.tb_heartbeat (p_id, p_ts)"
+             " VALUES ('%s', '%s') ON DUPLICATE KEY UPDATE p_ts='%s'",
+             HEARTBEAT_DB, monitor->config_id, cur_time_str, cur_time_str);
+    g_free(cur_time_str);
+
+    probe_round_begin(&monitor->write_round, write_round_done);
     for (i = 0; i < network_backends_count(bs); i++) {
         network_backend_t *backend = network_backends_get(bs, i);
         if (backend->state == BACKEND_STATE_DELETED ||
@@ -173,42 +739,89 @@ static void update_master_timestamp(int fd, short what, void *arg)
             continue;
 
         if (backend->type == BACKEND_TYPE_RW) {
-            static char sql[1024];
-            char *cur_time_str = get_current_sys_timestr();
-            snprintf(sql, sizeof(sql), "INSERT INTO %s.tb_heartbeat (p_id, p_ts)"
-                     " VALUES ('%s', '%s') ON DUPLICATE KEY UPDATE p_ts='%s'",
-                     HEARTBEAT_DB, monitor->config_id, cur_time_str, cur_time_str);
-
-            char *backend_addr = backend->addr->name->str;
-            MYSQL *conn = get_mysql_connection(monitor, backend_addr);
-            if (conn == NULL) {
-                if (backend->state != BACKEND_STATE_DOWN) {
-                    network_backends_modify(bs, i, backend->type, BACKEND_STATE_DOWN);
-                    g_critical("Backend %s is set to DOWN.", backend_addr);
-                }
+            backend_probe_t *probe = get_backend_probe(monitor, backend);
+            if (probe->in_flight)
+                continue;
+            probe->backend_ndx = i;
+            probe_start(probe, &monitor->write_round, sql, 1, write_probe_done);
+        }
+    }
+    probe_round_end(monitor, &monitor->write_round);
+}
+
+static void read_probe_done(backend_probe_t *probe)
+{
+    cetus_monitor_t *monitor = probe->monitor;
+    chassis *chas = monitor->chas;
+    network_backends_t *bs = chas->priv->backends;
+    network_backend_t *backend = probe_get_backend(probe);
+    if (backend == NULL || backend->state == BACKEND_STATE_DELETED ||
+        backend->state == BACKEND_STATE_MAINTAINING)
+        return;
+
+    char *backend_addr = probe->addr;
+    if (!probe->conn_ok) {
+        g_critical("Connection error when read delay from RO backend: %s", backend_addr);
+        if (backend->state != BACKEND_STATE_DOWN) {
+            network_backends_modify(bs, probe->backend_ndx, backend->type, BACKEND_STATE_DOWN);
+            g_critical("Backend %s is set to DOWN.", backend_addr);
+        }
+        monitor_publish(monitor, backend);
+        return;
+    }
+
+    int result = probe->query_errno;
+    if (result != probe->prev_query_errno && result != 0) {
+        g_critical("Select heartbeat error: %d, text: %s, backend: %s",
+                    result, probe->query_error->str, backend_addr);
+    } else if (result != probe->prev_query_errno && result == 0) {
+        g_message("Select heartbeat success. backend: %s", backend_addr);
+    }
+    probe->prev_query_errno = result;
+    if (result == 0) {
+        double ts_slave;
+        if (probe->has_value) {
+            char *p_ts = probe->value->str;
+            if (strstr(p_ts, ".") != NULL) {
+                char **tms = g_strsplit(p_ts, ".", -1);
+                glong ts_slave_sec = chassis_epoch_from_string(tms[0], NULL);
+                double ts_slave_msec = atof(tms[1]);
+                ts_slave = ts_slave_sec + ts_slave_msec/1000;
+                g_strfreev(tms);
             } else {
-                if (backend->state != BACKEND_STATE_UP) {
-                    network_backends_modify(bs, i, backend->type, BACKEND_STATE_UP);
-                    g_message("Backend %s is set to UP.", backend_addr);
-                }
-                static int previous_result[256] = {0}; /* for each backend group */
-                int result = mysql_real_query(conn, L(sql));
-                if (result != previous_result[i] && result != 0) {
-                    g_critical("Update heartbeat error: %d, text: %s, backend: %s",
-                               mysql_errno(conn), mysql_error(conn), backend_addr);
-                } else if (result != previous_result[i] && result == 0) {
-                    g_message("Update heartbeat success. backend: %s", backend_addr);
-                }
-                previous_result[i] = result;
+                ts_slave = chassis_epoch_from_string(p_ts, NULL);
+            }
+        } else {
+            g_critical("Check slave delay no data:%s", probe->command->str);
+            ts_slave = (double)G_MAXINT32;
+        }
+        if (ts_slave != 0) {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            double ts_now = tv.tv_sec + ((double)tv.tv_usec)/1000000;
+            double delay_secs = ts_now - ts_slave;
+            network_backends_set_slave_delay(bs, probe->backend_ndx, (int)(delay_secs * 1000));
+            if (delay_secs > chas->slave_delay_down_threshold_sec &&
+                backend->state != BACKEND_STATE_DOWN)
+            {
+                network_backends_modify(bs, probe->backend_ndx, backend->type, BACKEND_STATE_DOWN);
+                g_critical("Slave delay %.3f seconds. Set slave to DOWN.", delay_secs);
+            } else if (delay_secs <= chas->slave_delay_recover_threshold_sec &&
+                       backend->state != BACKEND_STATE_UP)
+            {
+                network_backends_modify(bs, probe->backend_ndx, backend->type, BACKEND_STATE_UP);
+                g_message("Slave delay %.3f seconds. Recovered. Set slave to UP.", delay_secs);
             }
-            g_free(cur_time_str);
         }
     }
+    monitor_publish(monitor, backend);
+}
 
-    /* Wait 50ms for RO write data */
+static void read_round_done(cetus_monitor_t *monitor)
+{
     struct timeval timeout = {0};
-    timeout.tv_usec = 50 * 1000;
-    ADD_MONITOR_TIMER(read_slave_timer, check_slave_timestamp, timeout);
+    timeout.tv_usec = CHECK_DELAY_INTERVAL;
+    ADD_MONITOR_TIMER(write_master_timer, update_master_timestamp, timeout);
 }
 
 static void check_slave_timestamp(int fd, short what, void *arg)
@@ -218,78 +831,25 @@ static void check_slave_timestamp(int fd, short what, void *arg)
     int i;
     network_backends_t *bs = chas->priv->backends;
 
+    static char sql[512];
+    snprintf(sql, sizeof(sql), "select p_ts from %s.tb_heartbeat where p_id='%s'",
+             HEARTBEAT_DB, monitor->config_id);
+
     /* Read delay sec and set slave UP/DOWN according to delay_secs */
+    probe_round_begin(&monitor->read_round, read_round_done);
     for (i = 0; i < network_backends_count(bs); i++) {
         network_backend_t *backend = network_backends_get(bs, i);
         if (backend->type == BACKEND_TYPE_RW ||backend->state == BACKEND_STATE_DELETED ||
             backend->state == BACKEND_STATE_MAINTAINING)
             continue;
 
-        char *backend_addr = backend->addr->name->str;
-        MYSQL *conn = get_mysql_connection(monitor, backend_addr);
-        if (conn == NULL) {
-            g_critical("Connection error when read delay from RO backend: %s", backend_addr);
-            if (backend->state != BACKEND_STATE_DOWN) {
-                network_backends_modify(bs, i, backend->type, BACKEND_STATE_DOWN);
-                g_critical("Backend %s is set to DOWN.", backend_addr);
-            }
+        backend_probe_t *probe = get_backend_probe(monitor, backend);
+        if (probe->in_flight)
             continue;
-        }
-
-        static char sql[512];
-        snprintf(sql, sizeof(sql), "select p_ts from %s.tb_heartbeat where p_id='%s'",
-                 HEARTBEAT_DB, monitor->config_id);
-        static int previous_result[256] = {0}; /* for each backend group */
-        int result = mysql_real_query(conn, L(sql));
-        if (result != previous_result[i] && result != 0) {
-            g_critical("Select heartbeat error: %d, text: %s, backend: %s",
-                        mysql_errno(conn), mysql_error(conn), backend_addr);
-        } else if (result != previous_result[i] && result == 0) {
-            g_message("Select heartbeat success. backend: %s", backend_addr);
-        }
-        previous_result[i] = result;
-        if (result == 0) {
-            MYSQL_RES *rs_set = mysql_store_result(conn);
-            MYSQL_ROW row = mysql_fetch_row(rs_set);
-            double ts_slave;
-            if (row != NULL) {
-                if (strstr(row[0],".") != NULL) {
-                    char **tms = g_strsplit(row[0], ".", -1);
-                    glong ts_slave_sec = chassis_epoch_from_string(tms[0], NULL);
-                    double ts_slave_msec = atof(tms[1]);
-                    ts_slave = ts_slave_sec + ts_slave_msec/1000;
-                    g_strfreev(tms);
-                } else {
-                    ts_slave = chassis_epoch_from_string(row[0], NULL);
-                }
-            } else {
-                g_critical("Check slave delay no data:%s", sql);
-                ts_slave = (double)G_MAXINT32;
-            }
-            if (ts_slave != 0) {
-                struct timeval tv;
-                gettimeofday(&tv, NULL);
-                double ts_now = tv.tv_sec + ((double)tv.tv_usec)/1000000;
-                double delay_secs = ts_now - ts_slave;
-                backend->slave_delay_msec = (int)delay_secs * 1000;
-                if (delay_secs > chas->slave_delay_down_threshold_sec &&
-                    backend->state != BACKEND_STATE_DOWN)
-                {
-                    network_backends_modify(bs, i, backend->type, BACKEND_STATE_DOWN);
-                    g_critical("Slave delay %.3f seconds. Set slave to DOWN.", delay_secs);
-                } else if (delay_secs <= chas->slave_delay_recover_threshold_sec &&
-                           backend->state != BACKEND_STATE_UP)
-                {
-                    network_backends_modify(bs, i, backend->type, BACKEND_STATE_UP);
-                    g_message("Slave delay %.3f seconds. Recovered. Set slave to UP.", delay_secs);
-                }
-            }
-            mysql_free_result(rs_set);
-        }
+        probe->backend_ndx = i;
+        probe_start(probe, &monitor->read_round, sql, 1, read_probe_done);
     }
-    struct timeval timeout = {0};
-    timeout.tv_usec = CHECK_DELAY_INTERVAL;
-    ADD_MONITOR_TIMER(write_master_timer, update_master_timestamp, timeout);
+    probe_round_end(monitor, &monitor->read_round);
 }
 
 #define MON_MAX_NAME_LEN 128
@@ -387,28 +947,29 @@ void cetus_monitor_close(cetus_monitor_t *monitor, monitor_type_t monitor_type)
     }
 }
 
-static void *cetus_monitor_mainloop(void *data)
+/**
+ * get what the probes need and start the checks
+ *
+ * @return FALSE if the monitor can't work
+ */
+static gboolean cetus_monitor_setup(cetus_monitor_t *monitor)
 {
-    cetus_monitor_t *monitor = data;
-
-    chassis_event_loop_t *loop = chassis_event_loop_new();
-    monitor->evloop = loop;
-
     chassis *chas = monitor->chas;
     monitor->config_id = chassis_config_get_id(chas->config_manager);
     if (!chas->default_username) {
         g_warning("default-username not set, monitor will not work");
-        return NULL;
+        return FALSE;
     }
 
     cetus_users_get_server_pwd(chas->priv->users,
                                chas->default_username, monitor->db_passwd);
     if (monitor->db_passwd->len == 0) { /* TODO: retry */
         g_warning("no password for %s, monitor will not work", chas->default_username);
-        return NULL;
+        return FALSE;
     }
+    network_mysqld_proto_password_hash(monitor->hashed_passwd, S(monitor->db_passwd));
     monitor->backend_conns = g_hash_table_new_full(
-            g_str_hash, g_str_equal, g_free, mysql_conn_free);
+            g_str_hash, g_str_equal, NULL, backend_probe_free);
 
     if (!chas->check_slave_delay) {
         cetus_monitor_open(monitor, MONITOR_TYPE_CHECK_ALIVE);
@@ -419,18 +980,68 @@ static void *cetus_monitor_mainloop(void *data)
 #if 0
     cetus_monitor_open(monitor, MONITOR_TYPE_CHECK_CONFIG);
 #endif
-    chassis_event_loop(loop);
+    return TRUE;
+}
+
+static void cetus_monitor_teardown(cetus_monitor_t *monitor)
+{
+    if (!monitor->backend_conns) {
+        return;
+    }
+    cetus_monitor_close(monitor, MONITOR_TYPE_CHECK_ALIVE);
+    cetus_monitor_close(monitor, MONITOR_TYPE_CHECK_DELAY);
 
-    g_message("monitor thread closing %d mysql conns",
+    g_message("monitor closing %d mysql conns",
               g_hash_table_size(monitor->backend_conns));
     g_hash_table_destroy(monitor->backend_conns);
-    mysql_thread_end();
+    monitor->backend_conns = NULL;
+}
+
+static void *cetus_monitor_mainloop(void *data)
+{
+    cetus_monitor_t *monitor = data;
+
+    chassis_event_loop_t *loop = chassis_event_loop_new();
+    monitor->evloop = loop;
+
+    if (!cetus_monitor_setup(monitor)) {
+        return NULL;
+    }
+    chassis_event_loop(loop);
+
+    cetus_monitor_teardown(monitor);
 
     g_debug("exiting monitor loop");
     chassis_event_loop_free(loop);
     return NULL;
 }
 
+/**
+ * multi-process mode: run the monitor on the event loop of the master,
+ * the workers are told about every backend it checked
+ */
+void cetus_monitor_start(cetus_monitor_t *monitor, chassis *chas)
+{
+    monitor->chas = chas;
+    chassis_workers_set_handler(WORKER_MSG_BACKEND_STATE, monitor_apply_backend_state, monitor);
+    if (chas->disable_threads) {
+        g_message("monitor is disabled");
+        return;
+    }
+
+    monitor->evloop = chas->event_base;
+    if (cetus_monitor_setup(monitor)) {
+        g_message("monitor started in the master");
+    }
+}
+
+/* a forked worker drops the monitor it got from the master */
+void cetus_monitor_stop(cetus_monitor_t *monitor)
+{
+    cetus_monitor_teardown(monitor);
+    monitor->evloop = NULL;
+}
+
 void cetus_monitor_start_thread(cetus_monitor_t *monitor, chassis *chas)
 {
     monitor->chas = chas;
@@ -475,6 +1086,7 @@ cetus_monitor_t *cetus_monitor_new()
     cetus_monitor_t *monitor = g_new0(cetus_monitor_t, 1);
 
     monitor->db_passwd = g_string_new(0);
+    monitor->hashed_passwd = g_string_new(0);
     return monitor;
 }
 
@@ -482,6 +1094,7 @@ void cetus_monitor_free(cetus_monitor_t *monitor)
 {
     /* backend_conns should be freed in its own thread, not here */
     g_string_free(monitor->db_passwd, TRUE);
+    g_string_free(monitor->hashed_passwd, TRUE);
     g_list_free_full(monitor->registered_objects, g_free);
     if (monitor->config_id) g_free(monitor->config_id);
     g_free(monitor);
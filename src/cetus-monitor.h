@@ -28,6 +28,10 @@ void cetus_monitor_start_thread(cetus_monitor_t *, chassis *data);
 
 void cetus_monitor_stop_thread(cetus_monitor_t *);
 
+void cetus_monitor_start(cetus_monitor_t *, chassis *);
+
+void cetus_monitor_stop(cetus_monitor_t *);
+
 void cetus_monitor_register_object(cetus_monitor_t *,
                                     const char *, monitor_callback_fn, void *);
 
@@ -0,0 +1,399 @@
+#include "cetus-prepared-stmt.h"
+
+#include <mysql.h>
+
+#include "cetus-util.h"
+#include "glib-ext.h"
+
+struct stmt_registry_t {
+    GHashTable *stmts;          /* id -> prepared_stmt_t */
+    guint32 next_id;
+};
+
+static void
+prepared_stmt_free(prepared_stmt_t *stmt)
+{
+    g_string_free(stmt->db, TRUE);
+    g_string_free(stmt->sql, TRUE);
+    if (stmt->param_types) {
+        g_string_free(stmt->param_types, TRUE);
+    }
+    if (stmt->plugin_data && stmt->plugin_data_free) {
+        stmt->plugin_data_free(stmt->plugin_data);
+    }
+    g_free(stmt);
+}
+
+guint32
+stmt_payload_get_id(const GString *payload)
+{
+    const guchar *p = (const guchar *)payload->str + 1;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32)p[3] << 24);
+}
+
+void
+stmt_payload_set_id(GString *payload, guint32 stmt_id)
+{
+    guchar *p = (guchar *)payload->str + 1;
+    p[0] = stmt_id & 0xff;
+    p[1] = (stmt_id >> 8) & 0xff;
+    p[2] = (stmt_id >> 16) & 0xff;
+    p[3] = (stmt_id >> 24) & 0xff;
+}
+
+void
+prepared_stmt_bind_types(prepared_stmt_t *stmt, GString *payload)
+{
+    if (stmt->num_params == 0) {
+        return;
+    }
+
+    /* command, stmt id, flags, iteration count, null bitmap */
+    gsize bound_pos = 1 + 4 + 1 + 4 + (stmt->num_params + 7) / 8;
+    gsize types_len = 2 * stmt->num_params;
+    if (payload->len <= bound_pos) {
+        return;
+    }
+
+    if (payload->str[bound_pos]) {
+        if (payload->len < bound_pos + 1 + types_len) {
+            return;
+        }
+        if (stmt->param_types == NULL) {
+            stmt->param_types = g_string_sized_new(types_len);
+        }
+        g_string_assign_len(stmt->param_types, payload->str + bound_pos + 1, types_len);
+    } else if (stmt->param_types) {
+        payload->str[bound_pos] = 1;
+        g_string_insert_len(payload, bound_pos + 1, S(stmt->param_types));
+    }
+}
+
+static guint64
+get_le(const guchar *p, int n)
+{
+    guint64 v = 0;
+    int i;
+    for (i = n - 1; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/**
+ * where the value of a param starts and how long it is
+ *
+ * @return FALSE if it runs past end
+ */
+static gboolean
+param_value(guint8 type, const guchar **p, const guchar *end, gsize *len)
+{
+    switch (type) {
+    case MYSQL_TYPE_NULL:
+        *len = 0;
+        break;
+    case MYSQL_TYPE_TINY:
+        *len = 1;
+        break;
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_YEAR:
+        *len = 2;
+        break;
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_FLOAT:
+        *len = 4;
+        break;
+    case MYSQL_TYPE_LONGLONG:
+    case MYSQL_TYPE_DOUBLE:
+        *len = 8;
+        break;
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_DATETIME:
+    case MYSQL_TYPE_TIMESTAMP:
+    case MYSQL_TYPE_TIME:
+        if (*p >= end) {
+            return FALSE;
+        }
+        *len = **p;
+        (*p)++;
+        break;
+    default: {                  /* length encoded string */
+        if (*p >= end) {
+            return FALSE;
+        }
+        guint8 c = **p;
+        int n = c < 0xfb ? 0 : c == 0xfc ? 2 : c == 0xfd ? 3 : c == 0xfe ? 8 : -1;
+        if (n < 0 || end - *p < 1 + n) {
+            return FALSE;
+        }
+        *len = n ? get_le(*p + 1, n) : c;
+        *p += 1 + n;
+        break;
+    }
+    }
+    return *len <= end - *p;
+}
+
+gboolean
+prepared_stmt_get_param(const prepared_stmt_t *stmt, const GString *payload, guint index,
+                        gboolean *is_int, gint64 *num, GString *str)
+{
+    const guchar *p = (const guchar *)payload->str;
+    const guchar *end = p + payload->len;
+    guint n = stmt->num_params;
+    gsize bitmap_len = (n + 7) / 8;
+
+    /* command, stmt id, flags, iteration count */
+    if (index >= n || payload->len < 1 + 4 + 1 + 4 + bitmap_len + 1 + 2 * n) {
+        return FALSE;
+    }
+    const guchar *nulls = p + 1 + 4 + 1 + 4;
+    if (nulls[index / 8] & (1 << (index % 8)) || nulls[bitmap_len] == 0) {
+        return FALSE;
+    }
+    const guchar *types = nulls + bitmap_len + 1;
+    p = types + 2 * n;
+
+    guint i;
+    gsize len = 0;
+    for (i = 0; i <= index; i++) {
+        if (nulls[i / 8] & (1 << (i % 8))) {
+            continue;
+        }
+        if (!param_value(types[2 * i], &p, end, &len)) {
+            return FALSE;
+        }
+        if (i < index) {
+            p += len;
+        }
+    }
+
+    guint8 type = types[2 * index];
+    gboolean is_unsigned = types[2 * index + 1] & 0x80;
+    switch (type) {
+    case MYSQL_TYPE_TINY:
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_YEAR:
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_LONGLONG: {
+        guint64 v = get_le(p, len);
+        int bits = 8 * len;
+        if (!is_unsigned && bits < 64 && (v >> (bits - 1)) & 1) {
+            v |= ~G_GUINT64_CONSTANT(0) << bits;    /* sign extend */
+        }
+        *is_int = TRUE;
+        *num = (gint64)v;
+        return TRUE;
+    }
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_DATETIME:
+    case MYSQL_TYPE_TIMESTAMP:
+        if (len < 4) {          /* zero date */
+            return FALSE;
+        }
+        g_string_printf(str, "%04u-%02u-%02u", (guint)get_le(p, 2), p[2], p[3]);
+        if (len >= 7) {
+            g_string_append_printf(str, " %02u:%02u:%02u", p[4], p[5], p[6]);
+        }
+        *is_int = FALSE;
+        return TRUE;
+    case MYSQL_TYPE_NULL:
+    case MYSQL_TYPE_FLOAT:
+    case MYSQL_TYPE_DOUBLE:
+    case MYSQL_TYPE_TIME:
+        return FALSE;
+    default:
+        g_string_assign_len(str, (const char *)p, len);
+        *is_int = FALSE;
+        return TRUE;
+    }
+}
+
+stmt_registry_t *
+stmt_registry_new(void)
+{
+    stmt_registry_t *registry = g_new0(stmt_registry_t, 1);
+    registry->stmts = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, (GDestroyNotify)prepared_stmt_free);
+    registry->next_id = 1;
+    return registry;
+}
+
+void
+stmt_registry_free(stmt_registry_t *registry)
+{
+    if (registry == NULL) {
+        return;
+    }
+    g_hash_table_destroy(registry->stmts);
+    g_free(registry);
+}
+
+prepared_stmt_t *
+stmt_registry_add(stmt_registry_t *registry, const GString *db,
+                  const char *sql, gsize sql_len, guint16 num_params)
+{
+    prepared_stmt_t *stmt = g_new0(prepared_stmt_t, 1);
+
+    /* 0 is never a valid statement id */
+    do {
+        stmt->id = registry->next_id++;
+    } while (stmt->id == 0
+             || g_hash_table_lookup(registry->stmts, GUINT_TO_POINTER(stmt->id)));
+
+    stmt->db = g_string_new_len(db->str, db->len);
+    stmt->sql = g_string_new_len(sql, sql_len);
+    stmt->num_params = num_params;
+    g_hash_table_insert(registry->stmts, GUINT_TO_POINTER(stmt->id), stmt);
+    return stmt;
+}
+
+prepared_stmt_t *
+stmt_registry_get(stmt_registry_t *registry, guint32 id)
+{
+    return g_hash_table_lookup(registry->stmts, GUINT_TO_POINTER(id));
+}
+
+void
+stmt_registry_remove(stmt_registry_t *registry, guint32 id)
+{
+    g_hash_table_remove(registry->stmts, GUINT_TO_POINTER(id));
+}
+
+typedef struct server_stmt_t {
+    GString *key;               /* db '\0' sql */
+    guint32 id;
+    GList lru_link;
+} server_stmt_t;
+
+struct server_stmt_cache_t {
+    GHashTable *stmts;          /* key -> server_stmt_t */
+    GQueue lru;                 /* most recently used at the head */
+    GArray *evicted;            /* ids still open on the server */
+    GString *key;               /* scratch for lookups */
+    guint max_stmts;
+};
+
+static void
+server_stmt_free(server_stmt_t *stmt)
+{
+    g_string_free(stmt->key, TRUE);
+    g_free(stmt);
+}
+
+server_stmt_cache_t *
+server_stmt_cache_new(guint max_stmts)
+{
+    server_stmt_cache_t *cache = g_new0(server_stmt_cache_t, 1);
+    cache->stmts = g_hash_table_new((GHashFunc)g_string_hash, (GEqualFunc)g_string_equal);
+    g_queue_init(&cache->lru);
+    cache->evicted = g_array_new(FALSE, FALSE, sizeof(guint32));
+    cache->key = g_string_new(NULL);
+    cache->max_stmts = MAX(max_stmts, 1);
+    return cache;
+}
+
+void
+server_stmt_cache_clear(server_stmt_cache_t *cache)
+{
+    server_stmt_t *stmt;
+    while ((stmt = g_queue_peek_head(&cache->lru))) {
+        g_queue_unlink(&cache->lru, &stmt->lru_link);
+        server_stmt_free(stmt);
+    }
+    g_hash_table_remove_all(cache->stmts);
+    g_array_set_size(cache->evicted, 0);
+}
+
+void
+server_stmt_cache_free(server_stmt_cache_t *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    server_stmt_cache_clear(cache);
+    g_hash_table_destroy(cache->stmts);
+    g_array_free(cache->evicted, TRUE);
+    g_string_free(cache->key, TRUE);
+    g_free(cache);
+}
+
+static GString *
+make_key(GString *key, const GString *db, const GString *sql)
+{
+    g_string_truncate(key, 0);
+    g_string_append_len(key, db->str, db->len);
+    g_string_append_c(key, '\0');
+    g_string_append_len(key, sql->str, sql->len);
+    return key;
+}
+
+guint32
+server_stmt_cache_lookup(server_stmt_cache_t *cache, const GString *db, const GString *sql)
+{
+    server_stmt_t *stmt = g_hash_table_lookup(cache->stmts, make_key(cache->key, db, sql));
+    if (stmt == NULL) {
+        return 0;
+    }
+    g_queue_unlink(&cache->lru, &stmt->lru_link);
+    g_queue_push_head_link(&cache->lru, &stmt->lru_link);
+    return stmt->id;
+}
+
+static void
+server_stmt_cache_evict(server_stmt_cache_t *cache, server_stmt_t *stmt)
+{
+    g_array_append_val(cache->evicted, stmt->id);
+    g_hash_table_remove(cache->stmts, stmt->key);
+    g_queue_unlink(&cache->lru, &stmt->lru_link);
+    server_stmt_free(stmt);
+}
+
+void
+server_stmt_cache_insert(server_stmt_cache_t *cache, const GString *db,
+                         const GString *sql, guint32 server_stmt_id)
+{
+    server_stmt_t *stmt = g_hash_table_lookup(cache->stmts, make_key(cache->key, db, sql));
+    if (stmt) {
+        /* prepared twice, the older handle is not needed any more */
+        server_stmt_cache_evict(cache, stmt);
+    }
+
+    while (cache->lru.length >= cache->max_stmts) {
+        server_stmt_cache_evict(cache, g_queue_peek_tail(&cache->lru));
+    }
+
+    stmt = g_new0(server_stmt_t, 1);
+    stmt->key = g_string_new_len(cache->key->str, cache->key->len);
+    stmt->id = server_stmt_id;
+    stmt->lru_link.data = stmt;
+    g_hash_table_insert(cache->stmts, stmt->key, stmt);
+    g_queue_push_head_link(&cache->lru, &stmt->lru_link);
+}
+
+guint32
+server_stmt_cache_remove(server_stmt_cache_t *cache, const GString *db, const GString *sql)
+{
+    server_stmt_t *stmt = g_hash_table_lookup(cache->stmts, make_key(cache->key, db, sql));
+    if (stmt == NULL) {
+        return 0;
+    }
+    guint32 id = stmt->id;
+    g_hash_table_remove(cache->stmts, stmt->key);
+    g_queue_unlink(&cache->lru, &stmt->lru_link);
+    server_stmt_free(stmt);
+    return id;
+}
+
+guint32
+server_stmt_cache_pop_evicted(server_stmt_cache_t *cache)
+{
+    if (cache->evicted->len == 0) {
+        return 0;
+    }
+    guint32 id = g_array_index(cache->evicted, guint32, cache->evicted->len - 1);
+    g_array_set_size(cache->evicted, cache->evicted->len - 1);
+    return id;
+}
@@ -0,0 +1,96 @@
+#ifndef _CETUS_PREPARED_STMT_H_
+#define _CETUS_PREPARED_STMT_H_
+
+#include <glib.h>
+
+#include "network-exports.h"
+
+#define SERVER_STMT_CACHE_SIZE_DEFAULT 128
+
+/**
+ * a statement prepared by a client, kept by the proxy so that it can be
+ * prepared again on whichever server connection runs it
+ */
+typedef struct {
+    guint32 id;                 /* the id handed to the client */
+    GString *db;                /* default db when it was prepared */
+    GString *sql;
+    guint16 num_params;
+    unsigned int is_read:1;     /* may run on a read-only backend */
+    unsigned int long_data_sent:1;  /* the next execute has to follow the data */
+    unsigned int cursor_open:1;     /* the last execute opened a cursor on the server */
+    GString *param_types;       /* 2 bytes per param, from the last execute binding them */
+    gpointer plugin_data;       /* routing state of the plugin */
+    GDestroyNotify plugin_data_free;
+} prepared_stmt_t;
+
+/* statement id of a COM_STMT_* payload, right after the command */
+NETWORK_API guint32 stmt_payload_get_id(const GString *payload);
+NETWORK_API void stmt_payload_set_id(GString *payload, guint32 stmt_id);
+
+/**
+ * make an execute carry the param types, the server keeps those of the
+ * last execute of the handle, and that may have been another client's
+ */
+NETWORK_API void prepared_stmt_bind_types(prepared_stmt_t *, GString *payload);
+
+/**
+ * value of param index in the COM_STMT_EXECUTE payload, the types have to
+ * be bound. integers are put in num, dates and strings in str as text
+ *
+ * @return FALSE if it is NULL, a float or time, or the payload is short
+ */
+NETWORK_API gboolean prepared_stmt_get_param(const prepared_stmt_t *, const GString *payload,
+                                             guint index, gboolean *is_int,
+                                             gint64 *num, GString *str);
+
+/**
+ * the prepared statements of one client, ids are assigned by the proxy
+ */
+typedef struct stmt_registry_t stmt_registry_t;
+
+NETWORK_API stmt_registry_t *stmt_registry_new(void);
+NETWORK_API void stmt_registry_free(stmt_registry_t *);
+
+NETWORK_API prepared_stmt_t *stmt_registry_add(stmt_registry_t *, const GString *db,
+                                               const char *sql, gsize sql_len,
+                                               guint16 num_params);
+
+/* NULL if the client never prepared id or closed it */
+NETWORK_API prepared_stmt_t *stmt_registry_get(stmt_registry_t *, guint32 id);
+
+NETWORK_API void stmt_registry_remove(stmt_registry_t *, guint32 id);
+
+/**
+ * the statements prepared on one server connection, by db and sql
+ *
+ * at most max_stmts are kept, the least recently used one is evicted
+ * and its id queued until the caller sends the COM_STMT_CLOSE
+ */
+typedef struct server_stmt_cache_t server_stmt_cache_t;
+
+NETWORK_API server_stmt_cache_t *server_stmt_cache_new(guint max_stmts);
+NETWORK_API void server_stmt_cache_free(server_stmt_cache_t *);
+
+/* id of the statement on the server, 0 if not prepared there */
+NETWORK_API guint32 server_stmt_cache_lookup(server_stmt_cache_t *, const GString *db,
+                                             const GString *sql);
+
+NETWORK_API void server_stmt_cache_insert(server_stmt_cache_t *, const GString *db,
+                                          const GString *sql, guint32 server_stmt_id);
+
+/**
+ * forget the statement, the caller closes it on the server
+ *
+ * @return its id on the server, 0 if not prepared there
+ */
+NETWORK_API guint32 server_stmt_cache_remove(server_stmt_cache_t *, const GString *db,
+                                             const GString *sql);
+
+/* the server dropped all of them (COM_CHANGE_USER, COM_RESET_CONNECTION) */
+NETWORK_API void server_stmt_cache_clear(server_stmt_cache_t *);
+
+/* next evicted id to close on the server, 0 if none */
+NETWORK_API guint32 server_stmt_cache_pop_evicted(server_stmt_cache_t *);
+
+#endif /* _CETUS_PREPARED_STMT_H_ */
@@ -0,0 +1,258 @@
+#include "cetus-query-cache.h"
+
+#include <string.h>
+
+#include "glib-ext.h"
+
+/* write times kept per table, above that only one time for all tables */
+#define QUERY_CACHE_MAX_WRITTEN_TABLES 4096
+
+typedef struct query_cache_entry_t {
+    gchar *key;
+    GPtrArray *packets;         /* shared, see network_packet_share() */
+    gchar **tables;
+    gsize size;
+    guint64 expire_ms;
+    GList lru_link;
+} query_cache_entry_t;
+
+struct query_cache_t {
+    GHashTable *entries;        /* key -> query_cache_entry_t */
+    GQueue lru;                 /* most recently used at the head */
+    GHashTable *table_entries;  /* table -> set of query_cache_entry_t */
+    GHashTable *written_tables; /* table -> guint64 *, last write in ms */
+    guint64 all_written_ms;     /* last write to unknown tables */
+    gsize size;
+    gsize max_size;
+};
+
+static void
+query_cache_entry_free(query_cache_entry_t *entry)
+{
+    guint i;
+    for (i = 0; i < entry->packets->len; i++) {
+        network_packet_pool_put(g_ptr_array_index(entry->packets, i));
+    }
+    g_ptr_array_free(entry->packets, TRUE);
+    g_strfreev(entry->tables);
+    g_free(entry->key);
+    g_free(entry);
+}
+
+query_cache_t *
+query_cache_new(gsize max_size)
+{
+    query_cache_t *cache = g_new0(query_cache_t, 1);
+    cache->entries = g_hash_table_new(g_str_hash, g_str_equal);
+    g_queue_init(&cache->lru);
+    cache->table_entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, (GDestroyNotify)g_hash_table_destroy);
+    cache->written_tables = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    cache->max_size = max_size;
+    return cache;
+}
+
+static void
+query_cache_remove(query_cache_t *cache, query_cache_entry_t *entry)
+{
+    int i;
+    for (i = 0; entry->tables[i]; i++) {
+        GHashTable *set = g_hash_table_lookup(cache->table_entries, entry->tables[i]);
+        if (set) {
+            g_hash_table_remove(set, entry);
+            if (g_hash_table_size(set) == 0) {
+                g_hash_table_remove(cache->table_entries, entry->tables[i]);
+            }
+        }
+    }
+    g_hash_table_remove(cache->entries, entry->key);
+    g_queue_unlink(&cache->lru, &entry->lru_link);
+    cache->size -= entry->size;
+    query_cache_entry_free(entry);
+}
+
+void
+query_cache_free(query_cache_t *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    GList *l;
+    while ((l = cache->lru.tail)) {
+        query_cache_remove(cache, l->data);
+    }
+    g_hash_table_destroy(cache->entries);
+    g_hash_table_destroy(cache->table_entries);
+    g_hash_table_destroy(cache->written_tables);
+    g_free(cache);
+}
+
+/* drop the expired entries at the cold end */
+static void
+query_cache_purge(query_cache_t *cache, guint64 now_ms)
+{
+    GList *l;
+    while ((l = cache->lru.tail)) {
+        query_cache_entry_t *entry = l->data;
+        if (entry->expire_ms > now_ms) {
+            break;
+        }
+        query_cache_remove(cache, entry);
+    }
+}
+
+gboolean
+query_cache_lookup(query_cache_t *cache, const char *key, guint64 now_ms,
+                   network_queue *send_queue)
+{
+    query_cache_purge(cache, now_ms);
+
+    query_cache_entry_t *entry = g_hash_table_lookup(cache->entries, key);
+    if (entry == NULL) {
+        return FALSE;
+    }
+    if (entry->expire_ms <= now_ms) {
+        query_cache_remove(cache, entry);
+        return FALSE;
+    }
+
+    g_queue_unlink(&cache->lru, &entry->lru_link);
+    g_queue_push_head_link(&cache->lru, &entry->lru_link);
+
+    guint i;
+    for (i = 0; i < entry->packets->len; i++) {
+        GString *packet = g_ptr_array_index(entry->packets, i);
+        network_queue_append(send_queue, network_packet_ref(packet));
+    }
+    return TRUE;
+}
+
+static gboolean
+query_cache_written_since(query_cache_t *cache, GPtrArray *tables, guint64 req_ms)
+{
+    if (cache->all_written_ms >= req_ms) {
+        return TRUE;
+    }
+    guint i;
+    for (i = 0; i < tables->len; i++) {
+        guint64 *written_ms = g_hash_table_lookup(cache->written_tables,
+                                                  g_ptr_array_index(tables, i));
+        if (written_ms && *written_ms >= req_ms) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+gboolean
+query_cache_insert(query_cache_t *cache, const char *key, GPtrArray *tables,
+                   network_queue *packets, guint64 req_ms, guint64 expire_ms)
+{
+    if (tables->len == 0 || query_cache_written_since(cache, tables, req_ms)) {
+        return FALSE;
+    }
+
+    gsize size = sizeof(query_cache_entry_t) + strlen(key) + 1;
+    GList *l;
+    guint i;
+    for (l = packets->chunks->head; l; l = l->next) {
+        GString *packet = l->data;
+        size += sizeof(GString) + packet->allocated_len;
+    }
+    for (i = 0; i < tables->len; i++) {
+        size += strlen(g_ptr_array_index(tables, i)) + 1;
+    }
+    if (size > cache->max_size / 8) {
+        g_debug("%s: resultset too large for query cache:%d", G_STRLOC, (int)size);
+        return FALSE;
+    }
+
+    query_cache_entry_t *entry = g_hash_table_lookup(cache->entries, key);
+    if (entry) {
+        query_cache_remove(cache, entry);
+    }
+    while (cache->size + size > cache->max_size
+           && (l = cache->lru.tail)) {
+        query_cache_remove(cache, l->data);
+    }
+
+    entry = g_new0(query_cache_entry_t, 1);
+    entry->key = g_strdup(key);
+    entry->size = size;
+    entry->expire_ms = expire_ms;
+    entry->packets = g_ptr_array_sized_new(packets->chunks->length);
+    GString *packet;
+    while ((packet = g_queue_pop_head(packets->chunks))) {
+        g_ptr_array_add(entry->packets, network_packet_share(packet));
+    }
+    packets->len = packets->offset = 0;
+
+    entry->tables = g_new0(gchar *, tables->len + 1);
+    for (i = 0; i < tables->len; i++) {
+        const char *table = g_ptr_array_index(tables, i);
+        entry->tables[i] = g_strdup(table);
+        GHashTable *set = g_hash_table_lookup(cache->table_entries, table);
+        if (set == NULL) {
+            set = g_hash_table_new(g_direct_hash, g_direct_equal);
+            g_hash_table_insert(cache->table_entries, g_strdup(table), set);
+        }
+        g_hash_table_insert(set, entry, entry);
+    }
+
+    entry->lru_link.data = entry;
+    g_queue_push_head_link(&cache->lru, &entry->lru_link);
+    g_hash_table_insert(cache->entries, entry->key, entry);
+    cache->size += size;
+    return TRUE;
+}
+
+void
+query_cache_invalidate(query_cache_t *cache, const char *table, guint64 now_ms)
+{
+    guint64 *written_ms = g_hash_table_lookup(cache->written_tables, table);
+    if (written_ms) {
+        *written_ms = now_ms;
+    } else if (g_hash_table_size(cache->written_tables) < QUERY_CACHE_MAX_WRITTEN_TABLES) {
+        written_ms = g_new(guint64, 1);
+        *written_ms = now_ms;
+        g_hash_table_insert(cache->written_tables, g_strdup(table), written_ms);
+    } else {
+        g_hash_table_remove_all(cache->written_tables);
+        cache->all_written_ms = now_ms;
+    }
+
+    GHashTable *set = g_hash_table_lookup(cache->table_entries, table);
+    if (set == NULL) {
+        return;
+    }
+    /* the set goes away with its last entry */
+    GList *entries = g_hash_table_get_keys(set);
+    GList *l;
+    for (l = entries; l; l = l->next) {
+        query_cache_remove(cache, l->data);
+    }
+    g_list_free(entries);
+}
+
+void
+query_cache_invalidate_all(query_cache_t *cache, guint64 now_ms)
+{
+    GList *l;
+    while ((l = cache->lru.tail)) {
+        query_cache_remove(cache, l->data);
+    }
+    g_hash_table_remove_all(cache->written_tables);
+    cache->all_written_ms = now_ms;
+}
+
+gsize
+query_cache_size(query_cache_t *cache)
+{
+    return cache->size;
+}
+
+guint
+query_cache_count(query_cache_t *cache)
+{
+    return g_hash_table_size(cache->entries);
+}
@@ -0,0 +1,52 @@
+#ifndef _CETUS_QUERY_CACHE_H_
+#define _CETUS_QUERY_CACHE_H_
+
+#include <glib.h>
+
+#include "network-exports.h"
+#include "network-queue.h"
+
+#define QUERY_CACHE_MAX_SIZE_DEFAULT (64 * 1024 * 1024)
+
+/**
+ * resultsets of read queries, one cache per process
+ *
+ * entries are bounded by a memory budget and evicted in LRU order, the
+ * packets are shared with the send queues of the clients instead of
+ * being copied. writes invalidate the entries of the tables they touch,
+ * tables are named "db.table"
+ */
+typedef struct query_cache_t query_cache_t;
+
+NETWORK_API query_cache_t *query_cache_new(gsize max_size);
+NETWORK_API void query_cache_free(query_cache_t *);
+
+/**
+ * append the cached packets of key to send_queue
+ *
+ * @return FALSE if not cached or expired
+ */
+NETWORK_API gboolean query_cache_lookup(query_cache_t *, const char *key,
+                                        guint64 now_ms, network_queue *send_queue);
+
+/**
+ * cache the packets of a resultset, they are taken from the queue
+ *
+ * @param tables  tables the query reads
+ * @param req_ms  when the query was received, nothing is cached if one
+ *                of the tables was written since
+ * @return FALSE if not cached, the packets are left in the queue
+ */
+NETWORK_API gboolean query_cache_insert(query_cache_t *, const char *key, GPtrArray *tables,
+                                        network_queue *packets, guint64 req_ms,
+                                        guint64 expire_ms);
+
+NETWORK_API void query_cache_invalidate(query_cache_t *, const char *table, guint64 now_ms);
+
+NETWORK_API void query_cache_invalidate_all(query_cache_t *, guint64 now_ms);
+
+NETWORK_API gsize query_cache_size(query_cache_t *);
+
+NETWORK_API guint query_cache_count(query_cache_t *);
+
+#endif /* _CETUS_QUERY_CACHE_H_ */
@@ -0,0 +1,333 @@
+#include "chassis-latency.h"
+
+#include <string.h>
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static int
+bucket_index(uint64_t us)
+{
+    if (us < LATENCY_SUB_BUCKETS) {
+        return us;
+    }
+    int msb = 63 - __builtin_clzll(us);
+    if (msb >= LATENCY_MAX_BITS) {
+        return LATENCY_BUCKETS - 1;
+    }
+    int shift = msb - LATENCY_SUB_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS + ((us >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* the largest value counted in bucket i */
+static uint64_t
+bucket_high(int i)
+{
+    if (i < LATENCY_SUB_BUCKETS) {
+        return i;
+    }
+    int shift = i / LATENCY_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(LATENCY_SUB_BUCKETS + i % LATENCY_SUB_BUCKETS) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+void
+latency_hist_add(latency_hist_t *h, uint64_t us)
+{
+    h->count++;
+    h->sum_us += us;
+    h->buckets[bucket_index(us)]++;
+}
+
+void
+latency_hist_merge(latency_hist_t *h, const latency_hist_t *other)
+{
+    uint64_t *sum = (uint64_t *)h;
+    const uint64_t *w = (const uint64_t *)other;
+    size_t i;
+    for (i = 0; i < sizeof(latency_hist_t) / sizeof(uint64_t); i++) {
+        sum[i] += w[i];
+    }
+}
+
+uint64_t
+latency_hist_percentile(const latency_hist_t *h, double q)
+{
+    if (h->count == 0) {
+        return 0;
+    }
+
+    double r = q * h->count;
+    uint64_t rank = (uint64_t) r;
+    if (rank < r || rank == 0) {
+        rank++;
+    }
+
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            return bucket_high(i);
+        }
+    }
+    return bucket_high(LATENCY_BUCKETS - 1);
+}
+
+void
+latency_hist_append_prometheus(GString *out, const char *name, const char *labels,
+                               const latency_hist_t *h)
+{
+    static const char *quantiles[] = {"0.5", "0.99", "0.999"};
+    static const double q[] = {0.5, 0.99, 0.999};
+    const char *sep = labels ? "," : "";
+    int i;
+
+    labels = labels ? labels : "";
+    for (i = 0; i < G_N_ELEMENTS(q); i++) {
+        g_string_append_printf(out, "%s{%s%squantile=\"%s\"} ", name, labels, sep, quantiles[i]);
+        if (h->count == 0) {
+            g_string_append(out, "NaN\n");
+        } else {
+            g_string_append_printf(out, "%.6f\n", latency_hist_percentile(h, q[i]) / 1e6);
+        }
+    }
+
+    if (*labels) {
+        g_string_append_printf(out, "%s_sum{%s} %.6f\n", name, labels, h->sum_us / 1e6);
+        g_string_append_printf(out, "%s_count{%s} %" G_GUINT64_FORMAT "\n", name, labels, h->count);
+    } else {
+        g_string_append_printf(out, "%s_sum %.6f\n", name, h->sum_us / 1e6);
+        g_string_append_printf(out, "%s_count %" G_GUINT64_FORMAT "\n", name, h->count);
+    }
+}
+
+const char *
+latency_cmd_name(int cmd)
+{
+    static const char *names[] = {
+        "select", "insert", "update", "delete", "query", "prepare", "execute", "other"
+    };
+    if (cmd < 0 || cmd >= LATENCY_CMD_MAX) {
+        return "other";
+    }
+    return names[cmd];
+}
+
+typedef struct {
+    uint64_t hash;
+    char *text;
+    size_t text_len;
+    size_t n;
+    gboolean started;
+    gboolean space;     /* blanks since the last token */
+    gboolean comma;     /* a ',' after a literal, held back */
+    gboolean literal;   /* the last token is a literal */
+} fingerprint_t;
+
+static void
+fp_putc(fingerprint_t *f, char c)
+{
+    f->hash = (f->hash ^ (guchar) c) * FNV_PRIME;
+    if (f->n + 1 < f->text_len) {
+        f->text[f->n++] = c;
+    }
+}
+
+/* a token is next, FALSE if it is a literal folded into the previous one */
+static gboolean
+fp_token(fingerprint_t *f, gboolean literal)
+{
+    if (literal && f->literal && f->comma) {
+        f->comma = FALSE;
+        f->space = FALSE;
+        return FALSE;
+    }
+    if (f->comma) {
+        fp_putc(f, ',');
+        f->comma = FALSE;
+    }
+    if (f->space && f->started) {
+        fp_putc(f, ' ');
+    }
+    f->space = FALSE;
+    f->started = TRUE;
+    f->literal = literal;
+    return TRUE;
+}
+
+static gboolean
+is_word_char(char c)
+{
+    return g_ascii_isalnum(c) || c == '_' || c == '$' || (guchar) c >= 0x80;
+}
+
+/* past the closing quote of the string at p */
+static const char *
+skip_quoted(const char *p, const char *end)
+{
+    char quote = *p++;
+    while (p < end) {
+        if (*p == '\\' && quote != '`') {
+            p += 2;
+        } else if (*p == quote) {
+            if (p + 1 < end && p[1] == quote) {
+                p += 2;
+            } else {
+                return p + 1;
+            }
+        } else {
+            p++;
+        }
+    }
+    return end;
+}
+
+uint64_t
+latency_sql_fingerprint(const char *sql, size_t len, char *text, size_t text_len)
+{
+    fingerprint_t f = {FNV_OFFSET_BASIS, text, text_len, 0, FALSE, FALSE, FALSE, FALSE};
+    const char *p = sql;
+    const char *end = sql + MIN(len, LATENCY_SQL_SCAN_LEN);
+
+    while (p < end && *p != '\0') {
+        char c = *p;
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            f.space = TRUE;
+            p++;
+        } else if (c == '#' || (c == '-' && p + 2 < end && p[1] == '-'
+                                && (p[2] == ' ' || p[2] == '\t' || p[2] == '\n'))) {
+            const char *q = memchr(p, '\n', end - p);
+            p = q ? q + 1 : end;
+            f.space = TRUE;
+        } else if (c == '/' && p + 1 < end && p[1] == '*') {
+            const char *q = p + 2;
+            while (q + 1 < end && !(q[0] == '*' && q[1] == '/')) {
+                q++;
+            }
+            p = q + 2 < end ? q + 2 : end;
+            f.space = TRUE;
+        } else if (c == '\'' || c == '"') {
+            p = skip_quoted(p, end);
+            if (fp_token(&f, TRUE)) {
+                fp_putc(&f, '?');
+            }
+        } else if (c == '`') {
+            const char *q = skip_quoted(p, end);
+            fp_token(&f, FALSE);
+            for (; p < q; p++) {
+                fp_putc(&f, *p);
+            }
+        } else if (g_ascii_isdigit(c) || c == '?') {
+            for (p++; p < end && (is_word_char(*p) || *p == '.'); p++) {
+                if ((*p == 'e' || *p == 'E') && p + 1 < end && (p[1] == '+' || p[1] == '-')) {
+                    p++;
+                }
+            }
+            if (fp_token(&f, TRUE)) {
+                fp_putc(&f, '?');
+            }
+        } else if (is_word_char(c)) {
+            fp_token(&f, FALSE);
+            for (; p < end && is_word_char(*p); p++) {
+                fp_putc(&f, g_ascii_tolower(*p));
+            }
+        } else if (c == ',' && f.literal && !f.comma) {
+            f.comma = TRUE;
+            f.space = FALSE;
+            p++;
+        } else {
+            fp_token(&f, FALSE);
+            fp_putc(&f, c);
+            p++;
+        }
+    }
+    if (f.comma) {
+        fp_putc(&f, ',');
+    }
+    if (text_len > 0) {
+        text[f.n] = '\0';
+    }
+    return f.hash ? f.hash : 1;
+}
+
+static gboolean
+starts_with_word(const char *text, const char *word)
+{
+    size_t n = strlen(word);
+    return strncmp(text, word, n) == 0 && !is_word_char(text[n]);
+}
+
+latency_cmd_t
+latency_sql_cmd(const char *text)
+{
+    if (starts_with_word(text, "select")) {
+        return LATENCY_CMD_SELECT;
+    } else if (starts_with_word(text, "insert") || starts_with_word(text, "replace")) {
+        return LATENCY_CMD_INSERT;
+    } else if (starts_with_word(text, "update")) {
+        return LATENCY_CMD_UPDATE;
+    } else if (starts_with_word(text, "delete")) {
+        return LATENCY_CMD_DELETE;
+    }
+    return LATENCY_CMD_QUERY;
+}
+
+/* slot of hash, or the one with the least weight if there is none */
+static latency_sql_t *
+latency_sql_find(latency_sql_t *top, int n, uint64_t hash, gboolean *found)
+{
+    latency_sql_t *min = NULL;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (top[i].hash == hash) {
+            *found = TRUE;
+            return &top[i];
+        }
+        if (min == NULL || top[i].weight < min->weight) {
+            min = &top[i];
+        }
+    }
+    *found = FALSE;
+    return min;
+}
+
+void
+latency_sql_add(latency_sql_t *top, int n, uint64_t hash, const char *text, uint64_t us)
+{
+    gboolean found;
+    latency_sql_t *slot = latency_sql_find(top, n, hash, &found);
+
+    if (!found) {
+        uint64_t weight = slot->hash ? slot->weight : 0;
+        memset(slot, 0, sizeof(*slot));
+        slot->hash = hash;
+        slot->weight = weight;
+        g_strlcpy(slot->text, text, sizeof(slot->text));
+    }
+    slot->weight += us;
+    latency_hist_add(&slot->hist, us);
+}
+
+void
+latency_sql_merge(latency_sql_t *top, int n, const latency_sql_t *other)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        const latency_sql_t *o = &other[i];
+        if (o->hash == 0) {
+            continue;
+        }
+
+        gboolean found;
+        latency_sql_t *slot = latency_sql_find(top, n, o->hash, &found);
+        if (found) {
+            slot->weight += o->weight;
+            latency_hist_merge(&slot->hist, &o->hist);
+        } else if (slot->hash == 0 || slot->weight < o->weight) {
+            *slot = *o;
+        }
+    }
+}
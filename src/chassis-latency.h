@@ -0,0 +1,91 @@
+#ifndef _CHASSIS_LATENCY_H_
+#define _CHASSIS_LATENCY_H_
+
+#include <glib.h>
+#include <stdint.h>
+
+#include "chassis-exports.h"
+
+/**
+ * log-linear histogram of latencies in microseconds, HDR style: below
+ * 16us one bucket per microsecond, above it every power of 2 is split
+ * into 16 buckets, so a value is off by at most 1/16. up to 2^32us
+ * (71 minutes) is kept apart, anything slower goes to the last bucket
+ *
+ * only 64-bit counters, histograms are summed word by word
+ */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 32
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct latency_hist_t {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t buckets[LATENCY_BUCKETS];
+} latency_hist_t;
+
+CHASSIS_API void latency_hist_add(latency_hist_t *, uint64_t us);
+CHASSIS_API void latency_hist_merge(latency_hist_t *, const latency_hist_t *);
+
+/* the latency q (0..1) of the samples are within, 0 if there is none */
+CHASSIS_API uint64_t latency_hist_percentile(const latency_hist_t *, double q);
+
+/**
+ * the histogram as a prometheus summary: p50, p99, p999, _sum and _count
+ * in seconds. labels is like 'a="b",c="d"' or NULL
+ */
+CHASSIS_API void latency_hist_append_prometheus(GString *out, const char *name,
+                                                const char *labels, const latency_hist_t *);
+
+/* kinds of commands kept apart */
+typedef enum {
+    LATENCY_CMD_SELECT,
+    LATENCY_CMD_INSERT,
+    LATENCY_CMD_UPDATE,
+    LATENCY_CMD_DELETE,
+    LATENCY_CMD_QUERY,      /* any other COM_QUERY */
+    LATENCY_CMD_PREPARE,
+    LATENCY_CMD_EXECUTE,
+    LATENCY_CMD_OTHER,
+    LATENCY_CMD_MAX
+} latency_cmd_t;
+
+CHASSIS_API const char *latency_cmd_name(int cmd);
+
+#define LATENCY_TOP_SQL 32
+#define LATENCY_SQL_TEXT_LEN 128
+#define LATENCY_SQL_SCAN_LEN 4096   /* the rest of a longer statement is ignored */
+
+/**
+ * latencies of the statements with one fingerprint, the N of them with
+ * the most time spent are kept (space saving, a fingerprint taking a
+ * slot inherits the weight of the one evicted)
+ */
+typedef struct latency_sql_t {
+    uint64_t hash;                  /* 0 if the slot is free */
+    uint64_t weight;                /* time spent in us, overestimated */
+    char text[LATENCY_SQL_TEXT_LEN];
+    latency_hist_t hist;            /* since it took the slot */
+} latency_sql_t;
+
+/**
+ * fingerprint of a statement, literals and placeholders are turned to ?
+ * ("?, ?" to one), comments dropped, blanks squeezed and words lowercased.
+ * the beginning of it is written to text, NUL terminated
+ *
+ * @return its hash, never 0
+ */
+CHASSIS_API uint64_t latency_sql_fingerprint(const char *sql, size_t len,
+                                             char *text, size_t text_len);
+
+/* kind of a COM_QUERY by its fingerprint */
+CHASSIS_API latency_cmd_t latency_sql_cmd(const char *text);
+
+CHASSIS_API void latency_sql_add(latency_sql_t *top, int n, uint64_t hash,
+                                 const char *text, uint64_t us);
+
+/* fold the table of another worker into top */
+CHASSIS_API void latency_sql_merge(latency_sql_t *top, int n, const latency_sql_t *other);
+
+#endif /* _CHASSIS_LATENCY_H_ */
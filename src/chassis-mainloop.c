@@ -4,7 +4,9 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <sys/mman.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -28,6 +30,7 @@
 #include "chassis-event.h"
 #include "chassis-log.h"
 #include "chassis-timings.h"
+#include "chassis-workers.h"
 
 static volatile sig_atomic_t signal_shutdown;
 
@@ -88,23 +91,12 @@ chassis *chassis_new() {
     incremental_guid_init(&(chas->guid_state));
 
     chas->startup_time = time(0);
+    chas->worker_processes = 1;
+    chas->worker_no = -1;
 
     return chas;
 }
 
-static void g_queue_free_cache_index(gpointer q) {
-    GQueue *queue = q;
-
-    query_cache_index_item *index;
-
-    while ((index = g_queue_pop_head(queue))) {
-        g_free(index->key);
-        g_free(index);
-    }
-
-    g_queue_free(queue);
-}
-
 /**
  * free the global scope
  *
@@ -150,8 +142,10 @@ void chassis_free(chassis *chas) {
     if (chas->default_db) g_free(chas->default_db);
     if (chas->default_username) g_free(chas->default_username);
     if (chas->default_hashed_pwd) g_free(chas->default_hashed_pwd);
-    if (chas->query_cache_table) g_hash_table_destroy(chas->query_cache_table);
-    if (chas->cache_index) g_queue_free_cache_index(chas->cache_index);
+    if (chas->worker_stats) {
+        munmap(chas->worker_stats, sizeof(chassis_worker_stats_t)
+                + chas->worker_processes * sizeof(query_stats_t));
+    }
 
     g_free(chas->event_hdr_version);
 
@@ -192,6 +186,129 @@ gboolean chassis_is_shutdown() {
     return signal_shutdown == 1;
 }
 
+/**
+ * map the stats slots of all workers, must be called before the fork
+ */
+int chassis_worker_stats_init(chassis *chas) {
+    size_t len = sizeof(chassis_worker_stats_t)
+        + chas->worker_processes * sizeof(query_stats_t);
+
+    void *p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        g_critical("%s: mmap(%zu) for worker stats failed: %s (%d)",
+                G_STRLOC, len, g_strerror(errno), errno);
+        return -1;
+    }
+    memset(p, 0, len);
+    chas->worker_stats = p;
+    return 0;
+}
+
+/**
+ * called in the forked worker before the mainloop starts
+ */
+void chassis_set_worker(chassis *chas, int worker_no) {
+    chas->worker_no = worker_no;
+
+    /* the workers must not share the random sequence of the parent,
+     * dist_tran_id and the guids are derived from it */
+    g_random_set_seed(getpid() ^ (guint32) time(0));
+
+    chas->guid_state.worker_id = (chas->guid_state.worker_id + worker_no) & 0x3f;
+    incremental_guid_init(&(chas->guid_state));
+
+    g_message("%s: worker %d of %d started, pid:%d, guid worker id:%d", G_STRLOC,
+            worker_no, chas->worker_processes, getpid(), chas->guid_state.worker_id);
+}
+
+static void
+worker_stats_publish(int G_GNUC_UNUSED fd, short G_GNUC_UNUSED what, void *arg)
+{
+    chassis *chas = arg;
+    chassis_worker_stats_t *ws = chas->worker_stats;
+
+    guint64 gen = ws->reset_gen;
+    if (gen != chas->stats_reset_gen) {
+        memset(&chas->query_stats, 0, sizeof(chas->query_stats));
+        chas->stats_reset_gen = gen;
+    }
+    ws->slots[chas->worker_no] = chas->query_stats;
+    if (chas->priv_worker_sync) chas->priv_worker_sync(chas, chas->priv);
+
+    static struct timeval one_sec = {1, 0};
+    /* EV_PERSIST not work for libevent1.4, re-activate timer each time */
+    chassis_event_add_with_timeout(chas, &chas->worker_stats_timer, &one_sec);
+}
+
+/* a process without client events still has to pass quiescent points */
+static void
+quiescent_announce(int G_GNUC_UNUSED fd, short G_GNUC_UNUSED what, void *arg)
+{
+    chassis *chas = arg;
+
+    if (chas->priv_quiescent) chas->priv_quiescent(chas, chas->priv);
+
+    static struct timeval one_sec = {1, 0};
+    /* EV_PERSIST not work for libevent1.4, re-activate timer each time */
+    chassis_event_add_with_timeout(chas, &chas->quiescent_timer, &one_sec);
+}
+
+/**
+ * get the query stats of this process, summed over all workers if any
+ *
+ * the other workers' part is at most one second old
+ */
+void chassis_query_stats_get(chassis *chas, query_stats_t *stats) {
+    *stats = chas->query_stats;
+    if (!chas->worker_stats) {
+        return;
+    }
+
+    guint64 *sum = (guint64 *)stats;
+    const size_t nwords = offsetof(query_stats_t, latency_sql) / sizeof(guint64);
+    int i;
+    size_t j;
+    for (i = 0; i < chas->worker_processes; i++) {
+        if (i == chas->worker_no) {
+            continue;
+        }
+        const guint64 *w = (const guint64 *)&(chas->worker_stats->slots[i]);
+        for (j = 0; j < nwords; j++) {
+            sum[j] += w[j];
+        }
+        latency_sql_merge(stats->latency_sql, LATENCY_TOP_SQL,
+                chas->worker_stats->slots[i].latency_sql);
+    }
+}
+
+guint64 chassis_query_stats_counter(chassis *chas, size_t offset) {
+    guint64 sum = *(const guint64 *)((const char *)&chas->query_stats + offset);
+    if (!chas->worker_stats) {
+        return sum;
+    }
+
+    int i;
+    for (i = 0; i < chas->worker_processes; i++) {
+        if (i == chas->worker_no) {
+            continue;
+        }
+        sum += *(const guint64 *)((const char *)&(chas->worker_stats->slots[i]) + offset);
+    }
+    return sum;
+}
+
+/**
+ * reset the query stats, other workers pick it up on their next publish
+ */
+void chassis_query_stats_reset(chassis *chas) {
+    memset(&chas->query_stats, 0, sizeof(chas->query_stats));
+    if (chas->worker_stats) {
+        memset(chas->worker_stats->slots, 0,
+                chas->worker_processes * sizeof(query_stats_t));
+        chas->stats_reset_gen = __sync_add_and_fetch(&chas->worker_stats->reset_gen, 1);
+    }
+}
+
 static void
 sigterm_handler(int G_GNUC_UNUSED fd, short G_GNUC_UNUSED event_type,
         void G_GNUC_UNUSED *_data)
@@ -212,6 +329,10 @@ sighup_handler(int G_GNUC_UNUSED fd, short G_GNUC_UNUSED event_type,
 
     /* ... and this into the new one */
     g_message("re-opened log file after SIGHUP");
+
+    if (chassis_is_master(chas)) {
+        chassis_workers_signal(chas, SIGHUP);
+    }
 }
 
 
@@ -231,6 +352,20 @@ static void event_log_use_glib(int libevent_log_level, const char *msg) {
     g_log(G_LOG_DOMAIN, glib_log_level, "(libevent) %s", msg);
 }
 
+static void chassis_dist_tran_init(chassis *chas) {
+    chas->dist_tran_id = g_random_int_range(0, 100000000);
+    int srv_id = g_random_int_range(0, 10000);
+    if (chas->proxy_address) {
+        snprintf(chas->dist_tran_prefix, MAX_DIST_TRAN_PREFIX, 
+                "clt-%s-%d", chas->proxy_address, srv_id);
+    } else {
+        snprintf(chas->dist_tran_prefix, MAX_DIST_TRAN_PREFIX,
+                "clt-%d", srv_id);
+    }
+    g_message("Initial dist_tran_id:%llu", chas->dist_tran_id);
+    g_message("dist_tran_prefix:%s", chas->dist_tran_prefix);
+}
+
 int chassis_mainloop(void *_chas) {
     chassis *chas = _chas;
     guint i;
@@ -258,17 +393,7 @@ int chassis_mainloop(void *_chas) {
         }
     }
 
-    chas->dist_tran_id = g_random_int_range(0, 100000000);
-    int srv_id = g_random_int_range(0, 10000);
-    if (chas->proxy_address) {
-        snprintf(chas->dist_tran_prefix, MAX_DIST_TRAN_PREFIX, 
-                "clt-%s-%d", chas->proxy_address, srv_id);
-    } else {
-        snprintf(chas->dist_tran_prefix, MAX_DIST_TRAN_PREFIX,
-                "clt-%d", srv_id);
-    }
-    g_message("Initial dist_tran_id:%llu", chas->dist_tran_id);
-    g_message("dist_tran_prefix:%s", chas->dist_tran_prefix);
+    chassis_dist_tran_init(chas);
 
     /*
      * drop root privileges if requested
@@ -337,11 +462,53 @@ int chassis_mainloop(void *_chas) {
     }
 #endif
 
+    if (chas->worker_processes > 1) {
+        if (chas->priv_master_init) chas->priv_master_init(chas, chas->priv);
+
+        int ret = chassis_workers_run(chas);
+        if (ret != 0) {
+            /* we are the master and all workers are gone */
+            signal_del(&ev_sigterm);
+            signal_del(&ev_sigint);
+#ifdef SIGHUP
+            signal_del(&ev_sighup);
+#endif
+            return ret > 0 ? 0 : -1;
+        }
+
+        /* a forked worker, it takes over the listen sockets and the pools */
+        chassis_dist_tran_init(chas);
+        if (chas->priv_worker_init) chas->priv_worker_init(chas, chas->priv);
+
+        for (i = 0; i < chas->modules->len; i++) {
+            chassis_plugin *p = chas->modules->pdata[i];
+
+            if (p->start_worker && 0 != p->start_worker(chas, p->config)) {
+                g_critical("%s: starting worker of plugin %s failed",
+                        G_STRLOC, p->name);
+                return -1;
+            }
+        }
+    }
+
+    struct timeval one_sec = {1, 0};
+    if (chassis_is_worker(chas)) {
+        evtimer_set(&chas->worker_stats_timer, worker_stats_publish, chas);
+        chassis_event_add_with_timeout(chas, &chas->worker_stats_timer, &one_sec);
+    }
+    evtimer_set(&chas->quiescent_timer, quiescent_announce, chas);
+    chassis_event_add_with_timeout(chas, &chas->quiescent_timer, &one_sec);
+
     /**
      * block until we are asked to shutdown
      */
     chassis_event_loop(mainloop);
 
+    if (chassis_is_worker(chas)) {
+        evtimer_del(&chas->worker_stats_timer);
+    }
+    evtimer_del(&chas->quiescent_timer);
+
     signal_del(&ev_sigterm);
     signal_del(&ev_sigint);
 #ifdef SIGHUP
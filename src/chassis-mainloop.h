@@ -21,6 +21,7 @@
 #include "chassis-shutdown-hooks.h"
 #include "cetus-util.h"
 #include "chassis-config.h"
+#include "chassis-latency.h"
 
 /** @defgroup chassis Chassis
  *
@@ -35,18 +36,19 @@ typedef struct chassis chassis;
 #define MAX_QUERY_TIME 1000
 #define MAX_WAIT_TIME 1024
 #define MAX_DIST_TRAN_PREFIX 32
+#define MAX_WORKER_PROCESSES 64
+#define MAX_BACKEND_ADDR_LEN 128
 
 #define MAX_ALLOWED_PACKET_CEIL    (1 * GB)
 #define MAX_ALLOWED_PACKET_DEFAULT (32 * MB)
 #define MAX_ALLOWED_PACKET_FLOOR   (1 * KB)
 
+/* sql plan cache entry, keyed by the fingerprint of the statement */
 typedef struct cached_sql_info_t {
     time_t     last_visit_time;
     int        visited_cnt;
-    int        parsed_txLevel;
-    int        parsed_rv;
-    int        parsed_join_op_unsupported;
-    GPtrArray *groups;
+    struct sql_template_t *tmpl;   /* NULL if the statement can't be re-bound */
+    GList      lru;                /* in the lru list of the cache, data is the key */
 } cached_sql_info_t;
 
 typedef struct rw_op_t {
@@ -54,6 +56,10 @@ typedef struct rw_op_t {
     uint64_t rw;
 } rw_op_t;
 
+/**
+ * only 64-bit counters here, workers' stats are summed word by word,
+ * except for latency_sql which is merged by fingerprint
+ */
 typedef struct query_stats_t {
     rw_op_t client_query;
     rw_op_t proxyed_query;
@@ -71,8 +77,31 @@ typedef struct query_stats_t {
     uint64_t com_select_global;
     uint64_t com_select_bad_key;
     uint64_t xa_count;
+    latency_hist_t latency_total;   /* from the request read to the response sent */
+    latency_hist_t latency_proxy;   /* the part of it no backend is working */
+    latency_hist_t latency_cmd[LATENCY_CMD_MAX];
+    latency_hist_t latency_backend[MAX_SERVER_NUM];
+    latency_sql_t latency_sql[LATENCY_TOP_SQL];     /* has to be the last */
 } query_stats_t;
 
+/* connections of one worker, for "show status" in the master */
+typedef struct worker_conns_t {
+    volatile int clients;
+    volatile int idle_backend_conns;
+    volatile int used_backend_conns;
+} worker_conns_t;
+
+/* state of all worker processes, mapped shared before fork() */
+typedef struct chassis_worker_stats_t {
+    volatile guint64 reset_gen; /* bumped by every "stats reset" */
+    /* address of the backend in each per-backend slot, written by the master only */
+    char backend_addrs[MAX_SERVER_NUM][MAX_BACKEND_ADDR_LEN];
+    /* open connections of each worker to each backend, the pools share one budget */
+    volatile int backend_conns[MAX_WORKER_PROCESSES][MAX_SERVER_NUM];
+    worker_conns_t conns[MAX_WORKER_PROCESSES];
+    query_stats_t slots[];      /* one slot per worker, published every second */
+} chassis_worker_stats_t;
+
 /* For generating unique global ids for MySQL */
 struct incremental_guid_state_t {
     unsigned int last_sec;
@@ -113,10 +142,16 @@ struct chassis {
     unsigned int disable_threads;
     unsigned int is_tcp_stream_enabled;
     unsigned int query_cache_enabled;
+    unsigned int sql_prescan_disabled;
+    unsigned int ps_multiplexing_enabled;
     unsigned int is_back_compressed;
     unsigned int compress_support;
+    int compress_level;      /* zlib level of the compressed protocol */
+    int zstd_compress_level; /* requested from backends speaking zstd */
+    int compress_min_len;    /* smaller packets are sent uncompressed */
     unsigned int client_found_rows;
     unsigned int master_preferred;
+    int read_balance_algo; /* backend_algo_t */
     unsigned int is_reduce_conns;
     unsigned int xa_log_detailed;
     unsigned int is_reset_conn_enabled;
@@ -124,17 +159,23 @@ struct chassis {
     unsigned int check_slave_delay;
     int complement_conn_cnt;
     int default_query_cache_timeout;
+    int query_cache_max_size;
+    int max_server_prepared_stmts;
     double slave_delay_down_threshold_sec;
     double slave_delay_recover_threshold_sec;
     unsigned int long_query_time;
     unsigned int min_req_time_for_cache;
     int cetus_max_allowed_packet;
     int disable_dns_cache;
+    int zerocopy_threshold;
 
     int max_resp_len;
     int merged_output_size;
     int max_header_size;
     int compressed_merged_output_size;
+    int stream_high_watermark;
+    int stream_low_watermark;
+    int merge_read_watermark;
 
     /* Conn-pool initialize settings */
     int max_idle_connections;
@@ -148,6 +189,13 @@ struct chassis {
     void (*priv_shutdown)(chassis *chas, chassis_private *priv);
     void (*priv_finally_free_shared)(chassis *chas, chassis_private *priv);
     void (*priv_free)(chassis *chas, chassis_private *priv);
+    /* publish per-worker state into worker_stats, called once a second */
+    void (*priv_worker_sync)(chassis *chas, chassis_private *priv);
+    /* multi-process mode, before the workers are forked and in each forked worker */
+    void (*priv_master_init)(chassis *chas, chassis_private *priv);
+    void (*priv_worker_init)(chassis *chas, chassis_private *priv);
+    /* called from a timer, the event loop holds no state of a previous event then */
+    void (*priv_quiescent)(chassis *chas, chassis_private *priv);
 
     chassis_log *log;
 
@@ -155,16 +203,26 @@ struct chassis {
 
     query_stats_t query_stats;
 
+    /* multi-process mode, worker_processes > 1 */
+    int worker_processes;
+    int worker_no;          /* -1 in the master */
+    guint64 stats_reset_gen;
+    chassis_worker_stats_t *worker_stats;
+    struct event worker_stats_timer;
+    struct event quiescent_timer;
+
     struct incremental_guid_state_t guid_state;
     time_t startup_time;
     struct chassis_options_t *options;
     chassis_config_t *config_manager;
-    GHashTable *query_cache_table;
-    GQueue *cache_index;
-    unsigned long long last_cache_purge_time;
+    struct query_cache_t *query_cache;
     gboolean allow_new_conns;
 };
 
+/* multi-process mode: the master runs the admin and the monitor, the workers the clients */
+#define chassis_is_master(chas) ((chas)->worker_processes > 1 && (chas)->worker_no < 0)
+#define chassis_is_worker(chas) ((chas)->worker_processes > 1 && (chas)->worker_no >= 0)
+
 CHASSIS_API chassis *chassis_new(void);
 CHASSIS_API void chassis_free(chassis *chas);
 CHASSIS_API int chassis_check_version(const char *lib_version, const char *hdr_version);
@@ -175,6 +233,13 @@ CHASSIS_API int chassis_check_version(const char *lib_version, const char *hdr_v
  */
 CHASSIS_API int chassis_mainloop(void *user_data);
 
+CHASSIS_API int chassis_worker_stats_init(chassis *chas);
+CHASSIS_API void chassis_set_worker(chassis *chas, int worker_no);
+CHASSIS_API void chassis_query_stats_get(chassis *chas, query_stats_t *stats);
+/* one counter of query_stats_t at offset, summed like chassis_query_stats_get() */
+CHASSIS_API guint64 chassis_query_stats_counter(chassis *chas, size_t offset);
+CHASSIS_API void chassis_query_stats_reset(chassis *chas);
+
 CHASSIS_API void chassis_set_shutdown_location(const gchar *location);
 CHASSIS_API gboolean chassis_is_shutdown(void);
 
@@ -61,6 +61,9 @@ typedef struct chassis_plugin {
     /**< handler function to set the argument values in the plugin's config */
     int (*apply_config)(chassis *chas, chassis_plugin_config *user_data);
 
+    /**< handler function called in each forked worker, multi-process mode only */
+    int (*start_worker)(chassis *chas, chassis_plugin_config *user_data);
+
     /**< handler function to retrieve the plugin's global state */
     void *(*get_global_state)(chassis_plugin_config *user_data, const char *member);
 
@@ -0,0 +1,539 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "glib-ext.h"
+#include "chassis-event.h"
+#include "chassis-workers.h"
+
+#define WORKER_REPLY_TIMEOUT 3000   /* ms, for all workers to answer */
+#define WORKER_SEND_TIMEOUT 100     /* ms, for a message nobody waits for */
+#define WORKER_RESTART_DELAY 2      /* seconds, don't loop if a worker keeps crashing */
+
+typedef struct worker_msg_header_t {
+    guint32 type;
+    guint32 seq;        /* 0 if no reply is expected */
+    guint32 len;        /* of the data that follows */
+} worker_msg_header_t;
+
+/* a worker as seen by the master */
+typedef struct worker_t {
+    pid_t pid;          /* -1 if not running */
+    int fd;             /* master end of the channel */
+    time_t start_at;    /* when to (re)start it */
+    GString *recv_buf;
+    GString *send_buf;  /* not sent yet, always ends at a message boundary */
+} worker_t;
+
+static worker_t *workers;
+static int nworkers;
+static guint32 last_seq;
+static gboolean workers_stopping;
+
+static struct event ev_sigchld, ev_sigusr1, ev_sigusr2;
+
+static struct {
+    worker_msg_handler_fn func;
+    void *arg;
+} handlers[WORKER_MSG_MAX];
+
+/* the channel as seen by a worker */
+static int channel_fd = -1;
+static struct event channel_read_event;
+static struct event channel_write_event;
+static GString *channel_recv_buf;
+static GString *channel_send_buf;
+
+void chassis_workers_set_handler(int type, worker_msg_handler_fn func, void *arg)
+{
+    g_assert(type > 0 && type < WORKER_MSG_MAX);
+    handlers[type].func = func;
+    handlers[type].arg = arg;
+}
+
+static void
+msg_append(GString *buf, int type, guint32 seq, const char *data, gsize len)
+{
+    worker_msg_header_t hdr = {type, seq, len};
+    g_string_append_len(buf, (const char *)&hdr, sizeof(hdr));
+    g_string_append_len(buf, data, len);
+}
+
+/**
+ * take the first complete message off buf
+ *
+ * @return FALSE if there isn't one yet
+ */
+static gboolean
+msg_peek(GString *buf, worker_msg_header_t *hdr)
+{
+    if (buf->len < sizeof(*hdr)) {
+        return FALSE;
+    }
+    memcpy(hdr, buf->str, sizeof(*hdr));
+    return buf->len - sizeof(*hdr) >= hdr->len;
+}
+
+static void
+msg_consume(GString *buf, const worker_msg_header_t *hdr)
+{
+    g_string_erase(buf, 0, sizeof(*hdr) + hdr->len);
+}
+
+/**
+ * read what is available on a non-blocking fd
+ *
+ * @return -1 on EOF or error, 0 otherwise
+ */
+static int
+channel_read(int fd, GString *buf)
+{
+    char chunk[16 * 1024];
+
+    for (;;) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n > 0) {
+            g_string_append_len(buf, chunk, n);
+        } else if (n == 0) {
+            return -1;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else {
+            g_critical("%s: read() from worker channel failed: %s (%d)",
+                    G_STRLOC, g_strerror(errno), errno);
+            return -1;
+        }
+    }
+}
+
+/**
+ * write as much of buf as the channel takes until the deadline
+ *
+ * @return -1 on error, 0 otherwise, the rest is left in buf
+ */
+static int
+channel_flush(int fd, GString *buf, gint64 deadline)
+{
+    while (buf->len > 0) {
+        ssize_t n = write(fd, buf->str, buf->len);
+        if (n > 0) {
+            g_string_erase(buf, 0, n);
+            continue;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            g_critical("%s: write() to worker channel failed: %s (%d)",
+                    G_STRLOC, g_strerror(errno), errno);
+            return -1;
+        }
+
+        int wait_ms = (deadline - g_get_monotonic_time()) / 1000;
+        if (wait_ms <= 0) {
+            return 0;
+        }
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        poll(&pfd, 1, wait_ms);
+    }
+    return 0;
+}
+
+static void
+worker_send(worker_t *w, int type, guint32 seq, const char *data, gsize len, gint64 deadline)
+{
+    /* the rest of an earlier message goes first */
+    channel_flush(w->fd, w->send_buf, deadline);
+    msg_append(w->send_buf, type, seq, data, len);
+    channel_flush(w->fd, w->send_buf, deadline);
+}
+
+void chassis_workers_signal(chassis G_GNUC_UNUSED *chas, int sig)
+{
+    int i;
+
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].pid > 0) kill(workers[i].pid, sig);
+    }
+}
+
+void chassis_workers_broadcast(chassis G_GNUC_UNUSED *chas, int type, const char *data, gsize len)
+{
+    gint64 deadline = g_get_monotonic_time() + WORKER_SEND_TIMEOUT * 1000;
+    int i;
+
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].pid > 0 && workers[i].fd >= 0) {
+            worker_send(&workers[i], type, 0, data, len, deadline);
+        }
+    }
+}
+
+int chassis_workers_request(chassis G_GNUC_UNUSED *chas, int type, const char *data, gsize len,
+                            GString **replies)
+{
+    gint64 deadline = g_get_monotonic_time() + WORKER_REPLY_TIMEOUT * 1000;
+    struct pollfd pfds[MAX_WORKER_PROCESSES];
+    int ndx[MAX_WORKER_PROCESSES];
+    int i, pending = 0;
+
+    if (++last_seq == 0) {
+        ++last_seq;
+    }
+    guint32 seq = last_seq;
+
+    for (i = 0; i < nworkers; i++) {
+        replies[i] = NULL;
+        /* one whose channel is closed is exiting, a restart gets the change anyway */
+        if (workers[i].pid > 0 && workers[i].fd >= 0) {
+            worker_send(&workers[i], type, seq, data, len, deadline);
+            pending++;
+        }
+    }
+
+    while (pending > 0) {
+        int n = 0;
+        for (i = 0; i < nworkers; i++) {
+            if (workers[i].pid > 0 && workers[i].fd >= 0 && replies[i] == NULL) {
+                pfds[n].fd = workers[i].fd;
+                pfds[n].events = POLLIN;
+                pfds[n].revents = 0;
+                ndx[n++] = i;
+            }
+        }
+        int wait_ms = (deadline - g_get_monotonic_time()) / 1000;
+        if (n == 0 || wait_ms <= 0) {
+            break;
+        }
+        if (poll(pfds, n, wait_ms) < 0 && errno != EINTR) {
+            g_critical("%s: poll() failed: %s (%d)", G_STRLOC, g_strerror(errno), errno);
+            break;
+        }
+
+        int j;
+        for (j = 0; j < n; j++) {
+            if (pfds[j].revents == 0) {
+                continue;
+            }
+            worker_t *w = &workers[ndx[j]];
+            if (channel_read(w->fd, w->recv_buf) != 0) {
+                /* it is dying, reaped in the loop */
+                close(w->fd);
+                w->fd = -1;
+            }
+
+            worker_msg_header_t hdr;
+            while (msg_peek(w->recv_buf, &hdr)) {
+                /* replies to requests that timed out are dropped */
+                if (hdr.seq == seq && replies[ndx[j]] == NULL) {
+                    replies[ndx[j]] = g_string_new_len(w->recv_buf->str + sizeof(hdr), hdr.len);
+                    pending--;
+                }
+                msg_consume(w->recv_buf, &hdr);
+            }
+        }
+    }
+
+    if (pending > 0) {
+        g_warning("%s: %d worker(s) didn't answer request type %d", G_STRLOC, pending, type);
+    }
+    return pending;
+}
+
+static void
+channel_write_ready(int G_GNUC_UNUSED fd, short G_GNUC_UNUSED what, void *arg)
+{
+    chassis *chas = arg;
+
+    if (channel_flush(channel_fd, channel_send_buf, 0) != 0) {
+        return;
+    }
+    if (channel_send_buf->len > 0) {
+        chassis_event_add(chas, &channel_write_event);
+    }
+}
+
+static void
+channel_read_ready(int G_GNUC_UNUSED fd, short G_GNUC_UNUSED what, void *arg)
+{
+    chassis *chas = arg;
+
+    if (channel_read(channel_fd, channel_recv_buf) != 0) {
+        g_message("%s: master is gone, worker %d stopping", G_STRLOC, chas->worker_no);
+        event_del(&channel_read_event);
+        chassis_set_shutdown_location(G_STRLOC);
+        return;
+    }
+
+    gboolean replied = FALSE;
+    worker_msg_header_t hdr;
+    while (msg_peek(channel_recv_buf, &hdr)) {
+        const char *data = channel_recv_buf->str + sizeof(hdr);
+        GString *reply = g_string_new(NULL);
+
+        if (hdr.type > 0 && hdr.type < WORKER_MSG_MAX && handlers[hdr.type].func) {
+            handlers[hdr.type].func(chas, data, hdr.len, reply, handlers[hdr.type].arg);
+        } else {
+            g_warning("%s: no handler for message type %u", G_STRLOC, hdr.type);
+        }
+        if (hdr.seq != 0) {
+            msg_append(channel_send_buf, hdr.type, hdr.seq, S(reply));
+            replied = TRUE;
+        }
+        g_string_free(reply, TRUE);
+        msg_consume(channel_recv_buf, &hdr);
+    }
+
+    if (replied && !event_pending(&channel_write_event, EV_WRITE, NULL)) {
+        channel_write_ready(channel_fd, EV_WRITE, chas);
+    }
+}
+
+/**
+ * called in the forked worker, the master's state is dropped
+ */
+static void
+worker_init(chassis *chas, int worker_no, int fd)
+{
+    int i;
+
+    if (event_reinit(chas->event_base) != 0) {
+        g_critical("%s: event_reinit() failed", G_STRLOC);
+    }
+    signal_del(&ev_sigchld);
+    signal_del(&ev_sigusr1);
+    signal_del(&ev_sigusr2);
+
+    for (i = 0; i < nworkers; i++) {
+        if (workers[i].fd >= 0) close(workers[i].fd);
+        g_string_free(workers[i].recv_buf, TRUE);
+        g_string_free(workers[i].send_buf, TRUE);
+    }
+    g_free(workers);
+    workers = NULL;
+    nworkers = 0;
+
+    chassis_set_worker(chas, worker_no);
+
+    channel_fd = fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    channel_recv_buf = g_string_new(NULL);
+    channel_send_buf = g_string_new(NULL);
+
+    event_set(&channel_read_event, fd, EV_READ|EV_PERSIST, channel_read_ready, chas);
+    chassis_event_add(chas, &channel_read_event);
+    event_set(&channel_write_event, fd, EV_WRITE, channel_write_ready, chas);
+    event_base_set(chas->event_base, &channel_write_event);
+}
+
+/**
+ * @return 0 in the worker, its pid in the master, -1 on error
+ */
+static pid_t
+worker_fork(chassis *chas, int ndx)
+{
+    worker_t *w = &workers[ndx];
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        g_critical("%s: socketpair() for worker %d failed: %s (%d)",
+                G_STRLOC, ndx, g_strerror(errno), errno);
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        worker_init(chas, ndx, fds[1]);
+        return 0;
+    } else if (pid < 0) {
+        g_critical("%s: fork() of worker %d failed: %s (%d)",
+                G_STRLOC, ndx, g_strerror(errno), errno);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    w->pid = pid;
+    w->fd = fds[0];
+    g_string_truncate(w->recv_buf, 0);
+    g_string_truncate(w->send_buf, 0);
+
+    g_message("%s: [master] started worker %d, PID=%d", G_STRLOC, ndx, pid);
+    return pid;
+}
+
+static void
+workers_stop(chassis *chas)
+{
+    workers_stopping = TRUE;
+    chassis_set_shutdown_location(G_STRLOC);
+    chassis_workers_signal(chas, SIGTERM);
+}
+
+/**
+ * collect the workers that exited
+ *
+ * @return -1 if one failed, 0 otherwise
+ */
+static int
+workers_reap(chassis *chas)
+{
+    int failed = 0;
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        int i;
+        for (i = 0; i < nworkers && workers[i].pid != pid; i++);
+        if (i == nworkers) continue;
+
+        worker_t *w = &workers[i];
+        w->pid = -1;
+        if (w->fd >= 0) {
+            close(w->fd);
+            w->fd = -1;
+        }
+
+        /* it doesn't hold any connections anymore */
+        if (chas->worker_stats) {
+            memset((void *)chas->worker_stats->backend_conns[i], 0,
+                    sizeof(chas->worker_stats->backend_conns[i]));
+            memset((void *)&chas->worker_stats->conns[i], 0, sizeof(chas->worker_stats->conns[i]));
+        }
+
+        if (WIFSIGNALED(status) && !workers_stopping) {
+            g_critical("%s: worker %d PID=%d died on signal=%d, restarting",
+                    G_STRLOC, i, pid, WTERMSIG(status));
+            w->start_at = time(0) + WORKER_RESTART_DELAY;
+            continue;
+        }
+
+        if (WIFEXITED(status)) {
+            g_message("%s: worker %d PID=%d exited with %d",
+                    G_STRLOC, i, pid, WEXITSTATUS(status));
+            if (WEXITSTATUS(status) != EXIT_SUCCESS) {
+                failed = -1;
+            }
+        }
+        if (!workers_stopping) {
+            workers_stop(chas);
+        }
+    }
+    return failed;
+}
+
+static void
+sigchld_handler(int G_GNUC_UNUSED fd, short G_GNUC_UNUSED what, void *arg)
+{
+    chassis *chas = arg;
+
+    /* reap it right away */
+    event_base_loopbreak(chas->event_base);
+}
+
+static void
+sigforward_handler(int fd, short G_GNUC_UNUSED what, void *arg)
+{
+    chassis_workers_signal(arg, fd);
+}
+
+int chassis_workers_run(chassis *chas)
+{
+    int i, failed = 0;
+
+    nworkers = chas->worker_processes;
+    workers = g_new0(worker_t, nworkers);
+    for (i = 0; i < nworkers; i++) {
+        workers[i].pid = -1;
+        workers[i].fd = -1;
+        workers[i].recv_buf = g_string_new(NULL);
+        workers[i].send_buf = g_string_new(NULL);
+    }
+
+    signal_set(&ev_sigchld, SIGCHLD, sigchld_handler, chas);
+    event_base_set(chas->event_base, &ev_sigchld);
+    signal_add(&ev_sigchld, NULL);
+
+    signal_set(&ev_sigusr1, SIGUSR1, sigforward_handler, chas);
+    event_base_set(chas->event_base, &ev_sigusr1);
+    signal_add(&ev_sigusr1, NULL);
+
+    signal_set(&ev_sigusr2, SIGUSR2, sigforward_handler, chas);
+    event_base_set(chas->event_base, &ev_sigusr2);
+    signal_add(&ev_sigusr2, NULL);
+
+    for (;;) {
+        if (workers_reap(chas) != 0) {
+            failed = 1;
+        }
+
+        if (chassis_is_shutdown() && !workers_stopping) {
+            workers_stop(chas);
+        }
+
+        int alive = 0;
+        time_t now = time(0);
+        for (i = 0; i < nworkers; i++) {
+            if (workers[i].pid < 0 && !workers_stopping && workers[i].start_at <= now) {
+                pid_t pid = worker_fork(chas, i);
+                if (pid == 0) {
+                    return 0;
+                } else if (pid < 0) {
+                    failed = 1;
+                    workers_stop(chas);
+                }
+            }
+            if (workers[i].pid > 0) {
+                alive++;
+            }
+        }
+
+        if (workers_stopping && alive == 0) {
+            break;
+        }
+
+        /* the admin and the monitor run in between */
+        struct timeval timeout = {1, 0};
+        event_base_loopexit(chas->event_base, &timeout);
+        if (event_base_dispatch(chas->event_base) == -1 && errno != EINTR) {
+            g_critical("%s: event_base_dispatch() failed: %s (%d)",
+                    G_STRLOC, g_strerror(errno), errno);
+        }
+        /* the master has no client events to pass quiescent points */
+        if (chas->priv_quiescent) chas->priv_quiescent(chas, chas->priv);
+    }
+
+    signal_del(&ev_sigchld);
+    signal_del(&ev_sigusr1);
+    signal_del(&ev_sigusr2);
+
+    for (i = 0; i < nworkers; i++) {
+        g_string_free(workers[i].recv_buf, TRUE);
+        g_string_free(workers[i].send_buf, TRUE);
+    }
+    g_free(workers);
+    workers = NULL;
+    nworkers = 0;
+
+    return failed ? -1 : 1;
+}
@@ -0,0 +1,57 @@
+#ifndef _CHASSIS_WORKERS_H_
+#define _CHASSIS_WORKERS_H_
+
+#include <glib.h>
+
+#include "chassis-exports.h"
+#include "chassis-mainloop.h"
+
+/**
+ * multi-process mode
+ *
+ * the master loads the config, answers the admin clients and runs the
+ * monitor. it forks the workers from its event loop, so that a restarted
+ * worker gets the state the admin and the monitor changed since startup.
+ * each worker talks to the master over a unix socket pair: the master
+ * sends requests, the worker runs the handler set for the type and
+ * replies if a reply is expected
+ */
+typedef enum {
+    WORKER_MSG_ADMIN_QUERY = 1,     /* admin statement, replied with the packets of its result */
+    WORKER_MSG_BACKEND_STATE,       /* result of the monitor, not replied */
+    WORKER_MSG_MAX
+} worker_msg_type_t;
+
+typedef void (*worker_msg_handler_fn)(chassis *chas, const char *data, gsize len,
+                                      GString *reply, void *arg);
+
+/* handler of a message type in the workers, set before they are forked */
+CHASSIS_API void chassis_workers_set_handler(int type, worker_msg_handler_fn func, void *arg);
+
+/**
+ * fork the workers and keep them alive until shutdown
+ *
+ * a worker that died on a signal is restarted, if one exits on its own
+ * the others are stopped too
+ *
+ * @return 0 in a forked worker, 1 in the master once all workers are gone,
+ *         -1 in the master if a worker failed
+ */
+CHASSIS_API int chassis_workers_run(chassis *chas);
+
+CHASSIS_API void chassis_workers_signal(chassis *chas, int sig);
+
+/* send a message to every running worker, no reply is expected */
+CHASSIS_API void chassis_workers_broadcast(chassis *chas, int type, const char *data, gsize len);
+
+/**
+ * send a request to every running worker and wait for the replies
+ *
+ * @param replies  one per worker, NULL if it isn't running or didn't reply
+ *                 in time, the others are to be freed by the caller
+ * @return the number of running workers that didn't reply
+ */
+CHASSIS_API int chassis_workers_request(chassis *chas, int type, const char *data, gsize len,
+                                        GString **replies);
+
+#endif /* _CHASSIS_WORKERS_H_ */
@@ -56,6 +56,9 @@
 #include "chassis-frontend.h"
 #include "chassis-options.h"
 #include "cetus-monitor.h"
+#include "cetus-query-cache.h"
+#include "cetus-prepared-stmt.h"
+#include "network-compress.h"
 
 #define GETTEXT_PACKAGE "cetus"
 
@@ -73,22 +76,35 @@ typedef struct {
     int merged_output_size;
     int max_header_size;
     int max_resp_len;
+    int stream_high_watermark;
+    int stream_low_watermark;
+    int merge_read_watermark;
     int master_preferred;
     int worker_id;
+    int worker_processes;
     int config_port;
     int disable_threads;
     int is_tcp_stream_enabled;
     int is_back_compressed;
     int is_client_compress_support;
+    int compress_level;
+    int zstd_compress_level;
+    int compress_min_len;
     int check_slave_delay;
     int is_reduce_conns;
     int is_reset_conn_enabled;
     int long_query_time;
     int xa_log_detailed;
     int cetus_max_allowed_packet;
+    int zerocopy_threshold;
+    int io_uring_enabled;
     int default_query_cache_timeout;
+    int query_cache_max_size;
     int query_cache_enabled;
     int disable_dns_cache;
+    int disable_sql_prescan;
+    int ps_multiplexing_enabled;
+    int max_server_prepared_stmts;
     double slave_delay_down_threshold_sec;
     double slave_delay_recover_threshold_sec;
 
@@ -119,6 +135,7 @@ typedef struct {
     char *default_username;
     char *default_charset;
     char *default_db;
+    char *read_balance;
 
     char *remote_config_url;
 } chassis_frontend_t;
@@ -134,19 +151,29 @@ chassis_frontend_t *chassis_frontend_new(void) {
     frontend->disable_threads = 0;
     frontend->is_back_compressed = 0;
     frontend->is_client_compress_support = 0;
+    frontend->compress_level = Z_DEFAULT_COMPRESSION;
+    frontend->zstd_compress_level = ZSTD_LEVEL_DEFAULT;
+    frontend->compress_min_len = MIN_COMPRESS_LENGTH;
     frontend->xa_log_detailed = 0;
 
     frontend->default_pool_size = 100;
     frontend->max_resp_len = 10 * 1024 * 1024; /* 10M */
     frontend->merged_output_size = 8192;
     frontend->max_header_size = 65536;
+    frontend->stream_high_watermark = 1024 * 1024;
+    frontend->stream_low_watermark = 256 * 1024;
+    frontend->merge_read_watermark = 131072;
     frontend->config_port = 3306;
+    frontend->worker_processes = 1;
 
     frontend->slave_delay_down_threshold_sec = 60.0;
     frontend->default_query_cache_timeout = 100;
+    frontend->query_cache_max_size = QUERY_CACHE_MAX_SIZE_DEFAULT;
     frontend->long_query_time = MAX_QUERY_TIME;
     frontend->cetus_max_allowed_packet = MAX_ALLOWED_PACKET_DEFAULT;
     frontend->disable_dns_cache = 0;
+    frontend->disable_sql_prescan = 0;
+    frontend->max_server_prepared_stmts = SERVER_STMT_CACHE_SIZE_DEFAULT;
     return frontend;
 }
 
@@ -170,6 +197,7 @@ void chassis_frontend_free(chassis_frontend_t *frontend) {
     g_free(frontend->default_username);
     g_free(frontend->default_db);
     g_free(frontend->default_charset);
+    g_free(frontend->read_balance);
 
     if (frontend->plugin_names) {
         g_strfreev(frontend->plugin_names);
@@ -298,12 +326,33 @@ int chassis_frontend_set_chassis_options(chassis_frontend_t *frontend, chassis_o
             0, 0, OPTION_ARG_INT, &(frontend->max_header_size),
             "set the max header size for tcp streaming", "<integer>");
 
+    chassis_options_add(opts,
+            "stream-high-watermark",
+            0, 0, OPTION_ARG_INT, &(frontend->stream_high_watermark),
+            "stop reading a streamed resultset when the client send queue exceeds it", "<integer>");
+
+    chassis_options_add(opts,
+            "stream-low-watermark",
+            0, 0, OPTION_ARG_INT, &(frontend->stream_low_watermark),
+            "resume reading a streamed resultset when the client send queue drops below it", "<integer>");
+
+    chassis_options_add(opts,
+            "merge-read-watermark",
+            0, 0, OPTION_ARG_INT, &(frontend->merge_read_watermark),
+            "read a shard of a streamed merge only when its pending rows are below it", "<integer>");
+
     chassis_options_add(opts,
             "worker_id",
             0, 0, OPTION_ARG_INT, &(frontend->worker_id),
             "Set the worker id and the maximum value allowed is 63 and the min value is 1",
             "<integer>");
 
+    chassis_options_add(opts,
+            "worker-processes",
+            0, 0, OPTION_ARG_INT, &(frontend->worker_processes),
+            "Number of worker processes sharing the listen ports (default: 1)",
+            "<integer>");
+
     chassis_options_add(opts,
             "disable-threads",
             0, 0, OPTION_ARG_NONE, &(frontend->disable_threads),
@@ -319,6 +368,21 @@ int chassis_frontend_set_chassis_options(chassis_frontend_t *frontend, chassis_o
             0, 0, OPTION_ARG_NONE, &(frontend->is_client_compress_support),
             "enable compression for client interactions", NULL);
 
+    chassis_options_add(opts,
+            "compress-level",
+            0, 0, OPTION_ARG_INT, &(frontend->compress_level),
+            "zlib level for compressed connections, 1 fastest to 9 smallest (default: 6)", "<int>");
+
+    chassis_options_add(opts,
+            "zstd-compress-level",
+            0, 0, OPTION_ARG_INT, &(frontend->zstd_compress_level),
+            "zstd level asked from backends supporting it, 1 to 22 (default: 3)", "<int>");
+
+    chassis_options_add(opts,
+            "compress-min-len",
+            0, 0, OPTION_ARG_INT, &(frontend->compress_min_len),
+            "Send packets smaller than this uncompressed on compressed connections (default: 50)", "<int>");
+
     chassis_options_add(opts,
             "check-slave-delay",
             0, 0, OPTION_ARG_NONE, &(frontend->check_slave_delay),
@@ -339,6 +403,11 @@ int chassis_frontend_set_chassis_options(chassis_frontend_t *frontend, chassis_o
             0, 0, OPTION_ARG_INT, &(frontend->default_query_cache_timeout),
             "timeout when proxy connect to backends", "<integer>");
 
+    chassis_options_add(opts,
+            "query-cache-max-size",
+            0, 0, OPTION_ARG_INT, &(frontend->query_cache_max_size),
+            "Memory budget of the query cache in bytes per worker (default: 64M)", "<integer>");
+
     chassis_options_add(opts,
             "long-query-time",
             0, 0, OPTION_ARG_INT, &(frontend->long_query_time),
@@ -379,14 +448,41 @@ int chassis_frontend_set_chassis_options(chassis_frontend_t *frontend, chassis_o
             0, 0, OPTION_ARG_NONE, &(frontend->disable_dns_cache),
             "Every new connection to backends will resolve domain name", NULL);
 
+    chassis_options_add(opts,
+            "disable-sql-prescan",
+            0, 0, OPTION_ARG_NONE, &(frontend->disable_sql_prescan),
+            "Always run the full parser in rw-split mode", NULL);
+
+    chassis_options_add(opts,
+            "enable-ps-multiplexing",
+            0, 0, OPTION_ARG_NONE, &(frontend->ps_multiplexing_enabled),
+            "Prepared statements don't pin the backend connection in rw-split mode", NULL);
+
+    chassis_options_add(opts,
+            "max-server-prepared-stmts",
+            0, 0, OPTION_ARG_INT, &(frontend->max_server_prepared_stmts),
+            "Prepared statements kept per backend connection (default: 128)", "<integer>");
+
     chassis_options_add(opts,
             "master-preferred",
             0, 0, OPTION_ARG_NONE, &(frontend->master_preferred),
             "Access to master preferentially", NULL);
+    chassis_options_add(opts,
+            "read-balance",
+            0, 0, OPTION_ARG_STRING, &(frontend->read_balance),
+            "Pick readonly backends by round-robin or p2c (default: round-robin)", "<string>");
     chassis_options_add(opts,
             "max-allowed-packet",
             0, 0, OPTION_ARG_INT, &(frontend->cetus_max_allowed_packet),
             "Max allowed packet as in mysql", "<int>");
+    chassis_options_add(opts,
+            "zerocopy-threshold",
+            0, 0, OPTION_ARG_INT, &(frontend->zerocopy_threshold),
+            "Send to clients with MSG_ZEROCOPY if a write reaches this size in bytes (default: 0, off)", "<int>");
+    chassis_options_add(opts,
+            "enable-io-uring",
+            0, 0, OPTION_ARG_NONE, &(frontend->io_uring_enabled),
+            "Write a query to all its shards with a single io_uring syscall", NULL);
     chassis_options_add(opts,
             "remote-conf-url",
             0, 0, OPTION_ARG_STRING, &(frontend->remote_config_url),
@@ -445,12 +541,6 @@ static gboolean check_plugin_mode_valid(chassis_frontend_t *frontend, chassis *s
     return TRUE;
 }
 
-static void g_query_cache_item_free(gpointer q) {
-    query_cache_item *item = q;
-    network_queue_free(item->queue);
-    g_free(item);
-}
-
 /* strdup with 1) default value & 2) NULL check */
 #define DUP_STRING(STR, DEFAULT) \
         (STR) ? g_strdup(STR) : ((DEFAULT) ? g_strdup(DEFAULT) : NULL)
@@ -481,10 +571,26 @@ static void init_parameters(chassis_frontend_t *frontend, chassis *srv)
     srv->max_header_size = frontend->max_header_size;
     g_message("%s:set max header size:%d", G_STRLOC, srv->max_header_size);
 
+    srv->stream_high_watermark = MAX(frontend->stream_high_watermark, 16384);
+    srv->stream_low_watermark = frontend->stream_low_watermark;
+    if (srv->stream_low_watermark < 0 || srv->stream_low_watermark >= srv->stream_high_watermark) {
+        srv->stream_low_watermark = srv->stream_high_watermark >> 2;
+    }
+    g_message("%s:set stream watermarks:%d/%d", G_STRLOC,
+            srv->stream_low_watermark, srv->stream_high_watermark);
+
+    srv->merge_read_watermark = MAX(frontend->merge_read_watermark, 16384);
+    g_message("%s:set merge read watermark:%d", G_STRLOC, srv->merge_read_watermark);
+
     if (frontend->worker_id > 0) {
         srv->guid_state.worker_id = frontend->worker_id & 0x3f;
     }
 
+    srv->worker_processes = CLAMP(frontend->worker_processes, 1, MAX_WORKER_PROCESSES);
+    if (srv->worker_processes > 1) {
+        g_message("%s:set worker processes:%d", G_STRLOC, srv->worker_processes);
+    }
+
 #undef DUP_STRING
 
     srv->client_found_rows = frontend->set_client_found_rows;
@@ -499,9 +605,9 @@ static void init_parameters(chassis_frontend_t *frontend, chassis *srv)
     srv->is_reset_conn_enabled = frontend->is_reset_conn_enabled;
     srv->query_cache_enabled = frontend->query_cache_enabled;
     if (srv->query_cache_enabled) {
-        srv->query_cache_table = g_hash_table_new_full(g_str_hash,
-                g_str_equal, g_free, g_query_cache_item_free);
-        srv->cache_index = g_queue_new();
+        srv->query_cache_max_size = MAX(frontend->query_cache_max_size, 1024 * 1024);
+        srv->query_cache = query_cache_new(srv->query_cache_max_size);
+        g_message("%s:set query cache max size:%d", G_STRLOC, srv->query_cache_max_size);
     }
     srv->is_tcp_stream_enabled = frontend->is_tcp_stream_enabled;
     if (srv->is_tcp_stream_enabled) {
@@ -510,10 +616,32 @@ static void init_parameters(chassis_frontend_t *frontend, chassis *srv)
     srv->disable_threads = frontend->disable_threads;
     srv->is_back_compressed = frontend->is_back_compressed;
     srv->compress_support = frontend->is_client_compress_support;
+    srv->compress_level = CLAMP(frontend->compress_level, Z_DEFAULT_COMPRESSION, Z_BEST_COMPRESSION);
+    srv->zstd_compress_level = CLAMP(frontend->zstd_compress_level, 1, ZSTD_LEVEL_MAX);
+    if (frontend->is_back_compressed && !cetus_zstd_available()) {
+        g_message("%s:built without zstd, backends are compressed with zlib", G_STRLOC);
+    }
+    srv->compress_min_len = CLAMP(frontend->compress_min_len, 0, PACKET_LEN_MAX);
     srv->check_slave_delay = frontend->check_slave_delay;
     srv->slave_delay_down_threshold_sec = frontend->slave_delay_down_threshold_sec;
     srv->master_preferred = frontend->master_preferred;
+    srv->read_balance_algo = BACKEND_ALGO_ROUND_ROBIN;
+    if (frontend->read_balance) {
+        if (g_ascii_strcasecmp(frontend->read_balance, "p2c") == 0) {
+            srv->read_balance_algo = BACKEND_ALGO_P2C;
+            g_message("%s:set read balance p2c", G_STRLOC);
+        } else if (g_ascii_strcasecmp(frontend->read_balance, "round-robin") != 0) {
+            g_warning("unknown read-balance: %s, use round-robin", frontend->read_balance);
+        }
+    }
     srv->disable_dns_cache = frontend->disable_dns_cache;
+    srv->sql_prescan_disabled = frontend->disable_sql_prescan;
+    srv->ps_multiplexing_enabled = frontend->ps_multiplexing_enabled;
+    srv->max_server_prepared_stmts = MAX(frontend->max_server_prepared_stmts, 1);
+    if (srv->ps_multiplexing_enabled) {
+        g_message("%s:ps multiplexing enabled, max server prepared stmts:%d",
+                G_STRLOC, srv->max_server_prepared_stmts);
+    }
     if (frontend->slave_delay_recover_threshold_sec > 0) {
         srv->slave_delay_recover_threshold_sec = frontend->slave_delay_recover_threshold_sec;
         if (frontend->slave_delay_recover_threshold_sec > srv->slave_delay_down_threshold_sec) {
@@ -529,6 +657,14 @@ static void init_parameters(chassis_frontend_t *frontend, chassis *srv)
     srv->long_query_time = MIN(frontend->long_query_time, MAX_QUERY_TIME);
     srv->cetus_max_allowed_packet = CLAMP(frontend->cetus_max_allowed_packet,
             MAX_ALLOWED_PACKET_FLOOR, MAX_ALLOWED_PACKET_CEIL);
+    srv->zerocopy_threshold = MAX(frontend->zerocopy_threshold, 0);
+    if (srv->zerocopy_threshold > 0) {
+        g_message("%s:set zerocopy threshold:%d", G_STRLOC, srv->zerocopy_threshold);
+    }
+    if (frontend->io_uring_enabled) {
+        network_socket_set_io_uring(TRUE);
+        g_message("%s:io_uring enabled for shard writes", G_STRLOC);
+    }
 }
 
 
@@ -537,6 +673,10 @@ release_resouces_when_exit(chassis_frontend_t *frontend, chassis *srv, GError *g
         chassis_options_t *opts, chassis_log *log)
 {
     if (gerr) g_error_free(gerr);
+    if (srv && srv->query_cache) {
+        query_cache_free(srv->query_cache);
+        srv->query_cache = NULL;
+    }
     if (srv) chassis_free(srv);
     g_debug("%s: call chassis_options_free", G_STRLOC);
     if (opts) chassis_options_free(opts);
@@ -970,7 +1110,14 @@ int main_cmdline(int argc, char **argv) {
             chassis_fdlimit_get());
 
 
-    cetus_monitor_start_thread(srv->priv->monitor, srv);
+    if (srv->worker_processes > 1) {
+        /* the workers are forked in the mainloop, the master runs the monitor */
+        if (chassis_worker_stats_init(srv) != 0) {
+            GOTO_EXIT(EXIT_FAILURE);
+        }
+    } else {
+        cetus_monitor_start_thread(srv->priv->monitor, srv);
+    }
 
     if (chassis_mainloop(srv)) {
         /* looks like we failed */
@@ -1,6 +1,7 @@
 #include "network-backend.h"
 
 #include <string.h>
+#include <sys/time.h>
 #include <glib.h>
 
 #include "chassis-plugin.h"
@@ -36,6 +37,8 @@ network_backend_t *network_backend_new() {
     b->server_group = g_string_new(NULL);
     b->address = g_string_new(NULL);
     b->challenges = g_ptr_array_new();
+    b->weight = BACKEND_WEIGHT_DEFAULT;
+    b->id = -1;
 
     return b;
 }
@@ -81,6 +84,58 @@ int network_backend_init_extra(network_backend_t *b, chassis *chas) {
     return 0;
 }
 
+#define LATENCY_EWMA_WEIGHT 8 /* a sample counts for 1/8 */
+#define LATENCY_DECAY_USEC (10 * G_USEC_PER_SEC) /* unused estimates halve in that time */
+#define LATENCY_FLOOR_USEC 100
+#define SLAVE_DELAY_PENALTY_MSEC 1000 /* each second of delay adds the cost once more */
+
+static gint64 backend_now_usec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (gint64)tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
+
+/* the estimate fades while no answer comes in, so a slow backend is tried again */
+static double backend_latency_usec(network_backend_t *b, gint64 now)
+{
+    double latency = b->latency_ewma_us;
+    gint64 idle = now - b->latency_sampled_at;
+    if (idle > 0) {
+        latency = latency * LATENCY_DECAY_USEC / (LATENCY_DECAY_USEC + idle);
+    }
+    return latency;
+}
+
+/**
+ * a query is sent to the backend
+ */
+void network_backend_query_start(network_backend_t *b)
+{
+    b->pending_queries++;
+}
+
+/**
+ * the query is answered, latency_us < 0 if it is given up
+ */
+void network_backend_query_done(network_backend_t *b, gint64 latency_us)
+{
+    if (b->pending_queries > 0) {
+        b->pending_queries--;
+    }
+    if (latency_us < 0) {
+        return;
+    }
+    gint64 now = backend_now_usec();
+    if (b->latency_sampled_at == 0) {
+        b->latency_ewma_us = latency_us;
+    } else {
+        double latency = backend_latency_usec(b, now);
+        b->latency_ewma_us = latency + (latency_us - latency) / LATENCY_EWMA_WEIGHT;
+    }
+    b->latency_sampled_at = now;
+}
+
 int network_backend_conns_count(network_backend_t *b)
 {
     int in_use = b->connected_clients;
@@ -88,6 +143,77 @@ int network_backend_conns_count(network_backend_t *b)
     return in_use + pooled;
 }
 
+/**
+ * open connections to this backend summed over all worker processes
+ *
+ * the counts of the others are as recent as their last publish
+ */
+int network_backend_conns_count_all(network_backend_t *b)
+{
+    chassis *chas = b->pool->srv;
+    int total = network_backend_conns_count(b);
+
+    if (chas == NULL || chas->worker_stats == NULL || b->id < 0) {
+        return total;
+    }
+
+    chassis_worker_stats_t *ws = chas->worker_stats;
+    int i;
+    for (i = 0; i < chas->worker_processes; i++) {
+        if (i != chas->worker_no) {
+            total += ws->backend_conns[i][b->id];
+        }
+    }
+    return total;
+}
+
+/**
+ * let the other workers know how many connections we have to this backend,
+ * on each one opened or closed for the budget and once a second
+ */
+void network_backend_conns_publish(network_backend_t *b)
+{
+    chassis *chas = b->pool->srv;
+
+    if (chas == NULL || chas->worker_stats == NULL || chas->worker_no < 0 || b->id < 0) {
+        return;
+    }
+    chas->worker_stats->backend_conns[chas->worker_no][b->id] = network_backend_conns_count(b);
+}
+
+/**
+ * the part of a pool size every worker may use without borrowing
+ */
+int network_backend_worker_share(network_backend_t *b, int pool_size)
+{
+    chassis *chas = b->pool->srv;
+
+    if (chas == NULL || chas->worker_processes <= 1) {
+        return pool_size;
+    }
+    return (pool_size + chas->worker_processes - 1) / chas->worker_processes;
+}
+
+/**
+ * TRUE if a worker borrowed beyond its share while all workers together
+ * exceed max_conn_pool, a returned connection should be closed then
+ * so that short workers can open theirs
+ */
+gboolean network_backend_over_worker_share(network_backend_t *b)
+{
+    chassis *chas = b->pool->srv;
+
+    if (chas == NULL || chas->worker_stats == NULL || b->config == NULL) {
+        return FALSE;
+    }
+
+    int max_conns = b->config->max_conn_pool;
+    if (network_backend_conns_count(b) <= network_backend_worker_share(b, max_conns)) {
+        return FALSE;
+    }
+    return network_backend_conns_count_all(b) > max_conns;
+}
+
 /*
  * save challenges from backend, will be used to authenticate front user
  */
@@ -127,6 +253,116 @@ static void network_group_free(network_group_t *);
 static void network_group_add(network_group_t *, network_backend_t *);
 static void network_group_update(network_group_t *gp);
 
+#define BACKEND_STATUS_AVAILABLE(st) \
+    ((st)->state == BACKEND_STATE_UP || (st)->state == BACKEND_STATE_UNKNOWN)
+
+static network_backends_snapshot_t *network_backends_snapshot_new(network_backends_t *bs)
+{
+    guint count = bs->backends->len;
+    guint ngroups = bs->groups->len;
+    network_backends_snapshot_t *snap = g_malloc0(sizeof(network_backends_snapshot_t)
+            + count * sizeof(backend_status_t) + ngroups * sizeof(group_status_t)
+            + count * sizeof(int));
+    snap->count = count;
+    snap->ro_server_num = bs->ro_server_num;
+    snap->status = (backend_status_t *)(snap + 1);
+    snap->ngroups = ngroups;
+    snap->groups = (group_status_t *)(snap->status + count);
+    snap->ro_up = (int *)(snap->groups + ngroups);
+
+    guint i;
+    for (i = 0; i < count; i++) {
+        network_backend_t *b = g_ptr_array_index(bs->backends, i);
+        backend_status_t *st = &snap->status[i];
+        st->backend = b;
+        st->state = b->state;
+        st->type = b->type;
+        st->slave_delay_msec = b->slave_delay_msec;
+        st->weight = b->weight;
+        if (st->type == BACKEND_TYPE_RO && st->weight != BACKEND_WEIGHT_DEFAULT) {
+            snap->weighted = TRUE;
+        }
+        if (st->type == BACKEND_TYPE_RO && BACKEND_STATUS_AVAILABLE(st)) {
+            snap->ro_up[snap->nro_up++] = i;
+        }
+    }
+    for (i = 0; i < ngroups; i++) {
+        network_group_t *gp = g_ptr_array_index(bs->groups, i);
+        group_status_t *gs = &snap->groups[i];
+        gs->master = gp->master ? gp->master->ndx : -1;
+        int j;
+        for (j = 0; j < gp->nslaves; j++) {
+            gs->slaves[j] = gp->slaves[j]->ndx;
+        }
+        gs->nslaves = gp->nslaves;
+    }
+    return snap;
+}
+
+static void network_backends_lock(network_backends_t *bs)
+{
+    g_mutex_lock(bs->publish_lock);
+}
+
+static void network_backends_unlock(network_backends_t *bs)
+{
+    g_mutex_unlock(bs->publish_lock);
+}
+
+/**
+ * replace the snapshot with the current state, called with the lock held
+ *
+ * the replaced one is retired at the current epoch, it can be freed once
+ * the event loop announced a later one
+ */
+static void network_backends_publish(network_backends_t *bs)
+{
+    network_backends_snapshot_t *old = bs->snapshot;
+    network_backends_snapshot_t *snap = network_backends_snapshot_new(bs);
+    snap->version = old ? old->version + 1 : 1;
+    g_atomic_pointer_set(&bs->snapshot, snap);
+    if (old == NULL) {
+        return;
+    }
+
+    old->retired_epoch = g_atomic_int_get(&bs->epoch);
+    old->next_retired = bs->retired;
+    bs->retired = old;
+    g_atomic_int_inc(&bs->epoch);
+
+    gint reader_epoch = g_atomic_int_get(&bs->reader_epoch);
+    network_backends_snapshot_t **link = &bs->retired;
+    while (*link) {
+        network_backends_snapshot_t *retired = *link;
+        if (reader_epoch - (gint)retired->retired_epoch > 0) {
+            *link = retired->next_retired;
+            g_free(retired);
+        } else {
+            link = &retired->next_retired;
+        }
+    }
+}
+
+/**
+ * the current snapshot, it stays valid until the caller returns to the
+ * event loop
+ */
+network_backends_snapshot_t *network_backends_get_snapshot(network_backends_t *bs)
+{
+    return g_atomic_pointer_get(&bs->snapshot);
+}
+
+/**
+ * announce that the event loop holds no snapshot, called between events
+ */
+void network_backends_quiescent(network_backends_t *bs)
+{
+    guint epoch = g_atomic_int_get(&bs->epoch);
+    if (bs->reader_epoch != epoch) {
+        g_atomic_int_set(&bs->reader_epoch, epoch);
+    }
+}
+
 network_backends_t *network_backends_new() {
     network_backends_t *bs;
 
@@ -134,6 +370,13 @@ network_backends_t *network_backends_new() {
 
     bs->backends = g_ptr_array_new();
     bs->groups = g_ptr_array_new_with_free_func((GDestroyNotify)network_group_free);
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+    bs->publish_lock = g_mutex_new();
+#else
+    bs->publish_lock = g_new0(GMutex, 1);
+    g_mutex_init(bs->publish_lock);
+#endif
+    network_backends_publish(bs);
     return bs;
 }
 
@@ -156,6 +399,19 @@ void network_backends_free(network_backends_t *bs) {
     }
     g_ptr_array_free(bs->backends, TRUE);
     g_ptr_array_free(bs->groups, TRUE);
+
+    while (bs->retired) {
+        network_backends_snapshot_t *retired = bs->retired;
+        bs->retired = retired->next_retired;
+        g_free(retired);
+    }
+    g_free(bs->snapshot);
+#if !GLIB_CHECK_VERSION(2, 32, 0)
+    g_mutex_free(bs->publish_lock);
+#else
+    g_mutex_clear(bs->publish_lock);
+    g_free(bs->publish_lock);
+#endif
     g_free(bs);
 }
 
@@ -174,6 +430,35 @@ static gboolean network_backends_into_group(network_backends_t *bs,
 
 static void network_backends_add_group(network_backends_t *bs, const char *name);
 
+/**
+ * the slot of a backend in the per-backend stats
+ *
+ * with worker processes the slots are keyed by the address, so that a
+ * backend has the same slot in all of them whatever order it was added in.
+ * the master claims them, it adds a backend before the workers are told to
+ */
+static int network_backend_get_id(chassis *chas, network_backend_t *b)
+{
+    if (chas == NULL || chas->worker_stats == NULL) {
+        return b->ndx < MAX_SERVER_NUM ? b->ndx : -1;
+    }
+
+    chassis_worker_stats_t *ws = chas->worker_stats;
+    const char *addr = b->addr->name->str;
+    int i;
+    for (i = 0; i < MAX_SERVER_NUM && ws->backend_addrs[i][0]; i++) {
+        if (strncmp(ws->backend_addrs[i], addr, MAX_BACKEND_ADDR_LEN - 1) == 0) {
+            return i;
+        }
+    }
+    if (i == MAX_SERVER_NUM || chassis_is_worker(chas)) {
+        g_warning("%s: no stats slot for backend %s", G_STRLOC, addr);
+        return -1;
+    }
+    g_strlcpy(ws->backend_addrs[i], addr, MAX_BACKEND_ADDR_LEN);
+    return i;
+}
+
 /*
  * FIXME: 1) remove _set_address, make this function callable with result of same
  *        2) differentiate between reasons for "we didn't add" (now -1 in all cases)
@@ -188,7 +473,6 @@ int network_backends_add(network_backends_t *bs, const gchar *address,
 
     char *group_p = NULL;
     if ((group_p = strrchr(address, '@')) != NULL) {
-        network_backends_add_group(bs, group_p + 1);
         g_string_assign(new_backend->server_group, group_p + 1);
         g_string_assign_len(new_backend->address, address, group_p - address);
     } else {
@@ -201,11 +485,16 @@ int network_backends_add(network_backends_t *bs, const gchar *address,
     }
 
     guint i;
+    network_backends_lock(bs);
+    if (new_backend->server_group->len > 0) {
+        network_backends_add_group(bs, new_backend->server_group->str);
+    }
     /* check if this backend is already known */
     for (i = 0; i < bs->backends->len; i++) {
         network_backend_t *old_backend = g_ptr_array_index(bs->backends, i);
 
         if (strleq(S(old_backend->addr->name), S(new_backend->addr->name))) {
+            network_backends_unlock(bs);
             network_backend_free(new_backend);
 
             g_critical("backend %s is already known!", address);
@@ -213,11 +502,15 @@ int network_backends_add(network_backends_t *bs, const gchar *address,
         }
     }
 
+    new_backend->ndx = bs->backends->len;
+    new_backend->id = network_backend_get_id(srv, new_backend);
     g_ptr_array_add(bs->backends, new_backend);
     if (type == BACKEND_TYPE_RO) {
         bs->ro_server_num += 1;
     }
     network_backends_into_group(bs, new_backend);
+    network_backends_publish(bs);
+    network_backends_unlock(bs);
     g_message("added %s backend: %s, state: %s", backend_type_t_str[type],
             address, backend_state_t_str[state]);
 
@@ -230,9 +523,11 @@ int network_backends_add(network_backends_t *bs, const gchar *address,
 int network_backends_remove(network_backends_t *bs, guint index) {
     network_backend_t *b = bs->backends->pdata[index];
     if (b != NULL) {
+        network_backends_lock(bs);
         if (b->type == BACKEND_TYPE_RO && bs->ro_server_num > 0) {
             bs->ro_server_num -= 1;
         }
+        network_backends_unlock(bs);
 
         return network_backends_modify(bs, index, BACKEND_TYPE_UNKNOWN, 
                 BACKEND_STATE_DELETED);
@@ -271,6 +566,7 @@ int network_backends_check(network_backends_t *bs) {
 
     bs->backend_last_check = now;
 
+    network_backends_lock(bs);
     for (i = 0; i < bs->backends->len; i++) {
         network_backend_t *cur = bs->backends->pdata[i];
 
@@ -287,6 +583,10 @@ int network_backends_check(network_backends_t *bs) {
             backends_woken_up++;
         }
     }
+    if (backends_woken_up > 0) {
+        network_backends_publish(bs);
+    }
+    network_backends_unlock(bs);
 
     return backends_woken_up;
 }
@@ -302,7 +602,11 @@ int network_backends_modify(network_backends_t *bs, guint ndx,
 {
     GTimeVal now;
     g_get_current_time(&now);
-    if (ndx >= network_backends_count(bs)) return -1;
+    network_backends_lock(bs);
+    if (ndx >= network_backends_count(bs)) {
+        network_backends_unlock(bs);
+        return -1;
+    }
     network_backend_t *cur = bs->backends->pdata[ndx];
 
     g_message("change backend: %s from type: %s, state: %s to type: %s, state: %s",
@@ -326,11 +630,89 @@ int network_backends_modify(network_backends_t *bs, guint ndx,
         cur->state_since = now;
     }
 
+    network_backends_publish(bs);
+    network_backends_unlock(bs);
+
     g_debug("%s: backend state:%d for backend:%p", G_STRLOC, cur->state, cur);
 
     return 0;
 }
 
+/**
+ * state change seen when connecting, the type is left alone
+ */
+int network_backends_set_state(network_backends_t *bs, guint ndx, backend_state_t state)
+{
+    network_backends_lock(bs);
+    if (ndx >= network_backends_count(bs)) {
+        network_backends_unlock(bs);
+        return -1;
+    }
+    network_backend_t *cur = bs->backends->pdata[ndx];
+    if (cur->state != state) {
+        cur->state = state;
+        g_get_current_time(&cur->state_since);
+        network_backends_publish(bs);
+    }
+    network_backends_unlock(bs);
+    return 0;
+}
+
+/**
+ * publish the replication delay of a slave, only when it changed
+ */
+int network_backends_set_slave_delay(network_backends_t *bs, guint ndx, int delay_msec)
+{
+    network_backends_lock(bs);
+    if (ndx >= network_backends_count(bs)) {
+        network_backends_unlock(bs);
+        return -1;
+    }
+    network_backend_t *cur = bs->backends->pdata[ndx];
+    if (cur->slave_delay_msec != delay_msec) {
+        cur->slave_delay_msec = delay_msec;
+        network_backends_publish(bs);
+    }
+    network_backends_unlock(bs);
+    return 0;
+}
+
+int network_backends_set_weight(network_backends_t *bs, guint ndx, int weight)
+{
+    if (weight < 0 || weight > BACKEND_WEIGHT_MAX) {
+        return -1;
+    }
+    network_backends_lock(bs);
+    if (ndx >= network_backends_count(bs)) {
+        network_backends_unlock(bs);
+        return -1;
+    }
+    network_backend_t *cur = bs->backends->pdata[ndx];
+    if (cur->weight != weight) {
+        cur->weight = weight;
+        cur->rr_current_weight = 0;
+        network_backends_publish(bs);
+    }
+    network_backends_unlock(bs);
+    return 0;
+}
+
+/**
+ * TRUE if the backend is a master, or a slave lagging no more than max_lag_msec
+ */
+gboolean network_backends_within_lag(network_backends_t *bs, guint ndx, int max_lag_msec)
+{
+    if (max_lag_msec <= 0) {
+        return TRUE;
+    }
+    network_backends_snapshot_t *snap = network_backends_get_snapshot(bs);
+    if (ndx >= snap->count) {
+        return FALSE;
+    }
+    backend_status_t *st = &snap->status[ndx];
+    return st->type != BACKEND_TYPE_RO || st->slave_delay_msec <= max_lag_msec;
+}
+
 network_backend_t *network_backends_get(network_backends_t *bs, guint ndx) {
     if (ndx >= network_backends_count(bs)) return NULL;
 
@@ -396,6 +778,7 @@ static void network_backends_add_group(network_backends_t *bs, const char *name)
     GString *gp_name = g_string_new(name);
     if (!network_backends_get_group(bs, gp_name)) {/* dup check */
         network_group_t *gp = network_group_new(gp_name);
+        gp->ndx = bs->groups->len;
         g_ptr_array_add(bs->groups, gp);
     } else {
         g_string_free(gp_name, TRUE);
@@ -465,82 +848,166 @@ static void network_group_update(network_group_t *gp)
 
 static int backends_get_ro_ndx_round_robin(network_backends_t *bs)
 {
-    int ro_index = 0, remainder = 0;
-    if (bs->ro_server_num > 0) {
-        remainder = (bs->read_count++) % bs->ro_server_num;
+    network_backends_snapshot_t *snap = network_backends_get_snapshot(bs);
+    if (snap->nro_up == 0) {
+        return -1;
     }
-    int count = network_backends_count(bs);
-    int i = 0;
-    for (i = 0; i < count; i++) {
-        network_backend_t *backend = network_backends_get(bs, i);
-        if ((backend->type == BACKEND_TYPE_RO)
-            && (backend->state == BACKEND_STATE_UP ||
-                backend->state == BACKEND_STATE_UNKNOWN))
-        {
-            if (ro_index == remainder) {
-                break;
-            }
-            ro_index++;
-        }
+    return snap->ro_up[(bs->read_count++) % snap->nro_up];
+}
+
+static int backends_get_ro_ndx_first(network_backends_snapshot_t *snap)
+{
+    return snap->nro_up > 0 ? snap->ro_up[0] : -1;
+}
+
+static int backends_get_ro_ndx_random(network_backends_snapshot_t *snap)
+{
+    if (snap->nro_up == 0) {
+        return -1;
     }
-    return i < count ? i : -1;
+    return snap->ro_up[g_random_int_range(0, snap->nro_up)];
 }
 
-static int backends_get_ro_ndx_first(network_backends_t *bs)
+/* less pending queries weighted by latency, slave delay is a penalty */
+static double backend_cost(backend_status_t *st, gint64 now)
 {
-    int i = 0;
-    int count = network_backends_count(bs);
-    for(i = 0; i < count; i++) {
-        network_backend_t *backend = network_backends_get(bs, i);
-        if ((backend->type == BACKEND_TYPE_RO)
-            && (backend->state == BACKEND_STATE_UP ||
-                backend->state == BACKEND_STATE_UNKNOWN))
-        {
-            return i;
+    network_backend_t *b = st->backend;
+    double cost = MAX(backend_latency_usec(b, now), LATENCY_FLOOR_USEC);
+    cost *= b->pending_queries + 1;
+    if (st->slave_delay_msec > 0) {
+        cost *= 1.0 + (double)st->slave_delay_msec / SLAVE_DELAY_PENALTY_MSEC;
+    }
+    if (st->weight > 0) {
+        cost /= st->weight;
+    }
+    return cost;
+}
+
+/**
+ * power of two choices: the cheaper of two random candidates
+ *
+ * @param candidates  indexes into snap->status
+ */
+static int backends_pick_p2c(network_backends_snapshot_t *snap, const int *candidates, int n)
+{
+    if (n <= 1) {
+        return n == 1 ? candidates[0] : -1;
+    }
+    int a = g_random_int_range(0, n);
+    int b = g_random_int_range(0, n - 1);
+    if (b >= a) {
+        b++;
+    }
+    gint64 now = backend_now_usec();
+    double cost_a = backend_cost(&snap->status[candidates[a]], now);
+    double cost_b = backend_cost(&snap->status[candidates[b]], now);
+    return cost_a <= cost_b ? candidates[a] : candidates[b];
+}
+
+/**
+ * keep the available readonly backends that take reads and lag no more
+ * than max_lag_msec
+ *
+ * @return number of candidates written
+ */
+static int backends_filter_ro(network_backends_snapshot_t *snap, const int *from, int n,
+                              int max_lag_msec, int *candidates)
+{
+    int i, count = 0;
+    for (i = 0; i < n; i++) {
+        backend_status_t *st = &snap->status[from[i]];
+        if (!BACKEND_STATUS_AVAILABLE(st) || st->weight == 0) {
+            continue;
         }
+        if (max_lag_msec > 0 && st->slave_delay_msec > max_lag_msec) {
+            g_debug("%s: skip backend %s, delay %d msec over %d", G_STRLOC,
+                    st->backend->addr->name->str, st->slave_delay_msec, max_lag_msec);
+            continue;
+        }
+        candidates[count++] = from[i];
     }
-    return -1;
+    return count;
 }
 
-static int backends_get_ro_ndx_random(network_backends_t *bs)
+/* smooth weighted round robin, the picks of a backend are spread evenly */
+static int backends_pick_weighted_round_robin(network_backends_snapshot_t *snap,
+                                              const int *candidates, int n)
 {
-    int count = network_backends_count(bs);
-    int ndx = g_random_int_range(0, count);
-    network_backend_t *backend = network_backends_get(bs, ndx);
-    if (backend->type == BACKEND_TYPE_RO) { /* luckily run into a RO */
-        if (backend->state == BACKEND_STATE_UP ||
-            backend->state == BACKEND_STATE_UNKNOWN) {
-            return ndx;
+    int i, total = 0;
+    network_backend_t *best = NULL;
+    int best_ndx = -1;
+    for (i = 0; i < n; i++) {
+        backend_status_t *st = &snap->status[candidates[i]];
+        network_backend_t *b = st->backend;
+        b->rr_current_weight += st->weight;
+        total += st->weight;
+        if (best == NULL || b->rr_current_weight > best->rr_current_weight) {
+            best = b;
+            best_ndx = candidates[i];
         }
-    } else { /* if we run into a RW, try it's neighbours */
-        if (ndx - 1 >= 0) {
-            backend = network_backends_get(bs, ndx - 1);
-            if ((backend->type == BACKEND_TYPE_RO)
-            && (backend->state == BACKEND_STATE_UP ||
-                backend->state == BACKEND_STATE_UNKNOWN)) {
-                return ndx-1;
-            }
-        } else if (ndx + 1 < count) {
-            if ((backend->type == BACKEND_TYPE_RO)
-            && (backend->state == BACKEND_STATE_UP ||
-                backend->state == BACKEND_STATE_UNKNOWN)) {
-                return ndx+1;
-            }
+    }
+    if (best) {
+        best->rr_current_weight -= total;
+    }
+    return best_ndx;
+}
+
+static int backends_pick_weighted_random(network_backends_snapshot_t *snap,
+                                         const int *candidates, int n)
+{
+    int i, total = 0;
+    for (i = 0; i < n; i++) {
+        total += snap->status[candidates[i]].weight;
+    }
+    if (total == 0) {
+        return -1;
+    }
+    int r = g_random_int_range(0, total);
+    for (i = 0; i < n; i++) {
+        r -= snap->status[candidates[i]].weight;
+        if (r < 0) {
+            break;
         }
     }
+    return candidates[i];
+}
 
-    return backends_get_ro_ndx_first(bs);
+static int backends_pick_weighted(network_backends_snapshot_t *snap, const int *candidates,
+                                  int n, backend_algo_t algo)
+{
+    switch (algo) {
+    case BACKEND_ALGO_ROUND_ROBIN:
+        return backends_pick_weighted_round_robin(snap, candidates, n);
+    case BACKEND_ALGO_RANDOM:
+        return backends_pick_weighted_random(snap, candidates, n);
+    case BACKEND_ALGO_FIRST:
+        return n > 0 ? candidates[0] : -1;
+    case BACKEND_ALGO_P2C:
+        return backends_pick_p2c(snap, candidates, n);
+    default:
+        return -1;
+    }
 }
 
-int network_backends_get_ro_ndx(network_backends_t *bs, backend_algo_t algo)
+int network_backends_get_ro_ndx(network_backends_t *bs, backend_algo_t algo, int max_lag_msec)
 {
+    network_backends_snapshot_t *snap = network_backends_get_snapshot(bs);
+    if (snap->weighted || max_lag_msec > 0) {
+        int candidates[MAX_SERVER_NUM];
+        int n = backends_filter_ro(snap, snap->ro_up, MIN(snap->nro_up, MAX_SERVER_NUM),
+                                   max_lag_msec, candidates);
+        return backends_pick_weighted(snap, candidates, n, algo);
+    }
+
     switch (algo) {
     case BACKEND_ALGO_ROUND_ROBIN:
         return backends_get_ro_ndx_round_robin(bs);
     case BACKEND_ALGO_RANDOM:
-        return backends_get_ro_ndx_random(bs);
+        return backends_get_ro_ndx_random(snap);
     case BACKEND_ALGO_FIRST:
-        return backends_get_ro_ndx_first(bs);
+        return backends_get_ro_ndx_first(snap);
+    case BACKEND_ALGO_P2C:
+        return backends_pick_p2c(snap, snap->ro_up, snap->nro_up);
     default:
         return -1;
     }
@@ -548,14 +1015,12 @@ int network_backends_get_ro_ndx(network_backends_t *bs, backend_algo_t algo)
 
 int network_backends_get_rw_ndx(network_backends_t *bs)
 {
+    network_backends_snapshot_t *snap = network_backends_get_snapshot(bs);
     int i = 0;
-    int count = network_backends_count(bs);
+    int count = snap->count;
     for (i = 0; i < count; i++) {
-        network_backend_t *backend = network_backends_get(bs, i);
-        if ((BACKEND_TYPE_RW == backend->type) &&
-            (backend->state == BACKEND_STATE_UP ||
-             backend->state == BACKEND_STATE_UNKNOWN))
-        {
+        backend_status_t *st = &snap->status[i];
+        if (st->type == BACKEND_TYPE_RW && BACKEND_STATUS_AVAILABLE(st)) {
             break;
         }
     }
@@ -585,38 +1050,74 @@ network_backends_get_challenge(network_backends_t *bs, int back_ndx)
         return NULL;
 }
 
-/* round robin pick */
-network_backend_t *network_group_pick_slave_backend(network_group_t *group)
+static gboolean slave_has_conns(network_backend_t *backend)
 {
-    int i;
-    network_backend_t *backend = NULL;
-    for (i = 0; i < group->nslaves; i++) {
-        size_t index = (group->slave_visit_cnt++) % group->nslaves;
-        backend = group->slaves[index];
-        if (backend->state != BACKEND_STATE_UP &&
-            backend->state != BACKEND_STATE_UNKNOWN)
-        {
-            g_debug(G_STRLOC ": skip dead backend(slave): %d", i);
-            continue;
-        }
+    int total = network_backend_conns_count(backend);
+    int connected_clts = backend->connected_clients;
+    int cur_idle = total - connected_clts;
+    int max_idle_conns = backend->config->max_conn_pool;
 
-        int total = network_backend_conns_count(backend);
-        int connected_clts = backend->connected_clients;
-        int cur_idle = total - connected_clts;
-        int max_idle_conns = backend->config->max_conn_pool;
+    g_debug("%s, slave:%s, total:%d, connected:%d, idle:%d, max:%d",
+            G_STRLOC, backend->addr->name->str, total, connected_clts,
+            cur_idle, max_idle_conns);
 
-        g_debug("%s, slave:%d, total:%d, connected:%d, idle:%d, max:%d",
-                G_STRLOC, (int) i, total, connected_clts,
-                cur_idle, max_idle_conns);
+    return cur_idle || total <= network_backend_worker_share(backend, max_idle_conns)
+        || network_backend_conns_count_all(backend) <= max_idle_conns;
+}
 
-        if (cur_idle || total <= max_idle_conns) {
-            break;
+/* pick by weight, falling back to round robin over those with spare connections */
+network_backend_t *network_group_pick_slave_backend(network_backends_t *bs,
+                                                    network_group_t *group,
+                                                    backend_algo_t algo,
+                                                    int max_lag_msec)
+{
+    network_backends_snapshot_t *snap = network_backends_get_snapshot(bs);
+    if ((guint)group->ndx >= snap->ngroups) {
+        return NULL;
+    }
+    group_status_t *gs = &snap->groups[group->ndx];
+    int candidates[MAX_GROUP_SLAVES];
+    int n = backends_filter_ro(snap, gs->slaves, gs->nslaves, max_lag_msec, candidates);
+    if (n == 0) {
+        return NULL;
+    }
+
+    network_backend_t *backend = NULL;
+    if (algo == BACKEND_ALGO_P2C || snap->weighted) {
+        int ndx = backends_pick_weighted(snap, candidates, n, algo);
+        if (ndx == -1) {
+            return NULL;
+        }
+        backend = snap->status[ndx].backend;
+        if (slave_has_conns(backend)) {
+            return backend;
+        }
+    }
+
+    int i;
+    for (i = 0; i < n; i++) {
+        size_t index = (group->slave_visit_cnt++) % n;
+        backend = snap->status[candidates[index]].backend;
+        if (slave_has_conns(backend)) {
+            return backend;
         }
     }
-    if (i == group->nslaves) {
-        backend = NULL;
+    return NULL;
+}
+
+network_backend_t *network_group_pick_master_backend(network_backends_t *bs,
+                                                     network_group_t *group)
+{
+    network_backends_snapshot_t *snap = network_backends_get_snapshot(bs);
+    if ((guint)group->ndx >= snap->ngroups) {
+        return NULL;
+    }
+    group_status_t *gs = &snap->groups[group->ndx];
+    if (gs->master < 0) {
+        return NULL;
     }
-    return backend;
+    backend_status_t *st = &snap->status[gs->master];
+    return BACKEND_STATUS_AVAILABLE(st) ? st->backend : NULL;
 }
 
 void network_group_get_slave_names(network_group_t *group, GString *slaves)
@@ -30,6 +30,7 @@ typedef enum {
     BACKEND_ALGO_ROUND_ROBIN,
     BACKEND_ALGO_RANDOM,
     BACKEND_ALGO_FIRST,
+    BACKEND_ALGO_P2C, /* less loaded and faster of two random ones */
 } backend_algo_t;
 
 typedef struct backend_config {
@@ -66,16 +67,72 @@ typedef struct {
     int                chal_ndx;
     time_t             last_check_time;
     int slave_delay_msec; /* valid if this is a ReadOnly slave */
+    int ndx;              /* position in network_backends_t.backends */
+    int id;               /* slot of the per-backend stats, the same in every worker, -1 if none */
+    int weight;           /* share of the reads, 0 takes none */
+    int rr_current_weight; /* smooth weighted round robin */
+
+    /* load seen by this worker, for BACKEND_ALGO_P2C */
+    int pending_queries;
+    double latency_ewma_us;   /* a double, integer steps of 1/8 would stall on fast backends */
+    gint64 latency_sampled_at;
 } network_backend_t;
 
 NETWORK_API network_backend_t *network_backend_new();
 NETWORK_API void network_backend_free(network_backend_t *b);
 NETWORK_API int network_backend_conns_count(network_backend_t *b);
+NETWORK_API int network_backend_conns_count_all(network_backend_t *b);
+NETWORK_API void network_backend_conns_publish(network_backend_t *b);
+NETWORK_API int network_backend_worker_share(network_backend_t *b, int pool_size);
+NETWORK_API gboolean network_backend_over_worker_share(network_backend_t *b);
 NETWORK_API int network_backend_init_extra(network_backend_t *b, chassis *chas);
+NETWORK_API void network_backend_query_start(network_backend_t *b);
+NETWORK_API void network_backend_query_done(network_backend_t *b, gint64 latency_us);
+#define BACKEND_WEIGHT_DEFAULT 1
+#define BACKEND_WEIGHT_MAX 100
 void network_backend_save_challenge(network_backend_t *b,
                                    const network_mysqld_auth_challenge *);
 network_mysqld_auth_challenge *network_backend_get_challenge(network_backend_t *b);
 
+#define MAX_GROUP_SLAVES 4
+
+/* what routing needs to know of a backend */
+typedef struct backend_status_t {
+    network_backend_t *backend;
+    backend_state_t state;
+    backend_type_t type;
+    int slave_delay_msec;
+    int weight;
+} backend_status_t;
+
+typedef struct group_status_t {
+    int master; /* index into status, -1 if none */
+    int slaves[MAX_GROUP_SLAVES];
+    int nslaves;
+} group_status_t;
+
+/**
+ * immutable copy of the backends state, read by the event loop without
+ * locks while the monitor thread and admin publish new ones
+ *
+ * a replaced snapshot is freed once the event loop passed a quiescent
+ * point, see network_backends_quiescent()
+ */
+typedef struct network_backends_snapshot_t {
+    guint version;
+    guint count;
+    guint ro_server_num;
+    gboolean weighted;         /* a readonly backend has a weight other than the default */
+    backend_status_t *status;  /* indexed like network_backends_t.backends */
+    guint nro_up;
+    int *ro_up;                /* readonly backends that are available */
+    guint ngroups;
+    group_status_t *groups;    /* indexed like network_backends_t.groups */
+
+    guint retired_epoch;
+    struct network_backends_snapshot_t *next_retired;
+} network_backends_snapshot_t;
+
 typedef struct {
     unsigned int ro_server_num;
     unsigned int read_count;
@@ -86,6 +143,12 @@ typedef struct {
     /* GHashTable *ip_table; */
     GTimeVal backend_last_check;
     GPtrArray *groups; /* GPtrArray<network_group_t *> */
+
+    network_backends_snapshot_t *snapshot; /* never NULL */
+    network_backends_snapshot_t *retired;
+    guint epoch;        /* bumped by each publish */
+    guint reader_epoch; /* epoch at the last quiescent point of the event loop */
+    GMutex *publish_lock;
 } network_backends_t;
 
 NETWORK_API network_backends_t *network_backends_new();
@@ -96,6 +159,12 @@ NETWORK_API int network_backends_remove(network_backends_t *bs, guint index);
 NETWORK_API int network_backends_check(network_backends_t *bs);
 NETWORK_API int network_backends_modify(network_backends_t *, guint , backend_type_t, backend_state_t);
 NETWORK_API network_backend_t *network_backends_get(network_backends_t *bs, guint ndx);
+NETWORK_API int network_backends_set_state(network_backends_t *, guint, backend_state_t);
+NETWORK_API int network_backends_set_slave_delay(network_backends_t *, guint, int);
+NETWORK_API int network_backends_set_weight(network_backends_t *, guint, int);
+NETWORK_API gboolean network_backends_within_lag(network_backends_t *, guint, int max_lag_msec);
+NETWORK_API network_backends_snapshot_t *network_backends_get_snapshot(network_backends_t *);
+NETWORK_API void network_backends_quiescent(network_backends_t *);
 NETWORK_API guint network_backends_count(network_backends_t *bs);
 NETWORK_API gboolean network_backends_load_user_profile(network_backends_t *, chassis *);
 
@@ -107,10 +176,9 @@ int network_backends_find_address(network_backends_t *bs, const char *);
 network_mysqld_auth_challenge *
 network_backends_get_challenge(network_backends_t *b, int back_ndx);
 
-#define MAX_GROUP_SLAVES 4
-
 typedef struct network_group_t {
     GString *name;
+    int ndx; /* position in network_backends_t.groups */
     network_backend_t *master;
     network_backend_t *slaves[MAX_GROUP_SLAVES];
     int nslaves;
@@ -119,12 +187,20 @@ typedef struct network_group_t {
 
 network_group_t *network_backends_get_group(network_backends_t *, const GString *name);
 
-/* round-robin pick a slave from group */
-network_backend_t *network_group_pick_slave_backend(network_group_t *);
+/**
+ * pick a slave from group by weight
+ *
+ * @param max_lag_msec  slaves lagging more are skipped, 0 for any
+ */
+network_backend_t *network_group_pick_slave_backend(network_backends_t *, network_group_t *,
+                                                    backend_algo_t, int max_lag_msec);
+
+/* master of group, NULL if it is not available */
+network_backend_t *network_group_pick_master_backend(network_backends_t *, network_group_t *);
 
 void network_group_get_slave_names(network_group_t *, GString *);
 
-int network_backends_get_ro_ndx(network_backends_t *, backend_algo_t);
+int network_backends_get_ro_ndx(network_backends_t *, backend_algo_t, int max_lag_msec);
 
 int network_backends_get_rw_ndx(network_backends_t *);
 
@@ -9,14 +9,25 @@
 
 #define CHUNK 16384
 
-int cetus_compress_init(z_stream *strm)
+gboolean cetus_zstd_available(void)
+{
+#ifdef HAVE_ZSTD
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+int cetus_compress_init(z_stream *strm, int level)
 {
     /* allocate deflate state */
     strm->zalloc = Z_NULL;
     strm->zfree = Z_NULL;
     strm->opaque = Z_NULL;
 
-    int level = Z_DEFAULT_COMPRESSION;
+    if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION) {
+        level = Z_DEFAULT_COMPRESSION;
+    }
 
     return deflateInit(strm, level);
 }
@@ -26,32 +37,48 @@ void cetus_compress_end(z_stream *strm)
     (void) deflateEnd(strm);
 }
 
-int cetus_compress(z_stream *strm, GString *dst, char *src, int src_len, int end)
+/* let zlib write at the end of dst, it is grown only when full */
+static void out_begin(z_stream *strm, GString *dst)
+{
+    gsize used = dst->len;
+    gsize room = dst->allocated_len - used - 1;
+    if (room == 0) {
+        room = MAX(CHUNK, used);
+    }
+    g_string_set_size(dst, used + room);
+    strm->next_out = (Bytef *) dst->str + used;
+    strm->avail_out = room;
+}
+
+static void out_end(z_stream *strm, GString *dst)
+{
+    g_string_truncate(dst, (char *) strm->next_out - dst->str);
+}
+
+int cetus_compress(z_stream *strm, GString *dst, const char *src, int src_len, int end)
 {
-    int flush;
-    unsigned char out[CHUNK];
+    int ret;
+    int flush = end ? Z_FINISH : Z_NO_FLUSH;
 
     strm->avail_in = src_len;
-    flush = end ? Z_FINISH : Z_NO_FLUSH;
     strm->next_in = (Bytef *) src;
 
     /* run deflate() on input until output buffer not full, finish
        compression if all of source has been read in */
     do {
-        strm->avail_out = CHUNK;
-        strm->next_out = out;
-        deflate(strm, flush);   /* no bad return value */
-        unsigned int have = CHUNK - strm->avail_out;
-        if (have > 0) {
-            g_string_append_len(dst, (const gchar *) out, have);
-        }
-
-    } while (strm->avail_out == 0);
-
-    return Z_OK;
+        out_begin(strm, dst);
+        ret = deflate(strm, flush);
+        out_end(strm, dst);
+    } while (strm->avail_out == 0 && ret != Z_STREAM_END);
+
+    if (end) {
+        /* ready for the next packet, keeping the allocated state */
+        deflateReset(strm);
+    }
+    return ret == Z_STREAM_ERROR ? ret : Z_OK;
 }
 
-static int cetus_uncompress_init(z_stream *strm)
+int cetus_uncompress_init(z_stream *strm)
 {
     /* allocate inflate state */
     strm->zalloc = Z_NULL;
@@ -63,44 +90,104 @@ static int cetus_uncompress_init(z_stream *strm)
     return inflateInit(strm);
 }
 
-static void cetus_uncompress_end(z_stream *strm)
+void cetus_uncompress_end(z_stream *strm)
 {
     (void) inflateEnd(strm);
 }
 
-int cetus_uncompress(GString *uncompressed_packet, unsigned char *src, int len)
+int cetus_uncompress(z_stream *strm, GString *uncompressed_packet, unsigned char *src, int len)
 {
     int ret;
-    z_stream strm;
-    unsigned char out[CHUNK];
-
-    cetus_uncompress_init(&strm);
 
     /* decompress until deflate stream ends or end of file */
-    strm.avail_in = len;
-    strm.next_in = src;
+    strm->avail_in = len;
+    strm->next_in = src;
 
     /* run inflate() on input until output buffer not full */
     do {
-        strm.avail_out = CHUNK;
-        strm.next_out = out;
-        ret = inflate(&strm, Z_NO_FLUSH);
+        out_begin(strm, uncompressed_packet);
+        ret = inflate(strm, Z_NO_FLUSH);
+        out_end(strm, uncompressed_packet);
         switch (ret) {
             case Z_NEED_DICT:
                 ret = Z_DATA_ERROR;     /* and fall through */
             case Z_DATA_ERROR:
             case Z_MEM_ERROR:
-                (void)inflateEnd(&strm);
+                inflateReset(strm);
                 return ret;
         }
-        unsigned int have = CHUNK - strm.avail_out;
+    } while (strm->avail_out == 0 && ret != Z_STREAM_END);
+
+    inflateReset(strm);
+
+    return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
+}
 
-        g_string_append_len(uncompressed_packet, (const gchar *) out, have);
+#ifdef HAVE_ZSTD
+/* same as out_begin() for zstd */
+static void zstd_out_begin(ZSTD_outBuffer *out, GString *dst)
+{
+    gsize used = dst->len;
+    gsize room = dst->allocated_len - used - 1;
+    if (room == 0) {
+        room = MAX(CHUNK, used);
+    }
+    g_string_set_size(dst, used + room);
+    out->dst = dst->str + used;
+    out->size = room;
+    out->pos = 0;
+}
 
-    } while (strm.avail_out == 0);
+static void zstd_out_end(ZSTD_outBuffer *out, GString *dst)
+{
+    g_string_truncate(dst, (char *) out->dst + out->pos - dst->str);
+}
 
-    cetus_uncompress_end(&strm);
+/* each compressed packet is a zstd frame of its own */
+int cetus_zstd_compress(ZSTD_CCtx *cctx, GString *dst, const char *src, int src_len, int end)
+{
+    ZSTD_inBuffer in = { src, src_len, 0 };
+    ZSTD_EndDirective mode = end ? ZSTD_e_end : ZSTD_e_continue;
+    size_t remaining;
 
-    return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
+    do {
+        ZSTD_outBuffer out;
+        zstd_out_begin(&out, dst);
+        remaining = ZSTD_compressStream2(cctx, &out, &in, mode);
+        zstd_out_end(&out, dst);
+        if (ZSTD_isError(remaining)) {
+            g_message("%s: zstd compress failed: %s", G_STRLOC, ZSTD_getErrorName(remaining));
+            ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+            return -1;
+        }
+    } while (end ? remaining != 0 : in.pos < in.size);
+
+    return 0;
 }
 
+int cetus_zstd_uncompress(ZSTD_DCtx *dctx, GString *uncompressed_packet, unsigned char *src, int len)
+{
+    ZSTD_inBuffer in = { src, len, 0 };
+    size_t ret;
+
+    do {
+        ZSTD_outBuffer out;
+        zstd_out_begin(&out, uncompressed_packet);
+        ret = ZSTD_decompressStream(dctx, &out, &in);
+        zstd_out_end(&out, uncompressed_packet);
+        if (ZSTD_isError(ret)) {
+            g_message("%s: zstd uncompress failed: %s", G_STRLOC, ZSTD_getErrorName(ret));
+            break;
+        }
+        if (ret != 0 && in.pos == in.size && out.pos < out.size) {
+            break; /* truncated frame */
+        }
+    } while (ret != 0);
+
+    if (ret != 0) {
+        ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+        return -1;
+    }
+    return 0;
+}
+#endif
@@ -12,11 +12,37 @@
 #include <zlib.h>
 #include "network-exports.h"
 
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #define MIN_COMPRESS_LENGTH  50
+#define ZSTD_LEVEL_DEFAULT   3
+#define ZSTD_LEVEL_MAX       22
+
+/* payload codec of the compressed protocol */
+typedef enum {
+    COMPRESS_ALGO_ZLIB,
+    COMPRESS_ALGO_ZSTD, /* CLIENT_ZSTD_COMPRESSION_ALGORITHM, MySQL 8.0.18+ */
+} compress_algo_t;
 
-NETWORK_API int cetus_uncompress(GString *uncompressed_packet, unsigned char *src, int len);
-NETWORK_API int cetus_compress(z_stream *strm, GString *dst, char *src, int src_len, int end);
+/* TRUE if built with zstd, the handshake falls back to zlib otherwise */
+NETWORK_API gboolean cetus_zstd_available(void);
+
+/* the streams are kept per socket and reset after each packet */
+NETWORK_API int cetus_uncompress_init(z_stream *strm);
+NETWORK_API void cetus_uncompress_end(z_stream *strm);
+NETWORK_API int cetus_uncompress(z_stream *strm, GString *uncompressed_packet,
+                                 unsigned char *src, int len);
+NETWORK_API int cetus_compress_init(z_stream *strm, int level);
 NETWORK_API void cetus_compress_end(z_stream *strm);
-NETWORK_API int cetus_compress_init(z_stream *strm);
+NETWORK_API int cetus_compress(z_stream *strm, GString *dst, const char *src, int src_len, int end);
+
+#ifdef HAVE_ZSTD
+NETWORK_API int cetus_zstd_compress(ZSTD_CCtx *cctx, GString *dst, const char *src, int src_len,
+                                    int end);
+NETWORK_API int cetus_zstd_uncompress(ZSTD_DCtx *dctx, GString *uncompressed_packet,
+                                      unsigned char *src, int len);
+#endif
 
 #endif
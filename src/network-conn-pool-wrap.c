@@ -130,6 +130,10 @@ int network_pool_add_conn(network_mysqld_con *con, int is_swap) {
                 to_be_put_to_pool = FALSE;
             }
         }
+        /* give the budget back to the other workers */
+        if (network_backend_over_worker_share(st->backend)) {
+            to_be_put_to_pool = FALSE;
+        }
     }
 
     if (to_be_put_to_pool == FALSE) {
@@ -145,6 +149,7 @@ int network_pool_add_conn(network_mysqld_con *con, int is_swap) {
         }
 
         st->backend->connected_clients--;
+        network_backend_conns_publish(st->backend);
 
         network_socket_free(con->server); 
 
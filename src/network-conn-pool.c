@@ -231,6 +231,9 @@ network_connection_pool_entry *network_connection_pool_add(network_connection_po
     entry->pool = pool;
 
     sock->is_authed = 1;
+    /* idle connections don't hold on to a receive slab */
+    network_queue_release_spare(sock->recv_queue_raw);
+    sock->recv_slab_size = NETWORK_QUEUE_SLAB_MIN;
 
     g_debug("%s: (add) adding socket to pool for user '%s' -> %p", 
             G_STRLOC, sock->response->username->str, sock);
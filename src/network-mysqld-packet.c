@@ -1485,6 +1485,12 @@ int network_mysqld_proto_get_auth_response(network_packet *packet,
                 (auth->client_capabilities & CLIENT_PLUGIN_AUTH)) {
             err = err || network_mysqld_proto_get_gstr(packet, auth->auth_plugin_name);
         }
+
+        if (!err && (auth->client_capabilities & CLIENT_ZSTD_COMPRESSION_ALGORITHM)
+                && packet->data->len > packet->offset) {
+            /* the level is the last field, after the connect attributes */
+            auth->zstd_level = packet->data->str[packet->data->len - 1];
+        }
     } else {
         err = err || network_mysqld_proto_get_int16(packet, &l_cap);
         err = err || network_mysqld_proto_get_int24(packet, &auth->max_packet_size);
@@ -1551,6 +1557,13 @@ int network_mysqld_proto_get_and_change_auth_response(network_packet *packet,
         cap[2] &= ~(8|16);
         err = err || network_mysqld_proto_get_int32(packet, &auth->client_capabilities);
 
+        if (!err && (auth->client_capabilities & CLIENT_ZSTD_COMPRESSION_ALGORITHM)
+                && mysql_packet_len <= packet->data->len) {
+            /* the level is the last field, dropped with the others below */
+            auth->zstd_level = packet->data->str[mysql_packet_len - 1];
+            cap[3] &= ~(CLIENT_ZSTD_COMPRESSION_ALGORITHM >> 24);
+        }
+
         err = err || network_mysqld_proto_get_int32(packet, &auth->max_packet_size);
         err = err || network_mysqld_proto_get_int8(packet, &auth->charset);
 
@@ -1647,6 +1660,10 @@ int network_mysqld_proto_append_auth_response(GString *packet,
             g_string_append_len(packet, S(auth->auth_plugin_name));
             network_mysqld_proto_append_int8(packet, 0x00); /* trailing \0 */
         }
+
+        if (auth->client_capabilities & CLIENT_ZSTD_COMPRESSION_ALGORITHM) {
+            network_mysqld_proto_append_int8(packet, auth->zstd_level);
+        }
     }
 
     return 0;
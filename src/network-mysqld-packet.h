@@ -75,6 +75,9 @@ typedef struct {
 #ifndef CLIENT_PLUGIN_AUTH
 #define CLIENT_PLUGIN_AUTH (1UL << 19)
 #endif
+#ifndef CLIENT_ZSTD_COMPRESSION_ALGORITHM
+#define CLIENT_ZSTD_COMPRESSION_ALGORITHM (1UL << 26)
+#endif
 
 #define CETUS_DEFAULT_FLAGS CLIENT_BASIC_FLAGS                          \
     & ~CLIENT_PLUGIN_AUTH /* not support plugin auth */                 \
@@ -84,7 +87,8 @@ typedef struct {
     & ~CLIENT_PLUGIN_AUTH_LENENC_CLIENT_DATA                            \
     & ~CLIENT_CAN_HANDLE_EXPIRED_PASSWORDS                              \
     & ~CLIENT_SESSION_TRACK                                             \
-    & ~CLIENT_DEPRECATE_EOF
+    & ~CLIENT_DEPRECATE_EOF                                             \
+    & ~CLIENT_ZSTD_COMPRESSION_ALGORITHM
 
 
 NETWORK_API network_mysqld_com_query_result_t *network_mysqld_com_query_result_new(void);
@@ -199,6 +203,7 @@ struct network_mysqld_auth_response {
     GString *auth_plugin_data;
     GString *database;
     GString *auth_plugin_name;
+    guint8   zstd_level; /* with CLIENT_ZSTD_COMPRESSION_ALGORITHM */
 };
 
 NETWORK_API network_mysqld_auth_response *network_mysqld_auth_response_new(guint server_capabilities);
@@ -52,6 +52,8 @@
 #include "cetus-monitor.h"
 #include "cetus-variable.h"
 #include "plugin-common.h"
+#include "cetus-query-cache.h"
+#include "cetus-prepared-stmt.h"
 #ifdef NETWORK_DEBUG_TRACE_STATE_CHANGES
 #include "cetus-query-queue.h"
 #endif
@@ -205,10 +207,53 @@ void network_mysqld_priv_free(chassis G_GNUC_UNUSED *chas,
     g_free(priv);
 }
 
+/**
+ * keep our backend connection counts fresh for the other workers,
+ * even if we don't open or pool any connection for a while
+ */
+static void network_mysqld_priv_worker_sync(chassis *chas,
+        chassis_private *priv)
+{
+    int i;
+
+    for (i = 0; i < network_backends_count(priv->backends); i++) {
+        network_backend_t *backend = network_backends_get(priv->backends, i);
+        network_backend_conns_publish(backend);
+    }
+
+    worker_conns_t *conns = &chas->worker_stats->conns[chas->worker_no];
+    conns->clients = priv->cons->len;
+    conns->idle_backend_conns = network_backends_idle_conns(priv->backends);
+    conns->used_backend_conns = network_backends_used_conns(priv->backends);
+}
+
+static void network_mysqld_priv_quiescent(chassis G_GNUC_UNUSED *chas,
+        chassis_private *priv)
+{
+    /* retired backends snapshots get freed without client events too */
+    network_backends_quiescent(priv->backends);
+}
+
+static void network_mysqld_priv_master_init(chassis *chas, chassis_private *priv)
+{
+    cetus_monitor_start(priv->monitor, chas);
+}
+
+static void network_mysqld_priv_worker_init(chassis G_GNUC_UNUSED *chas,
+        chassis_private *priv)
+{
+    /* the monitor stays with the master */
+    cetus_monitor_stop(priv->monitor);
+}
+
 int network_mysqld_init(chassis *srv) {
     srv->priv_free = network_mysqld_priv_free;
     srv->priv_shutdown = network_mysqld_priv_shutdown;
     srv->priv_finally_free_shared = network_mysqld_priv_finally_free_shared;
+    srv->priv_worker_sync = network_mysqld_priv_worker_sync;
+    srv->priv_master_init = network_mysqld_priv_master_init;
+    srv->priv_worker_init = network_mysqld_priv_worker_init;
+    srv->priv_quiescent = network_mysqld_priv_quiescent;
     srv->priv      = network_mysqld_priv_init();
 
     cetus_users_read_json(srv->priv->users, srv->config_manager);
@@ -306,6 +351,10 @@ void network_mysqld_con_free(network_mysqld_con *con) {
         con->parse.data_free(con->parse.data);
     }
 
+    if (con->stmt_prep_result) {
+        network_mysqld_com_stmt_prepare_result_free(con->stmt_prep_result);
+    }
+
     if (con->servers != NULL) {
         g_warning("%s: servers are not null for con:%p", G_STRLOC, con);
     }
@@ -331,6 +380,14 @@ void network_mysqld_con_free(network_mysqld_con *con) {
     if (con->sharding_plan) {
         sharding_plan_free(con->sharding_plan);
     }
+    g_free(con->query_cache_key);
+    if (con->query_cache_tables) {
+        g_ptr_array_free(con->query_cache_tables, TRUE);
+    }
+    if (con->query_cache_written) { /* not committed */
+        g_ptr_array_free(con->query_cache_written, TRUE);
+    }
+    network_mysqld_con_time_backend(con, NULL);
     g_string_free(con->auth_switch_to_method, TRUE);
     g_string_free(con->auth_switch_to_data, TRUE);
 
@@ -450,7 +507,7 @@ int network_mysqld_queue_append(network_socket *sock, network_queue *queue,
         GString *s;
         gsize cur_packet_len = MIN(packet_len, PACKET_LEN_MAX);
 
-        s = g_string_sized_new(packet_len + 4);
+        s = network_packet_pool_get(cur_packet_len + 4);
 
         if (sock->packet_id_is_reset) {
             sock->packet_id_is_reset = FALSE;
@@ -665,8 +722,12 @@ network_mysqld_con_get_packet(chassis *chas, network_socket *con)
     header.allocated_len = sizeof(header_str);
     header.len = 0;
 
-    /* read the packet len if the leading packet */
-    if (!network_queue_peek_str(recv_queue_raw, NET_HEADER_SIZE, 
+    /* read the packet len if the leading packet, in place if we can */
+    const char *contig = network_queue_peek_contig(recv_queue_raw, NET_HEADER_SIZE);
+    if (contig) {
+        header.str = (char *) contig;
+        header.len = NET_HEADER_SIZE;
+    } else if (!network_queue_peek_str(recv_queue_raw, NET_HEADER_SIZE, 
                 &header)) 
     {
         g_debug("%s:wait for event", G_STRLOC);
@@ -747,37 +808,58 @@ network_mysqld_con_get_uncompressed_packet(chassis *chas, network_socket *con)
         return NETWORK_SOCKET_ERROR;
     }
 
-    /* move the packet from the raw queue to the recv-queue */
-    if ((packet = network_queue_pop_str(con->recv_queue_raw, 
-                    packet_len + NET_HEADER_SIZE + COMP_HEADER_SIZE, NULL))) 
-    {
+    /*
+     * uncompress straight out of the receive slab if the packet doesn't
+     * cross a chunk boundary, otherwise collect it into one string first
+     */
+    gsize total_len = packet_len + header_length;
+    const char *raw = network_queue_peek_contig(con->recv_queue_raw, total_len);
+    packet = NULL;
+    if (raw == NULL) {
+        packet = network_queue_pop_str(con->recv_queue_raw, total_len, NULL);
+        if (packet == NULL) {
+            return NETWORK_SOCKET_WAIT_FOR_EVENT;
+        }
+        raw = packet->str;
+    }
+
 #if NETWORK_DEBUG_TRACE_IO
-        g_debug("%s:output for sock:%p", G_STRLOC, con);
-        /* to trace the data we received from the socket, enable this */
-        g_debug_hexdump(G_STRLOC, S(packet));
+    g_debug("%s:output for sock:%p", G_STRLOC, con);
+    /* to trace the data we received from the socket, enable this */
+    g_debug_hexdump(G_STRLOC, raw, total_len);
 #endif
-        unsigned char *info = (unsigned char *) packet->str + NET_HEADER_SIZE;
-        int uncompressed_len = info[0] | info[1] << 8 | info[2] << 16;
-        g_debug("%s: do uncompress here, com len:%d, uncompress len:%d",
-                G_STRLOC, packet_len, uncompressed_len);
-
-        GString *uncompressed_packet;
-        if (uncompressed_len == 0) {
-            uncompressed_len = packet_len;
-            uncompressed_packet = g_string_sized_new(uncompressed_len);
-            g_string_append_len(uncompressed_packet, (char *) (info + COMP_HEADER_SIZE),
-                    uncompressed_len);
-        } else {
-            uncompressed_packet = g_string_sized_new(uncompressed_len);
-            cetus_uncompress(uncompressed_packet, 
-                    (unsigned char *) packet->str + header_length, packet_len);
-            g_debug("%s:call cetus_uncompress for con:%p", G_STRLOC, con);
+    unsigned char *info = (unsigned char *) raw + NET_HEADER_SIZE;
+    int uncompressed_len = info[0] | info[1] << 8 | info[2] << 16;
+    g_debug("%s: do uncompress here, com len:%d, uncompress len:%d",
+            G_STRLOC, packet_len, uncompressed_len);
+
+    GString *uncompressed_packet;
+    if (uncompressed_len == 0) {
+        uncompressed_len = packet_len;
+        uncompressed_packet = g_string_sized_new(uncompressed_len);
+        g_string_append_len(uncompressed_packet, (char *) (info + COMP_HEADER_SIZE),
+                uncompressed_len);
+    } else {
+        uncompressed_packet = g_string_sized_new(uncompressed_len);
+        if (network_socket_uncompress(con, uncompressed_packet,
+                    (unsigned char *) raw + header_length, packet_len) != 0
+            || uncompressed_packet->len != (gsize) uncompressed_len)
+        {
+            g_message("%s: corrupted compressed packet for con:%p", G_STRLOC, con);
+            g_string_free(uncompressed_packet, TRUE);
+            if (packet) {
+                g_string_free(packet, TRUE);
+            }
+            return NETWORK_SOCKET_ERROR;
         }
+        g_debug("%s:call cetus_uncompress for con:%p", G_STRLOC, con);
+    }
 
-        network_queue_append(con->recv_queue_uncompress_raw, uncompressed_packet);
+    network_queue_append(con->recv_queue_uncompress_raw, uncompressed_packet);
+    if (packet) {
         g_string_free(packet, TRUE);
     } else {
-        return NETWORK_SOCKET_WAIT_FOR_EVENT;
+        network_queue_skip(con->recv_queue_raw, total_len);
     }
 
     return NETWORK_SOCKET_SUCCESS;
@@ -889,6 +971,7 @@ network_mysqld_read_mul_packets(chassis G_GNUC_UNUSED *chas,
     server->is_waiting = 0;
     server->resp_len += to_read;
     enum enum_server_command orig_command = con->parse.command;
+    gpointer orig_parse_data = con->parse.data;
     if (con->attr_adj_state == ATTR_DIF_CHANGE_USER) {
         con->parse.command = COM_CHANGE_USER;
         g_debug("%s: set command COM_CHANGE_USER, attr adj:%d for con:%p",
@@ -898,6 +981,9 @@ network_mysqld_read_mul_packets(chassis G_GNUC_UNUSED *chas,
         g_debug("%s: set command COM_INIT_DB", G_STRLOC);
     } else if (con->attr_adj_state == ATTR_DIF_SET_OPTION) {
         con->parse.command = COM_SET_OPTION;
+    } else if (con->attr_adj_state == ATTR_DIF_PREPARE_STMT) {
+        con->parse.command = COM_STMT_PREPARE;
+        con->parse.data = con->stmt_prep_result;
     }
 
     network_socket *orig_server = con->server;
@@ -973,6 +1059,7 @@ network_mysqld_read_mul_packets(chassis G_GNUC_UNUSED *chas,
             G_STRLOC, server->parse.qs_state, ret, con);
 
     con->parse.command = orig_command;
+    con->parse.data = orig_parse_data;
 
     if ((*is_finished == 0) && ret == NETWORK_SOCKET_SUCCESS) {
         g_message("%s: not finished for server:%p, orig server:%p", 
@@ -1096,6 +1183,10 @@ plugin_call(chassis *srv, network_mysqld_con *con, int state)
                     con->state = ST_READ_QUERY;
                     if (con->is_client_compressed) {
                         con->client->do_compress = 1;
+                        if (con->client->compress_algo == COMPRESS_ALGO_ZLIB) {
+                            con->client->compress_level = con->srv->compress_level;
+                        }
+                        con->client->compress_min_len = con->srv->compress_min_len;
                         network_socket_set_send_buffer_size(con->client,
                                 COMPRESS_BUF_SIZE);
                     }
@@ -1558,6 +1649,73 @@ gboolean shard_set_default_db_consistant(network_mysqld_con *con)
     return result;
 }
 
+gboolean
+shard_set_stmt_prepared(network_mysqld_con *con)
+{
+    size_t i;
+
+    for (i = 0; i < con->servers->len; i++) {
+        server_session_t *pmd = g_ptr_array_index(con->servers, i);
+        if (!pmd->participated || pmd->attr_consistent) {
+            continue;
+        }
+
+        pmd->attr_adjusted_now = 0;
+        if ((pmd->attr_diff & ATTR_DIF_PREPARE_STMT) == 0) {
+            continue;
+        }
+
+        GString *payload = g_string_sized_new(con->orig_sql->len + 1);
+        g_string_append_c(payload, (char) COM_STMT_PREPARE);
+        g_string_append_len(payload, S(con->orig_sql));
+        network_mysqld_queue_reset(pmd->server);
+        network_mysqld_queue_append(pmd->server, pmd->server->send_queue, S(payload));
+        g_string_free(payload, TRUE);
+        g_debug("%s: prepare stmt again on server:%p", G_STRLOC, pmd->server);
+
+        pmd->attr_adjusted_now = 1;
+        pmd->server->parse.qs_state = PARSE_COM_QUERY_INIT;
+        con->resp_expected_num++;
+    }
+
+    /* only one server runs a statement, one tracker will do */
+    if (con->stmt_prep_result) {
+        network_mysqld_com_stmt_prepare_result_free(con->stmt_prep_result);
+    }
+    con->stmt_prep_result = network_mysqld_com_stmt_prepare_result_new();
+
+    return TRUE;
+}
+
+/* point the execute to the handles the statement just got on the servers */
+static void
+shard_stmt_prepared_again(network_mysqld_con *con)
+{
+    GString *packet = g_queue_peek_head(con->client->recv_queue->chunks);
+    size_t i;
+
+    for (i = 0; i < con->servers->len; i++) {
+        server_session_t *pmd = g_ptr_array_index(con->servers, i);
+        if (!pmd->participated || !pmd->attr_adjusted_now) {
+            continue;
+        }
+
+        guint32 server_stmt_id = network_mysqld_prepare_ok_stmt_id(pmd->server, NULL);
+        if (server_stmt_id == 0) {
+            /* the execute gets an unknown handler error from the server */
+            g_warning("%s: prepare again failed on server:%s for con:%p",
+                    G_STRLOC, pmd->server->dst->name->str, con);
+            continue;
+        }
+        server_stmt_cache_insert(network_mysqld_server_stmt_cache(con, pmd->server),
+                con->client->default_db, con->orig_sql, server_stmt_id);
+        network_mysqld_close_evicted_stmts(pmd->server);
+
+        GString payload = { packet->str + NET_HEADER_SIZE, packet->len - NET_HEADER_SIZE, 0 };
+        stmt_payload_set_id(&payload, server_stmt_id);
+    }
+}
+
 static session_attr_flags_t next_attribute(session_attr_flags_t flags,
                                            session_attr_flags_t attr)
 {
@@ -1565,7 +1723,7 @@ static session_attr_flags_t next_attribute(session_attr_flags_t flags,
     uint32_t a = attr << 1;
     while (a != 0 && ((a & flags) == 0)) { a <<= 1; }
 
-    if (a > ATTR_DIF_SET_AUTOCOMMIT) {
+    if (a > ATTR_DIF_PREPARE_STMT) {
         a = ATTR_START;
     }
 
@@ -1578,46 +1736,48 @@ build_attr_statements(network_mysqld_con *con)
     g_debug("%s:build_attr_statements here, attr state:%d",
             G_STRLOC, con->attr_adj_state);
 
-    con->attr_adj_state = next_attribute(con->unmatched_attribute, 
-            con->attr_adj_state);
-
-    if (con->attr_adj_state == ATTR_DIF_SET_AUTOCOMMIT) {
-        if (!con->dist_tran && con->delay_send_auto_commit) {
-            con->delay_send_auto_commit = 0;
-            g_debug("%s:need to set autocommit for con:%p", G_STRLOC, con);
-        } else {
-            con->attr_adj_state = ATTR_START;
-        }
+    if (con->attr_adj_state == ATTR_DIF_PREPARE_STMT) {
+        shard_stmt_prepared_again(con);
     }
 
     con->resp_expected_num = 0;
 
-    switch(con->attr_adj_state) {
-    case ATTR_DIF_DEFAULT_DB:
-        shard_set_default_db_consistant(con);
-        break;
-    case ATTR_DIF_CHARSET:
-        shard_set_charset_consistant(con);
-        break;
-    case ATTR_DIF_SET_OPTION:
-        shard_set_multi_stmt_consistant(con);
-        break;
-    case ATTR_DIF_SET_AUTOCOMMIT:
-        shard_set_autocommit(con);
-        break;
-    case ATTR_START:
-        break;
-    default:
-        g_message("%s:strange attr adj state:%d, conn:%p", 
-                  G_STRLOC, con->attr_adj_state, con);
-        break;
-    }
+    /* an attribute may turn out to need nothing, go on with the next one */
+    do {
+        con->attr_adj_state = next_attribute(con->unmatched_attribute, 
+                con->attr_adj_state);
 
-    con->state = ST_SEND_QUERY;
+        switch(con->attr_adj_state) {
+        case ATTR_DIF_DEFAULT_DB:
+            shard_set_default_db_consistant(con);
+            break;
+        case ATTR_DIF_CHARSET:
+            shard_set_charset_consistant(con);
+            break;
+        case ATTR_DIF_SET_OPTION:
+            shard_set_multi_stmt_consistant(con);
+            break;
+        case ATTR_DIF_SET_AUTOCOMMIT:
+            if (!con->dist_tran && con->delay_send_auto_commit) {
+                con->delay_send_auto_commit = 0;
+                g_debug("%s:need to set autocommit for con:%p", G_STRLOC, con);
+                shard_set_autocommit(con);
+            }
+            break;
+        case ATTR_DIF_PREPARE_STMT:
+            shard_set_stmt_prepared(con);
+            break;
+        case ATTR_START:
+            break;
+        default:
+            g_message("%s:strange attr adj state:%d, conn:%p", 
+                      G_STRLOC, con->attr_adj_state, con);
+            con->attr_adj_state = ATTR_START;
+            break;
+        }
+    } while (con->attr_adj_state != ATTR_START && con->resp_expected_num == 0);
 
-    if (con->resp_expected_num == 0) {
-        con->attr_adj_state = ATTR_START;
-    }
+    con->state = ST_SEND_QUERY;
 
     g_debug("%s: expected num:%d", G_STRLOC, con->resp_expected_num);
     g_debug("%s: attr adj state:%d", G_STRLOC, con->attr_adj_state);
@@ -1630,6 +1790,53 @@ build_attr_statements(network_mysqld_con *con)
 }
 
 
+server_stmt_cache_t *
+network_mysqld_server_stmt_cache(network_mysqld_con *con, network_socket *server)
+{
+    if (server->stmt_cache == NULL) {
+        server->stmt_cache = server_stmt_cache_new(con->srv->max_server_prepared_stmts);
+    }
+    return server->stmt_cache;
+}
+
+guint32
+network_mysqld_prepare_ok_stmt_id(network_socket *server, guint16 *num_params)
+{
+    GString *packet = g_queue_peek_head(server->recv_queue->chunks);
+    if (packet == NULL || packet->len < NET_HEADER_SIZE + 9
+            || packet->str[NET_HEADER_SIZE] != MYSQLD_PACKET_OK)
+    {
+        return 0;
+    }
+
+    const guchar *p = (const guchar *)packet->str + NET_HEADER_SIZE + 1;
+    if (num_params) {
+        *num_params = p[6] | (p[7] << 8);
+    }
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((guint32)p[3] << 24);
+}
+
+void
+network_mysqld_close_evicted_stmts(network_socket *server)
+{
+    guint32 stmt_id;
+
+    if (server->stmt_cache == NULL) {
+        return;
+    }
+    while ((stmt_id = server_stmt_cache_pop_evicted(server->stmt_cache)) != 0) {
+        GString *payload = g_string_sized_new(5);
+        g_string_append_c(payload, (char) COM_STMT_CLOSE);
+        g_string_append_len(payload, "\0\0\0\0", 4);
+        stmt_payload_set_id(payload, stmt_id);
+
+        /* no response, the one of the command is read as usual */
+        network_mysqld_queue_reset(server);
+        network_mysqld_queue_append(server, server->send_queue, S(payload));
+        g_string_free(payload, TRUE);
+    }
+}
+
 void
 shard_build_xa_query(network_mysqld_con *con, server_session_t *pmd)
 {
@@ -2086,7 +2293,7 @@ normal_result_merge(network_mysqld_con *con)
             g_critical("%s: tcp streamed resultset_merge failed:%p", G_STRLOC, con);
             g_debug_hexdump(G_STRLOC, S(con->orig_sql));
         }
-        network_queue_clear(con->client->send_queue);
+        network_socket_clear_send_queue(con->client);
         g_debug("%s: merge failed", G_STRLOC);
         if (result.detail) {
             network_mysqld_con_send_error_full(con->client, S(result.detail),
@@ -2189,10 +2396,82 @@ static void disp_query_after_consistant_attr(network_mysqld_con *con) {
     }
 }
  
+/**
+ * count the query as pending on backend until it is answered, a query
+ * still pending on the previous one is given up
+ */
+void network_mysqld_con_time_backend(network_mysqld_con *con, network_backend_t *backend)
+{
+    if (con->timed_backend) {
+        network_backend_query_done(con->timed_backend, -1);
+    }
+    con->timed_backend = backend;
+    if (backend) {
+        network_backend_query_start(backend);
+    }
+}
+
+static gint64 timeval_diff_usec(const struct timeval *from, const struct timeval *to) {
+    gint64 us = (to->tv_sec - from->tv_sec) * (gint64)G_USEC_PER_SEC
+        + (to->tv_usec - from->tv_usec);
+    return MAX(us, 0);
+}
+
+static void handle_query_latency_stats(network_mysqld_con *con, gint64 latency_us) {
+    query_stats_t *stats = &(con->srv->query_stats);
+    gint64 backend_us = 0;
+    int cmd;
+
+    if (timerisset(&(con->srv_send_time)) && timerisset(&(con->srv_recv_time))) {
+        backend_us = timeval_diff_usec(&(con->srv_send_time), &(con->srv_recv_time));
+        backend_us = MIN(backend_us, latency_us);
+    }
+    latency_hist_add(&(stats->latency_total), latency_us);
+    latency_hist_add(&(stats->latency_proxy), latency_us - backend_us);
+
+    if (con->timed_backend && con->timed_backend->id >= 0) {
+        latency_hist_add(&(stats->latency_backend[con->timed_backend->id]), backend_us);
+    }
+
+    switch (con->parse.command) {
+    case COM_QUERY:
+        cmd = LATENCY_CMD_QUERY;
+        break;
+    case COM_STMT_PREPARE:
+        cmd = LATENCY_CMD_PREPARE;
+        break;
+    case COM_STMT_EXECUTE:
+        cmd = LATENCY_CMD_EXECUTE;
+        break;
+    default:
+        latency_hist_add(&(stats->latency_cmd[LATENCY_CMD_OTHER]), latency_us);
+        return;
+    }
+
+    /* orig_sql of an execute is left from an earlier query, not its statement */
+    if (cmd != LATENCY_CMD_EXECUTE && con->orig_sql->len > 0) {
+        char text[LATENCY_SQL_TEXT_LEN];
+        uint64_t hash = latency_sql_fingerprint(S(con->orig_sql), text, sizeof(text));
+        latency_sql_add(stats->latency_sql, LATENCY_TOP_SQL, hash, text, latency_us);
+        if (cmd == LATENCY_CMD_QUERY) {
+            cmd = latency_sql_cmd(text);
+        }
+    }
+    latency_hist_add(&(stats->latency_cmd[cmd]), latency_us);
+}
+
 static void handle_query_time_stats(network_mysqld_con *con) {
     int diff = (con->resp_send_time.tv_sec - con->req_recv_time.tv_sec) * 1000;
     diff += (con->resp_send_time.tv_usec - con->req_recv_time.tv_usec) / 1000;
 
+    gint64 latency_us = timeval_diff_usec(&(con->req_recv_time), &(con->resp_send_time));
+    handle_query_latency_stats(con, latency_us);
+
+    if (con->timed_backend) {
+        network_backend_query_done(con->timed_backend, latency_us);
+        con->timed_backend = NULL;
+    }
+
     diff = MAX(0, diff);
     if (diff >= con->srv->long_query_time) {
         g_log("slowquery", G_LOG_LEVEL_MESSAGE,
@@ -2233,14 +2512,21 @@ handle_read_query(network_mysqld_con *con, network_mysqld_con_state_t ostate)
     recv_sock->total_output = 0;
 
     recv_sock->compressed_packet_id = 1;
-    recv_sock->do_strict_compress = 0;
 
     con->client->do_query_cache = 0;
     con->client->query_cache_too_long = 0;
     con->query_cache_judged = 0;
+    if (con->query_cache_key) {
+        g_free(con->query_cache_key);
+        con->query_cache_key = NULL;
+        g_ptr_array_free(con->query_cache_tables, TRUE);
+        con->query_cache_tables = NULL;
+    }
     con->is_read_ro_server_allowed = 0;
 
     gettimeofday(&(con->req_recv_time), NULL);
+    timerclear(&(con->srv_send_time));
+    timerclear(&(con->srv_recv_time));
 
     if (!con->is_wait_server) {
         do { 
@@ -2289,6 +2575,7 @@ handle_read_query(network_mysqld_con *con, network_mysqld_con_state_t ostate)
     }
 
     con->resp_too_long = 0;
+    con->stream_paused = 0;
     g_debug("%s:call read query", G_STRLOC);
     switch (plugin_call(srv, con, con->state)) {
     case NETWORK_SOCKET_SUCCESS:
@@ -2356,12 +2643,9 @@ handle_read_query(network_mysqld_con *con, network_mysqld_con_state_t ostate)
 
 static void 
 process_write_to_server(network_mysqld_con *con, server_session_t *pmd, 
-        int *write_wait)
+        network_socket_retval_t ret, int *write_wait)
 {
-    network_socket_retval_t ret;
-
     con->num_write_pending++;
-    ret = network_mysqld_write(con->srv, pmd->server);
 
     switch (ret) 
     {
@@ -2419,6 +2703,11 @@ process_shard_write(network_mysqld_con *con, int *disp_flag)
     con->num_write_pending = 0;
 
     int i, write_wait = 0;
+    int num_writes = 0;
+    server_session_t **pmds = g_new(server_session_t *, con->servers->len);
+    network_socket **socks = g_new(network_socket *, con->servers->len);
+    network_socket_retval_t *rets = g_new(network_socket_retval_t, con->servers->len);
+
     for (i = 0; i < con->servers->len; i++) {
         server_session_t *pmd = g_ptr_array_index(con->servers, i);
         pmd->index = i;
@@ -2444,10 +2733,21 @@ process_shard_write(network_mysqld_con *con, int *disp_flag)
         pmd->server->resp_len = 0;
 
         if (!g_queue_is_empty(pmd->server->send_queue->chunks)) {
-            process_write_to_server(con, pmd, &write_wait);
+            pmds[num_writes] = pmd;
+            socks[num_writes] = pmd->server;
+            num_writes++;
         }
     } /* for each server */
 
+    /* the writes of all the servers at once */
+    network_socket_write_batch(socks, num_writes, rets);
+    for (i = 0; i < num_writes; i++) {
+        process_write_to_server(con, pmds[i], rets[i], &write_wait);
+    }
+    g_free(pmds);
+    g_free(socks);
+    g_free(rets);
+
     if (con->state == ST_READ_M_QUERY_RESULT) {
         if (write_wait) {
             *disp_flag = DISP_STOP;
@@ -2530,6 +2830,10 @@ process_rw_write(network_mysqld_con *con, network_mysqld_con_state_t ostate,
                 network_mysqld_queue_reset(con->server);
             }
 
+            /* long data doesn't close anything */
+            if (con->parse.command != COM_STMT_CLOSE || con->prepare_stmt_count == 0) {
+                break;
+            }
             con->prepare_stmt_count--;
             g_debug("%s: conn:%p, sub, now prepare_stmt_count:%d",
                     G_STRLOC, con,
@@ -2906,7 +3210,7 @@ check_server_status(network_mysqld_con *con, int *srv_down_count, int *srv_respo
 
 static void disp_no_workers(network_mysqld_con *con) {
     if (con->dist_tran) {
-        network_queue_clear(con->client->send_queue);
+        network_socket_clear_send_queue(con->client);
         con->dist_tran_state = NEXT_ST_XA_OVER;
         con->dist_tran = 0;
         con->dist_tran_failed = 0;
@@ -2970,7 +3274,7 @@ static int disp_resp_workers_not_matched(network_mysqld_con *con, int *disp_flag
                         C("service unavailable"), ER_SERVER_SHUTDOWN, "08S01");
 
                 remove_mul_server_recv_packets(con);
-                network_queue_clear(con->client->send_queue);
+                network_socket_clear_send_queue(con->client);
                 network_queue_clear(con->client->recv_queue);
                 network_mysqld_queue_reset(con->client);
 
@@ -2998,6 +3302,24 @@ static int disp_resp_workers_not_matched(network_mysqld_con *con, int *disp_flag
 }
 
 
+/* the client prepared a statement, it gets the id of the proxy instead */
+static void
+shard_register_prepared_stmt(network_mysqld_con *con, network_socket *server)
+{
+    guint32 server_stmt_id = network_mysqld_prepare_ok_stmt_id(server,
+            &con->client_stmt_num_params);
+    if (server_stmt_id == 0 || con->client_stmt_id == 0) {
+        return;
+    }
+
+    server_stmt_cache_insert(network_mysqld_server_stmt_cache(con, server),
+            con->client->default_db, con->orig_sql, server_stmt_id);
+
+    GString *packet = g_queue_peek_head(server->recv_queue->chunks);
+    GString payload = { packet->str + NET_HEADER_SIZE, packet->len - NET_HEADER_SIZE, 0 };
+    stmt_payload_set_id(&payload, con->client_stmt_id);
+}
+
 static void
 disp_single_resp(network_mysqld_con *con)
 {
@@ -3024,6 +3346,10 @@ disp_single_resp(network_mysqld_con *con)
         out = pmd->server->recv_queue->chunks;
         in = con->client->send_queue;
 
+        if (con->parse.command == COM_STMT_PREPARE) {
+            shard_register_prepared_stmt(con, pmd->server);
+        }
+
         GString *packet = g_queue_pop_head(out);
         while (packet) {
             network_queue_append(in, packet);
@@ -3101,7 +3427,7 @@ static int disp_attr(network_mysqld_con *con, int srv_down_count, int *disp_flag
         *disp_flag = DISP_STOP;
         return 0;
     } else {
-        if (con->attr_adj_state <= ATTR_DIF_SET_AUTOCOMMIT) {
+        if (con->attr_adj_state <= ATTR_DIF_PREPARE_STMT) {
             if (srv_down_count > 0) {
                 con->state = ST_SEND_QUERY_RESULT;
                 if (con->dist_tran) {
@@ -3114,7 +3440,7 @@ static int disp_attr(network_mysqld_con *con, int srv_down_count, int *disp_flag
                         C("MySQL server down"), ER_SERVER_SHUTDOWN, "08S01");
 
                 remove_mul_server_recv_packets(con);
-                network_queue_clear(con->client->send_queue);
+                network_socket_clear_send_queue(con->client);
                 network_queue_clear(con->client->recv_queue);
                 network_mysqld_queue_reset(con->client);
 
@@ -3270,6 +3596,31 @@ void send_part_content_to_client(network_mysqld_con *con)
  
 }
 
+/**
+ * whether reading the backend of a streamed resultset has to wait for the client
+ *
+ * reads stop once the client send queue is above the high watermark and
+ * resume when it is back below the low one, which bounds the memory of a
+ * connection whatever the size of the resultset
+ */
+int network_mysqld_con_stream_paused(network_mysqld_con *con)
+{
+    gsize pending = con->client->send_queue->len;
+
+    if (con->stream_paused) {
+        if (pending <= (gsize) con->srv->stream_low_watermark) {
+            con->stream_paused = 0;
+            g_debug("%s: resume reading server for con:%p", G_STRLOC, con);
+        }
+    } else if (pending >= (gsize) con->srv->stream_high_watermark) {
+        con->stream_paused = 1;
+        g_debug("%s: pause reading server for con:%p, pending:%llu",
+                G_STRLOC, con, (unsigned long long) pending);
+    }
+
+    return con->stream_paused;
+}
+
 
 static void process_service_unavailable(network_mysqld_con *con) {
 
@@ -3377,45 +3728,31 @@ send_result_to_client(network_mysqld_con *con, network_mysqld_con_state_t ostate
     if (con->data) {
         cetus_clean_conn_data(con);
     }
+
+    if (con->servers_cancelled) {
+        if (con->servers) {
+            proxy_remove_cancelled_shard_conns(con);
+        }
+        con->servers_cancelled = 0;
+    }
     
     gettimeofday(&(con->resp_send_time), NULL);
     handle_query_time_stats(con);
 
     if (con->client->do_query_cache) {
-        if (con->client->query_cache_too_long) {
-            network_queue_free(con->client->cache_queue);
-            con->client->cache_queue = NULL;
-        } else {
-            GString *key = g_string_new(NULL);
-            g_string_append(key, con->orig_sql->str);
-            g_string_append(key, con->client->response->username->str);
-            g_string_append(key, con->client->default_db->str);
-            g_message("%s:key for cache:%s", G_STRLOC, key->str);
-            gchar *md5_key = g_compute_checksum_for_string(G_CHECKSUM_MD5, S(key));
-            g_string_free(key, TRUE);
-
-            query_cache_item *item = g_hash_table_lookup(srv->query_cache_table, md5_key);
-            if (item) {
-                g_warning("%s:key for cache exists:%s", G_STRLOC, md5_key);
-                g_hash_table_remove(srv->query_cache_table, md5_key);
-                network_queue_free(con->client->cache_queue);
-                g_free(md5_key);
-            } else {
-                g_debug("%s:put content to cache:%s", G_STRLOC, md5_key);
-                item = g_new0(query_cache_item, 1);
-                g_hash_table_insert(srv->query_cache_table, md5_key, item);
-                gchar *dup_key = g_strdup(md5_key);
-                query_cache_index_item *index = g_new0(query_cache_index_item, 1);
-                index->key = dup_key;
-                unsigned long long access_ms;
-                access_ms = con->resp_send_time.tv_sec * 1000 + con->resp_send_time.tv_usec / 1000;
-                index->expire_ms = access_ms + srv->default_query_cache_timeout;
-                g_queue_push_tail(srv->cache_index, index);
-
-                item->queue = con->client->cache_queue;
+        if (!con->client->query_cache_too_long && con->query_cache_key) {
+            guint64 req_ms, access_ms;
+            req_ms = con->req_recv_time.tv_sec * 1000ULL + con->req_recv_time.tv_usec / 1000;
+            access_ms = con->resp_send_time.tv_sec * 1000ULL + con->resp_send_time.tv_usec / 1000;
+            if (query_cache_insert(srv->query_cache, con->query_cache_key,
+                        con->query_cache_tables, con->client->cache_queue,
+                        req_ms, access_ms + srv->default_query_cache_timeout)) {
+                g_debug("%s:put content to cache:%s", G_STRLOC, con->query_cache_key);
             }
-            con->client->cache_queue = NULL;
         }
+        network_queue_free(con->client->cache_queue);
+        con->client->cache_queue = NULL;
+        con->client->do_query_cache = 0;
     }
 
     if (con->resultset_is_finished) {
@@ -3451,6 +3788,24 @@ normal_read_query_result(network_mysqld_con *con, network_mysqld_con_state_t ost
 {
     struct timeval timeout;
     chassis *srv = con->srv;
+
+    /* woken up by the client while the server reads are paused */
+    if (con->stream_paused) {
+        send_part_content_to_client(con);
+        if (con->state != ST_READ_QUERY_RESULT) {
+            con->stream_paused = 0;
+            return DISP_CONTINUE;
+        }
+        if (network_mysqld_con_stream_paused(con)) {
+            timeout = con->write_timeout;
+            WAIT_FOR_EVENT(con->client, EV_WRITE, &timeout);
+        } else {
+            timeout = con->read_timeout;
+            WAIT_FOR_EVENT(con->server, EV_READ, &timeout);
+        }
+        return DISP_STOP;
+    }
+
     /* read all packets of the resultset 
      *
      * depending on the backend we may forward the data 
@@ -3482,7 +3837,9 @@ normal_read_query_result(network_mysqld_con *con, network_mysqld_con_state_t ost
         switch (network_mysqld_read(srv, recv_sock)) {
             case NETWORK_SOCKET_SUCCESS:
                 recv_sock->resp_len += read_len;
-                if (recv_sock->resp_len > con->srv->max_resp_len) {
+                /* a streamed resultset is bounded by the watermarks instead */
+                if (recv_sock->resp_len > con->srv->max_resp_len &&
+                        !(srv->is_tcp_stream_enabled && !con->resultset_is_needed)) {
                     network_queue_clear(con->server->recv_queue);
                     network_mysqld_queue_reset(con->server);
                     g_message("%s: resp too long:%p, src port:%s, sql:%s", 
@@ -3507,6 +3864,14 @@ normal_read_query_result(network_mysqld_con *con, network_mysqld_con_state_t ost
                     g_debug("%s: send_part_content_to_client", G_STRLOC);
                     send_part_content_to_client(con);
                 }
+                if (con->state != ST_READ_QUERY_RESULT) {
+                    return DISP_CONTINUE;
+                }
+                if (network_mysqld_con_stream_paused(con)) {
+                    timeout = con->write_timeout;
+                    WAIT_FOR_EVENT(con->client, EV_WRITE, &timeout);
+                    return DISP_STOP;
+                }
                 WAIT_FOR_EVENT(con->server, EV_READ, &timeout);
                 return DISP_STOP;
             case NETWORK_SOCKET_ERROR_RETRY:
@@ -3527,7 +3892,7 @@ normal_read_query_result(network_mysqld_con *con, network_mysqld_con_state_t ost
                 if (!con->resultset_is_finished && 
                         !con->resultset_is_needed) 
                 {
-                    if (con->client->send_queue->len > 65536) {
+                    if (con->client->send_queue->len > (gsize) srv->stream_high_watermark) {
                         con->state = ST_SEND_QUERY_RESULT;
                         g_warning("%s: send queue len is too big for sock:%p", 
                                 G_STRLOC, con->client);
@@ -3605,6 +3970,9 @@ process_read_event(network_mysqld_con *con, int event_fd)
                 event_fd, g_strerror(errno));
         con->prev_state = con->state;
         con->state = ST_ERROR;
+    } else if (b == 0 && event_fd == con->client->fd 
+            && network_socket_zerocopy_only(con->client)) {
+        g_debug("%s:only zerocopy completions for con:%p", G_STRLOC, con);
     } else if (b != 0) {
         if (event_fd == con->client->fd) {
             con->client->to_read = b;
@@ -3680,6 +4048,9 @@ void network_mysqld_con_handle(int event_fd, short events, void *user_data) {
     chassis *srv = con->srv;
     int retval;
 
+    /* no backends snapshot of a previous event is in use here */
+    network_backends_quiescent(srv->priv->backends);
+
     if (events == EV_READ) {
         process_read_event(con, event_fd);
     } else if (events == EV_TIMEOUT) {
@@ -3994,6 +4365,13 @@ void network_mysqld_con_handle(int event_fd, short events, void *user_data) {
             break;
         }
 
+        if (con->state == ST_SEND_QUERY && !timerisset(&(con->srv_send_time))) {
+            gettimeofday(&(con->srv_send_time), NULL);
+        } else if (con->state == ST_SEND_QUERY_RESULT
+                && (ostate == ST_READ_QUERY_RESULT || ostate == ST_READ_M_QUERY_RESULT)) {
+            gettimeofday(&(con->srv_recv_time), NULL);
+        }
+
         event_fd = -1;
         events   = 0;
     } while (ostate != con->state);
@@ -4093,6 +4471,7 @@ void network_mysqld_con_accept(int G_GNUC_UNUSED event_fd, short events,
     /* looks like we open a client connection */
     client_con = network_mysqld_con_new();
     client_con->client = client;
+    client->zerocopy_threshold = listen_con->srv->zerocopy_threshold;
 
     g_debug("%s: add a new client connection: %p",
             G_STRLOC, client_con);
@@ -4355,7 +4734,18 @@ static retval_t proxy_self_create_auth(chassis *srv, server_connection_state_t *
     auth->client_capabilities = CETUS_DEFAULT_FLAGS;
 
     if (srv->is_back_compressed) {
-        auth->client_capabilities |= CLIENT_COMPRESS;
+        if (cetus_zstd_available()
+            && (challenge->capabilities & CLIENT_ZSTD_COMPRESSION_ALGORITHM))
+        {
+            auth->client_capabilities |= CLIENT_ZSTD_COMPRESSION_ALGORITHM;
+            auth->zstd_level = srv->zstd_compress_level;
+            send_sock->compress_algo = COMPRESS_ALGO_ZSTD;
+            send_sock->compress_level = srv->zstd_compress_level;
+        } else {
+            auth->client_capabilities |= CLIENT_COMPRESS;
+            send_sock->compress_algo = COMPRESS_ALGO_ZLIB;
+            send_sock->compress_level = srv->compress_level;
+        }
     }
 
     if (send_sock->default_db->len == 0) {
@@ -4450,7 +4840,8 @@ process_self_event(server_connection_state_t *con, int events, int event_fd)
             g_message("%s: self conn timeout, state:%d, con:%p, server:%p",
                     G_STRLOC, con->state, con, con->server);
             con->state = ST_ASYNC_ERROR;
-            con->backend->state = BACKEND_STATE_DOWN;
+            network_backends_set_state(con->srv->priv->backends, con->backend->ndx,
+                                       BACKEND_STATE_DOWN);
             g_message("%s: set backend:%p down", G_STRLOC, con->backend);
         }
     }
@@ -4543,6 +4934,7 @@ static int process_self_read_auth_result(server_connection_state_t *con)
 #endif
         if (con->srv->is_back_compressed) {
             con->server->do_compress = 1;
+            con->server->compress_min_len = con->srv->compress_min_len;
         }
         network_pool_add_idle_conn(con->pool, con->srv, con->server);
         con->server = NULL; /* tell _self_con_free we succeed */
@@ -4582,8 +4974,8 @@ static void network_mysqld_self_con_handle(int event_fd, short events,
             switch (network_socket_connect_finish(con->server)) {
             case NETWORK_SOCKET_SUCCESS:
                 if (con->backend->state != BACKEND_STATE_UP) {
-                    con->backend->state = BACKEND_STATE_UP;
-                    g_get_current_time(&(con->backend->state_since));
+                    network_backends_set_state(con->srv->priv->backends, con->backend->ndx,
+                                               BACKEND_STATE_UP);
                     g_message(G_STRLOC ": set backend: %s (%p) up",
                               con->backend->addr->name->str, con->backend);
                 }
@@ -4591,7 +4983,8 @@ static void network_mysqld_self_con_handle(int event_fd, short events,
                 break;
             default:
                 con->state = ST_ASYNC_ERROR;
-                con->backend->state = BACKEND_STATE_DOWN;
+                network_backends_set_state(con->srv->priv->backends, con->backend->ndx,
+                                           BACKEND_STATE_DOWN);
                 g_message(G_STRLOC ": set backend: %s (%p) down",
                           con->backend->addr->name->str, con->backend);
                 break;
@@ -4711,12 +5104,14 @@ void network_connection_pool_create_conn(network_mysqld_con *con) {
             g_debug("%s: backend ndx:%d total conn:%d, max allowed:%d", 
                     G_STRLOC, i, total, max_allowed_conn_num);
 
-            if (total >= max_allowed_conn_num) {
+            if (total >= network_backend_worker_share(backend, max_allowed_conn_num)
+                    && network_backend_conns_count_all(backend) >= max_allowed_conn_num) {
                 g_message("%s: backend ndx:%d reach max conn num:%d", 
                         G_STRLOC, i, max_allowed_conn_num);
                 backend->last_check_time = cur;
                 continue;
-            } else if (total >= pool->mid_idle_connections) {
+            } else if (total >= network_backend_worker_share(backend,
+                        pool->mid_idle_connections)) {
                 int is_need_to_create = 0;
                 switch(backend->type) {
                 case BACKEND_TYPE_RW:
@@ -4766,6 +5161,7 @@ void network_connection_pool_create_conn(network_mysqld_con *con) {
             }
 
             scs->backend->connected_clients++;
+            network_backend_conns_publish(scs->backend);
             g_message("%s: connected_clients add, backend ndx:%d, for server:%p, faked con:%p", 
                         G_STRLOC, i, scs->server, scs);
 
@@ -4780,8 +5176,7 @@ void network_connection_pool_create_conn(network_mysqld_con *con) {
             }
             case NETWORK_SOCKET_SUCCESS:
                 if (backend->state != BACKEND_STATE_UP) {
-                    backend->state = BACKEND_STATE_UP;
-                    g_get_current_time(&(backend->state_since));
+                    network_backends_set_state(g->backends, i, BACKEND_STATE_UP);
                     g_message("%s: set backend:%p, ndx:%d up", G_STRLOC, backend, i);
                 }
                 ASYNC_WAIT_FOR_EVENT(scs->server, EV_READ, 0, scs);
@@ -4789,8 +5184,7 @@ void network_connection_pool_create_conn(network_mysqld_con *con) {
                 break;
             default:
                 scs->backend->connected_clients--;
-                backend->state = BACKEND_STATE_DOWN;
-                g_get_current_time(&(backend->state_since));
+                network_backends_set_state(g->backends, i, BACKEND_STATE_DOWN);
                 network_mysqld_self_con_free(scs);
                 g_message("%s: set backend ndx:%d down", G_STRLOC, i);
                 break;
@@ -4806,8 +5200,12 @@ void network_connection_pool_create_conns(chassis *srv) {
 
     for (i = 0; i < network_backends_count(g->backends); i++) {
         network_backend_t *backend = network_backends_get(g->backends, i);
-        if (backend != NULL) {
-            for (j = 0; j < backend->config->mid_conn_pool; j++) {
+        /* one added by the admin has no pool config */
+        if (backend != NULL && backend->config != NULL) {
+            /* with worker processes each one opens its share */
+            int mid_conns = network_backend_worker_share(backend,
+                    backend->config->mid_conn_pool);
+            for (j = 0; j < mid_conns; j++) {
                 server_connection_state_t *scs = network_mysqld_self_con_init(srv);
                 if (srv->disable_dns_cache)
                     network_address_set_address(scs->server->dst, backend->address->str);
@@ -4839,6 +5237,7 @@ void network_connection_pool_create_conns(chassis *srv) {
                         G_STRLOC, i, scs->server, scs);
 
                 scs->backend->connected_clients++;
+                network_backend_conns_publish(scs->backend);
                 switch(network_socket_connect(scs->server)) {
                 case NETWORK_SOCKET_ERROR_RETRY: {
                     scs->state = ST_ASYNC_CONN;
@@ -4848,9 +5247,8 @@ void network_connection_pool_create_conns(chassis *srv) {
                 }
                 case NETWORK_SOCKET_SUCCESS:
                     if (backend->state != BACKEND_STATE_UP) {
-                        backend->state = BACKEND_STATE_UP;
+                        network_backends_set_state(g->backends, i, BACKEND_STATE_UP);
                         g_message("%s: set backend:%p, ndx:%d up", G_STRLOC, backend, i);
-                        g_get_current_time(&(backend->state_since));
                     }
                     ASYNC_WAIT_FOR_EVENT(scs->server, EV_READ, 0, scs);
                     scs->state = ST_ASYNC_READ_HANDSHAKE;
@@ -4859,8 +5257,7 @@ void network_connection_pool_create_conns(chassis *srv) {
                 default:
                     scs->backend->connected_clients--;
                     network_mysqld_self_con_free(scs);
-                    backend->state = BACKEND_STATE_DOWN;
-                    g_get_current_time(&(backend->state_since));
+                    network_backends_set_state(g->backends, i, BACKEND_STATE_DOWN);
                     g_message("%s: set backend ndx:%d down, connected_clients sub", G_STRLOC, i);
                     break;
                 }
@@ -283,6 +283,7 @@ typedef enum {
 	ATTR_DIF_CHARSET = 8,
 	ATTR_DIF_SET_OPTION = 16,
 	ATTR_DIF_SET_AUTOCOMMIT = 32, /* TODO: START TRANSACTION */
+	ATTR_DIF_PREPARE_STMT = 64, /* statement to execute not prepared there */
 } session_attr_flags_t;
 
 typedef struct {
@@ -304,6 +305,7 @@ typedef struct merge_parameters_s {
     int row_cnter;
     int off_pos;
     int is_pack_err;
+    int is_rest_cancelled;
     int aggr_output_len;
       
 } merge_parameters_t;
@@ -357,15 +359,6 @@ typedef struct mysqld_query_attr_t {
     unsigned int conn_reserved:1;
 } mysqld_query_attr_t;
 
-typedef struct query_cache_index_item {
-    gchar *key;
-    unsigned long long expire_ms;
-} query_cache_index_item;
-
-typedef struct query_cache_item {
-    network_queue *queue;
-} query_cache_item;
-
 struct query_queue_t;
 /**
  * get the name of a connection state
@@ -421,6 +414,13 @@ struct network_mysqld_con {
 
     session_attr_flags_t attr_adj_state;
 
+    /* sharding: statement id given to the client for the prepare in flight */
+    guint32 client_stmt_id;
+    /* sharding: number of params in the PREPARE OK of the server */
+    guint16 client_stmt_num_params;
+    /* sharding: tracks the responses of ATTR_DIF_PREPARE_STMT */
+    gpointer stmt_prep_result;
+
     proxy_session_state_t proxy_state;
 
     having_condition_t hav_condi;
@@ -537,6 +537,8 @@ struct network_mysqld_con {
     unsigned int xa_query_status_error_and_abort:1;
     unsigned int use_all_prev_servers:1;
     unsigned int partially_merged:1;
+    unsigned int servers_cancelled:1;
+    unsigned int stream_paused:1;
     unsigned int query_cache_judged:1;
     unsigned int is_client_compressed:1;
     unsigned int last_backend_type:2;
@@ -549,6 +551,18 @@ struct network_mysqld_con {
     struct timeval req_recv_time; 
     struct timeval resp_recv_time;
     struct timeval resp_send_time;
+    /* the backends work from the first query sent to the last result read */
+    struct timeval srv_send_time;
+    struct timeval srv_recv_time;
+
+    /* read that missed the query cache, kept to cache its resultset */
+    gchar *query_cache_key;
+    GPtrArray *query_cache_tables; /* "db.table" it reads */
+    /* written in the transaction, invalidated when it ends, NULL for unknown tables */
+    GPtrArray *query_cache_written;
+
+    /* backend answering the current query, its latency is recorded */
+    network_backend_t *timed_backend;
 
     guint64 resp_cnt;
     guint64 last_insert_id;
@@ -685,10 +699,14 @@ typedef struct {
     int trx_read_write; /* default TF_READ_WRITE */
     int trx_isolation_level; /* default TF_REPEATABLE_READ */
 
+    struct stmt_registry_t *stmt_registry; /* rw-only: prepared statements, if multiplexed */
+    int open_cursors;   /* rw-only: statements of the registry with a cursor on the server */
 } proxy_plugin_con_t;
 
 NETWORK_API network_mysqld_con *network_mysqld_con_new(void);
 NETWORK_API void network_mysqld_con_free(network_mysqld_con *con);
+NETWORK_API void network_mysqld_con_time_backend(network_mysqld_con *con,
+                                                 network_backend_t *backend);
 
 NETWORK_API void network_mysqld_con_accept(int event_fd, short events, void *user_data);
 
@@ -737,6 +755,7 @@ network_mysqld_read_mul_packets(chassis G_GNUC_UNUSED *chas, network_mysqld_con
         network_socket *server, int *is_finished);
 
 NETWORK_API void send_part_content_to_client(network_mysqld_con *con);
+NETWORK_API int network_mysqld_con_stream_paused(network_mysqld_con *con);
 NETWORK_API void set_conn_attr(network_mysqld_con *con, network_socket *server);
 NETWORK_API int network_mysqld_init(chassis *srv);
 NETWORK_API void network_mysqld_add_connection(chassis *srv, network_mysqld_con *con, gboolean listen);
@@ -754,6 +773,15 @@ NETWORK_API gboolean shard_set_autocommit(network_mysqld_con *con);
 NETWORK_API gboolean shard_set_charset_consistant(network_mysqld_con *con);
 NETWORK_API gboolean shard_set_default_db_consistant(network_mysqld_con *con);
 NETWORK_API gboolean shard_set_multi_stmt_consistant(network_mysqld_con *con);
+NETWORK_API gboolean shard_set_stmt_prepared(network_mysqld_con *con);
 NETWORK_API void shard_build_xa_query(network_mysqld_con *con, server_session_t *pmd);
 
+/* statement cache of server, created on first use */
+NETWORK_API struct server_stmt_cache_t *network_mysqld_server_stmt_cache(network_mysqld_con *con,
+        network_socket *server);
+/* statement id in the COM_STMT_PREPARE OK at the head of the server's recv queue, 0 if none */
+NETWORK_API guint32 network_mysqld_prepare_ok_stmt_id(network_socket *server, guint16 *num_params);
+/* queue a COM_STMT_CLOSE for each statement evicted from the cache of server */
+NETWORK_API void network_mysqld_close_evicted_stmts(network_socket *server);
+
 #endif
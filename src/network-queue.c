@@ -6,6 +6,179 @@
 #include "network-queue.h"
 #include "network-mysqld-proto.h"
 
+/**
+ * packet pool
+ *
+ * packets are taken from and given back to free lists by size class
+ * instead of going through malloc for each of them. a class holds the
+ * strings whose allocated_len lies between its size and the next one.
+ * there is one pool per process, it must only be used from the event
+ * loop thread
+ */
+static const guint packet_class_size[NETWORK_PACKET_POOL_CLASSES] = {
+    64, 512, 4096, 16384, 65536
+};
+
+/* upper bound of the free lists, about 2MB per class when full */
+static const guint packet_class_max_free[NETWORK_PACKET_POOL_CLASSES] = {
+    4096, 2048, 512, 128, 32
+};
+
+static GPtrArray *packet_free_list[NETWORK_PACKET_POOL_CLASSES];
+static network_packet_pool_stats_t packet_pool_stats;
+
+/**
+ * a packet put in several queues at once, see network_packet_share()
+ *
+ * a GString always has room for its NUL, allocated_len 0 tells a shared
+ * packet from the others
+ */
+typedef struct {
+    GString packet;     /* has to be the first */
+    guint refcount;
+} shared_packet_t;
+
+guint
+network_packet_pool_class_size(int class_no)
+{
+    return packet_class_size[class_no];
+}
+
+/**
+ * get an empty string that can hold len bytes
+ */
+GString *
+network_packet_pool_get(gsize len)
+{
+    int i;
+
+    for (i = 0; i < NETWORK_PACKET_POOL_CLASSES; i++) {
+        if (packet_class_size[i] > len) {
+            break;
+        }
+    }
+
+    if (i == NETWORK_PACKET_POOL_CLASSES) {
+        packet_pool_stats.misses++;
+        return g_string_sized_new(len);
+    }
+
+    GPtrArray *list = packet_free_list[i];
+    if (list && list->len > 0) {
+        packet_pool_stats.hits++;
+        return g_ptr_array_remove_index_fast(list, list->len - 1);
+    }
+
+    packet_pool_stats.misses++;
+    /* -1: glib rounds allocated_len up to the next power of two */
+    return g_string_sized_new(packet_class_size[i] - 1);
+}
+
+/**
+ * give a string back to the pool, frees it if it doesn't fit a class
+ */
+void
+network_packet_pool_put(GString *packet)
+{
+    int i;
+
+    if (packet == NULL) {
+        return;
+    }
+
+    if (packet->allocated_len == 0) {
+        shared_packet_t *shared = (shared_packet_t *)packet;
+        if (--shared->refcount == 0) {
+            g_free(shared->packet.str);
+            g_free(shared);
+        }
+        return;
+    }
+
+    for (i = NETWORK_PACKET_POOL_CLASSES - 1; i >= 0; i--) {
+        if (packet->allocated_len >= packet_class_size[i]) {
+            break;
+        }
+    }
+
+    if (i < 0 || packet->allocated_len > 2 * packet_class_size[NETWORK_PACKET_POOL_CLASSES - 1]) {
+        packet_pool_stats.drops++;
+        g_string_free(packet, TRUE);
+        return;
+    }
+
+    if (packet_free_list[i] == NULL) {
+        packet_free_list[i] = g_ptr_array_sized_new(packet_class_max_free[i]);
+    }
+
+    GPtrArray *list = packet_free_list[i];
+    if (list->len >= packet_class_max_free[i]) {
+        packet_pool_stats.drops++;
+        g_string_free(packet, TRUE);
+        return;
+    }
+
+    g_string_truncate(packet, 0);
+    g_ptr_array_add(list, packet);
+    packet_pool_stats.puts++;
+}
+
+/**
+ * free all pooled strings, used when we are asked to give memory back
+ */
+void
+network_packet_pool_shrink(void)
+{
+    int i;
+
+    for (i = 0; i < NETWORK_PACKET_POOL_CLASSES; i++) {
+        GPtrArray *list = packet_free_list[i];
+        if (list == NULL) {
+            continue;
+        }
+        while (list->len > 0) {
+            g_string_free(g_ptr_array_remove_index_fast(list, list->len - 1), TRUE);
+        }
+    }
+}
+
+void
+network_packet_pool_get_stats(network_packet_pool_stats_t *stats)
+{
+    int i;
+
+    *stats = packet_pool_stats;
+    for (i = 0; i < NETWORK_PACKET_POOL_CLASSES; i++) {
+        stats->free_count[i] = packet_free_list[i] ? packet_free_list[i]->len : 0;
+    }
+}
+
+/**
+ * make a packet shareable by several queues without copying it
+ *
+ * packet is taken over, the returned one must not be modified. each
+ * network_packet_ref() needs a network_packet_pool_put(), the last one
+ * frees it
+ */
+GString *
+network_packet_share(GString *packet)
+{
+    shared_packet_t *shared = g_new(shared_packet_t, 1);
+    shared->packet.len = packet->len;
+    shared->packet.allocated_len = 0;
+    shared->packet.str = g_string_free(packet, FALSE);
+    shared->refcount = 1;
+    return &shared->packet;
+}
+
+GString *
+network_packet_ref(GString *packet)
+{
+    g_assert(packet->allocated_len == 0);
+    ((shared_packet_t *)packet)->refcount++;
+    return packet;
+}
+
 network_queue *network_queue_new() {
     network_queue *queue;
 
@@ -22,11 +195,15 @@ void network_queue_free(network_queue *queue) {
     if (!queue) return;
 
     while ((packet = g_queue_pop_head(queue->chunks))) {
-        g_string_free(packet, TRUE);
+        network_packet_pool_put(packet);
     }
 
     g_queue_free(queue->chunks);
 
+    if (queue->spare) {
+        network_packet_pool_put(queue->spare);
+    }
+
     g_free(queue);
 }
 
@@ -35,7 +212,7 @@ void network_queue_clear(network_queue *queue)
     if (!queue) return;
     GString *packet;
     while ((packet = g_queue_pop_head(queue->chunks)) != NULL) {
-        g_string_free(packet, TRUE);
+        network_packet_pool_put(packet);
     }
     queue->len = queue->offset = 0;
 }
@@ -56,6 +233,103 @@ int network_queue_append(network_queue *queue, GString *s) {
     return 0;
 }
 
+/**
+ * keep a drained chunk around so the next read doesn't have to allocate
+ *
+ * only one chunk is kept and only if it is a plain receive slab
+ */
+static void
+network_queue_recycle_chunk(network_queue *queue, GString *chunk)
+{
+    if (queue->recycle_chunks && queue->spare == NULL
+            && chunk->allocated_len <= NETWORK_QUEUE_SLAB_MAX) {
+        g_string_truncate(chunk, 0);
+        queue->spare = chunk;
+    } else {
+        network_packet_pool_put(chunk);
+    }
+}
+
+/**
+ * hand out the recycled chunk if it can hold min_len bytes
+ *
+ * @return NULL if there is no spare chunk or it is too small
+ */
+GString *
+network_queue_take_spare(network_queue *queue, gsize min_len)
+{
+    GString *chunk = queue->spare;
+
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    queue->spare = NULL;
+
+    /* keep room for the trailing \0 */
+    if (chunk->allocated_len <= min_len) {
+        network_packet_pool_put(chunk);
+        return NULL;
+    }
+
+    return chunk;
+}
+
+void
+network_queue_release_spare(network_queue *queue)
+{
+    if (queue->spare) {
+        network_packet_pool_put(queue->spare);
+        queue->spare = NULL;
+    }
+}
+
+/**
+ * get a pointer to the next peek_len bytes without copying them
+ *
+ * @return NULL if there is not enough data or it spans more than one chunk
+ */
+const char *
+network_queue_peek_contig(network_queue *queue, gsize peek_len)
+{
+    GString *chunk;
+
+    if (queue->len < peek_len) {
+        return NULL;
+    }
+
+    chunk = g_queue_peek_head(queue->chunks);
+    if (chunk == NULL || chunk->len - queue->offset < peek_len) {
+        return NULL;
+    }
+
+    return chunk->str + queue->offset;
+}
+
+/**
+ * drop skip_len bytes from the head of the queue
+ */
+void
+network_queue_skip(network_queue *queue, gsize skip_len)
+{
+    GString *chunk;
+
+    g_assert_cmpint(queue->len, >=, skip_len);
+
+    while (skip_len && (chunk = g_queue_peek_head(queue->chunks))) {
+        gsize we_have = MIN(skip_len, chunk->len - queue->offset);
+
+        queue->offset += we_have;
+        queue->len    -= we_have;
+        skip_len -= we_have;
+
+        if (chunk->len == queue->offset) {
+            network_queue_recycle_chunk(queue, g_queue_pop_head(queue->chunks));
+            queue->offset = 0;
+        }
+    }
+}
+
 /**
  * get a string from the head of the queue and leave the queue unchanged 
  *
@@ -124,11 +398,13 @@ network_queue_pop_str(network_queue *queue, gsize steal_len, GString *dest)
         gsize we_have = we_want < (chunk->len - queue->offset) ? 
             we_want : (chunk->len - queue->offset);
 
-        if (!dest && (queue->offset == 0) && (chunk->len == steal_len)) {
+        if (!dest && (queue->offset == 0) && (chunk->len == steal_len)
+                && chunk->allocated_len <= 2 * (steal_len + 1)) {
             /* optimize the common case that we want to have to full chunk
              *
              * if dest is null, we can remove the GString from the queue and
-             * return it directly without copying it
+             * return it directly without copying it. a receive slab much
+             * larger than the packet is copied instead and stays reusable
              */
             dest = g_queue_pop_head(queue->chunks);
             queue->len -= we_have;
@@ -137,7 +413,7 @@ network_queue_pop_str(network_queue *queue, gsize steal_len, GString *dest)
 
         if (!dest) {
             /* if we don't have a dest-buffer yet, create one */
-            dest = g_string_sized_new(steal_len);
+            dest = network_packet_pool_get(steal_len);
         }
         g_string_append_len(dest, chunk->str + queue->offset, we_have);
 
@@ -147,7 +423,7 @@ network_queue_pop_str(network_queue *queue, gsize steal_len, GString *dest)
 
         if (chunk->len == queue->offset) {
             /* the chunk is done, remove it */
-            g_string_free(g_queue_pop_head(queue->chunks), TRUE);
+            network_queue_recycle_chunk(queue, g_queue_pop_head(queue->chunks));
             queue->offset = 0;
         } else {
             break;
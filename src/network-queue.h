@@ -5,12 +5,30 @@
 
 #include <glib.h>
 
+/* bounds of the per-socket receive slab, see network_socket_read() */
+#define NETWORK_QUEUE_SLAB_MIN 2048
+#define NETWORK_QUEUE_SLAB_MAX 65536
+
+/* size classes of the packet pool: 64B, 512B, 4KB, 16KB, 64KB */
+#define NETWORK_PACKET_POOL_CLASSES 5
+
+typedef struct {
+    guint64 hits;       /* get served from a free list */
+    guint64 misses;     /* get that had to allocate */
+    guint64 puts;       /* strings kept for reuse */
+    guint64 drops;      /* strings freed because they didn't fit */
+    guint free_count[NETWORK_PACKET_POOL_CLASSES];
+} network_packet_pool_stats_t;
+
 /* a input or output stream */
 typedef struct {
     GQueue *chunks;
 
     size_t len;    /* len in all chunks (w/o the offset) */
     size_t offset; /* offset in the first chunk */
+
+    GString *spare; /* drained receive chunk kept for the next read */
+    gboolean recycle_chunks; /* set on the raw receive queue only */
 } network_queue;
 
 NETWORK_API network_queue *network_queue_new(void);
@@ -19,5 +37,17 @@ void network_queue_clear(network_queue *queue);
 NETWORK_API int network_queue_append(network_queue *queue, GString *chunk);
 NETWORK_API GString *network_queue_pop_str(network_queue *queue, gsize steal_len, GString *dest);
 NETWORK_API GString *network_queue_peek_str(network_queue *queue, gsize peek_len, GString *dest);
+NETWORK_API const char *network_queue_peek_contig(network_queue *queue, gsize peek_len);
+NETWORK_API void network_queue_skip(network_queue *queue, gsize skip_len);
+NETWORK_API GString *network_queue_take_spare(network_queue *queue, gsize min_len);
+NETWORK_API void network_queue_release_spare(network_queue *queue);
+
+NETWORK_API GString *network_packet_pool_get(gsize len);
+NETWORK_API void network_packet_pool_put(GString *packet);
+NETWORK_API void network_packet_pool_shrink(void);
+NETWORK_API guint network_packet_pool_class_size(int class_no);
+NETWORK_API void network_packet_pool_get_stats(network_packet_pool_stats_t *stats);
+NETWORK_API GString *network_packet_share(GString *packet);
+NETWORK_API GString *network_packet_ref(GString *packet);
 
 #endif
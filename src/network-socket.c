@@ -28,6 +28,18 @@
 #include <fcntl.h>
 #include <linux/version.h>
 
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+#include <linux/errqueue.h>
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+#define HAVE_MSG_ZEROCOPY 1
+#endif
+#endif
+
+#ifdef HAVE_LIBURING
+#include <stdint.h>
+#include <liburing.h>
+#endif
+
 #ifdef HAVE_WRITEV
 #define USE_BUFFERED_NETIO 
 #else
@@ -55,8 +67,26 @@
 #include "network-mysqld-packet.h"
 #include "cetus-util.h"
 #include "network-compress.h"
+#include "cetus-prepared-stmt.h"
 #include "glib-ext.h"
 
+#ifdef HAVE_MSG_ZEROCOPY
+typedef struct {
+    GString *chunk;
+    guint32 seq;    /* can be freed once zerocopy_done reaches it */
+    time_t expire;  /* for chunks of closed sockets */
+} zerocopy_chunk_t;
+
+/* chunks of closed sockets the kernel may still be sending from */
+static GQueue *zerocopy_orphans;
+
+#define ZEROCOPY_ORPHAN_TIMEOUT 5
+
+static void network_socket_zerocopy_reap(network_socket *sock);
+static void network_socket_zerocopy_release(network_socket *sock);
+#endif
+static void network_socket_retire_chunk(network_socket *sock, GString *s);
+
 network_socket *network_socket_new() {
     network_socket *s;
 
@@ -65,6 +95,7 @@ network_socket *network_socket_new() {
     s->send_queue = network_queue_new();
     s->recv_queue = network_queue_new();
     s->recv_queue_raw = network_queue_new();
+    s->recv_queue_raw->recycle_chunks = TRUE;
     s->recv_queue_uncompress_raw = network_queue_new();
 
     s->default_db = g_string_new(NULL);
@@ -78,6 +109,10 @@ network_socket *network_socket_new() {
     s->fd           = -1;
     s->socket_type  = SOCK_STREAM; /* let's default to TCP */
     s->packet_id_is_reset = TRUE;
+    s->recv_slab_size = NETWORK_QUEUE_SLAB_MIN;
+    s->compress_algo = COMPRESS_ALGO_ZLIB;
+    s->compress_level = Z_DEFAULT_COMPRESSION;
+    s->compress_min_len = MIN_COMPRESS_LENGTH;
 
     s->src = network_address_new();
     s->dst = network_address_new();
@@ -95,10 +130,24 @@ void network_socket_free(network_socket *s) {
         g_string_free(s->last_compressed_packet, TRUE);
         s->last_compressed_packet = NULL;
     }
+    if (s->deflate_strm) {
+        cetus_compress_end(s->deflate_strm);
+        g_free(s->deflate_strm);
+    }
+    if (s->inflate_strm) {
+        cetus_uncompress_end(s->inflate_strm);
+        g_free(s->inflate_strm);
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(s->zstd_cctx);
+    ZSTD_freeDCtx(s->zstd_dctx);
+#endif
+    network_socket_clear_send_queue(s);
     network_queue_free(s->send_queue);
     network_queue_free(s->recv_queue);
     network_queue_free(s->recv_queue_raw);
     network_queue_free(s->recv_queue_uncompress_raw);
+    network_queue_free(s->cache_queue);
 
     if (s->response) network_mysqld_auth_response_free(s->response);
     if (s->challenge) network_mysqld_auth_challenge_free(s->challenge);
@@ -106,6 +155,12 @@ void network_socket_free(network_socket *s) {
     network_address_free(s->dst);
     network_address_free(s->src);
 
+#ifdef HAVE_MSG_ZEROCOPY
+    network_socket_zerocopy_release(s);
+#endif
+    g_free(s->send_iov);
+    server_stmt_cache_free(s->stmt_cache);
+
     if (s->event.ev_base) { /* if .ev_base isn't set, the event never got added */
         g_debug("%s:event del, ev:%p",G_STRLOC, &(s->event));
         event_del(&(s->event));
@@ -114,6 +169,13 @@ void network_socket_free(network_socket *s) {
     if (s->fd != -1) {
         closesocket(s->fd);
     }
+    if (s->worker_fds) {
+        guint i;
+        for (i = 0; i < s->worker_fds->len; i++) {
+            closesocket(g_array_index(s->worker_fds, int, i));
+        }
+        g_array_free(s->worker_fds, TRUE);
+    }
 
     g_string_free(s->default_db, TRUE);
     g_string_free(s->charset_client, TRUE);
@@ -412,6 +474,24 @@ network_socket_retval_t network_socket_bind(network_socket *con) {
                         g_strerror(errno), errno);
                 return NETWORK_SOCKET_ERROR;
             }
+
+            if (con->reuseport) {
+#ifdef SO_REUSEPORT
+                if (0 != setsockopt(con->fd, SOL_SOCKET, SO_REUSEPORT, 
+                            SETSOCKOPT_OPTVAL_CAST &val, sizeof(val))) 
+                {
+                    g_critical("%s: setsockopt(%s, SOL_SOCKET, SO_REUSEPORT) failed: %s (%d)", 
+                            G_STRLOC,
+                            con->dst->name->str,
+                            g_strerror(errno), errno);
+                    return NETWORK_SOCKET_ERROR;
+                }
+#else
+                g_critical("%s: SO_REUSEPORT is not supported, can't share %s between workers", 
+                        G_STRLOC, con->dst->name->str);
+                return NETWORK_SOCKET_ERROR;
+#endif
+            }
         }
 
         if (con->dst->addr.common.sa_family == AF_INET6) {
@@ -566,20 +646,58 @@ network_socket_retval_t network_socket_bind(network_socket *con) {
  *
  * @param sock the socket
  */
+/**
+ * get a buffer with room for to_read bytes at its end
+ *
+ * reads are appended to the receive slab at the tail of the raw queue, so
+ * the packets of a resultset share one buffer instead of one per read.
+ * the slab size follows the recent reads: it grows at once and shrinks
+ * by half when the reads get much smaller. a drained slab is kept by the
+ * queue and reused for the next read
+ */
+static GString *
+network_socket_get_recv_buffer(network_socket *sock)
+{
+    network_queue *raw = sock->recv_queue_raw;
+    gsize want = sock->to_read;
+    GString *slab;
+
+    if (want > sock->recv_slab_size) {
+        while (sock->recv_slab_size < want && sock->recv_slab_size < NETWORK_QUEUE_SLAB_MAX) {
+            sock->recv_slab_size <<= 1;
+        }
+    } else if (want < sock->recv_slab_size / 4 && sock->recv_slab_size > NETWORK_QUEUE_SLAB_MIN) {
+        sock->recv_slab_size >>= 1;
+    }
+
+    /* keep room for the trailing \0 */
+    slab = g_queue_peek_tail(raw->chunks);
+    if (slab && slab->allocated_len - slab->len > want) {
+        return slab;
+    }
+
+    slab = network_queue_take_spare(raw, want);
+    if (slab == NULL) {
+        /* -1: glib rounds allocated_len up to the next power of two */
+        slab = network_packet_pool_get(MAX(want, sock->recv_slab_size - 1));
+    }
+    g_queue_push_tail(raw->chunks, slab);
+
+    return slab;
+}
+
 network_socket_retval_t network_socket_read(network_socket *sock) {
     gssize len;
 
     if (sock->to_read > 0) {
-        GString *packet = g_string_sized_new(sock->to_read);
-
-        g_queue_push_tail(sock->recv_queue_raw->chunks, packet);
+        GString *packet = network_socket_get_recv_buffer(sock);
 
         g_debug("%s: recv queue length:%d, sock:%p, client addr:%s, to read:%d",
                 G_STRLOC, sock->recv_queue_raw->chunks->length, 
                 sock, sock->src->name->str, (int) sock->to_read);
 
         g_debug("%s: tcp read:%d for fd:%d", G_STRLOC, (int) sock->to_read, sock->fd);
-        len = recv(sock->fd, packet->str, sock->to_read, 0);
+        len = recv(sock->fd, packet->str + packet->len, sock->to_read, 0);
 
         if (-1 == len) {
             switch (errno) {
@@ -607,12 +725,97 @@ network_socket_retval_t network_socket_read(network_socket *sock) {
 
         sock->to_read -= len;
         sock->recv_queue_raw->len += len;
-        packet->len = len;
+        packet->len += len;
+        packet->str[packet->len] = '\0';
     }
 
     return NETWORK_SOCKET_SUCCESS;
 }
 
+/* create the compression state of the negotiated algorithm on first use */
+static gboolean
+network_socket_compress_ready(network_socket *sock)
+{
+#ifdef HAVE_ZSTD
+    if (sock->compress_algo == COMPRESS_ALGO_ZSTD) {
+        if (sock->zstd_cctx == NULL) {
+            sock->zstd_cctx = ZSTD_createCCtx();
+            if (sock->zstd_cctx == NULL) {
+                g_warning("%s: ZSTD_createCCtx failed", G_STRLOC);
+                return FALSE;
+            }
+            ZSTD_CCtx_setParameter(sock->zstd_cctx, ZSTD_c_compressionLevel,
+                                   sock->compress_level);
+        }
+        return TRUE;
+    }
+#endif
+    if (sock->deflate_strm == NULL) {
+        z_stream *strm = g_new0(z_stream, 1);
+        if (cetus_compress_init(strm, sock->compress_level) != Z_OK) {
+            g_warning("%s: deflateInit failed: %s", G_STRLOC, strm->msg ? strm->msg : "");
+            g_free(strm);
+            return FALSE;
+        }
+        sock->deflate_strm = strm;
+    }
+    return TRUE;
+}
+
+static gsize
+network_socket_compress_bound(network_socket *sock, gsize len)
+{
+#ifdef HAVE_ZSTD
+    if (sock->compress_algo == COMPRESS_ALGO_ZSTD) {
+        return ZSTD_compressBound(len);
+    }
+#endif
+    return deflateBound(sock->deflate_strm, len);
+}
+
+static int
+network_socket_compress(network_socket *sock, GString *dst, const char *src, int len, int end)
+{
+#ifdef HAVE_ZSTD
+    if (sock->compress_algo == COMPRESS_ALGO_ZSTD) {
+        return cetus_zstd_compress(sock->zstd_cctx, dst, src, len, end);
+    }
+#endif
+    return cetus_compress(sock->deflate_strm, dst, src, len, end) == Z_OK ? 0 : -1;
+}
+
+/**
+ * uncompress the payload of a compressed packet with the negotiated algorithm
+ *
+ * @return 0 on success
+ */
+int
+network_socket_uncompress(network_socket *sock, GString *dst, unsigned char *src, int len)
+{
+#ifdef HAVE_ZSTD
+    if (sock->compress_algo == COMPRESS_ALGO_ZSTD) {
+        if (sock->zstd_dctx == NULL) {
+            sock->zstd_dctx = ZSTD_createDCtx();
+            if (sock->zstd_dctx == NULL) {
+                g_warning("%s: ZSTD_createDCtx failed", G_STRLOC);
+                return -1;
+            }
+        }
+        return cetus_zstd_uncompress(sock->zstd_dctx, dst, src, len);
+    }
+#endif
+    if (sock->inflate_strm == NULL) {
+        z_stream *strm = g_new0(z_stream, 1);
+        if (cetus_uncompress_init(strm) != Z_OK) {
+            g_warning("%s: inflateInit failed: %s", G_STRLOC, strm->msg ? strm->msg : "");
+            g_free(strm);
+            return -1;
+        }
+        sock->inflate_strm = strm;
+    }
+    return cetus_uncompress(sock->inflate_strm, dst, src, len) == Z_OK ? 0 : -1;
+}
+
 static network_socket_retval_t 
 network_socket_compressed_write(network_socket *con, int send_chunks) 
 {
@@ -674,10 +877,27 @@ network_socket_compressed_write(network_socket *con, int send_chunks)
 
     g_assert_cmpint(chunk_count, >, 0); /* make sure it is never negative */
 
-    z_stream strm;
-    cetus_compress_init(&strm);
+    GList *chunk;
+    gint chunk_id;
+
+    /* payload of this compressed packet, small ones are not worth deflating */
+    gsize pending = 0;
+    for (chunk = con->send_queue->chunks->head, chunk_id = 0;
+            chunk && chunk_id < chunk_count && pending <= PACKET_LEN_MAX;
+            chunk_id++, chunk = chunk->next)
+    {
+        GString *s = chunk->data;
+        pending += s->len - (chunk_id == 0 ? con->send_queue->offset : 0);
+    }
+    pending = MIN(pending, PACKET_LEN_MAX);
+
+    gboolean do_compress = pending >= con->compress_min_len;
+    if (do_compress && !network_socket_compress_ready(con)) {
+        return NETWORK_SOCKET_ERROR;
+    }
 
-    GString *compress_packet = g_string_sized_new(16384);
+    GString *compress_packet = g_string_sized_new(NET_HEADER_SIZE + COMP_HEADER_SIZE
+            + (do_compress ? network_socket_compress_bound(con, pending) : pending));
 
     network_mysqld_proto_append_packet_len(compress_packet, 0);
     network_mysqld_proto_append_packet_id(compress_packet, con->compressed_packet_id);
@@ -686,10 +906,8 @@ network_socket_compressed_write(network_socket *con, int send_chunks)
 
     int uncompressed_len = 0, is_too_large = 0;
 
-    GList *chunk;
-    gint chunk_id;
-
     int need_more_write = 0;
+    int ret = 0;
 
     for (chunk = con->send_queue->chunks->head, chunk_id = 0; 
             chunk && chunk_id < chunk_count; chunk_id++, chunk = chunk->next)
@@ -715,14 +933,11 @@ network_socket_compressed_write(network_socket *con, int send_chunks)
         g_debug("%s: offset:%d, str_len:%d, s->len:%d", G_STRLOC, 
                 (int) con->send_queue->offset, str_len, (int) s->len);
 
-        if (!con->do_strict_compress && uncompressed_len < MIN_COMPRESS_LENGTH && end) {
+        if (!do_compress) {
+            /* sent as is, an uncompressed length of 0 tells so */
             g_string_append_len(compress_packet, str, str_len);
-            if (con->send_queue->offset != 0) {
-                g_warning("%s:con->send_queue->offset is not zero here", G_STRLOC);
-            }
+            con->send_queue->offset = 0;
         } else {
-                
-            con->do_strict_compress = 1;
             uncompressed_len += str_len;
             if (uncompressed_len > PACKET_LEN_MAX) {
                 g_message("%s:too large packet:%d, s->len:%d", G_STRLOC, 
@@ -730,22 +945,23 @@ network_socket_compressed_write(network_socket *con, int send_chunks)
                 uncompressed_len -= str_len;
                 str_len = PACKET_LEN_MAX - uncompressed_len;
                 if (str_len == 0) {
-                    cetus_compress(&strm, compress_packet, NULL, 0, 1);
+                    ret = network_socket_compress(con, compress_packet, NULL, 0, 1);
                     con->send_queue->offset = 0;
                 } else {
                     uncompressed_len = PACKET_LEN_MAX;
-                    cetus_compress(&strm, compress_packet, str, str_len, 1);
+                    ret = network_socket_compress(con, compress_packet, str, str_len, 1);
                     con->send_queue->offset += str_len;
                 }
                 is_too_large = 1;
             } else {
-                cetus_compress(&strm, compress_packet, str, str_len, end);
+                ret = network_socket_compress(con, compress_packet, str, str_len, end);
                 con->send_queue->offset = 0;
             }
         }
 
-        if (end || is_too_large) {
-            cetus_compress_end(&strm);
+        if (ret != 0) {
+            g_string_free(compress_packet, TRUE);
+            return NETWORK_SOCKET_ERROR;
         }
 
         con->total_output += str_len;
@@ -786,7 +1002,7 @@ network_socket_compressed_write(network_socket *con, int send_chunks)
             break;
         }
         GString *s = chunk->data;
-        g_string_free(s, TRUE);
+        network_packet_pool_put(s);
         g_queue_delete_link(con->send_queue->chunks, chunk);
         chunk = con->send_queue->chunks->head;
         i++;
@@ -849,35 +1065,208 @@ network_socket_compressed_write(network_socket *con, int send_chunks)
     return NETWORK_SOCKET_SUCCESS;
 }
 
+#ifdef HAVE_MSG_ZEROCOPY
 /**
- * write data to the socket
+ * collect the zerocopy completions from the error queue and free the
+ * chunks the kernel is done with
+ */
+static void
+network_socket_zerocopy_reap(network_socket *sock)
+{
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    zerocopy_chunk_t *zc;
+
+    while (sock->zerocopy_done != sock->zerocopy_sent) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sock->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            break;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            /* [ee_info, ee_data] are done, tcp completes them in order */
+            sock->zerocopy_done = serr->ee_data + 1;
+        }
+    }
+
+    if (sock->zerocopy_pending == NULL) {
+        return;
+    }
+
+    while ((zc = g_queue_peek_head(sock->zerocopy_pending))
+            && (gint32) (sock->zerocopy_done - zc->seq) >= 0) {
+        g_queue_pop_head(sock->zerocopy_pending);
+        network_packet_pool_put(zc->chunk);
+        g_free(zc);
+    }
+}
+
+/**
+ * hand the chunks still in flight to the orphan list before closing,
+ * they are freed after a grace period
+ */
+static void
+network_socket_zerocopy_release(network_socket *sock)
+{
+    zerocopy_chunk_t *zc;
+    time_t now = time(0);
+
+    if (zerocopy_orphans) {
+        while ((zc = g_queue_peek_head(zerocopy_orphans)) && zc->expire <= now) {
+            g_queue_pop_head(zerocopy_orphans);
+            network_packet_pool_put(zc->chunk);
+            g_free(zc);
+        }
+    }
+
+    if (sock->zerocopy_pending == NULL) {
+        return;
+    }
+
+    if (sock->fd != -1) {
+        network_socket_zerocopy_reap(sock);
+    }
+
+    while ((zc = g_queue_pop_head(sock->zerocopy_pending))) {
+        if (zerocopy_orphans == NULL) {
+            zerocopy_orphans = g_queue_new();
+        }
+        zc->expire = now + ZEROCOPY_ORPHAN_TIMEOUT;
+        g_queue_push_tail(zerocopy_orphans, zc);
+    }
+
+    g_queue_free(sock->zerocopy_pending);
+    sock->zerocopy_pending = NULL;
+}
+
+/**
+ * MSG_ZEROCOPY only pays off for large writes, SO_ZEROCOPY is turned on
+ * the first time a write reaches the threshold
+ */
+static gboolean
+network_socket_use_zerocopy(network_socket *sock, gsize total)
+{
+    if (sock->zerocopy_threshold == 0 || total < sock->zerocopy_threshold
+            || sock->zerocopy_failed || sock->do_query_cache) {
+        return FALSE;
+    }
+
+    if (!sock->zerocopy_enabled) {
+        int on = 1;
+        if (setsockopt(sock->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) != 0) {
+            g_message("%s: setsockopt(SO_ZEROCOPY) failed: %s, use writev", 
+                    G_STRLOC, g_strerror(errno));
+            sock->zerocopy_failed = 1;
+            return FALSE;
+        }
+        sock->zerocopy_enabled = 1;
+    }
+
+    return TRUE;
+}
+#endif
+
+/**
+ * check if a read event was raised by zerocopy completions only
  *
+ * they are queued on the error queue, which makes the fd readable with
+ * nothing to read
  */
-static network_socket_retval_t 
-network_socket_write_writev(network_socket *con, int send_chunks) 
+gboolean
+network_socket_zerocopy_only(network_socket *sock)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+    char c;
+
+    if (!sock->zerocopy_enabled) {
+        return FALSE;
+    }
+
+    network_socket_zerocopy_reap(sock);
+
+    if (recv(sock->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 
+            && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return TRUE;
+    }
+#endif
+    return FALSE;
+}
+
+/**
+ * free a chunk that has been written
+ *
+ * while zerocopy sends are in flight the kernel may still read from it
+ */
+static void
+network_socket_retire_chunk(network_socket *sock, GString *s)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+    if (sock->zerocopy_sent != sock->zerocopy_done) {
+        zerocopy_chunk_t *zc = g_new0(zerocopy_chunk_t, 1);
+        zc->chunk = s;
+        zc->seq = sock->zerocopy_sent;
+        if (sock->zerocopy_pending == NULL) {
+            sock->zerocopy_pending = g_queue_new();
+        }
+        g_queue_push_tail(sock->zerocopy_pending, zc);
+        return;
+    }
+#endif
+    network_packet_pool_put(s);
+}
+
+void
+network_socket_clear_send_queue(network_socket *sock)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+    if (sock->send_queue->offset > 0) {
+        /* partly sent, the kernel may not be done with the part sent */
+        network_socket_retire_chunk(sock, g_queue_pop_head(sock->send_queue->chunks));
+    }
+#endif
+    network_queue_clear(sock->send_queue);
+}
+
+/**
+ * point the iovec array of the socket at the queued chunks
+ *
+ * @return the number of chunks in the array
+ */
+static gint
+network_socket_fill_iov(network_socket *con, int send_chunks, gsize *total)
 {
-    /* send the whole queue */
     GList *chunk;
     struct iovec *iov;
     gint chunk_id;
     gint chunk_count;
-    gssize len;
-    int os_errno;
-    gint max_chunk_count;
-
-    if (send_chunks == 0) return NETWORK_SOCKET_SUCCESS;
 
     chunk_count = send_chunks > 0 ? send_chunks : (gint)con->send_queue->chunks->length;
 
-    if (chunk_count == 0) return NETWORK_SOCKET_SUCCESS;
+    if (chunk_count == 0) return 0;
 
-    max_chunk_count = UIO_MAXIOV;
-
-    chunk_count = chunk_count > max_chunk_count ? max_chunk_count : chunk_count;
+    chunk_count = MIN(chunk_count, UIO_MAXIOV);
 
     g_assert_cmpint(chunk_count, >, 0); /* make sure it is never negative */
 
-    iov = g_new0(struct iovec, chunk_count);
+    if (con->send_iov_size < chunk_count) {
+        /* grow by powers of two, it settles after a few large resultsets */
+        int size = MAX(con->send_iov_size, 16);
+        while (size < chunk_count) {
+            size <<= 1;
+        }
+        con->send_iov_size = MIN(size, UIO_MAXIOV);
+        con->send_iov = g_renew(struct iovec, con->send_iov, con->send_iov_size);
+    }
+    iov = con->send_iov;
+    *total = 0;
 
     for (chunk = con->send_queue->chunks->head, chunk_id = 0; 
             chunk && chunk_id < chunk_count; 
@@ -893,92 +1282,170 @@ network_socket_write_writev(network_socket *con, int send_chunks)
             iov[chunk_id].iov_base = s->str;
             iov[chunk_id].iov_len  = s->len;
         }  
+        *total += iov[chunk_id].iov_len;
 
         if (s->len == 0) {
             g_warning("%s: s->len is zero", G_STRLOC);
         }
     }
 
-    g_debug("%s: network socket:%p, send (src:%s, dst:%s) fd:%d", 
-            G_STRLOC,
-            con,
-            con->src->name->str,
-            con->dst->name->str,
-            con->fd);
-
-    len = writev(con->fd, iov, chunk_count);
-    g_debug("%s: tcp write:%d, chunk count:%d", G_STRLOC, (int) len, (int) chunk_count);
-    os_errno = errno;
-
-    g_free(iov);
+    return chunk_id;
+}
 
-    if (-1 == len) {
-        switch (os_errno) {
-            case E_NET_WOULDBLOCK:
-            case EAGAIN:
-                return NETWORK_SOCKET_WAIT_FOR_EVENT;
-            case EPIPE:
-            case E_NET_CONNRESET:
-            case E_NET_CONNABORTED:
-                /** remote side closed the connection */
-                return NETWORK_SOCKET_ERROR;
-            default:
-                g_message("%s: writev(%s, ...) failed: %s", 
-                        G_STRLOC, 
-                        con->dst->name->str, 
-                        g_strerror(errno));
-                return NETWORK_SOCKET_ERROR;
-        }
-    } else if (len == 0) {
-        return NETWORK_SOCKET_ERROR;
-    }
+/**
+ * drop the chunks which we have sent out from the send queue
+ */
+static void
+network_socket_sent(network_socket *con, gsize len)
+{
+    GList *chunk;
 
     con->send_queue->offset += len;
     con->send_queue->len    -= len;
 
-    /* check all the chunks which we have sent out */
-    for (chunk = con->send_queue->chunks->head; chunk; ) {
+    while ((chunk = con->send_queue->chunks->head)) {
         GString *s = chunk->data;
 
         if (s->len == 0) {
             g_warning("%s: s->len is zero", G_STRLOC);
         }
 
-        if (con->send_queue->offset >= s->len) {
-            con->send_queue->offset -= s->len;
+        if (con->send_queue->offset < s->len) {
+            break;
+        }
+
+        con->send_queue->offset -= s->len;
 #if NETWORK_DEBUG_TRACE_IO
-            g_debug("%s:output for sock:%p", G_STRLOC, con);
-            /* to trace the data we sent to the socket, enable this */
-            g_debug_hexdump(G_STRLOC, S(s));
+        g_debug("%s:output for sock:%p", G_STRLOC, con);
+        /* to trace the data we sent to the socket, enable this */
+        g_debug_hexdump(G_STRLOC, S(s));
 #endif
-            if (!con->do_query_cache) {
-                g_string_free(s, TRUE);
-            } else {
-                size_t len = con->cache_queue->len + s->len;
-                if (len > MAX_QUERY_CACHE_SIZE) {
-                    if (!con->query_cache_too_long) {
-                        g_message("%s:too long for cache queue:%p, len:%d", 
-                                G_STRLOC, con, (int) len);
-                        con->query_cache_too_long = 1;
-                    }
-                    g_string_free(s, TRUE);
-                } else {
-                    g_debug("%s:append packet to cache queue:%p, len:%d, total:%d", 
-                        G_STRLOC, con, (int) s->len, (int) len);
-                    network_queue_append(con->cache_queue, s);
+        if (!con->do_query_cache) {
+            network_socket_retire_chunk(con, s);
+        } else {
+            size_t len = con->cache_queue->len + s->len;
+            if (len > MAX_QUERY_CACHE_SIZE) {
+                if (!con->query_cache_too_long) {
+                    g_message("%s:too long for cache queue:%p, len:%d", 
+                            G_STRLOC, con, (int) len);
+                    con->query_cache_too_long = 1;
                 }
+                network_packet_pool_put(s);
+            } else {
+                g_debug("%s:append packet to cache queue:%p, len:%d, total:%d", 
+                    G_STRLOC, con, (int) s->len, (int) len);
+                network_queue_append(con->cache_queue, s);
             }
+        }
 
-            g_queue_delete_link(con->send_queue->chunks, chunk);
+        g_queue_delete_link(con->send_queue->chunks, chunk);
+    }
+}
 
-            chunk = con->send_queue->chunks->head;
-        } else {
-            g_debug("%s:wait for event", G_STRLOC);
+static network_socket_retval_t
+network_socket_write_failed(network_socket *con, int os_errno)
+{
+    switch (os_errno) {
+        case E_NET_WOULDBLOCK:
+        case EAGAIN:
             return NETWORK_SOCKET_WAIT_FOR_EVENT;
+        case EPIPE:
+        case E_NET_CONNRESET:
+        case E_NET_CONNABORTED:
+            /** remote side closed the connection */
+            return NETWORK_SOCKET_ERROR;
+        default:
+            g_message("%s: writev(%s, ...) failed: %s", 
+                    G_STRLOC, 
+                    con->dst->name->str, 
+                    g_strerror(os_errno));
+            return NETWORK_SOCKET_ERROR;
+    }
+}
+
+/**
+ * write data to the socket
+ *
+ * the iovec array is kept in the socket and reused. as long as a batch
+ * goes out completely and more chunks are queued, we write the next
+ * batch right away instead of waiting for the next write event
+ */
+static network_socket_retval_t 
+network_socket_write_writev(network_socket *con, int send_chunks) 
+{
+    /* send the whole queue */
+    struct iovec *iov;
+    gint chunk_count;
+    gssize len;
+    gsize total;
+    int os_errno;
+
+    if (send_chunks == 0) return NETWORK_SOCKET_SUCCESS;
+
+#ifdef HAVE_MSG_ZEROCOPY
+    if (con->zerocopy_sent != con->zerocopy_done) {
+        network_socket_zerocopy_reap(con);
+    }
+#endif
+
+again:
+    chunk_count = network_socket_fill_iov(con, send_chunks, &total);
+
+    if (chunk_count == 0) return NETWORK_SOCKET_SUCCESS;
+
+    iov = con->send_iov;
+
+    g_debug("%s: network socket:%p, send (src:%s, dst:%s) fd:%d", 
+            G_STRLOC,
+            con,
+            con->src->name->str,
+            con->dst->name->str,
+            con->fd);
+
+#ifdef HAVE_MSG_ZEROCOPY
+    if (network_socket_use_zerocopy(con, total)) {
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = chunk_count;
+
+        len = sendmsg(con->fd, &msg, MSG_ZEROCOPY);
+        if (len > 0) {
+            con->zerocopy_sent++;
+        } else if (len == -1 && errno == ENOBUFS) {
+            /* out of optmem for the notifications, copy this time */
+            len = writev(con->fd, iov, chunk_count);
         }
+    } else {
+        len = writev(con->fd, iov, chunk_count);
     }
+#else
+    len = writev(con->fd, iov, chunk_count);
+#endif
+    os_errno = errno;
 
-    return NETWORK_SOCKET_SUCCESS;
+    g_debug("%s: tcp write:%d, chunk count:%d", G_STRLOC, (int) len, (int) chunk_count);
+
+    if (-1 == len) {
+        return network_socket_write_failed(con, os_errno);
+    } else if (len == 0) {
+        return NETWORK_SOCKET_ERROR;
+    }
+
+    network_socket_sent(con, len);
+
+    if (con->send_queue->chunks->length == 0) {
+        return NETWORK_SOCKET_SUCCESS;
+    }
+
+    if (con->send_queue->offset == 0 && (gsize) len == total && send_chunks < 0) {
+        /* the whole batch went out, the socket likely takes more */
+        goto again;
+    }
+
+    g_debug("%s:wait for event", G_STRLOC);
+    return NETWORK_SOCKET_WAIT_FOR_EVENT;
 }
 
 /**
@@ -1004,6 +1471,247 @@ network_socket_retval_t network_socket_write(network_socket *sock, int send_chun
     }
 }
 
+#ifdef HAVE_LIBURING
+#define WRITE_RING_ENTRIES 64
+
+static gboolean io_uring_enabled;
+
+/* set up lazily, the workers are forked after the options are read */
+static struct io_uring write_ring;
+static int write_ring_state;    /* 0: not yet, 1: ready, -1: unavailable */
+
+static gboolean
+network_socket_write_ring_ready(void)
+{
+    if (write_ring_state == 0) {
+        int ret = io_uring_queue_init(WRITE_RING_ENTRIES, &write_ring, 0);
+        if (ret < 0) {
+            g_message("%s: io_uring_queue_init failed: %s, use writev",
+                    G_STRLOC, g_strerror(-ret));
+            write_ring_state = -1;
+        } else {
+            write_ring_state = 1;
+        }
+    }
+    return write_ring_state == 1;
+}
+
+/* result of the write of sock from the completion of its send */
+static network_socket_retval_t
+network_socket_write_ring_result(network_socket *sock, int res)
+{
+    if (res < 0) {
+        return network_socket_write_failed(sock, -res);
+    } else if (res == 0) {
+        return NETWORK_SOCKET_ERROR;
+    }
+
+    network_socket_sent(sock, res);
+    if (sock->send_queue->chunks->length == 0) {
+        return NETWORK_SOCKET_SUCCESS;
+    }
+    /* more than one iovec array or a short write */
+    return network_socket_write_writev(sock, -1);
+}
+
+/**
+ * cancel the sends not completed yet and wait until the kernel is done
+ * with them, they point at the msghdrs and iovecs of the caller
+ *
+ * the cancelled ones sent nothing and are written with writev. if the
+ * ring fails again the rest is left to io_uring_queue_exit() and fails
+ */
+static void
+network_socket_write_ring_abort(network_socket **socks, const int *ndx, int n,
+                                network_socket_retval_t *rets,
+                                gboolean *in_flight, int pending)
+{
+    struct io_uring_cqe *cqe;
+    int i, ret;
+
+    for (i = 0; i < n; i++) {
+        if (in_flight[i]) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&write_ring);
+            if (sqe == NULL) {
+                break;
+            }
+            io_uring_prep_cancel(sqe, (void *) (uintptr_t) i, 0);
+            io_uring_sqe_set_data(sqe, (void *) (uintptr_t) WRITE_RING_ENTRIES);
+            pending++;
+        }
+    }
+
+    ret = io_uring_submit(&write_ring);
+    if (ret < 0) {
+        pending = 0;
+    }
+
+    /* a completion for each send and each cancel */
+    while (pending > 0) {
+        ret = io_uring_wait_cqe(&write_ring, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        } else if (ret < 0) {
+            break;
+        }
+        i = (int) (uintptr_t) io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&write_ring, cqe);
+        pending--;
+
+        if (i == WRITE_RING_ENTRIES) {
+            continue;
+        }
+        in_flight[i] = FALSE;
+        if (res == -ECANCELED) {
+            rets[ndx[i]] = network_socket_write_writev(socks[i], -1);
+        } else {
+            rets[ndx[i]] = network_socket_write_ring_result(socks[i], res);
+        }
+    }
+
+    io_uring_queue_exit(&write_ring);
+}
+
+/**
+ * submit the writes of a round with a single syscall
+ *
+ * MSG_DONTWAIT makes a full socket complete with -EAGAIN at once instead
+ * of being polled by the kernel, so the wait never blocks
+ */
+static void
+network_socket_write_ring(network_socket **socks, const int *ndx, int n,
+                          network_socket_retval_t *rets)
+{
+    struct msghdr msgs[WRITE_RING_ENTRIES];
+    gboolean in_flight[WRITE_RING_ENTRIES];
+    gsize total;
+    struct io_uring_cqe *cqe;
+    int i, submitted = 0;
+
+    for (i = 0; i < n; i++) {
+        network_socket *sock = socks[i];
+        struct io_uring_sqe *sqe;
+        gint chunk_count;
+
+        in_flight[i] = FALSE;
+        chunk_count = network_socket_fill_iov(sock, -1, &total);
+        if (chunk_count == 0) {
+            rets[ndx[i]] = NETWORK_SOCKET_SUCCESS;
+            continue;
+        }
+
+        sqe = io_uring_get_sqe(&write_ring);
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_iov = sock->send_iov;
+        msgs[i].msg_iovlen = chunk_count;
+        io_uring_prep_sendmsg(sqe, sock->fd, &msgs[i], MSG_DONTWAIT | MSG_NOSIGNAL);
+        io_uring_sqe_set_data(sqe, (void *) (uintptr_t) i);
+        /* until its completion is seen */
+        rets[ndx[i]] = NETWORK_SOCKET_ERROR;
+        in_flight[i] = TRUE;
+        submitted++;
+    }
+
+    if (submitted == 0) {
+        return;
+    }
+
+    int ret = io_uring_submit_and_wait(&write_ring, submitted);
+    if (ret < 0 && ret != -EINTR) {
+        /* the sqes are left in the ring, never submit it again */
+        g_critical("%s: io_uring_submit_and_wait failed: %s, use writev",
+                G_STRLOC, g_strerror(-ret));
+        write_ring_state = -1;
+        io_uring_queue_exit(&write_ring);
+        for (i = 0; i < n; i++) {
+            rets[ndx[i]] = network_socket_write_writev(socks[i], -1);
+        }
+        return;
+    }
+
+    while (submitted > 0) {
+        ret = io_uring_wait_cqe(&write_ring, &cqe);
+        if (ret == -EINTR) {
+            continue;
+        } else if (ret < 0) {
+            g_critical("%s: io_uring_wait_cqe failed: %s, use writev",
+                    G_STRLOC, g_strerror(-ret));
+            write_ring_state = -1;
+            network_socket_write_ring_abort(socks, ndx, n, rets, in_flight, submitted);
+            break;
+        }
+
+        i = (int) (uintptr_t) io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&write_ring, cqe);
+        in_flight[i] = FALSE;
+        submitted--;
+
+        rets[ndx[i]] = network_socket_write_ring_result(socks[i], res);
+    }
+}
+#endif
+
+void network_socket_set_io_uring(gboolean enabled)
+{
+#ifdef HAVE_LIBURING
+    io_uring_enabled = enabled;
+#else
+    if (enabled) {
+        g_message("%s: built without liburing, use writev", G_STRLOC);
+    }
+#endif
+}
+
+/**
+ * write the send queues of several sockets, like the fan-out of a query
+ *
+ * with io_uring the writes go to the kernel in one syscall for up to 64
+ * sockets, otherwise they are written one after another
+ *
+ * @param rets  result of network_socket_write() for each socket
+ */
+void network_socket_write_batch(network_socket **socks, int n, network_socket_retval_t *rets)
+{
+    int i;
+
+#ifdef HAVE_LIBURING
+    if (io_uring_enabled && n > 1 && network_socket_write_ring_ready()) {
+        network_socket *ring_socks[WRITE_RING_ENTRIES];
+        int ring_ndx[WRITE_RING_ENTRIES];
+        int count = 0;
+
+        for (i = 0; i < n; i++) {
+            network_socket *sock = socks[i];
+            /* compressed and zerocopy writes keep their own path */
+            if (sock->socket_type != SOCK_STREAM || sock->do_compress
+#ifdef HAVE_MSG_ZEROCOPY
+                    || sock->zerocopy_enabled
+#endif
+                    ) {
+                rets[i] = network_socket_write(sock, -1);
+                continue;
+            }
+            ring_socks[count] = sock;
+            ring_ndx[count] = i;
+            if (++count == WRITE_RING_ENTRIES) {
+                network_socket_write_ring(ring_socks, ring_ndx, count, rets);
+                count = 0;
+            }
+        }
+        if (count > 0) {
+            network_socket_write_ring(ring_socks, ring_ndx, count, rets);
+        }
+        return;
+    }
+#endif
+
+    for (i = 0; i < n; i++) {
+        rets[i] = network_socket_write(socks[i], -1);
+    }
+}
+
 network_socket_retval_t network_socket_to_read(network_socket *sock) {
     int b = -1;
 
@@ -109,8 +109,24 @@ typedef struct {
     network_queue *cache_queue;
     GString *last_compressed_packet;
     int compressed_unsend_offset;
+    int compress_algo;          /** compress_algo_t, negotiated in the handshake */
+    int compress_level;         /** level of compress_algo */
+    guint compress_min_len;     /** smaller compressed packets go out uncompressed */
+    struct z_stream_s *deflate_strm; /** created on first use, reset per packet */
+    struct z_stream_s *inflate_strm;
+    struct ZSTD_CCtx_s *zstd_cctx;
+    struct ZSTD_DCtx_s *zstd_dctx;
+
+    struct iovec *send_iov;     /** reused by writev, grows up to UIO_MAXIOV */
+    int send_iov_size;
+
+    guint zerocopy_threshold;   /** MSG_ZEROCOPY for writes of at least this many bytes, 0 = off */
+    guint32 zerocopy_sent;      /** zerocopy sends issued */
+    guint32 zerocopy_done;      /** zerocopy sends the kernel reported as completed */
+    GQueue *zerocopy_pending;   /** sent chunks the kernel may still read from */
 
     off_t to_read;
+    guint recv_slab_size;   /** receive slab size, follows the recent reads */
     off_t resp_len;
     int total_output;
 
@@ -138,8 +154,10 @@ typedef struct {
     unsigned int query_cache_too_long:1;
     unsigned int max_header_size_reached:1;
     unsigned int do_compress:1;
-    unsigned int do_strict_compress:1;
     unsigned int do_query_cache:1;
+    unsigned int reuseport:1;           /** listen port shared by worker processes */
+    unsigned int zerocopy_failed:1;     /** SO_ZEROCOPY not supported, don't try again */
+    unsigned int zerocopy_enabled:1;
 
     guint8    charset_code;
 
@@ -162,12 +180,18 @@ typedef struct {
     server_state_data    parse;
     server_query_status  qstat;
 
+    struct server_stmt_cache_t *stmt_cache; /** statements prepared on this server connection */
+
+    GArray *worker_fds;     /** listen sockets bound by the master, one per worker */
 } network_socket;
 
 
 NETWORK_API network_socket *network_socket_new(void);
 NETWORK_API void network_socket_free(network_socket *s);
 NETWORK_API network_socket_retval_t network_socket_write(network_socket *con, int send_chunks);
+NETWORK_API void network_socket_write_batch(network_socket **socks, int n,
+                                           network_socket_retval_t *rets);
+NETWORK_API void network_socket_set_io_uring(gboolean enabled);
 NETWORK_API network_socket_retval_t network_socket_read(network_socket *con);
 NETWORK_API network_socket_retval_t network_socket_to_read(network_socket *sock);
 NETWORK_API network_socket_retval_t network_socket_set_non_blocking(network_socket *sock);
@@ -176,6 +200,11 @@ NETWORK_API network_socket_retval_t network_socket_connect_finish(network_socket
 NETWORK_API network_socket_retval_t network_socket_bind(network_socket *con);
 NETWORK_API network_socket *network_socket_accept(network_socket *srv, int *reason);
 NETWORK_API network_socket_retval_t network_socket_set_send_buffer_size(network_socket *sock, int size); 
+NETWORK_API gboolean network_socket_zerocopy_only(network_socket *sock);
+/* drop the queued writes, the kernel may still read from a zerocopy one */
+NETWORK_API void network_socket_clear_send_queue(network_socket *sock);
+NETWORK_API int network_socket_uncompress(network_socket *sock, GString *dst,
+                                          unsigned char *src, int len);
 
 #endif
 
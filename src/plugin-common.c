@@ -32,6 +32,7 @@ typedef int socklen_t;
 
 #include "network-conn-pool.h"
 #include "network-conn-pool-wrap.h"
+#include "server-session.h"
 
 #include "sys-pedantic.h"
 #include "network-injection.h"
@@ -46,8 +47,8 @@ typedef int socklen_t;
 #include "cetus-users.h"
 #include "chassis-options.h"
 #include "plugin-common.h"
-
-#define MAX_CACHED_ITEMS 65536
+#include "cetus-query-cache.h"
+#include "network-compress.h"
 
 network_socket_retval_t do_read_auth(network_mysqld_con *con, GHashTable *allow_ip_table, GHashTable *deny_ip_table)
 {
@@ -93,6 +94,13 @@ network_socket_retval_t do_read_auth(network_mysqld_con *con, GHashTable *allow_
         } else if (auth->client_capabilities & CLIENT_COMPRESS) {
             con->is_client_compressed = 1;
             g_message("%s: client compressed for con:%p", G_STRLOC, con);
+        } else if (auth->client_capabilities & CLIENT_ZSTD_COMPRESSION_ALGORITHM) {
+            con->is_client_compressed = 1;
+            con->client->compress_algo = COMPRESS_ALGO_ZSTD;
+            con->client->compress_level = auth->zstd_level ?
+                MIN(auth->zstd_level, ZSTD_LEVEL_MAX) : ZSTD_LEVEL_DEFAULT;
+            g_message("%s: client zstd compressed, level %d for con:%p",
+                      G_STRLOC, con->client->compress_level, con);
         } else if (auth->client_capabilities & CLIENT_MULTI_STATEMENTS) {
             con->client->is_multi_stmt_set = 1;
         }
@@ -222,7 +230,8 @@ static int proxy_c_connect_server(network_mysqld_con *con,
                 G_STRLOC, i, total, connected_clts,
                 cur_idle, max_idle_conns);
 
-        if (cur_idle > 0 || total <= max_idle_conns) {
+        if (cur_idle > 0 || total <= network_backend_worker_share(backend, max_idle_conns)
+                || network_backend_conns_count_all(backend) <= max_idle_conns) {
             *p_backend_ndx = i;
             *p_backend = backend;
             break;
@@ -348,6 +357,14 @@ network_socket_retval_t do_connect_cetus(network_mysqld_con *con,
         return NETWORK_SOCKET_SUCCESS;
     }
 
+    challenge = network_mysqld_auth_challenge_copy(challenge);
+    /* the client side is compressed by us, whatever the backend supports */
+    if (con->srv->compress_support && cetus_zstd_available()) {
+        challenge->capabilities |= CLIENT_ZSTD_COMPRESSION_ALGORITHM;
+    } else {
+        challenge->capabilities &= ~CLIENT_ZSTD_COMPRESSION_ALGORITHM;
+    }
+
     GString *auth_packet = g_string_new(NULL);
     network_mysqld_proto_append_auth_challenge(auth_packet, challenge);
 
@@ -360,7 +377,7 @@ network_socket_retval_t do_connect_cetus(network_mysqld_con *con,
 
     g_assert(con->client->challenge == NULL);
 
-    con->client->challenge = network_mysqld_auth_challenge_copy(challenge);
+    con->client->challenge = challenge;
 
     con->state = ST_SEND_HANDSHAKE;
 
@@ -404,9 +421,68 @@ network_socket_retval_t plugin_add_backends(chassis *chas,
     return 0;
 }
 
+/**
+ * bind the listen socket of a plugin
+ *
+ * the master of multi-process mode binds a TCP port once per worker with
+ * SO_REUSEPORT, so that the kernel spreads the clients over the workers
+ * and a restarted worker takes over the socket of the one it replaces
+ */
+int plugin_bind_listen(chassis *chas, network_socket *listen_sock)
+{
+    int family = listen_sock->dst->addr.common.sa_family;
+    int i;
+
+    if (!chassis_is_master(chas) || (family != AF_INET && family != AF_INET6)) {
+        return network_socket_bind(listen_sock) == NETWORK_SOCKET_SUCCESS ? 0 : -1;
+    }
+
+    listen_sock->reuseport = 1;
+    listen_sock->worker_fds = g_array_sized_new(FALSE, FALSE, sizeof(int), chas->worker_processes);
+    for (i = 0; i < chas->worker_processes; i++) {
+        if (network_socket_bind(listen_sock) != NETWORK_SOCKET_SUCCESS) {
+            return -1;
+        }
+        g_array_append_val(listen_sock->worker_fds, listen_sock->fd);
+        listen_sock->fd = -1;
+    }
+    return 0;
+}
+
+/**
+ * accept clients on the listen socket, in a worker it takes its own one
+ */
+void plugin_start_accept(chassis *chas, network_mysqld_con *listen_con)
+{
+    network_socket *listen_sock = listen_con->server;
+
+    if (listen_sock->worker_fds) {
+        guint i;
+        for (i = 0; i < listen_sock->worker_fds->len; i++) {
+            int fd = g_array_index(listen_sock->worker_fds, int, i);
+            if ((int) i == chas->worker_no) {
+                listen_sock->fd = fd;
+            } else {
+                close(fd);
+            }
+        }
+        g_array_free(listen_sock->worker_fds, TRUE);
+        listen_sock->worker_fds = NULL;
+    } else if (chassis_is_worker(chas)) {
+        /* shared with the master, the path stays */
+        listen_sock->dst->can_unlink_socket = FALSE;
+    }
+
+    event_set(&(listen_sock->event), listen_sock->fd,
+            EV_READ|EV_PERSIST, network_mysqld_con_accept, listen_con);
+    event_base_set(chas->event_base, &(listen_sock->event));
+    event_add(&(listen_sock->event), NULL);
+    g_debug("%s:listen sock, ev:%p", G_STRLOC, (&listen_sock->event));
+}
+
 int do_check_qeury_cache(network_mysqld_con *con)
 {
-    if (con->is_client_compressed) {
+    if (con->is_client_compressed || con->query_cache_key == NULL) {
         return 0;
     }
 
@@ -417,14 +493,10 @@ int do_check_qeury_cache(network_mysqld_con *con)
     g_debug("%s:req time:%d, min:%d for cache", G_STRLOC,
             diff, con->srv->min_req_time_for_cache);
     if (diff >= con->srv->min_req_time_for_cache) {
-        if (g_hash_table_size(con->srv->query_cache_table) < MAX_CACHED_ITEMS) {
-            con->client->do_query_cache = 1;
-            con->client->cache_queue = network_queue_new();
-            g_debug("%s: candidate for query cache", G_STRLOC);
-            return 1;
-        } else {
-            g_message("%s: too many cached items", G_STRLOC);
-        }
+        con->client->do_query_cache = 1;
+        con->client->cache_queue = network_queue_new();
+        g_debug("%s: candidate for query cache", G_STRLOC);
+        return 1;
     } else {
         g_debug("%s: not cached for sql:%s", G_STRLOC, con->orig_sql->str);
     }
@@ -432,7 +504,82 @@ int do_check_qeury_cache(network_mysqld_con *con)
     return 0;
 }
 
-int try_to_get_resp_from_query_cache(network_mysqld_con *con)
+static void query_cache_add_table(GPtrArray *tables, const char *db, const char *table)
+{
+    gchar *name = g_strdup_printf("%s.%s", db ? db : "", table);
+    gchar *lower = g_ascii_strdown(name, -1);
+    g_free(name);
+
+    guint i;
+    for (i = 0; i < tables->len; i++) {
+        if (strcmp(g_ptr_array_index(tables, i), lower) == 0) {
+            g_free(lower);
+            return;
+        }
+    }
+    g_ptr_array_add(tables, lower);
+}
+
+static void query_cache_collect_src_tables(sql_src_list_t *, const char *, GPtrArray *);
+
+static void query_cache_collect_select_tables(sql_select_t *select, const char *db,
+                                              GPtrArray *tables)
+{
+    for (; select; select = select->prior) {
+        query_cache_collect_src_tables(select->from_src, db, tables);
+    }
+}
+
+static void query_cache_collect_src_tables(sql_src_list_t *sources, const char *db,
+                                           GPtrArray *tables)
+{
+    guint i;
+    for (i = 0; sources && i < sources->len; i++) {
+        sql_src_item_t *src = g_ptr_array_index(sources, i);
+        if (src->table_name) {
+            query_cache_add_table(tables, src->dbname ? src->dbname : db, src->table_name);
+        }
+        if (src->select) {
+            query_cache_collect_select_tables(src->select, db, tables);
+        }
+    }
+}
+
+/**
+ * tables a statement reads (SELECT) or writes (INSERT, UPDATE, DELETE),
+ * nothing is collected if the parser didn't keep the statement
+ */
+static void query_cache_collect_tables(sql_context_t *context, const char *db,
+                                       GPtrArray *tables)
+{
+    if (context->sql_statement == NULL) {
+        return;
+    }
+    switch (context->stmt_type) {
+    case STMT_SELECT:
+        query_cache_collect_select_tables(context->sql_statement, db, tables);
+        break;
+    case STMT_INSERT: {
+        sql_insert_t *insert = context->sql_statement;
+        query_cache_collect_src_tables(insert->table, db, tables);
+        break;
+    }
+    case STMT_UPDATE: {
+        sql_update_t *update = context->sql_statement;
+        query_cache_collect_src_tables(update->table, db, tables);
+        break;
+    }
+    case STMT_DELETE: {
+        sql_delete_t *delete = context->sql_statement;
+        query_cache_collect_src_tables(delete->from_src, db, tables);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+int try_to_get_resp_from_query_cache(network_mysqld_con *con, sql_context_t *context)
 {
     chassis *srv = con->srv;
     GString *key = g_string_new(NULL);
@@ -444,42 +591,11 @@ int try_to_get_resp_from_query_cache(network_mysqld_con *con)
     g_debug("%s:visit try_to_get_resp_from_query_cache:%s", G_STRLOC, key->str);
     g_string_free(key, TRUE);
 
-    unsigned long long access_ms;
-    access_ms = con->req_recv_time.tv_sec * 1000 + con->req_recv_time.tv_usec / 1000;
-    /* purge first */
-    if (srv->last_cache_purge_time != access_ms) {
-        int len = srv->cache_index->length;
-        while (len > 0) {
-            query_cache_index_item *index = g_queue_peek_head(srv->cache_index);
-            if (index->expire_ms > access_ms) {
-                break;
-            } else {
-                g_debug("%s:drop content from cache:%s", G_STRLOC, index->key);
-                g_hash_table_remove(con->srv->query_cache_table, index->key);
-                g_queue_pop_head(srv->cache_index);
-                len = srv->cache_index->length;
-                g_free(index->key);
-                g_free(index);
-            }
-        }
-
-        srv->last_cache_purge_time = access_ms;
-    }
-
-    query_cache_item *item = g_hash_table_lookup(con->srv->query_cache_table, md5_key);
-    g_free(md5_key);
+    guint64 access_ms;
+    access_ms = con->req_recv_time.tv_sec * 1000ULL + con->req_recv_time.tv_usec / 1000;
 
-    if (item != NULL) {
-        int i;
-        int len = item->queue->chunks->length;
-        for (i = 0; i < len; i++) {
-            GString *packet = g_queue_peek_nth(item->queue->chunks, i);
-            GString *dup_packet = g_string_new(NULL);
-            g_string_append_len(dup_packet, S(packet));
-            network_queue_append(con->client->send_queue, dup_packet);
-            g_debug("%s:read packet len:%d from cache", G_STRLOC, (int) dup_packet->len);
-            g_debug_hexdump(G_STRLOC, S(dup_packet));
-        }
+    if (query_cache_lookup(srv->query_cache, md5_key, access_ms, con->client->send_queue)) {
+        g_free(md5_key);
         con->state = ST_SEND_QUERY_RESULT;
         con->client->do_query_cache = 0;
         g_debug("%s:read content from cache:%s", G_STRLOC, con->orig_sql->str);
@@ -488,10 +604,123 @@ int try_to_get_resp_from_query_cache(network_mysqld_con *con)
         network_mysqld_queue_reset(con->client);
 
         return 1;
+    }
+
+    g_debug("%s:no cached item for con:%p", G_STRLOC, con);
+    GPtrArray *tables = g_ptr_array_new_with_free_func(g_free);
+    query_cache_collect_tables(context, con->client->default_db->str, tables);
+    if (tables->len > 0) {
+        g_free(con->query_cache_key);
+        if (con->query_cache_tables) {
+            g_ptr_array_free(con->query_cache_tables, TRUE);
+        }
+        con->query_cache_key = md5_key;
+        con->query_cache_tables = tables;
     } else {
-        g_debug("%s:no cached item for con:%p", G_STRLOC, con);
-        return 0;
+        g_free(md5_key);
+        g_ptr_array_free(tables, TRUE);
+    }
+    return 0;
+}
+
+/* the writes of a transaction are seen by the others once it ends */
+static void query_cache_flush_written(network_mysqld_con *con, query_cache_t *cache,
+                                      guint64 now_ms)
+{
+    GPtrArray *written = con->query_cache_written;
+    guint i;
+
+    if (written == NULL) {
+        return;
+    }
+    for (i = 0; i < written->len; i++) {
+        const char *table = g_ptr_array_index(written, i);
+        if (table == NULL) {
+            query_cache_invalidate_all(cache, now_ms);
+            break;
+        }
+        query_cache_invalidate(cache, table, now_ms);
+    }
+    g_ptr_array_free(written, TRUE);
+    con->query_cache_written = NULL;
+}
+
+void invalidate_query_cache(network_mysqld_con *con, sql_context_t *context)
+{
+    query_cache_t *cache = con->srv->query_cache;
+    if (cache == NULL) {
+        return;
+    }
+
+    guint64 now_ms;
+    now_ms = con->req_recv_time.tv_sec * 1000ULL + con->req_recv_time.tv_usec / 1000;
+
+    gboolean is_dml = FALSE;
+    switch (context->stmt_type) {
+    case STMT_SELECT:
+    case STMT_SHOW:
+    case STMT_SHOW_COLUMNS:
+    case STMT_SHOW_CREATE:
+    case STMT_SHOW_WARNINGS:
+    case STMT_EXPLAIN_TABLE:
+    case STMT_SET_NAMES:
+    case STMT_SET_TRANSACTION:
+    case STMT_USE:
+    case STMT_SAVEPOINT:
+        return;
+    case STMT_SET:
+        if (sql_context_is_autocommit_on(context)) { /* commits */
+            query_cache_flush_written(con, cache, now_ms);
+        }
+        return;
+    case STMT_START:
+    case STMT_COMMIT:
+    case STMT_ROLLBACK:
+        query_cache_flush_written(con, cache, now_ms);
+        return;
+    case STMT_INSERT:
+    case STMT_UPDATE:
+    case STMT_DELETE:
+        is_dml = TRUE;
+        break;
+    default:
+        if (!(context->rw_flag & CF_WRITE) && context->rc != PARSE_UNRECOGNIZED) {
+            return;
+        }
+        /* DDL commits the transaction */
+        query_cache_flush_written(con, cache, now_ms);
+        break;
     }
+
+    GPtrArray *tables = g_ptr_array_new_with_free_func(g_free);
+    query_cache_collect_tables(context, con->client->default_db->str, tables);
+
+    if (is_dml && (con->is_in_transaction || con->is_start_trans_buffered || !con->is_auto_commit)) {
+        /* the others read the old rows until the commit, and may cache them */
+        if (con->query_cache_written == NULL) {
+            con->query_cache_written = g_ptr_array_new_with_free_func(g_free);
+        }
+        if (tables->len == 0) {
+            g_ptr_array_add(con->query_cache_written, NULL);
+        }
+        guint i;
+        for (i = 0; i < tables->len; i++) {
+            g_ptr_array_add(con->query_cache_written, g_strdup(g_ptr_array_index(tables, i)));
+        }
+        g_ptr_array_free(tables, TRUE);
+        return;
+    }
+
+    if (tables->len == 0) {
+        g_debug("%s:invalidate query cache for sql:%s", G_STRLOC, con->orig_sql->str);
+        query_cache_invalidate_all(cache, now_ms);
+    } else {
+        guint i;
+        for (i = 0; i < tables->len; i++) {
+            query_cache_invalidate(cache, g_ptr_array_index(tables, i), now_ms);
+        }
+    }
+    g_ptr_array_free(tables, TRUE);
 }
 
 gboolean proxy_put_shard_conn_to_pool(network_mysqld_con *con)
@@ -542,6 +771,11 @@ gboolean proxy_put_shard_conn_to_pool(network_mysqld_con *con)
                     is_put_to_pool_allowed = 0;
                 }
             }
+            if (is_put_to_pool_allowed && network_backend_over_worker_share(pmd->backend)) {
+                /* give the budget back to the other workers */
+                is_reduced = 1;
+                is_put_to_pool_allowed = 0;
+            }
 
             CHECK_PENDING_EVENT(&(server->event));
 
@@ -559,6 +793,9 @@ gboolean proxy_put_shard_conn_to_pool(network_mysqld_con *con)
             }
 
             pmd->backend->connected_clients--;
+            if (!is_put_to_pool_allowed) {
+                network_backend_conns_publish(pmd->backend);
+            }
             g_debug("%s: conn clients sub, total len:%d, backend:%p, value:%d con:%p",
                     G_STRLOC, con->servers->len, pmd->backend, 
                     pmd->backend->connected_clients, con);
@@ -576,6 +813,42 @@ gboolean proxy_put_shard_conn_to_pool(network_mysqld_con *con)
     return TRUE;
 }
 
+/**
+ * close the server conns whose reading was cancelled after LIMIT
+ *
+ * they still have the rest of the resultset on the wire, so they are
+ * never used again, not even by the next query of a reserved conn
+ */
+void
+proxy_remove_cancelled_shard_conns(network_mysqld_con *con)
+{
+    int i;
+
+    for (i = 0; i < con->servers->len; i++) {
+        server_session_t *pmd = (server_session_t *)g_ptr_array_index(con->servers, i);
+        if (!pmd->server->is_closed) {
+            continue;
+        }
+
+        CHECK_PENDING_EVENT(&(pmd->server->event));
+        pmd->backend->connected_clients--;
+        network_backend_conns_publish(pmd->backend);
+        con->srv->complement_conn_cnt++;
+        g_debug("%s: close cancelled server:%p, backend:%p, value:%d con:%p",
+                G_STRLOC, pmd->server, pmd->backend,
+                pmd->backend->connected_clients, con);
+
+        g_ptr_array_remove_index(con->servers, i);
+        server_session_free(pmd);
+        i--;
+    }
+
+    if (con->servers->len == 0) {
+        g_ptr_array_free(con->servers, TRUE);
+        con->servers = NULL;
+    }
+}
+
 void 
 remove_mul_server_recv_packets(network_mysqld_con *con) 
 {
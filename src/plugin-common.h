@@ -21,13 +21,18 @@
 #include <glib.h>
 
 #include "network-exports.h"
+#include "sql-context.h"
 
 NETWORK_API network_socket_retval_t do_read_auth(network_mysqld_con *, GHashTable *, GHashTable *);
 NETWORK_API network_socket_retval_t do_connect_cetus(network_mysqld_con *, network_backend_t **, int *);
 NETWORK_API network_socket_retval_t plugin_add_backends(chassis *, gchar **, gchar **);
+NETWORK_API int plugin_bind_listen(chassis *, network_socket *);
+NETWORK_API void plugin_start_accept(chassis *, network_mysqld_con *);
 NETWORK_API int do_check_qeury_cache(network_mysqld_con *con);
-NETWORK_API int try_to_get_resp_from_query_cache(network_mysqld_con *con);
+NETWORK_API int try_to_get_resp_from_query_cache(network_mysqld_con *con, sql_context_t *context);
+NETWORK_API void invalidate_query_cache(network_mysqld_con *con, sql_context_t *context);
 NETWORK_API gboolean proxy_put_shard_conn_to_pool(network_mysqld_con *con);
+NETWORK_API void proxy_remove_cancelled_shard_conns(network_mysqld_con *con);
 NETWORK_API void remove_mul_server_recv_packets(network_mysqld_con *con);
 
 #endif
@@ -1124,12 +1124,12 @@ static int modify_record(GList *cand1, GROUP_AGGR *aggr,
         memcpy(buf_pos, after, (*orig_packet_len) - (after - before));
 
         *orig_packet_len = packet_len;
-        GString *packet = g_string_sized_new(NET_HEADER_SIZE + packet_len);
+        GString *packet = network_packet_pool_get(NET_HEADER_SIZE + packet_len);
         packet->len     = NET_HEADER_SIZE;
         g_string_append_len(packet, buffer, packet_len);
         network_mysqld_proto_set_packet_len(packet, packet_len);
 
-        g_string_free(cand1->data, TRUE);
+        network_packet_pool_put(cand1->data);
         cand1->data = packet;
         packet1->data = packet;
     }
@@ -1492,7 +1492,7 @@ static gint is_prior_to(GString *pkt1, GString *pkt2, order_by_para_t *para,
             break;
         case FIELD_TYPE_TIME:
             if (!compare_value_from_records(&packet1, &packet2, order,
-                        FIELD_TYPE_DATE, &result, compare_failed)) 
+                        FIELD_TYPE_TIME, &result, compare_failed)) 
             {
                 return result;
             }
@@ -1500,7 +1500,7 @@ static gint is_prior_to(GString *pkt1, GString *pkt2, order_by_para_t *para,
             break;
         case FIELD_TYPE_YEAR: 
             if (!compare_value_from_records(&packet1, &packet2, order,
-                        FIELD_TYPE_DATE, &result, compare_failed)) 
+                        FIELD_TYPE_YEAR, &result, compare_failed)) 
             {
                 return result;
             }
@@ -1547,6 +1547,385 @@ static gint is_prior_to(GString *pkt1, GString *pkt2, order_by_para_t *para,
 }
 
 
+/*
+ * sort keys
+ *
+ * the ORDER BY columns of a row are decoded once, when the row gets to
+ * the top of its queue, into a byte string that sorts with memcmp() the
+ * same way is_prior_to() sorts the rows. every column is encoded into a
+ * self-delimiting segment, the bytes of a DESC segment are inverted
+ */
+typedef struct {
+    unsigned char *buf;
+    int cap;
+    int len;
+    int truncated;
+} sort_key_writer_t;
+
+typedef struct {
+    int pos;
+    unsigned int type;
+    unsigned int desc;
+} sort_key_col_t;
+
+#define SORT_KEY_OK      0
+#define SORT_KEY_PARTIAL 1  /* stopped at a column without order */
+#define SORT_KEY_FAILED  2  /* malformed row or value */
+
+static inline void
+sort_key_put(sort_key_writer_t *w, unsigned char c)
+{
+    if (w->len < w->cap) {
+        w->buf[w->len++] = c;
+    } else {
+        w->truncated = 1;
+    }
+}
+
+/* same ordering as strcasecmp(), NULL and '' come first */
+static void
+sort_key_put_str(sort_key_writer_t *w, const char *s, guint64 len)
+{
+    guint64 i;
+
+    for (i = 0; i < len && !w->truncated; i++) {
+        unsigned char c = g_ascii_tolower(s[i]);
+        sort_key_put(w, c);
+        if (c == 0) {
+            sort_key_put(w, 0xff);
+        }
+    }
+    sort_key_put(w, 0);
+    sort_key_put(w, 0);
+}
+
+/**
+ * decimal number as class byte, exponent and significant digits
+ *
+ * @return 0 if s is not a plain decimal number, like cmp_str_num() wants
+ */
+static int
+sort_key_put_num(sort_key_writer_t *w, const char *s, guint64 len)
+{
+    int neg = 0;
+    const char *end = s + len;
+
+    if (len > 0 && (s[0] == '-' || s[0] == '+')) {
+        neg = (s[0] == '-');
+        s++;
+    }
+
+    const char *dot = NULL, *p;
+    for (p = s; p < end; p++) {
+        if (*p == '.') {
+            if (dot || p == s || p == end - 1) {
+                return 0;
+            }
+            dot = p;
+        } else if (*p < '0' || *p > '9') {
+            return 0;
+        }
+    }
+
+    const char *int_end = dot ? dot : end;
+    const char *frac = dot ? dot + 1 : end;
+
+    /* strip leading zeros of the integer part and trailing zeros of the fraction */
+    while (s < int_end && *s == '0') {
+        s++;
+    }
+    while (end > frac && end[-1] == '0') {
+        end--;
+    }
+
+    int exp;
+    const char *digits;
+    if (s < int_end) {
+        exp = int_end - s;
+        digits = s;
+    } else {
+        digits = frac;
+        while (digits < end && *digits == '0') {
+            digits++;
+        }
+        exp = -(digits - frac);
+    }
+
+    if (digits >= end) {
+        sort_key_put(w, 0x02); /* zero */
+        return 1;
+    }
+
+    unsigned char flip = neg ? 0xff : 0;
+    int e = exp + 0x8000;
+
+    sort_key_put(w, neg ? 0x01 : 0x03);
+    sort_key_put(w, (e >> 8) ^ flip);
+    sort_key_put(w, (e & 0xff) ^ flip);
+    for (p = digits; p < end; p++) {
+        if (*p != '.') {
+            sort_key_put(w, *p ^ flip);
+        }
+    }
+    sort_key_put(w, flip);
+
+    return 1;
+}
+
+static void
+sort_key_put_int64(sort_key_writer_t *w, gint64 v)
+{
+    guint64 u = (guint64) v ^ G_GUINT64_CONSTANT(0x8000000000000000);
+    int i;
+
+    for (i = 56; i >= 0; i -= 8) {
+        sort_key_put(w, (u >> i) & 0xff);
+    }
+}
+
+/* only year, month and day are compared, as compare_date() does */
+static void
+sort_key_put_date(sort_key_writer_t *w, const char *s, guint64 len)
+{
+    char buf[32];
+    int y = 1970, m = 1, d = 1;
+
+    if (len > 0 && len < sizeof(buf)) {
+        memcpy(buf, s, len);
+        buf[len] = '\0';
+        y = m = d = 0;
+        sscanf(buf, "%d-%d-%d", &y, &m, &d);
+    }
+    sort_key_put_int64(w, ((gint64) y * 16 + m) * 32 + d);
+}
+
+static void
+sort_key_put_time(sort_key_writer_t *w, const char *s, guint64 len)
+{
+    char buf[32];
+    int neg = 0, h = 0, m = 0, sec = 0;
+
+    if (len > 0 && len < sizeof(buf)) {
+        memcpy(buf, s, len);
+        buf[len] = '\0';
+        char *p = buf;
+        if (*p == '-') {
+            neg = 1;
+            p++;
+        }
+        sscanf(p, "%d:%d:%d", &h, &m, &sec);
+    }
+
+    gint64 v = (gint64) h * 3600 + m * 60 + sec;
+    sort_key_put_int64(w, neg ? -v : v);
+}
+
+static void
+sort_key_put_year(sort_key_writer_t *w, const char *s, guint64 len)
+{
+    char buf[32];
+    gint64 y = 1970;
+
+    if (len > 0 && len < sizeof(buf)) {
+        memcpy(buf, s, len);
+        buf[len] = '\0';
+        y = atol(buf);
+    }
+    sort_key_put_int64(w, y);
+}
+
+/**
+ * pick up the values of the columns at pos[0..n-1] walking the row once,
+ * NULL is returned as an empty value
+ *
+ * @return 0 if the row is malformed
+ */
+static int
+row_fetch_fields(GString *pkt, const int *pos, int n, const char **vals, guint64 *lens,
+        int *nulls)
+{
+    int i, j, max_pos = -1;
+
+    for (j = 0; j < n; j++) {
+        max_pos = MAX(max_pos, pos[j]);
+    }
+
+    network_packet packet;
+    packet.data = pkt;
+    packet.offset = NET_HEADER_SIZE;
+    for (i = 0; i <= max_pos; i++) {
+        const char *val = "";
+        guint64 len = 0;
+        int is_null = 0;
+
+        if (packet.offset >= pkt->len) {
+            return 0;
+        }
+
+        if ((unsigned char) pkt->str[packet.offset] == MYSQLD_PACKET_NULL) {
+            packet.offset++;
+            is_null = 1;
+        } else {
+            if (network_mysqld_proto_get_lenenc_int(&packet, &len) != 0
+                    || packet.offset + len > pkt->len) {
+                return 0;
+            }
+            val = pkt->str + packet.offset;
+            packet.offset += len;
+        }
+
+        for (j = 0; j < n; j++) {
+            if (pos[j] == i) {
+                vals[j] = val;
+                lens[j] = len;
+                if (nulls) {
+                    nulls[j] = is_null;
+                }
+            }
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * encode the columns cols of a row into w
+ *
+ * @return SORT_KEY_OK, SORT_KEY_PARTIAL or SORT_KEY_FAILED
+ */
+static int
+sort_key_encode_row(sort_key_writer_t *w, GString *pkt, const sort_key_col_t *cols, int n)
+{
+    const char *vals[MAX(MAX_ORDER_COLS, MAX_GROUP_COLS)];
+    guint64 lens[MAX(MAX_ORDER_COLS, MAX_GROUP_COLS)];
+    int pos[MAX(MAX_ORDER_COLS, MAX_GROUP_COLS)];
+    int i, j;
+
+    for (j = 0; j < n; j++) {
+        pos[j] = cols[j].pos;
+    }
+    if (!row_fetch_fields(pkt, pos, n, vals, lens, NULL)) {
+        return SORT_KEY_FAILED;
+    }
+
+    for (j = 0; j < n && !w->truncated; j++) {
+        int start = w->len;
+
+        switch (cols[j].type) {
+        case FIELD_TYPE_TINY:
+        case FIELD_TYPE_SHORT:
+        case FIELD_TYPE_LONG:
+        case FIELD_TYPE_LONGLONG:
+        case FIELD_TYPE_INT24:
+        case FIELD_TYPE_NEWDECIMAL:
+        case FIELD_TYPE_DECIMAL:
+        case FIELD_TYPE_FLOAT:
+        case FIELD_TYPE_DOUBLE:
+            if (!sort_key_put_num(w, vals[j], lens[j])) {
+                return SORT_KEY_FAILED;
+            }
+            break;
+        case FIELD_TYPE_DATE:
+            sort_key_put_date(w, vals[j], lens[j]);
+            break;
+        case FIELD_TYPE_TIME:
+            sort_key_put_time(w, vals[j], lens[j]);
+            break;
+        case FIELD_TYPE_YEAR:
+            sort_key_put_year(w, vals[j], lens[j]);
+            break;
+        case FIELD_TYPE_TIMESTAMP:
+        case FIELD_TYPE_DATETIME:
+        case FIELD_TYPE_VAR_STRING:
+        case FIELD_TYPE_STRING:
+            sort_key_put_str(w, vals[j], lens[j]);
+            break;
+        case FIELD_TYPE_NEWDATE:
+        case FIELD_TYPE_NULL:
+        case FIELD_TYPE_BIT:
+        case FIELD_TYPE_ENUM:
+        case FIELD_TYPE_SET:
+        case FIELD_TYPE_TINY_BLOB:
+        case FIELD_TYPE_MEDIUM_BLOB:
+        case FIELD_TYPE_LONG_BLOB:
+        case FIELD_TYPE_BLOB:
+        case FIELD_TYPE_GEOMETRY:
+            /* is_prior_to() doesn't look any further */
+            return SORT_KEY_PARTIAL;
+        default:
+            return SORT_KEY_FAILED;
+        }
+
+        if (cols[j].desc) {
+            for (i = start; i < w->len; i++) {
+                w->buf[i] = ~w->buf[i];
+            }
+        }
+    }
+
+    return SORT_KEY_OK;
+}
+
+static void
+heap_element_build_key(heap_element *e, order_by_para_t *para)
+{
+    sort_key_col_t cols[MAX_ORDER_COLS];
+    int j;
+
+    for (j = 0; j < para->order_array_size; j++) {
+        cols[j].pos = para->order_array[j].pos;
+        cols[j].type = para->order_array[j].type;
+        cols[j].desc = para->order_array[j].desc;
+    }
+
+    sort_key_writer_t w = {e->sort_key, MAX_SORT_KEY_LEN, 0, 0};
+    int ret = sort_key_encode_row(&w, e->record->data, cols, para->order_array_size);
+
+    e->key_valid = 1;
+    e->key_failed = (ret == SORT_KEY_FAILED);
+    e->key_partial = (ret == SORT_KEY_PARTIAL);
+    e->key_truncated = w.truncated;
+    e->sort_key_len = w.len;
+}
+
+/**
+ * is_prior_to() for two heap elements, with memcmp() on the sort keys
+ *
+ * falls back to is_prior_to() if a key could not be built or the
+ * truncated keys tie
+ */
+static gint
+heap_element_prior_to(heap_element *e1, heap_element *e2, order_by_para_t *para,
+        int *is_record_equal, int *compare_failed)
+{
+    if (!e1->key_valid) {
+        heap_element_build_key(e1, para);
+    }
+    if (!e2->key_valid) {
+        heap_element_build_key(e2, para);
+    }
+
+    if (!e1->key_failed && !e2->key_failed) {
+        int len = MIN(e1->sort_key_len, e2->sort_key_len);
+        int ret = memcmp(e1->sort_key, e2->sort_key, len);
+
+        if (ret != 0) {
+            return ret < 0;
+        }
+
+        if (e1->sort_key_len == e2->sort_key_len 
+                && !e1->key_truncated && !e2->key_truncated) {
+            if (!e1->key_partial && is_record_equal) {
+                *is_record_equal = 1;
+            }
+            return 1;
+        }
+    }
+
+    return is_prior_to(e1->record->data, e2->record->data, para,
+            e1->index, e2->index, is_record_equal, compare_failed);
+}
+
 /* find index of field by name, the name might be an alias */
 static int cetus_result_find_fielddef(cetus_result_t *res,
                                       const char *table, const char *field)
@@ -1756,6 +2135,485 @@ fulfill_condi(char *aggr_value, having_condition_t *hav_condi, result_merge_t *m
 }
 
 
+#ifdef __SIZEOF_INT128__
+/*
+ * hash aggregation
+ *
+ * the rows of all shards are folded into one group per distinct GROUP BY
+ * key, with typed accumulators instead of decimal strings, so the shards
+ * may return their groups in any order. the groups are sorted on their
+ * encoded keys before they are sent. whatever can't be accumulated exactly
+ * makes aggr_by_hash() give up, aggr_by_group() then merges the sorted
+ * shard results as before
+ */
+#define AGGR_HASH_MAX_KEY_LEN 1024
+#define AGGR_HASH_MAX_GROUPS  100000
+#define AGGR_MAX_SCALE        30
+
+typedef struct {
+    __int128 sum;           /* SUM and COUNT, in units of 10^-scale */
+    int scale;
+    const char *val;        /* MIN and MAX, points into a shard row */
+    guint64 len;
+    unsigned int has_value:1;
+} aggr_acc_t;
+
+typedef struct {
+    GString *row;           /* first row of the group, gives the other columns */
+    aggr_acc_t acc[MAX_AGGR_FUNS];
+    int key_len;
+    unsigned char key[];    /* GROUP BY columns encoded as a sort key */
+} aggr_group_t;
+
+static guint
+aggr_group_hash(gconstpointer p)
+{
+    const aggr_group_t *g = p;
+    guint h = 2166136261u;
+    int i;
+
+    for (i = 0; i < g->key_len; i++) {
+        h = (h ^ g->key[i]) * 16777619u;
+    }
+    return h;
+}
+
+static gboolean
+aggr_group_equal(gconstpointer a, gconstpointer b)
+{
+    const aggr_group_t *g1 = a;
+    const aggr_group_t *g2 = b;
+
+    return g1->key_len == g2->key_len && memcmp(g1->key, g2->key, g1->key_len) == 0;
+}
+
+static gint
+aggr_group_cmp(gconstpointer a, gconstpointer b)
+{
+    const aggr_group_t *g1 = *(aggr_group_t **) a;
+    const aggr_group_t *g2 = *(aggr_group_t **) b;
+    int ret = memcmp(g1->key, g2->key, MIN(g1->key_len, g2->key_len));
+
+    return ret != 0 ? ret : g1->key_len - g2->key_len;
+}
+
+static int
+int128_scale_up(__int128 *v, int n)
+{
+    while (n-- > 0) {
+        if (__builtin_mul_overflow(*v, 10, v)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * plain decimal number as an integer and its scale
+ *
+ * @return 0 if s is not a plain decimal number or does not fit
+ */
+static int
+aggr_parse_decimal(const char *s, guint64 len, __int128 *value, int *scale)
+{
+    const char *end = s + len;
+    int neg = 0, dot = 0, digits = 0, sc = 0;
+    __int128 v = 0;
+
+    if (s < end && (*s == '-' || *s == '+')) {
+        neg = (*s == '-');
+        s++;
+    }
+
+    for (; s < end; s++) {
+        if (*s == '.') {
+            if (dot) {
+                return 0;
+            }
+            dot = 1;
+            continue;
+        }
+        if (*s < '0' || *s > '9') {
+            return 0;
+        }
+        if (__builtin_mul_overflow(v, 10, &v) || __builtin_add_overflow(v, *s - '0', &v)) {
+            return 0;
+        }
+        digits++;
+        if (dot) {
+            sc++;
+        }
+    }
+
+    if (digits == 0 || sc > AGGR_MAX_SCALE) {
+        return 0;
+    }
+
+    *value = neg ? -v : v;
+    *scale = sc;
+    return 1;
+}
+
+/* cmp_str_num() for values that are not NUL terminated */
+static int
+aggr_num_cmp(const char *s1, guint64 len1, const char *s2, guint64 len2, int *failed)
+{
+    unsigned char buf1[128], buf2[128];
+    sort_key_writer_t w1 = {buf1, sizeof(buf1), 0, 0};
+    sort_key_writer_t w2 = {buf2, sizeof(buf2), 0, 0};
+
+    if (!sort_key_put_num(&w1, s1, len1) || !sort_key_put_num(&w2, s2, len2)
+            || w1.truncated || w2.truncated) {
+        *failed = 1;
+        return 0;
+    }
+
+    int ret = memcmp(buf1, buf2, MIN(w1.len, w2.len));
+    return ret != 0 ? ret : w1.len - w2.len;
+}
+
+/**
+ * strcasecmp() for values that are not NUL terminated
+ *
+ * folded like the GROUP BY keys, as the default collations compare
+ */
+static int
+aggr_str_cmp(const char *s1, guint64 len1, const char *s2, guint64 len2)
+{
+    guint64 i, len = MIN(len1, len2);
+
+    for (i = 0; i < len; i++) {
+        int ret = (guchar) g_ascii_tolower(s1[i]) - (guchar) g_ascii_tolower(s2[i]);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return len1 < len2 ? -1 : (len1 > len2);
+}
+
+/**
+ * fold a non-NULL value of a shard row into the accumulator
+ *
+ * @return 0 if the value can't be accumulated exactly
+ */
+static int
+aggr_acc_add(aggr_acc_t *acc, GROUP_AGGR *aggr, const char *val, guint64 len)
+{
+    int is_num = 0;
+
+    switch (aggr->type) {
+    case FIELD_TYPE_TINY:
+    case FIELD_TYPE_SHORT:
+    case FIELD_TYPE_LONG:
+    case FIELD_TYPE_LONGLONG:
+    case FIELD_TYPE_INT24:
+    case FIELD_TYPE_NEWDECIMAL:
+    case FIELD_TYPE_DECIMAL:
+    case FIELD_TYPE_FLOAT:
+    case FIELD_TYPE_DOUBLE:
+        is_num = 1;
+        break;
+    case FIELD_TYPE_TIME:
+    case FIELD_TYPE_TIMESTAMP:
+    case FIELD_TYPE_DATETIME:
+    case FIELD_TYPE_YEAR:
+    case FIELD_TYPE_NEWDATE:
+    case FIELD_TYPE_DATE:
+    case FIELD_TYPE_VAR_STRING:
+    case FIELD_TYPE_STRING:
+        break;
+    default:
+        return 0;
+    }
+
+    switch (aggr->fun_type) {
+    case FT_SUM:
+    case FT_COUNT: {
+        __int128 v;
+        int scale;
+
+        if (!is_num || !aggr_parse_decimal(val, len, &v, &scale)) {
+            return 0;
+        }
+        if (!acc->has_value) {
+            acc->sum = v;
+            acc->scale = scale;
+            break;
+        }
+        if (scale > acc->scale) {
+            if (!int128_scale_up(&acc->sum, scale - acc->scale)) {
+                return 0;
+            }
+            acc->scale = scale;
+        } else if (!int128_scale_up(&v, acc->scale - scale)) {
+            return 0;
+        }
+        if (__builtin_add_overflow(acc->sum, v, &acc->sum)) {
+            return 0;
+        }
+        break;
+    }
+    case FT_MAX:
+    case FT_MIN:
+        if (acc->has_value) {
+            int failed = 0;
+            int ret = is_num ? aggr_num_cmp(val, len, acc->val, acc->len, &failed)
+                : aggr_str_cmp(val, len, acc->val, acc->len);
+
+            if (failed) {
+                return 0;
+            }
+            if ((aggr->fun_type == FT_MAX && ret <= 0) || (aggr->fun_type == FT_MIN && ret >= 0)) {
+                return 1;
+            }
+        }
+        acc->val = val;
+        acc->len = len;
+        break;
+    default:
+        return 0;
+    }
+
+    acc->has_value = 1;
+    return 1;
+}
+
+/**
+ * SUM or COUNT as a decimal string, FLOAT and DOUBLE lose the trailing
+ * zeros of the fraction as in modify_record()
+ */
+static int
+aggr_acc_format(aggr_acc_t *acc, int type, char *buf)
+{
+    char digits[64];
+    int n = 0, len = 0, skip = 0, i;
+    unsigned __int128 u = acc->sum < 0 ? -(unsigned __int128) acc->sum : (unsigned __int128) acc->sum;
+
+    /* least significant digit first */
+    do {
+        digits[n++] = '0' + (int) (u % 10);
+        u /= 10;
+    } while (u > 0);
+    while (n <= acc->scale) {
+        digits[n++] = '0';
+    }
+
+    if (type == FIELD_TYPE_FLOAT || type == FIELD_TYPE_DOUBLE) {
+        while (skip < acc->scale && digits[skip] == '0') {
+            skip++;
+        }
+    }
+
+    if (acc->sum < 0) {
+        buf[len++] = '-';
+    }
+    for (i = n - 1; i >= acc->scale; i--) {
+        buf[len++] = digits[i];
+    }
+    if (skip < acc->scale) {
+        buf[len++] = '.';
+        for (i = acc->scale - 1; i >= skip; i--) {
+            buf[len++] = digits[i];
+        }
+    }
+    buf[len] = '\0';
+
+    return len;
+}
+
+/**
+ * the first row of the group with the aggregated values put in
+ */
+static GString *
+aggr_group_build_row(aggr_group_t *g, aggr_by_group_para_t *para)
+{
+    GString *row = g->row;
+    GString *pkt = network_packet_pool_get(row->len + 64 * para->aggr_num);
+    network_packet packet;
+    int i, k;
+
+    pkt->len = NET_HEADER_SIZE;
+
+    packet.data = row;
+    packet.offset = NET_HEADER_SIZE;
+    for (i = 0; packet.offset < row->len; i++) {
+        guint start = packet.offset;
+
+        if (skip_field(&packet, 1) != 0) {
+            network_packet_pool_put(pkt);
+            return NULL;
+        }
+
+        for (k = 0; k < para->aggr_num && para->aggr_array[k].pos != i; k++) {
+        }
+        if (k == para->aggr_num) {
+            g_string_append_len(pkt, row->str + start, packet.offset - start);
+            continue;
+        }
+
+        GROUP_AGGR *aggr = para->aggr_array + k;
+        aggr_acc_t *acc = g->acc + k;
+        if (!acc->has_value) {
+            network_mysqld_proto_append_int8(pkt, MYSQLD_PACKET_NULL);
+        } else if (aggr->fun_type == FT_MAX || aggr->fun_type == FT_MIN) {
+            network_mysqld_proto_append_lenenc_str_len(pkt, acc->val, acc->len);
+        } else {
+            char buf[64];
+            int len = aggr_acc_format(acc, aggr->type, buf);
+            network_mysqld_proto_append_lenenc_str_len(pkt, buf, len);
+        }
+    }
+
+    if (pkt->len - NET_HEADER_SIZE >= PACKET_LEN_MAX) {
+        network_packet_pool_put(pkt);
+        return NULL;
+    }
+    network_mysqld_proto_set_packet_len(pkt, pkt->len - NET_HEADER_SIZE);
+
+    return pkt;
+}
+
+/**
+ * GROUP BY over the unordered rows of all shards
+ *
+ * the shard rows are left in recv_queues
+ *
+ * @return FALSE if aggr_by_group() has to do it, nothing was sent then
+ */
+static gboolean
+aggr_by_hash(aggr_by_group_para_t *para, GList **candidates, guint *pkt_count,
+        result_merge_t *merged_result)
+{
+    sort_key_col_t cols[MAX_GROUP_COLS];
+    int aggr_pos[MAX_AGGR_FUNS];
+    const char *vals[MAX_AGGR_FUNS];
+    guint64 lens[MAX_AGGR_FUNS];
+    int nulls[MAX_AGGR_FUNS];
+    gboolean ok = TRUE;
+    size_t iter;
+    int i, k;
+
+    for (i = 0; i < para->group_array_size; i++) {
+        cols[i].pos = para->group_array[i].pos;
+        cols[i].type = para->group_array[i].type;
+        cols[i].desc = para->group_array[i].desc;
+    }
+    for (k = 0; k < para->aggr_num; k++) {
+        aggr_pos[k] = para->aggr_array[k].pos;
+    }
+
+    GHashTable *groups = g_hash_table_new_full(aggr_group_hash, aggr_group_equal, g_free, NULL);
+    aggr_group_t *probe = g_malloc(sizeof(aggr_group_t) + AGGR_HASH_MAX_KEY_LEN);
+
+    for (iter = 0; iter < para->recv_queues->len && ok; iter++) {
+        GList *l;
+        for (l = candidates[iter]; l != NULL; l = l->next) {
+            GString *row = l->data;
+
+            if (get_pkt_type(row) == MYSQLD_PACKET_EOF) {
+                break;
+            }
+            if (get_pkt_type(row) == MYSQLD_PACKET_ERR) {
+                ok = FALSE;
+                break;
+            }
+
+            sort_key_writer_t w = {probe->key, AGGR_HASH_MAX_KEY_LEN, 0, 0};
+            if (sort_key_encode_row(&w, row, cols, para->group_array_size) != SORT_KEY_OK
+                    || w.truncated
+                    || !row_fetch_fields(row, aggr_pos, para->aggr_num, vals, lens, nulls))
+            {
+                ok = FALSE;
+                break;
+            }
+            probe->key_len = w.len;
+
+            aggr_group_t *g = g_hash_table_lookup(groups, probe);
+            if (g == NULL) {
+                if (g_hash_table_size(groups) >= AGGR_HASH_MAX_GROUPS) {
+                    ok = FALSE;
+                    break;
+                }
+                g = g_malloc0(sizeof(aggr_group_t) + w.len);
+                g->row = row;
+                g->key_len = w.len;
+                memcpy(g->key, probe->key, w.len);
+                g_hash_table_insert(groups, g, g);
+            }
+
+            for (k = 0; k < para->aggr_num && ok; k++) {
+                if (!nulls[k] && !aggr_acc_add(g->acc + k, para->aggr_array + k, vals[k], lens[k])) {
+                    ok = FALSE;
+                }
+            }
+            if (!ok) {
+                break;
+            }
+        }
+    }
+    g_free(probe);
+
+    GPtrArray *rows = g_ptr_array_new();
+    if (ok) {
+        GPtrArray *sorted = g_ptr_array_sized_new(g_hash_table_size(groups));
+        GHashTableIter it;
+        gpointer key;
+        gint64 off_pos = 0;
+
+        g_hash_table_iter_init(&it, groups);
+        while (g_hash_table_iter_next(&it, &key, NULL)) {
+            g_ptr_array_add(sorted, key);
+        }
+        g_ptr_array_sort(sorted, aggr_group_cmp);
+
+        for (i = 0; i < sorted->len && rows->len < para->limit->row_count; i++) {
+            GString *pkt = aggr_group_build_row(sorted->pdata[i], para);
+            if (pkt == NULL) {
+                ok = FALSE;
+                break;
+            }
+
+            if (para->hav_condi->rel_type) {
+                char aggr_value[MAX_COL_VALUE_LEN] = {0};
+                retrieve_aggr_value(pkt, para->aggr_array, aggr_value);
+                if (!fulfill_condi(aggr_value, para->hav_condi, merged_result)) {
+                    network_packet_pool_put(pkt);
+                    continue;
+                }
+            }
+
+            if (off_pos < para->limit->offset) {
+                off_pos++;
+                network_packet_pool_put(pkt);
+                continue;
+            }
+            g_ptr_array_add(rows, pkt);
+        }
+        g_ptr_array_free(sorted, TRUE);
+    }
+
+    for (i = 0; i < rows->len; i++) {
+        GString *pkt = rows->pdata[i];
+        if (ok) {
+            pkt->str[3] = (*pkt_count) + 1;
+            ++(*pkt_count);
+            network_queue_append(para->send_queue, pkt);
+        } else {
+            network_packet_pool_put(pkt);
+        }
+    }
+    g_ptr_array_free(rows, TRUE);
+    g_hash_table_destroy(groups);
+
+    if (!ok) {
+        g_debug("%s: no hash aggregation, merge the sorted groups", G_STRLOC);
+    }
+
+    return ok;
+}
+#endif
+
+
 static int aggr_by_group(aggr_by_group_para_t *para,
         GList **candidates, guint *pkt_count, result_merge_t *merged_result)
 {
@@ -1844,7 +2702,7 @@ static int aggr_by_group(aggr_by_group_para_t *para,
                 row_cnter++;
                 network_queue_append(para->send_queue, (GString *) candidate->data); 
             } else {
-                g_string_free((GString *) candidate->data, TRUE);
+                network_packet_pool_put((GString *) candidate->data);
             }
 
             candidates[cand_index] = candidate->next;
@@ -1887,10 +2745,8 @@ void heap_adjust(heap_type *heap, int s, int m, int *compare_failed)
                 } else {
                     is_dup = 0;
                     k = j;
-                    if (!is_prior_to(heap->element[j]->record->data, 
-                                heap->element[j + 1]->record->data, &(heap->order_para),
-                                heap->element[j]->index, heap->element[j + 1]->index,
-                                &is_dup, compare_failed)) 
+                    if (!heap_element_prior_to(heap->element[j], heap->element[j + 1],
+                                &(heap->order_para), &is_dup, compare_failed)) 
                     {
                         j++;
                         heap->element[j]->is_prior_to = 0;
@@ -1917,8 +2773,7 @@ void heap_adjust(heap_type *heap, int s, int m, int *compare_failed)
 
         if (!rc->is_over) {
             is_dup = 0;
-            if (is_prior_to(rc->record->data, heap->element[j]->record->data,
-                        &(heap->order_para), rc->index, heap->element[j]->index,
+            if (heap_element_prior_to(rc, heap->element[j], &(heap->order_para),
                         &is_dup, compare_failed)) 
             {
                 if (is_dup) {
@@ -1943,10 +2798,77 @@ void heap_adjust(heap_type *heap, int s, int m, int *compare_failed)
     heap->element[s]->refreshed = 1;
 }
 
+/* whether the rows of a server not merged yet are below the watermark */
+static gboolean
+merge_candidates_below(GList *candidate, gsize watermark)
+{
+    gsize len = 0;
+    for (; candidate != NULL && candidate->data != NULL; candidate = candidate->next) {
+        len += ((GString *) candidate->data)->len;
+        if (len >= watermark) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static void check_server_sess_wait_for_event(network_mysqld_con *con, 
+        int pmd_index, short ev_type, struct timeval *timeout);
+
+static void merge_client_writable(int G_GNUC_UNUSED event_fd, short events, void *user_data)
+{
+    network_mysqld_con *con = user_data;
+
+    if (events == EV_TIMEOUT) {
+        g_message("%s: write timeout while merging for con:%p, sql:%s",
+                G_STRLOC, con, con->orig_sql->str);
+        con->prev_state = con->state;
+        con->state = ST_ERROR;
+    } else {
+        send_part_content_to_client(con);
+    }
+
+    if (con->state == ST_ERROR) {
+        con->stream_paused = 0;
+        network_mysqld_con_handle(-1, 0, con);
+        return;
+    }
+
+    check_server_sess_wait_for_event(con, -1, EV_READ, &con->read_timeout);
+}
+
+/**
+ * read more rows of the servers the merge needs
+ *
+ * the rows merged go to the client, so nothing is read while the client
+ * send queue is above the high watermark. without pmd_index only the
+ * servers with less than merge-read-watermark rows pending are read,
+ * which bounds the memory of the merge to servers x watermark
+ */
 static void check_server_sess_wait_for_event(network_mysqld_con *con, 
         int pmd_index, short ev_type, struct timeval *timeout)
 {
+    merge_parameters_t *data = con->data;
     size_t i;
+
+    /* a server still being read merges again when done, then the client is waited for */
+    for (i = 0; i < con->servers->len; i++) {
+        server_session_t *pmd = g_ptr_array_index(con->servers, i);
+        if (pmd->server->is_waiting) {
+            break;
+        }
+    }
+
+    if (network_mysqld_con_stream_paused(con)) {
+        if (i == con->servers->len && !event_pending(&(con->client->event), EV_WRITE, NULL)) {
+            g_debug("%s: wait for client before reading servers:%p", G_STRLOC, con);
+            event_set(&(con->client->event), con->client->fd, EV_WRITE,
+                    merge_client_writable, con);
+            chassis_event_add_with_timeout(con->srv, &(con->client->event), &con->write_timeout);
+        }
+        return;
+    }
+
     for (i = 0; i < con->servers->len; i++) {
         server_session_t *pmd = g_ptr_array_index(con->servers, i);
         if (pmd_index >= 0) {
@@ -1960,6 +2882,11 @@ static void check_server_sess_wait_for_event(network_mysqld_con *con,
                 g_debug("%s: pmd %d is waiting", G_STRLOC, (int) i);
                 continue;
             }
+            if (pmd_index < 0 && !merge_candidates_below(data->candidates[i],
+                        con->srv->merge_read_watermark)) {
+                g_debug("%s: pmd %d has enough rows pending", G_STRLOC, (int) i);
+                continue;
+            }
             con->num_read_pending++;
             pmd->read_cal_flag = 0;
             g_debug("%s: pmd %d is not read finished, read pending:%d, fd:%d, pmd index:%d", 
@@ -1975,6 +2902,57 @@ static void check_server_sess_wait_for_event(network_mysqld_con *con,
     }
 }
 
+/**
+ * the limit is reached, stop reading the servers with rows left
+ *
+ * their connections are closed instead of drained, which aborts the
+ * queries on the backends, see proxy_remove_cancelled_shard_conns().
+ * nothing is done if one of them is in a transaction, closing would
+ * roll it back, or if the client holds its server conns
+ */
+static gboolean cancel_servers_after_limit(network_mysqld_con *con)
+{
+    size_t i;
+
+    if (con->client->is_server_conn_reserved) {
+        return FALSE;
+    }
+
+    for (i = 0; i < con->servers->len; i++) {
+        server_session_t *pmd = g_ptr_array_index(con->servers, i);
+        if (pmd->participated && !pmd->server->is_read_finished
+                && pmd->server->is_in_tran_context) {
+            return FALSE;
+        }
+    }
+
+    for (i = 0; i < con->servers->len; i++) {
+        server_session_t *pmd = g_ptr_array_index(con->servers, i);
+        network_socket *server = pmd->server;
+        if (!pmd->participated || server->is_read_finished) {
+            continue;
+        }
+
+        if (server->is_waiting) {
+            event_del(&(server->event));
+            server->is_waiting = 0;
+            if (pmd->read_cal_flag == 0) {
+                con->num_read_pending--;
+                pmd->read_cal_flag = 1;
+            }
+        }
+        pmd->state = NET_RW_STATE_FINISHED;
+        server->is_read_finished = 1;
+        server->is_closed = 1;
+        con->num_pending_servers--;
+        con->servers_cancelled = 1;
+        g_debug("%s: stop reading server fd:%d after limit for con:%p",
+                G_STRLOC, server->fd, con);
+    }
+
+    return TRUE;
+}
+
 static int check_after_limit(network_mysqld_con *con, merge_parameters_t *data,
         int is_finished) 
 {
@@ -1983,9 +2961,14 @@ static int check_after_limit(network_mysqld_con *con, merge_parameters_t *data,
     gboolean is_more_to_read = FALSE;
     GList *candidate = NULL; 
     size_t iter;
+    int partially_merged = con->partially_merged;
 
     g_debug("%s: call check_after_limit", G_STRLOC);
 
+    if (data->is_rest_cancelled) {
+        return 1;
+    }
+
     for (iter = 0; iter < recv_queues->len; iter++) {
         gboolean is_over = FALSE;
         do {
@@ -2009,7 +2992,7 @@ static int check_after_limit(network_mysqld_con *con, merge_parameters_t *data,
             candidates[iter] = candidate->next;
             g_debug("%s: free packet addr:%p, iter:%d, pkt_type:%d", G_STRLOC, 
                     candidate->data, (int) iter, (int) pkt_type);
-            g_string_free((GString *) candidate->data, TRUE);
+            network_packet_pool_put((GString *) candidate->data);
             network_queue *recv_queue = recv_queues->pdata[iter];
             g_queue_delete_link(recv_queue->chunks, candidate); 
         } while(!is_over);
@@ -2023,6 +3006,13 @@ static int check_after_limit(network_mysqld_con *con, merge_parameters_t *data,
                 G_STRLOC, con);
     }
 
+    if (is_more_to_read && !is_finished && cancel_servers_after_limit(con)) {
+        g_debug("%s: rest of the resultset cancelled for:%p", G_STRLOC, con);
+        con->partially_merged = partially_merged;
+        data->is_rest_cancelled = 1;
+        return 1;
+    }
+
     if (is_more_to_read) {
         g_debug("%s: need more reading for:%p", G_STRLOC, con);
         check_server_sess_wait_for_event(con, -1, EV_READ, &con->read_timeout);
@@ -2088,7 +3078,7 @@ static int do_simple_merge(network_mysqld_con *con, merge_parameters_t *data, in
 
             if ((*off_pos) < limit->offset) {
                 (*off_pos) ++;
-                g_string_free((GString *) candidate->data, TRUE);
+                network_packet_pool_put((GString *) candidate->data);
             } else {
 
                 int packet_len = network_mysqld_proto_get_packet_len(candidate->data);
@@ -2187,6 +3177,7 @@ static int do_sort_merge(network_mysqld_con *con, merge_parameters_t *data,
                 return 0;
             } else {
                 heap->element[0]->record = candidates[cand_index];
+                heap->element[0]->key_valid = 0;
                 g_debug("%s: record:%p for index:%d", G_STRLOC, heap->element[0]->record, cand_index);
                 heap_adjust(heap, 1, recv_queues->len, compare_failed);
                 if (*compare_failed) {
@@ -2205,10 +3196,10 @@ static int do_sort_merge(network_mysqld_con *con, merge_parameters_t *data,
                 cand_index != last_output_index) 
         {
             g_debug("%s: dup element at:%d", G_STRLOC, cand_index);
-            g_string_free((GString *) candidate->data, TRUE);
+            network_packet_pool_put((GString *) candidate->data);
         } else if ((*off_pos) < limit->offset) {
             (*off_pos)++;
-            g_string_free((GString *) candidate->data, TRUE);
+            network_packet_pool_put((GString *) candidate->data);
             g_debug("%s: off pos here:%d", G_STRLOC, (int) (*off_pos));
         } else {
             
@@ -2233,6 +3224,7 @@ static int do_sort_merge(network_mysqld_con *con, merge_parameters_t *data,
         heap->element[0]->refreshed = 0;
         heap->element[0]->is_prior_to = 0;
         heap->element[0]->record = heap->element[0]->record->next;
+        heap->element[0]->key_valid = 0;
 
         candidates[cand_index] = candidate->next;
         network_queue *recv_queue = recv_queues->pdata[cand_index];
@@ -2314,6 +3306,7 @@ create_heap_for_merge_sort(network_mysqld_con *con, merge_parameters_t *data, in
                 } else {
                     heap->element[iter]->record = candidates[iter];
                     heap->element[iter]->index = iter;
+                    heap->element[iter]->key_valid = 0;
                     heap->element[iter]->is_over = 0;
                 }
             } else {
@@ -2357,7 +3350,7 @@ int callback_merge(network_mysqld_con *con, merge_parameters_t *data, int is_fin
         }
     }
 
-    if (is_finished) {
+    if (is_finished || data->is_rest_cancelled) {
         g_debug("%s: finished is true", G_STRLOC);
         if (data->is_pack_err) {
             if (data->err_pack == NULL) {
@@ -2781,7 +3774,7 @@ prepare_for_row_process(GList **candidates, GPtrArray *recv_queues, network_queu
             if (i == 0) {
                 network_queue_append(send_queue, packet);
             } else {
-                g_string_free(packet, TRUE);
+                network_packet_pool_put(packet);
             }
 
             /* check if the last packet is field EOF packet */
@@ -2987,7 +3980,11 @@ merge_for_select(sql_context_t *context, network_queue *send_queue, GPtrArray *r
         para.group_array_size = group_array_size;
         para.aggr_num = aggr_num;
 
-        if (!aggr_by_group(&para, candidates, &pkt_count, merged_result)) {
+        gboolean done = FALSE;
+#ifdef __SIZEOF_INT128__
+        done = aggr_by_hash(&para, candidates, &pkt_count, merged_result);
+#endif
+        if (!done && !aggr_by_group(&para, candidates, &pkt_count, merged_result)) {
             g_free(candidates);
             g_warning("%s:aggr_by_group error", G_STRLOC);
             return 0;
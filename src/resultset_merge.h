@@ -32,6 +32,8 @@ typedef struct ORDER_BY {
     int pos;
 } ORDER_BY;
 
+#define MAX_SORT_KEY_LEN 240
+
 typedef struct {
     GList *record;
     int index;
@@ -40,6 +42,13 @@ typedef struct {
     unsigned int refreshed:1;
     unsigned int is_dup:1;
     unsigned int is_prior_to:1;
+    unsigned int key_valid:1;       /* sort_key is built from record */
+    unsigned int key_truncated:1;   /* did not fit, ties need a full compare */
+    unsigned int key_partial:1;     /* stopped at a column without order */
+    unsigned int key_failed:1;      /* could not be encoded, use a full compare */
+    unsigned short sort_key_len;
+    /* the ORDER BY columns of record, encoded so that memcmp() sorts them */
+    unsigned char sort_key[MAX_SORT_KEY_LEN];
 } heap_element;
 
 typedef struct order_by_para_s {
@@ -62,7 +62,7 @@ static void do_tcp_stream_after_recv_resp(network_mysqld_con *con, server_sessio
         if (con->num_pending_servers == 0) {
             g_debug("%s: merge over", G_STRLOC);
             if (callback_merge(con, con->data, 1) == RM_FAIL) {
-                network_queue_clear(con->client->send_queue);
+                network_socket_clear_send_queue(con->client);
                 network_mysqld_con_send_error_full(con->client, C("merge failed"),
                         ER_CETUS_RESULT_MERGE, "HY000");
             }
@@ -70,11 +70,15 @@ static void do_tcp_stream_after_recv_resp(network_mysqld_con *con, server_sessio
             network_mysqld_con_handle(-1, 0, con);
         } else {
             if (callback_merge(con, con->data, 0) == RM_FAIL) {
-                network_queue_clear(con->client->send_queue);
+                network_socket_clear_send_queue(con->client);
                 network_mysqld_con_send_error_full(con->client, C("merge failed"),
                         ER_CETUS_RESULT_MERGE, "HY000");
                 con->state = ST_SEND_QUERY_RESULT;
                 network_mysqld_con_handle(-1, 0, con);
+            } else if (data->is_rest_cancelled) {
+                g_debug("%s: merge over after limit", G_STRLOC);
+                con->state = ST_SEND_QUERY_RESULT;
+                network_mysqld_con_handle(-1, 0, con);
             }
         }
     } else {
@@ -237,6 +241,51 @@ process_write_event(network_mysqld_con *con, server_session_t *pmd)
 
 }
 
+static void server_sess_client_handler(int event_fd, short events, void *user_data);
+
+/* forward what was read, the server waits while the client lags behind */
+static void
+server_sess_stream_to_client(network_mysqld_con *con, server_session_t *pmd)
+{
+    GString *packet;
+    while ((packet = g_queue_pop_head(pmd->server->recv_queue->chunks)) != NULL) {
+        network_mysqld_queue_append_raw(con->client, con->client->send_queue, packet);
+    }
+
+    g_debug("%s: send_part_content_to_client", G_STRLOC);
+    send_part_content_to_client(con);
+
+    if (con->state != ST_ERROR && network_mysqld_con_stream_paused(con)) {
+        event_set(&(con->client->event), con->client->fd, EV_WRITE,
+                server_sess_client_handler, pmd);
+        chassis_event_add_with_timeout(con->srv, &(con->client->event), &con->write_timeout);
+        return;
+    }
+
+    server_sess_wait_for_event(pmd, EV_READ, &con->read_timeout);
+}
+
+static void
+server_sess_client_handler(int G_GNUC_UNUSED event_fd, short events, void *user_data)
+{
+    server_session_t *pmd = (server_session_t *)user_data;
+    network_mysqld_con *con = pmd->con;
+
+    if (events == EV_TIMEOUT) {
+        g_message("%s: write timeout while streaming for con:%p, sql:%s",
+                G_STRLOC, con, con->orig_sql->str);
+        con->prev_state = con->state;
+        con->state = ST_ERROR;
+    } else {
+        server_sess_stream_to_client(con, pmd);
+    }
+
+    if (con->state == ST_ERROR) {
+        con->stream_paused = 0;
+        network_mysqld_con_handle(-1, 0, con);
+    }
+}
+
 static int
 process_read_server(network_mysqld_con *con, server_session_t *pmd)
 {
@@ -271,23 +320,16 @@ process_read_server(network_mysqld_con *con, server_session_t *pmd)
                     set_conn_attr(con, pmd->server);
                     pmd->state = NET_RW_STATE_PART_FINISHED;
                     g_debug("%s:tcp stream is true for:%p", G_STRLOC, con);
+                } else if (con->candidate_tcp_streamed) {
+                    server_sess_stream_to_client(con, pmd);
                 } else {
-                    if (con->candidate_tcp_streamed) {
-                        GString *packet;
-                        while ((packet = g_queue_pop_head(pmd->server->recv_queue->chunks)) != NULL) {
-                            network_mysqld_queue_append_raw(con->client, con->client->send_queue, packet);
-                        }
-
-                        g_debug("%s: send_part_content_to_client", G_STRLOC);
-
-                        send_part_content_to_client(con);
-                    } 
                     server_sess_wait_for_event(pmd, EV_READ, &con->read_timeout);
                 }
             }
             break;
         case NETWORK_SOCKET_WAIT_FOR_EVENT:
-            if (sock->resp_len > con->srv->max_resp_len) {
+            /* streamed resultsets are bounded by the watermarks instead */
+            if (sock->resp_len > con->srv->max_resp_len && !con->candidate_tcp_streamed) {
                 pmd->state = NET_RW_STATE_FINISHED;
                 con->server_to_be_closed = 1;
                 con->resp_too_long = 1;
@@ -321,14 +363,10 @@ process_read_server(network_mysqld_con *con, server_session_t *pmd)
                     if (con->num_servers_visited == 1 && sock->max_header_size_reached
                             && con->candidate_tcp_streamed) 
                     {
-                        GString *packet;
-                        while ((packet = g_queue_pop_head(pmd->server->recv_queue->chunks)) != NULL) {
-                            network_mysqld_queue_append_raw(con->client, con->client->send_queue, packet);
-                        }
-                        g_debug("%s: send_part_content_to_client", G_STRLOC);
-                        send_part_content_to_client(con);
+                        server_sess_stream_to_client(con, pmd);
+                    } else {
+                        server_sess_wait_for_event(pmd, EV_READ, &con->read_timeout);
                     }
-                    server_sess_wait_for_event(pmd, EV_READ, &con->read_timeout);
                     return 0;
                 }
             }
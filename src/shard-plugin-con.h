@@ -17,6 +17,9 @@ typedef struct {
     int trx_read_write; /* default TF_READ_WRITE */
     int trx_isolation_level; /* default TF_REPEATABLE_READ */
 
+    struct stmt_registry_t *stmt_registry; /* prepared statements of the client */
+    GString *stmt_group; /* group of the statement command, owned by the config */
+
 } shard_plugin_con_t;
 
 NETWORK_API shard_plugin_con_t *shard_plugin_con_new();
@@ -77,6 +77,110 @@ gboolean sharding_partition_contain_hash(sharding_partition_t *partition, int va
     return TestBit(partition->hash_set, val);
 }
 
+static unsigned int
+supplemental_hash(unsigned int value)
+{
+    unsigned int tmp1 = value >> 20;
+    unsigned int tmp2 = value >> 12;
+    unsigned int tmp3 = tmp1 ^ tmp2;
+    unsigned int h = value ^ tmp3;
+    tmp1 = h >> 7;
+    tmp2 = h >> 4;
+    tmp3 = tmp1 ^ tmp2;
+    h = h ^ tmp3;
+    return h;
+}
+
+static unsigned int
+cetus_str_hash(const unsigned char *key)
+{
+    int len = strlen((const char *) key);
+    unsigned int hashcode_head = 0;
+    int i = 0;
+    int max = 8;
+
+    if (max > len) {
+        max = len;
+    }
+    for (; i < max; i++) {
+        hashcode_head <<= 4;
+        hashcode_head += key[i];
+    }
+    if (len > max) {
+        i = len - 8;
+        unsigned int hashcode_tail = 0;
+        for (; i < len; i++) {
+            hashcode_tail <<= 4;
+            hashcode_tail += key[i];
+        }
+        return supplemental_hash(hashcode_head ^ hashcode_tail);
+    } else {
+        return supplemental_hash(hashcode_head);
+    }
+}
+
+sharding_partition_t *sharding_vdb_get_partition(const sharding_vdb_t *vdb,
+                                                 gint64 num, const char *str)
+{
+    GPtrArray *partitions = vdb->partitions;
+
+    if (vdb->method == SHARD_METHOD_HASH) {
+        if (!vdb->hash_index) {
+            return NULL;
+        }
+        int64_t hash_value = (vdb->key_type == SHARD_DATA_TYPE_STR)
+            ? cetus_str_hash((const unsigned char *)str) : num;
+        int32_t hash_mod = hash_value % vdb->logic_shard_num;
+        if (hash_mod < 0) {
+            return NULL;
+        }
+        return vdb->hash_index[hash_mod];
+    }
+
+    /* range: find the first partition whose high range >= value */
+    int low = 0, high = (int)partitions->len;
+    sharding_partition_t *part;
+    if (vdb->key_type == SHARD_DATA_TYPE_STR) {
+        while (low < high) {
+            int mid = (low + high) / 2;
+            part = g_ptr_array_index(partitions, mid);
+            if (part->value == NULL || strcmp(str, part->value) <= 0) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+        if (low == partitions->len) {
+            return NULL;
+        }
+        part = g_ptr_array_index(partitions, low);
+        if (part->low_value && strcmp(str, part->low_value) <= 0) {
+            return NULL;
+        }
+    } else {
+        if (!vdb->range_index) {
+            return NULL;
+        }
+        int val = num;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (val <= vdb->range_index[mid]) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+        if (low == partitions->len) {
+            return NULL;
+        }
+        part = g_ptr_array_index(partitions, low);
+        if (val <= (int)(int64_t)part->low_value) {
+            return NULL;
+        }
+    }
+    return part;
+}
+
 static sharding_vdb_t *sharding_vdb_new()
 {
     sharding_vdb_t *vdb = g_new0(struct sharding_vdb_t, 1);
@@ -112,6 +216,8 @@ static void sharding_vdb_free(sharding_vdb_t *vdb)
     g_ptr_array_free(vdb->partitions, TRUE);
 
     g_ptr_array_free(vdb->databases, TRUE);
+    g_free(vdb->hash_index);
+    g_free(vdb->range_index);
     g_free(vdb);
 }
 
@@ -504,6 +610,28 @@ GPtrArray *shard_conf_get_single_table_distinct_group(GPtrArray *groups,
     return groups;
 }
 
+GString *shard_conf_get_group(const char *name)
+{
+    GList *l;
+    for (l = shard_conf_vdbs; l; l = l->next) {
+        sharding_vdb_t *vdb = l->data;
+        int i;
+        for (i = 0; i < vdb->partitions->len; ++i) {
+            sharding_partition_t *part = g_ptr_array_index(vdb->partitions, i);
+            if (strcmp(part->group_name->str, name) == 0) {
+                return part->group_name;
+            }
+        }
+    }
+    for (l = shard_conf_single_tables; l; l = l->next) {
+        single_table_t *t = l->data;
+        if (strcmp(t->group->str, name) == 0) {
+            return t->group;
+        }
+    }
+    return NULL;
+}
+
 static int sharding_type(const char *str) {
     struct code_map_t {
         const char *name;
@@ -633,7 +761,7 @@ static gint cmp_shard_range_groups_int(gconstpointer a, gconstpointer b) {
     sharding_partition_t *item2 = *(sharding_partition_t **)b;
     int n1 = (int) (int64_t) item1->value;
     int n2 = (int) (int64_t) item2->value;
-    return n1-n2;
+    return n1 < n2 ? -1 : (n1 > n2 ? 1 : 0);
 }
 
 static gint cmp_shard_range_groups_str(gconstpointer a, gconstpointer b) {
@@ -651,7 +779,22 @@ static gint cmp_shard_range_groups_str(gconstpointer a, gconstpointer b) {
 
 static void setup_partitions(GPtrArray *partitions, sharding_vdb_t *vdb)
 {
-    if (vdb->method == SHARD_METHOD_RANGE) {
+    if (vdb->method == SHARD_METHOD_HASH) {
+        if (vdb->logic_shard_num <= 0 || vdb->logic_shard_num > MAX_HASH_VALUE_COUNT) {
+            return; /* rejected by sharding_vdb_is_valid() */
+        }
+        /* direct lookup: hash value -> first partition containing it */
+        vdb->hash_index = g_new0(sharding_partition_t *, vdb->logic_shard_num);
+        int i, j;
+        for (i = 0; i < partitions->len; ++i) {
+            sharding_partition_t *part = g_ptr_array_index(partitions, i);
+            for (j = 0; j < vdb->logic_shard_num; ++j) {
+                if (!vdb->hash_index[j] && TestBit(part->hash_set, j)) {
+                    vdb->hash_index[j] = part;
+                }
+            }
+        }
+    } else if (vdb->method == SHARD_METHOD_RANGE) {
         /* sort partitions */
         if (vdb->key_type == SHARD_DATA_TYPE_INT
             || vdb->key_type == SHARD_DATA_TYPE_DATETIME
@@ -676,6 +819,14 @@ static void setup_partitions(GPtrArray *partitions, sharding_vdb_t *vdb)
                 prev_value = (int64_t)part->value;
             }
         }
+        /* boundaries for binary search, strings are searched in place */
+        if (vdb->key_type != SHARD_DATA_TYPE_STR) {
+            vdb->range_index = g_new0(int, partitions->len + 1);
+            for (i = 0; i < partitions->len; ++i) {
+                sharding_partition_t *part = g_ptr_array_index(partitions, i);
+                vdb->range_index[i] = (int)(int64_t)part->value;
+            }
+        }
     }
 }
 /**
@@ -37,6 +37,15 @@ typedef struct sharding_partition_t {
 } sharding_partition_t;
 
 gboolean sharding_partition_contain_hash(sharding_partition_t *, int);
+
+/**
+ * the partition a sharding key value falls into
+ * str is used for SHARD_DATA_TYPE_STR keys, num for others
+ *
+ * @return NULL if no partition contains the value
+ */
+sharding_partition_t *sharding_vdb_get_partition(const sharding_vdb_t *,
+                                                 gint64 num, const char *str);
 //gboolean sharding_partition_cover_range(sharding_partition_t *, );
 
 struct sharding_vdb_t {
@@ -46,6 +55,10 @@ struct sharding_vdb_t {
     int logic_shard_num;
     GPtrArray *partitions; /* GPtrArray<sharding_partition_t *> */
     GPtrArray *databases; /* GPtrArray<sharding_database_t *> */
+
+    /* routing index, built by setup_partitions() */
+    sharding_partition_t **hash_index; /* hash value -> partition */
+    int *range_index; /* sorted high range of each partition, int/date keys */
 };
 
 struct sharding_table_t {
@@ -92,6 +105,9 @@ GPtrArray *shard_conf_table_partitions(GPtrArray *partitions,
  */
 void shard_conf_find_groups(GPtrArray *groups, const char *match, const char *db);
 
+/* the configured group named name, NULL if there is none */
+GString *shard_conf_get_group(const char *name);
+
 
 gboolean shard_conf_load(char *);
 
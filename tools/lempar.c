@@ -404,6 +404,15 @@ void ParseFree(
   (*freeProc)((void *)pParser);
 }
 
+/*
+** Pop everything off the stack of a parser, destructors included, so
+** that it can take another input.
+*/
+void ParseReset(void *p) {
+  yyParser *pParser = (yyParser *)p;
+  while(pParser->yyidx>=0) yy_pop_parser_stack(pParser);
+}
+
 /*
 ** Return the peak depth of the stack for a parser.
 */